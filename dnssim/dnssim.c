@@ -0,0 +1,705 @@
+/* Offline DNS cache simulator.
+ *
+ * Replays the DNS answers and the connection events of a log file written
+ * by the driver through the DNS cache (sys/dnscache.c) and prints, for each
+ * combination of number of buckets, capacity and replacement policy, the
+ * hit rate of the lookups and the memory used by the cache.
+ *
+ * Build (Linux):
+ *   cc -O2 -fno-strict-aliasing -Wall -Wno-multichar -Wno-unknown-pragmas \
+ *      -Idnssim -o dnssim/dnssim dnssim/dnssim.c sys/dnscache.c \
+ *      sys/largemem.c
+ *
+ * (The lists of the cache use sentinels of a different type than the
+ * entries, so strict aliasing has to be disabled. The driver sources use
+ * multi-character pool tags and MSVC pragmas.)
+ *
+ * Usage:
+ *   dnssim [-b <buckets>,...] [-c <capacity>,...] [-t <default TTL>]
+ *          [-g <grace>] <log file>
+ */
+
+#include <stdio.h>
+#include <arpa/inet.h>
+#include "../sys/dnscache.h"
+
+#define DEFAULT_BUCKETS "127,1021,8191"
+#define DEFAULT_CAPACITIES "250,500,1000,2000,4000,8000,16000"
+#define DEFAULT_TTL 300 /* Seconds (old logs don't have the TTL). */
+#define DEFAULT_GRACE 300 /* Seconds. */
+
+#define MAX_VALUES 32
+#define MAX_LINE 4096
+
+typedef enum {
+  EVENT_ANSWER,
+  EVENT_NEW_CONNECTION,
+  EVENT_CLOSED_CONNECTION
+} event_type_t;
+
+typedef struct {
+  event_type_t type;
+  BOOL https;
+
+  /* Milliseconds. */
+  LONGLONG time;
+
+  UINT32 ttl;
+
+  unsigned ip_version;
+  UINT8 ip[16];
+
+  char* hostname;
+  UINT16 hostnamelen;
+} event_t;
+
+typedef struct {
+  event_t* events;
+  size_t count;
+  size_t size;
+} trace_t;
+
+/* Expiration time of the last answer for each address (open addressing). */
+typedef struct {
+  unsigned ip_version;
+  UINT8 ip[16];
+  LONGLONG expires;
+} ttl_entry_t;
+
+typedef struct {
+  ttl_entry_t* entries;
+  size_t mask;
+} ttl_map_t;
+
+typedef struct {
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned long https_lookups;
+  unsigned long https_hits;
+  unsigned long closed_lookups;
+  unsigned long closed_hits;
+  unsigned long strict_hits;
+  unsigned long grace_hits;
+  SIZE_T memory;
+} result_t;
+
+static BOOL LoadTrace(const char* filename,
+                      UINT32 default_ttl,
+                      trace_t* trace,
+                      size_t* nanswers);
+
+static BOOL ParseLine(const char* line, UINT32 default_ttl, event_t* event);
+static BOOL ParseTime(const char* line, LONGLONG* time);
+static BOOL ParseAnswer(const char* s, UINT32 default_ttl, event_t* event);
+static BOOL ParseConnection(const char* s, event_t* event);
+static BOOL ParseAddress(const char* s, size_t len, event_t* event);
+static BOOL AddEvent(trace_t* trace, const event_t* event);
+static void FreeTrace(trace_t* trace);
+
+static BOOL Replay(const trace_t* trace,
+                   size_t nanswers,
+                   unsigned nbuckets,
+                   unsigned capacity,
+                   dns_cache_policy_t policy,
+                   LONGLONG grace,
+                   result_t* result);
+
+static BOOL InitTtlMap(ttl_map_t* map, size_t count);
+static ttl_entry_t* FindTtlEntry(ttl_map_t* map, const event_t* event);
+
+static unsigned ParseList(const char* s, unsigned* values);
+static void Usage(const char* program);
+
+static double Percentage(unsigned long n, unsigned long total)
+{
+  return (total > 0) ? (100.0 * n) / total : 0.0;
+}
+
+int main(int argc, char** argv)
+{
+  const char* buckets_list;
+  const char* capacities_list;
+  unsigned buckets[MAX_VALUES];
+  unsigned capacities[MAX_VALUES];
+  unsigned nbuckets;
+  unsigned ncapacities;
+  UINT32 default_ttl;
+  LONGLONG grace;
+  trace_t trace;
+  size_t nanswers;
+  result_t result;
+  dns_cache_policy_t policy;
+  unsigned b;
+  unsigned c;
+  int i;
+
+  buckets_list = DEFAULT_BUCKETS;
+  capacities_list = DEFAULT_CAPACITIES;
+  default_ttl = DEFAULT_TTL;
+  grace = DEFAULT_GRACE;
+
+  for (i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-b") == 0) {
+      buckets_list = argv[i + 1];
+    } else if (strcmp(argv[i], "-c") == 0) {
+      capacities_list = argv[i + 1];
+    } else if (strcmp(argv[i], "-t") == 0) {
+      default_ttl = (UINT32) strtoul(argv[i + 1], NULL, 10);
+    } else if (strcmp(argv[i], "-g") == 0) {
+      grace = strtoll(argv[i + 1], NULL, 10);
+    } else {
+      break;
+    }
+  }
+
+  if (i + 1 != argc) {
+    Usage(argv[0]);
+    return -1;
+  }
+
+  if (((nbuckets = ParseList(buckets_list, buckets)) == 0) ||
+      ((ncapacities = ParseList(capacities_list, capacities)) == 0)) {
+    Usage(argv[0]);
+    return -1;
+  }
+
+  if (!LoadTrace(argv[i], default_ttl, &trace, &nanswers)) {
+    fprintf(stderr, "Error loading trace '%s'.\n", argv[i]);
+    return -1;
+  }
+
+  printf("# %lu events, %lu answers, grace: %lld s.\n",
+         (unsigned long) trace.count,
+         (unsigned long) nanswers,
+         (long long) grace);
+
+  printf("%8s %9s %6s %10s %9s %7s %7s %7s %7s %7s\n",
+         "buckets",
+         "capacity",
+         "policy",
+         "memory(KB)",
+         "lookups",
+         "hit%",
+         "https%",
+         "closed%",
+         "strict%",
+         "grace%");
+
+  for (b = 0; b < nbuckets; b++) {
+    for (policy = DNS_CACHE_POLICY_CLOCK;
+         policy <= DNS_CACHE_POLICY_FIFO;
+         policy++) {
+      for (c = 0; c < ncapacities; c++) {
+        if (!Replay(&trace,
+                    nanswers,
+                    buckets[b],
+                    capacities[c],
+                    policy,
+                    grace * 1000,
+                    &result)) {
+          fprintf(stderr, "Error replaying trace.\n");
+
+          FreeTrace(&trace);
+          return -1;
+        }
+
+        printf("%8u %9u %6s %10lu %9lu %7.2f %7.2f %7.2f %7.2f %7.2f\n",
+               buckets[b],
+               capacities[c],
+               (policy == DNS_CACHE_POLICY_CLOCK) ? "clock" : "fifo",
+               (unsigned long) (result.memory / 1024),
+               result.lookups,
+               Percentage(result.hits, result.lookups),
+               Percentage(result.https_hits, result.https_lookups),
+               Percentage(result.closed_hits, result.closed_lookups),
+               Percentage(result.strict_hits, result.lookups),
+               Percentage(result.grace_hits, result.lookups));
+      }
+    }
+  }
+
+  FreeTrace(&trace);
+
+  return 0;
+}
+
+BOOL LoadTrace(const char* filename,
+               UINT32 default_ttl,
+               trace_t* trace,
+               size_t* nanswers)
+{
+  FILE* file;
+  char line[MAX_LINE];
+  event_t event;
+
+  if ((file = fopen(filename, "r")) == NULL) {
+    return FALSE;
+  }
+
+  trace->events = NULL;
+  trace->count = 0;
+  trace->size = 0;
+
+  *nanswers = 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    if (ParseLine(line, default_ttl, &event)) {
+      if (!AddEvent(trace, &event)) {
+        free(event.hostname);
+
+        FreeTrace(trace);
+        fclose(file);
+
+        return FALSE;
+      }
+
+      if (event.type == EVENT_ANSWER) {
+        (*nanswers)++;
+      }
+    }
+  }
+
+  fclose(file);
+
+  return TRUE;
+}
+
+BOOL ParseLine(const char* line, UINT32 default_ttl, event_t* event)
+{
+  /* Skip timestamp: "[YYYY/MM/DD HH:MM:SS.mmm] ". */
+  if (!ParseTime(line, &event->time)) {
+    return FALSE;
+  }
+
+  line += 26;
+
+  event->https = FALSE;
+  event->hostname = NULL;
+  event->hostnamelen = 0;
+
+  if (strncmp(line, "Hostname: ", 10) == 0) {
+    return ParseAnswer(line + 10, default_ttl, event);
+  } else if (strncmp(line, "[HTTP] ", 7) == 0) {
+    return ParseConnection(line + 7, event);
+  } else if (strncmp(line, "[HTTPS] ", 8) == 0) {
+    event->https = TRUE;
+    return ParseConnection(line + 8, event);
+  }
+
+  return FALSE;
+}
+
+BOOL ParseTime(const char* line, LONGLONG* time)
+{
+  unsigned year;
+  unsigned month;
+  unsigned day;
+  unsigned hour;
+  unsigned minute;
+  unsigned second;
+  unsigned millisecond;
+  LONGLONG days;
+  LONGLONG era;
+  unsigned yoe;
+  unsigned doy;
+
+  if (sscanf(line,
+             "[%4u/%2u/%2u %2u:%2u:%2u.%3u] ",
+             &year,
+             &month,
+             &day,
+             &hour,
+             &minute,
+             &second,
+             &millisecond) != 7) {
+    return FALSE;
+  }
+
+  if ((month < 1) || (month > 12) || (day < 1) || (day > 31)) {
+    return FALSE;
+  }
+
+  /* Days since 1970/01/01 (proleptic Gregorian calendar). */
+  year -= (month <= 2);
+  era = year / 400;
+  yoe = year - (unsigned) (era * 400);
+  doy = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+  days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+
+  *time = ((((days * 24 + hour) * 60 + minute) * 60 + second) * 1000) +
+          millisecond;
+
+  return TRUE;
+}
+
+BOOL ParseAnswer(const char* s, UINT32 default_ttl, event_t* event)
+{
+  const char* hostname;
+  const char* end;
+  const char* address;
+
+  /* "'<name>' -> '<hostname>', address: <address>[ (<type> hint)]
+   * [, TTL: <ttl>]."
+   */
+  if ((*s != '\'') ||
+      ((s = strstr(s + 1, "' -> '")) == NULL)) {
+    return FALSE;
+  }
+
+  hostname = s + 6;
+
+  if ((end = strstr(hostname, "', address: ")) == NULL) {
+    return FALSE;
+  }
+
+  if ((end == hostname) || (end - hostname > 255)) {
+    return FALSE;
+  }
+
+  address = end + 12;
+
+  if ((s = strstr(address, ", TTL: ")) != NULL) {
+    event->ttl = (UINT32) strtoul(s + 7, NULL, 10);
+  } else {
+    event->ttl = default_ttl;
+
+    /* Address followed by ".\r\n". */
+    s = address + strcspn(address, "\r\n");
+    if ((s == address) || (s[-1] != '.')) {
+      return FALSE;
+    }
+
+    s--;
+  }
+
+  /* Address hint of a SVCB/HTTPS record. */
+  if ((s - address > 6) && (memcmp(s - 6, " hint)", 6) == 0)) {
+    do {
+      s--;
+    } while ((s > address) && (*s != '('));
+
+    if ((s == address) || (s[-1] != ' ')) {
+      return FALSE;
+    }
+
+    s--;
+  }
+
+  if (!ParseAddress(address, s - address, event)) {
+    return FALSE;
+  }
+
+  event->hostnamelen = (UINT16) (end - hostname);
+
+  if ((event->hostname = (char*) malloc(event->hostnamelen)) == NULL) {
+    return FALSE;
+  }
+
+  memcpy(event->hostname, hostname, event->hostnamelen);
+
+  event->type = EVENT_ANSWER;
+
+  return TRUE;
+}
+
+BOOL ParseConnection(const char* s, event_t* event)
+{
+  const char* remote;
+  const char* end;
+
+  /* "[New connection] <local> -> <remote>..." */
+  if (strncmp(s, "[New connection] ", 17) == 0) {
+    event->type = EVENT_NEW_CONNECTION;
+  } else if (strncmp(s, "[Closed connection] ", 20) == 0) {
+    event->type = EVENT_CLOSED_CONNECTION;
+  } else {
+    return FALSE;
+  }
+
+  if ((remote = strstr(s, " -> ")) == NULL) {
+    return FALSE;
+  }
+
+  remote += 4;
+
+  /* Strip the port. */
+  if (*remote == '[') {
+    remote++;
+
+    if ((end = strchr(remote, ']')) == NULL) {
+      return FALSE;
+    }
+  } else {
+    if ((end = strchr(remote, ':')) == NULL) {
+      return FALSE;
+    }
+  }
+
+  return ParseAddress(remote, end - remote, event);
+}
+
+BOOL ParseAddress(const char* s, size_t len, event_t* event)
+{
+  char address[INET6_ADDRSTRLEN];
+
+  if (len >= sizeof(address)) {
+    return FALSE;
+  }
+
+  memcpy(address, s, len);
+  address[len] = 0;
+
+  if (inet_pton(AF_INET, address, event->ip) == 1) {
+    event->ip_version = 4;
+    return TRUE;
+  }
+
+  if (inet_pton(AF_INET6, address, event->ip) == 1) {
+    event->ip_version = 6;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+BOOL AddEvent(trace_t* trace, const event_t* event)
+{
+  event_t* events;
+  size_t size;
+
+  if (trace->count == trace->size) {
+    size = (trace->size == 0) ? 1024 : trace->size * 2;
+
+    if ((events = (event_t*) realloc(trace->events,
+                                     size * sizeof(event_t))) == NULL) {
+      return FALSE;
+    }
+
+    trace->events = events;
+    trace->size = size;
+  }
+
+  trace->events[trace->count++] = *event;
+
+  return TRUE;
+}
+
+void FreeTrace(trace_t* trace)
+{
+  size_t i;
+
+  for (i = 0; i < trace->count; i++) {
+    free(trace->events[i].hostname);
+  }
+
+  free(trace->events);
+
+  trace->events = NULL;
+  trace->count = 0;
+  trace->size = 0;
+}
+
+BOOL Replay(const trace_t* trace,
+            size_t nanswers,
+            unsigned nbuckets,
+            unsigned capacity,
+            dns_cache_policy_t policy,
+            LONGLONG grace,
+            result_t* result)
+{
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  const event_t* event;
+  ttl_map_t ttl_map;
+  ttl_entry_t* ttl_entry;
+  char hostname[256];
+  const char* found;
+  size_t i;
+
+  if (!InitDnsCache(nbuckets, capacity, FALSE)) {
+    return FALSE;
+  }
+
+  if (!InitTtlMap(&ttl_map, nanswers)) {
+    FreeDnsCache();
+    return FALSE;
+  }
+
+  SetDnsCachePolicy(policy);
+
+  memset(result, 0, sizeof(result_t));
+
+  for (i = 0; i < trace->count; i++) {
+    event = &trace->events[i];
+
+    if (event->type == EVENT_ANSWER) {
+      /* The driver keeps the expiration time in 100-nanosecond units. */
+      if (event->ip_version == 4) {
+        AddIPv4ToDnsCache(event->ip,
+                          event->hostname,
+                          event->hostnamelen,
+                          (event->time + (LONGLONG) event->ttl * 1000) *
+                          10000);
+      } else {
+        AddIPv6ToDnsCache(event->ip,
+                          event->hostname,
+                          event->hostnamelen,
+                          (event->time + (LONGLONG) event->ttl * 1000) *
+                          10000);
+      }
+
+      ttl_entry = FindTtlEntry(&ttl_map, event);
+      ttl_entry->expires = event->time + (LONGLONG) event->ttl * 1000;
+
+      continue;
+    }
+
+    if (event->ip_version == 4) {
+      found = GetIPv4FromDnsCache(event->ip, hostname);
+    } else {
+      found = GetIPv6FromDnsCache(event->ip, hostname);
+    }
+
+    result->lookups++;
+
+    if (event->https) {
+      result->https_lookups++;
+    }
+
+    if (event->type == EVENT_CLOSED_CONNECTION) {
+      result->closed_lookups++;
+    }
+
+    if (found) {
+      result->hits++;
+
+      if (event->https) {
+        result->https_hits++;
+      }
+
+      if (event->type == EVENT_CLOSED_CONNECTION) {
+        result->closed_hits++;
+      }
+
+      /* Would it be a hit if the cache honored the TTL? */
+      ttl_entry = FindTtlEntry(&ttl_map, event);
+
+      if (event->time <= ttl_entry->expires) {
+        result->strict_hits++;
+      }
+
+      if (event->time <= ttl_entry->expires + grace) {
+        result->grace_hits++;
+      }
+    }
+  }
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+  result->memory = ipv4_stats.memory + ipv6_stats.memory;
+
+  free(ttl_map.entries);
+  FreeDnsCache();
+
+  return TRUE;
+}
+
+BOOL InitTtlMap(ttl_map_t* map, size_t count)
+{
+  size_t size;
+
+  /* Keep the load factor below 50%. */
+  size = 16;
+  while (size < count * 2) {
+    size <<= 1;
+  }
+
+  if ((map->entries = (ttl_entry_t*) calloc(size,
+                                            sizeof(ttl_entry_t))) == NULL) {
+    return FALSE;
+  }
+
+  map->mask = size - 1;
+
+  return TRUE;
+}
+
+ttl_entry_t* FindTtlEntry(ttl_map_t* map, const event_t* event)
+{
+  ttl_entry_t* entry;
+  size_t ip_size;
+  size_t h;
+  size_t i;
+
+  ip_size = (event->ip_version == 4) ? 4 : 16;
+
+  /* FNV-1a. */
+  h = 2166136261u;
+  for (i = 0; i < ip_size; i++) {
+    h = (h ^ event->ip[i]) * 16777619u;
+  }
+
+  do {
+    entry = &map->entries[h & map->mask];
+
+    if (entry->ip_version == 0) {
+      /* Not found: the address has never been in an answer. */
+      entry->ip_version = event->ip_version;
+      memcpy(entry->ip, event->ip, ip_size);
+      entry->expires = 0;
+
+      return entry;
+    }
+
+    if ((entry->ip_version == event->ip_version) &&
+        (memcmp(entry->ip, event->ip, ip_size) == 0)) {
+      return entry;
+    }
+
+    h++;
+  } while (TRUE);
+}
+
+unsigned ParseList(const char* s, unsigned* values)
+{
+  unsigned count;
+  char* end;
+
+  count = 0;
+
+  do {
+    if (count == MAX_VALUES) {
+      return 0;
+    }
+
+    if ((values[count] = (unsigned) strtoul(s, &end, 10)) == 0) {
+      return 0;
+    }
+
+    count++;
+
+    if (*end == 0) {
+      return count;
+    }
+
+    if (*end != ',') {
+      return 0;
+    }
+
+    s = end + 1;
+  } while (TRUE);
+}
+
+void Usage(const char* program)
+{
+  fprintf(stderr,
+          "Usage: %s [-b <buckets>,...] [-c <capacity>,...] "
+          "[-t <default TTL>] [-g <grace>] <log file>\n"
+          "  -b  Numbers of buckets (default: " DEFAULT_BUCKETS ").\n"
+          "  -c  Capacities (default: " DEFAULT_CAPACITIES ").\n"
+          "  -t  TTL of the answers without TTL in seconds "
+          "(default: %u).\n"
+          "  -g  Grace period after the TTL in seconds (default: %u).\n",
+          program,
+          DEFAULT_TTL,
+          DEFAULT_GRACE);
+}
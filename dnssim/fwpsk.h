@@ -0,0 +1,228 @@
+#ifndef DNSSIM_FWPSK_H
+#define DNSSIM_FWPSK_H
+
+/* Minimal user-mode replacements for the kernel definitions used by
+ * dnscache.c and largemem.c, so that the simulator can be built on Linux
+ * from the same sources as the driver.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+typedef int BOOL;
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef uint32_t ULONG;
+typedef uint64_t ULONGLONG;
+typedef int32_t LONG;
+typedef int64_t LONGLONG;
+typedef size_t SIZE_T;
+typedef uintptr_t ULONG_PTR;
+
+#define TRUE 1
+#define FALSE 0
+
+#define PAGE_SIZE 4096
+#define LARGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define __inline inline
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+
+#define UNREFERENCED_PARAMETER(p) ((void) (p))
+#define C_ASSERT(e) _Static_assert(e, #e)
+
+/* Memory. */
+#define NonPagedPool 0
+#define MmCached 1
+
+typedef union {
+  LONGLONG QuadPart;
+} PHYSICAL_ADDRESS;
+
+static inline void* ExAllocatePoolWithTag(int type, SIZE_T size, ULONG tag)
+{
+  UNREFERENCED_PARAMETER(type);
+  UNREFERENCED_PARAMETER(tag);
+
+  return malloc(size);
+}
+
+static inline void ExFreePoolWithTag(void* ptr, ULONG tag)
+{
+  UNREFERENCED_PARAMETER(tag);
+
+  free(ptr);
+}
+
+/* Large pages: explicit huge pages if some are reserved
+ * (/proc/sys/vm/nr_hugepages), otherwise transparent huge pages on a
+ * mapping aligned to the huge page size.
+ */
+#define KernelMode 0
+#define NormalPagePriority 16
+#define MdlMappingNoExecute 0x40000000
+#define MM_ALLOCATE_REQUIRE_CONTIGUOUS_CHUNKS 0x4
+#define MM_ALLOCATE_FULLY_REQUIRED 0x8
+#define MM_ALLOCATE_FAST_LARGE_PAGES 0x40
+
+typedef struct _MDL {
+  /* Next buffer of a chain (the net buffers of ../tests/ndis.h). */
+  struct _MDL* Next;
+
+  void* base;
+  SIZE_T length;
+
+  void* va;
+  SIZE_T size;
+} MDL;
+
+static inline MDL* MmAllocatePagesForMdlEx(PHYSICAL_ADDRESS lowest,
+                                           PHYSICAL_ADDRESS highest,
+                                           PHYSICAL_ADDRESS skip,
+                                           SIZE_T size,
+                                           int cache_type,
+                                           ULONG flags)
+{
+  MDL* mdl;
+
+  UNREFERENCED_PARAMETER(lowest);
+  UNREFERENCED_PARAMETER(highest);
+  UNREFERENCED_PARAMETER(skip);
+  UNREFERENCED_PARAMETER(cache_type);
+  UNREFERENCED_PARAMETER(flags);
+
+  if ((mdl = (MDL*) malloc(sizeof(MDL))) == NULL) {
+    return NULL;
+  }
+
+  mdl->Next = NULL;
+
+  mdl->length = size;
+  mdl->base = mmap(NULL,
+                   mdl->length,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                   -1,
+                   0);
+
+  if (mdl->base != MAP_FAILED) {
+    mdl->va = mdl->base;
+  } else {
+    /* One more huge page to align the mapping. */
+    mdl->length = size + LARGE_PAGE_SIZE;
+    mdl->base = mmap(NULL,
+                     mdl->length,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+
+    if (mdl->base == MAP_FAILED) {
+      free(mdl);
+      return NULL;
+    }
+
+    mdl->va = (void*) (((uintptr_t) mdl->base + LARGE_PAGE_SIZE - 1) &
+                       ~((uintptr_t) LARGE_PAGE_SIZE - 1));
+
+    madvise(mdl->va, size, MADV_HUGEPAGE);
+  }
+
+  mdl->size = size;
+
+  return mdl;
+}
+
+#define MmGetMdlByteCount(mdl) ((mdl)->size)
+
+static inline void* MmMapLockedPagesSpecifyCache(MDL* mdl,
+                                                 int mode,
+                                                 int cache_type,
+                                                 void* address,
+                                                 BOOL bugcheck,
+                                                 ULONG priority)
+{
+  UNREFERENCED_PARAMETER(mode);
+  UNREFERENCED_PARAMETER(cache_type);
+  UNREFERENCED_PARAMETER(address);
+  UNREFERENCED_PARAMETER(bugcheck);
+  UNREFERENCED_PARAMETER(priority);
+
+  return mdl->va;
+}
+
+static inline void MmUnmapLockedPages(void* address, MDL* mdl)
+{
+  UNREFERENCED_PARAMETER(address);
+  UNREFERENCED_PARAMETER(mdl);
+}
+
+static inline void MmFreePagesFromMdl(MDL* mdl)
+{
+  munmap(mdl->base, mdl->length);
+}
+
+static inline void ExFreePool(void* ptr)
+{
+  free(ptr);
+}
+
+/* Synchronization (the simulator is single-threaded, the threaded tests of
+ * ../tests use the same definitions).
+ */
+typedef volatile LONG KSPIN_LOCK;
+
+typedef struct {
+  KSPIN_LOCK* lock;
+} KLOCK_QUEUE_HANDLE;
+
+static inline void KeInitializeSpinLock(KSPIN_LOCK* lock)
+{
+  *lock = 0;
+}
+
+static inline void KeAcquireInStackQueuedSpinLock(
+                     KSPIN_LOCK* lock,
+                     KLOCK_QUEUE_HANDLE* lock_handle
+                   )
+{
+  lock_handle->lock = lock;
+
+  while (__sync_lock_test_and_set(lock, 1)) {
+    sched_yield();
+  }
+}
+
+static inline void KeReleaseInStackQueuedSpinLock(
+                     KLOCK_QUEUE_HANDLE* lock_handle
+                   )
+{
+  __sync_lock_release(lock_handle->lock);
+}
+
+static inline LONG InterlockedIncrement(volatile LONG* addend)
+{
+  return __sync_add_and_fetch(addend, 1);
+}
+
+#define KeMemoryBarrier() __sync_synchronize()
+#define YieldProcessor() sched_yield()
+
+static inline ULONG KeGetCurrentProcessorNumberEx(void* number)
+{
+  UNREFERENCED_PARAMETER(number);
+
+  return 0;
+}
+
+#define PF_TEMPORAL_LEVEL_1 0
+#define PreFetchCacheLine(level, address) \
+        __builtin_prefetch((const void*) (address))
+
+#endif /* DNSSIM_FWPSK_H */
@@ -0,0 +1,6 @@
+#ifndef DNSSIM_NTDDK_H
+#define DNSSIM_NTDDK_H
+
+#include "fwpsk.h"
+
+#endif /* DNSSIM_NTDDK_H */
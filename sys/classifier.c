@@ -0,0 +1,146 @@
+#include <ntddk.h>
+#include <string.h>
+#include "classifier.h"
+
+#define TLS_CONTENT_TYPE_HANDSHAKE 0x16
+#define TLS_HANDSHAKE_CLIENT_HELLO 0x01
+
+#define DNS_HEADER_LEN 12
+
+/* Maximum number of methods starting with the same character. */
+#define MAX_METHODS 3
+
+typedef struct {
+  /* Method followed by a space, in the first bytes of a little-endian
+   * integer, and mask of its bytes.
+   */
+  UINT64 token;
+  UINT64 mask;
+} method_t;
+
+#define TOKEN(a, b, c, d, e, f, g, h)                     \
+  ((UINT64) (a) | ((UINT64) (b) << 8) |                  \
+   ((UINT64) (c) << 16) | ((UINT64) (d) << 24) |         \
+   ((UINT64) (e) << 32) | ((UINT64) (f) << 40) |         \
+   ((UINT64) (g) << 48) | ((UINT64) (h) << 56))
+
+#define MASK(len) \
+  (((len) == 8) ? ~(UINT64) 0 : (((UINT64) 1 << ((len) * 8)) - 1))
+
+#define METHOD(a, b, c, d, e, f, g, h, len) \
+  {TOKEN(a, b, c, d, e, f, g, h), MASK(len)}
+
+/* Request methods grouped by their first character. */
+static const method_t methods[][MAX_METHODS] = {
+  /* 0: none. */
+  {{0, 0}},
+  /* 1: 'C'. */
+  {METHOD('C', 'O', 'N', 'N', 'E', 'C', 'T', ' ', 8)},
+  /* 2: 'D'. */
+  {METHOD('D', 'E', 'L', 'E', 'T', 'E', ' ', 0, 7)},
+  /* 3: 'G'. */
+  {METHOD('G', 'E', 'T', ' ', 0, 0, 0, 0, 4)},
+  /* 4: 'H'. */
+  {METHOD('H', 'E', 'A', 'D', ' ', 0, 0, 0, 5)},
+  /* 5: 'O'. */
+  {METHOD('O', 'P', 'T', 'I', 'O', 'N', 'S', ' ', 8)},
+  /* 6: 'P'. */
+  {
+    METHOD('P', 'O', 'S', 'T', ' ', 0, 0, 0, 5),
+    METHOD('P', 'U', 'T', ' ', 0, 0, 0, 0, 4),
+    METHOD('P', 'A', 'T', 'C', 'H', ' ', 0, 0, 6)
+  },
+  /* 7: 'T'. */
+  {METHOD('T', 'R', 'A', 'C', 'E', ' ', 0, 0, 6)}
+};
+
+BOOL IsHttpRequest(const UINT8* data, SIZE_T len)
+{
+  const method_t* candidates;
+  UINT64 first;
+  UINT8 index;
+  unsigned i;
+
+  /* Shortest method: "GET ". */
+  if (len < 4) {
+    return FALSE;
+  }
+
+  switch (data[0]) {
+    case 'C':
+      index = 1;
+      break;
+    case 'D':
+      index = 2;
+      break;
+    case 'G':
+      index = 3;
+      break;
+    case 'H':
+      index = 4;
+      break;
+    case 'O':
+      index = 5;
+      break;
+    case 'P':
+      index = 6;
+      break;
+    case 'T':
+      index = 7;
+      break;
+    default:
+      return FALSE;
+  }
+
+  /* First 8 bytes (little-endian). */
+  first = 0;
+  memcpy(&first, data, (len < 8) ? len : 8);
+
+  candidates = methods[index];
+
+  for (i = 0; (i < MAX_METHODS) && (candidates[i].mask != 0); i++) {
+    if ((first & candidates[i].mask) == candidates[i].token) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+BOOL IsTlsClientHello(const UINT8* data, SIZE_T len)
+{
+  /* Record header (type, version 3.x, length) + ClientHello. */
+  return ((len >= 6) &&
+          (data[0] == TLS_CONTENT_TYPE_HANDSHAKE) &&
+          (data[1] == 3) &&
+          (data[2] <= 4) &&
+          (data[5] == TLS_HANDSHAKE_CLIENT_HELLO));
+}
+
+BOOL IsDnsResponse(const UINT8* data, SIZE_T len)
+{
+  /* Header: response (QR) of a standard query (opcode 0) with one
+   * question.
+   */
+  return ((len >= DNS_HEADER_LEN) &&
+          ((data[2] & 0xf8) == 0x80) &&
+          (data[4] == 0) &&
+          (data[5] == 1));
+}
+
+BOOL IsDnsQuery(const UINT8* data, SIZE_T len)
+{
+  /* Header: query (QR) of a standard query (opcode 0) with one question. */
+  return ((len >= DNS_HEADER_LEN) &&
+          ((data[2] & 0xf8) == 0) &&
+          (data[4] == 0) &&
+          (data[5] == 1));
+}
+
+BOOL IsDnsTcpQuery(const UINT8* data, SIZE_T len)
+{
+  /* Length (which covers at least the header) followed by the query. */
+  return ((len >= 2 + DNS_HEADER_LEN) &&
+          (((data[0] << 8) | data[1]) >= DNS_HEADER_LEN) &&
+          (IsDnsQuery(data + 2, len - 2)));
+}
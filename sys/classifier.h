@@ -0,0 +1,36 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#pragma warning(push)
+#pragma warning(disable:4201) /* Unnamed struct/union. */
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+/* Detectors of the dissectors (dissector.h): they look at the first bytes
+ * of the payload.
+ */
+
+/* First outbound segment of a TCP connection: request method followed by a
+ * space.
+ */
+BOOL IsHttpRequest(const UINT8* data, SIZE_T len);
+
+/* First outbound segment of a TCP connection: TLS handshake record with a
+ * ClientHello.
+ */
+BOOL IsTlsClientHello(const UINT8* data, SIZE_T len);
+
+/* UDP datagram: DNS response to a standard query with one question. */
+BOOL IsDnsResponse(const UINT8* data, SIZE_T len);
+
+/* Outbound UDP datagram: standard query with one question. */
+BOOL IsDnsQuery(const UINT8* data, SIZE_T len);
+
+/* First outbound segment of a TCP connection: length of the message
+ * followed by a standard query with one question.
+ */
+BOOL IsDnsTcpQuery(const UINT8* data, SIZE_T len);
+
+#endif /* CLASSIFIER_H */
@@ -0,0 +1,290 @@
+#include <stddef.h>
+#include <ntstrsafe.h>
+#include "config.h"
+#include "inspect.h"
+#include "http_scanner.h"
+
+/* Longest string value (the path of the log file or the list of excluded
+ * subnets).
+ */
+#define MAX_STRING_VALUE 512
+
+/* Numeric values are stored in 'unsigned' and 'BOOL' fields. */
+C_ASSERT(sizeof(unsigned) == sizeof(ULONG));
+C_ASSERT(sizeof(BOOL) == sizeof(ULONG));
+
+/* The path of the log file is read in the buffer of the string values. */
+C_ASSERT(CONFIG_MAX_PATH <= MAX_STRING_VALUE);
+
+typedef struct {
+  const WCHAR* name;
+  SIZE_T offset;
+  ULONG minimum;
+  ULONG maximum;
+} config_value_t;
+
+#define CONFIG_VALUE(name, field, minimum, maximum) \
+  {name, offsetof(config_t, field), minimum, maximum}
+
+static const config_value_t values[] = {
+  CONFIG_VALUE(L"MaxPackets", max_packets, MIN_PACKETS, 64 * 1024),
+  CONFIG_VALUE(L"MaxPacketSize", max_packet_size, 512, 16 * 1024),
+  CONFIG_VALUE(L"CaptureRecords", capture_records, 0, 1),
+  CONFIG_VALUE(L"LargePages", large_pages, 0, 1),
+  CONFIG_VALUE(L"StatsEveryMs", stats_interval_ms, 0, 24 * 60 * 60 * 1000),
+  CONFIG_VALUE(L"FlushLogsEveryMs", flush_interval_ms, 100, 60 * 1000),
+  CONFIG_VALUE(L"LogBufferSize", log_buffer_size, 4 * 1024, 1024 * 1024),
+  CONFIG_VALUE(L"DnsBuckets", dns_buckets, 1, 64 * 1024),
+  CONFIG_VALUE(L"DnsEntries", dns_entries, 1, 1024 * 1024),
+  CONFIG_VALUE(L"InspectAllTcpPorts", inspect_all_tcp_ports, 0, 1),
+  CONFIG_VALUE(L"InspectLoopback", inspect_loopback, 0, 1),
+  CONFIG_VALUE(L"HttpMaxFlows", http_max_flows, 0, 4096),
+  CONFIG_VALUE(L"HttpMaxHeaders", http_max_headers, 1, 4096),
+  CONFIG_VALUE(L"HttpMaxHeaderSize", http_max_header_size, 1024, 0xffff),
+  CONFIG_VALUE(L"HttpKeepAlive", http_keep_alive, 0, 1),
+  CONFIG_VALUE(L"HttpLogHeaders",
+               http_log_headers,
+               0,
+               (1 << HTTP_NUMBER_HEADERS) - 1),
+  CONFIG_VALUE(L"DnsTcpMaxFlows", dns_tcp_max_flows, 0, 4096),
+  CONFIG_VALUE(L"DnsTcpMaxMessages", dns_tcp_max_messages, 1, 4096),
+  CONFIG_VALUE(L"DnsTcpMaxMessageSize",
+               dns_tcp_max_message_size,
+               512,
+               0xffff),
+  CONFIG_VALUE(L"TlsMaxFlows", tls_max_flows, 0, 4096),
+  CONFIG_VALUE(L"TlsMaxRecords", tls_max_records, 1, 4096),
+  CONFIG_VALUE(L"TlsMaxRecordSize", tls_max_record_size, 512, 0xffff),
+  CONFIG_VALUE(L"DnsMaxQueries", dns_max_queries, 0, 64 * 1024),
+  CONFIG_VALUE(L"DnsQueryTimeoutMs", dns_query_timeout_ms, 100, 60 * 1000),
+  CONFIG_VALUE(L"DnsDropUnsolicited", dns_drop_unsolicited, 0, 1)
+};
+
+static BOOL ReadString(WDFKEY key,
+                       const WCHAR* name,
+                       WCHAR* buf,
+                       USHORT size);
+
+static BOOL ParsePorts(const WCHAR* str, UINT16* ports, unsigned* count);
+
+void GetDefaultConfig(_Out_ config_t* config)
+{
+  const dissector_t* dissector;
+  unsigned i;
+
+  RtlZeroMemory(config, sizeof(config_t));
+
+  config->max_packets = MAX_PACKETS;
+  config->max_packet_size = MAX_PACKET_SIZE;
+  config->capture_records = CAPTURE_RECORDS;
+  config->large_pages = USE_LARGE_PAGES;
+
+  config->stats_interval_ms = LOG_STATS_EVERY_MS;
+  config->flush_interval_ms = FLUSH_LOGS_EVERY_MS;
+  config->log_buffer_size = LOG_BUFFER_SIZE;
+  RtlStringCbCopyW(config->log_file, sizeof(config->log_file), LOG_FILE);
+
+  config->dns_buckets = DNS_BUCKETS;
+  config->dns_entries = DNS_ENTRIES;
+
+  config->inspect_all_tcp_ports = INSPECT_ALL_TCP_PORTS;
+  config->inspect_loopback = INSPECT_LOOPBACK;
+  RtlStringCbCopyA(config->excluded_subnets,
+                   sizeof(config->excluded_subnets),
+                   EXCLUDED_SUBNETS);
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    dissector = GetDissector((protocol_t) i);
+
+    config->nports[i] = min(dissector->nports, MAX_DISSECTOR_PORTS);
+
+    memcpy(config->ports[i],
+           dissector->ports,
+           config->nports[i] * sizeof(UINT16));
+  }
+
+  config->http_max_flows = HTTP_MAX_FLOWS;
+  config->http_max_headers = HTTP_MAX_HEADERS;
+  config->http_max_header_size = HTTP_MAX_HEADER_SIZE;
+  config->http_keep_alive = HTTP_KEEP_ALIVE;
+  config->http_log_headers = HTTP_LOG_HEADERS;
+
+  config->dns_tcp_max_flows = DNS_TCP_MAX_FLOWS;
+  config->dns_tcp_max_messages = DNS_TCP_MAX_MESSAGES;
+  config->dns_tcp_max_message_size = DNS_TCP_MAX_MESSAGE_SIZE;
+
+  config->tls_max_flows = TLS_MAX_FLOWS;
+  config->tls_max_records = TLS_MAX_RECORDS;
+  config->tls_max_record_size = TLS_MAX_RECORD_SIZE;
+
+  config->dns_max_queries = DNS_MAX_QUERIES;
+  config->dns_query_timeout_ms = DNS_QUERY_TIMEOUT_MS;
+  config->dns_drop_unsolicited = DNS_DROP_UNSOLICITED;
+}
+
+void ReadConfig(_In_ WDFKEY key, _Inout_ config_t* config)
+{
+  UNICODE_STRING name;
+  WCHAR buf[MAX_STRING_VALUE];
+  WCHAR portsname[32];
+  UINT16 ports[MAX_DISSECTOR_PORTS];
+  unsigned nports;
+  ULONG value;
+  unsigned i;
+
+  /* Numeric values. */
+  for (i = 0; i < ARRAYSIZE(values); i++) {
+    RtlInitUnicodeString(&name, values[i].name);
+
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &name, &value))) {
+      if ((value < values[i].minimum) || (value > values[i].maximum)) {
+        value = (value < values[i].minimum) ? values[i].minimum :
+                                               values[i].maximum;
+
+        DbgPrint("Registry value %ws out of range, using %u.",
+                 values[i].name,
+                 value);
+      }
+
+      *((ULONG*) ((UINT8*) config + values[i].offset)) = value;
+    }
+  }
+
+  /* The query table has a power of 2 number of slots (at least 4). */
+  if (config->dns_max_queries > 0) {
+    if (config->dns_max_queries < 4) {
+      config->dns_max_queries = 4;
+    } else {
+      while ((config->dns_max_queries & (config->dns_max_queries - 1)) != 0) {
+        config->dns_max_queries &= config->dns_max_queries - 1;
+      }
+    }
+  }
+
+  /* Log file (a longer path would be truncated). */
+  if (ReadString(key, L"LogFile", buf, sizeof(config->log_file))) {
+    if (buf[0] != 0) {
+      RtlStringCbCopyW(config->log_file, sizeof(config->log_file), buf);
+    }
+  }
+
+  /* Excluded subnets (ASCII, validated when the filters are added). */
+  if (ReadString(key, L"ExcludedSubnets", buf, sizeof(buf))) {
+    for (i = 0;
+         (buf[i] != 0) &&
+         (buf[i] < 0x80) &&
+         (i < sizeof(config->excluded_subnets) - 1);
+         i++) {
+      config->excluded_subnets[i] = (char) buf[i];
+    }
+
+    if (buf[i] == 0) {
+      config->excluded_subnets[i] = 0;
+    } else {
+      DbgPrint("Invalid registry value ExcludedSubnets, ignored.");
+
+      RtlStringCbCopyA(config->excluded_subnets,
+                       sizeof(config->excluded_subnets),
+                       EXCLUDED_SUBNETS);
+    }
+  }
+
+  /* Ports of the dissectors ("<name>Ports", the dissectors with the same
+   * name share the value).
+   */
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    if (!NT_SUCCESS(RtlStringCbPrintfW(portsname,
+                                       sizeof(portsname),
+                                       L"%SPorts",
+                                       GetDissector((protocol_t) i)->name))) {
+      continue;
+    }
+
+    if (ReadString(key, portsname, buf, sizeof(buf))) {
+      if (ParsePorts(buf, ports, &nports)) {
+        memcpy(config->ports[i], ports, nports * sizeof(UINT16));
+        config->nports[i] = nports;
+      } else {
+        DbgPrint("Invalid registry value %ws, ignored.", portsname);
+      }
+    }
+  }
+}
+
+BOOL ReadString(WDFKEY key, const WCHAR* name, WCHAR* buf, USHORT size)
+{
+  UNICODE_STRING value_name;
+  UNICODE_STRING value;
+  USHORT len;
+  NTSTATUS status;
+
+  RtlInitUnicodeString(&value_name, name);
+
+  value.Buffer = buf;
+  value.Length = 0;
+  value.MaximumLength = (USHORT) (size - sizeof(WCHAR));
+
+  if (!NT_SUCCESS(status = WdfRegistryQueryUnicodeString(key,
+                                                         &value_name,
+                                                         &len,
+                                                         &value))) {
+    if (status == STATUS_BUFFER_OVERFLOW) {
+      DbgPrint("Registry value %ws too long, ignored.", name);
+    }
+
+    return FALSE;
+  }
+
+  /* The string might not be terminated. */
+  buf[value.Length / sizeof(WCHAR)] = 0;
+
+  return TRUE;
+}
+
+BOOL ParsePorts(const WCHAR* str, UINT16* ports, unsigned* count)
+{
+  ULONG port;
+  unsigned n;
+
+  n = 0;
+
+  do {
+    /* Skip separators. */
+    while ((*str == L' ') || (*str == L',')) {
+      str++;
+    }
+
+    if (*str == 0) {
+      break;
+    }
+
+    if ((*str < L'0') || (*str > L'9') || (n == MAX_DISSECTOR_PORTS)) {
+      return FALSE;
+    }
+
+    port = 0;
+
+    while ((*str >= L'0') && (*str <= L'9')) {
+      if ((port = (port * 10) + (*str - L'0')) > 0xffff) {
+        return FALSE;
+      }
+
+      str++;
+    }
+
+    if ((port == 0) ||
+        ((*str != 0) && (*str != L' ') && (*str != L','))) {
+      return FALSE;
+    }
+
+    ports[n++] = (UINT16) port;
+  } while (*str != 0);
+
+  if (n == 0) {
+    return FALSE;
+  }
+
+  *count = n;
+
+  return TRUE;
+}
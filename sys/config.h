@@ -0,0 +1,75 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <ntddk.h>
+#include <wdf.h>
+#include "dissector.h"
+
+/* Maximum length of the path of the log file (including the terminator). */
+#define CONFIG_MAX_PATH 260
+
+/* Maximum length of the list of excluded subnets (including the
+ * terminator).
+ */
+#define CONFIG_MAX_SUBNETS 512
+
+typedef struct {
+  /* Packet pool. */
+  unsigned max_packets;
+  unsigned max_packet_size;
+  BOOL capture_records;
+  BOOL large_pages;
+
+  /* Worker thread and log file. */
+  unsigned stats_interval_ms;
+  unsigned flush_interval_ms;
+  unsigned log_buffer_size;
+  WCHAR log_file[CONFIG_MAX_PATH];
+
+  /* DNS cache. */
+  unsigned dns_buckets;
+  unsigned dns_entries;
+
+  /* Filters. */
+  BOOL inspect_all_tcp_ports;
+  BOOL inspect_loopback;
+  char excluded_subnets[CONFIG_MAX_SUBNETS];
+
+  /* Remote ports of the dissectors. */
+  UINT16 ports[PROTOCOL_COUNT][MAX_DISSECTOR_PORTS];
+  unsigned nports[PROTOCOL_COUNT];
+
+  /* HTTP flows. */
+  unsigned http_max_flows;
+  unsigned http_max_headers;
+  unsigned http_max_header_size;
+  BOOL http_keep_alive;
+  unsigned http_log_headers;
+
+  /* DNS over TCP flows. */
+  unsigned dns_tcp_max_flows;
+  unsigned dns_tcp_max_messages;
+  unsigned dns_tcp_max_message_size;
+
+  /* TLS flows. */
+  unsigned tls_max_flows;
+  unsigned tls_max_records;
+  unsigned tls_max_record_size;
+
+  /* DNS queries. */
+  unsigned dns_max_queries;
+  unsigned dns_query_timeout_ms;
+  BOOL dns_drop_unsolicited;
+} config_t;
+
+/* Default configuration (inspect.h and the default ports of the
+ * dissectors).
+ */
+void GetDefaultConfig(_Out_ config_t* config);
+
+/* Override the configuration with the values of the registry key (the
+ * values out of range are clamped, the invalid ones are ignored).
+ */
+void ReadConfig(_In_ WDFKEY key, _Inout_ config_t* config);
+
+#endif /* CONFIG_H */
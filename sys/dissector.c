@@ -0,0 +1,267 @@
+#include <ntddk.h>
+#include "dissector.h"
+#include "classifier.h"
+#include "packet_processor.h"
+#include "http_scanner.h"
+#include "dns_parser.h"
+
+/* The ports of the dissectors are in an open-addressed hash table (at most
+ * half full, port 0 marks the free slots). There are two tables: the new
+ * ports are added to the one which is not in use and then it replaces the
+ * other one, so the lookups don't take any lock.
+ */
+#define PORTS_HASH_SIZE 128
+#define PORT_HASH(port) (((port) ^ ((port) >> 3)) & (PORTS_HASH_SIZE - 1))
+
+C_ASSERT(2 * PROTOCOL_COUNT * MAX_DISSECTOR_PORTS <= PORTS_HASH_SIZE);
+
+typedef struct {
+  UINT16 port;
+  UINT8 protocol;
+} port_entry_t;
+
+static const UINT16 http_ports[] = {80, 3128, 8000, 8080};
+static const UINT16 tls_ports[] = {443, 8443};
+static const UINT16 dns_ports[] = {53};
+
+static const dissector_t dissectors[PROTOCOL_COUNT] = {
+  /* PROTOCOL_UNKNOWN. */
+  {NULL, 0, NULL, 0, NULL, 0, NULL, NULL, FALSE},
+
+  /* PROTOCOL_HTTP. */
+  {
+    "HTTP",
+    TRANSPORT_TCP,
+    http_ports,
+    ARRAYSIZE(http_ports),
+    IsHttpRequest,
+    CAPTURE_ALL,
+    BuildHttpRecord,
+    LogHttp,
+    TRUE
+  },
+
+  /* PROTOCOL_TLS (the fingerprint needs the whole ClientHello). */
+  {
+    "HTTPS",
+    TRANSPORT_TCP,
+    tls_ports,
+    ARRAYSIZE(tls_ports),
+    IsTlsClientHello,
+    CAPTURE_ALL,
+    NULL,
+    LogHttps,
+    TRUE
+  },
+
+  /* PROTOCOL_DNS. */
+  {
+    "DNS",
+    TRANSPORT_UDP,
+    dns_ports,
+    ARRAYSIZE(dns_ports),
+    IsDnsResponse,
+    CAPTURE_ALL,
+    BuildDnsRecord,
+    LogDns,
+    FALSE
+  },
+
+  /* PROTOCOL_DNS_TCP: the query is only detected, the responses are
+   * reassembled from the inbound data of the connection (dns_flow.c).
+   */
+  {
+    "DNS",
+    TRANSPORT_TCP,
+    dns_ports,
+    ARRAYSIZE(dns_ports),
+    IsDnsTcpQuery,
+    0,
+    NULL,
+    LogDns,
+    FALSE
+  }
+};
+
+/* Ports of the dissectors (the default ones or set by SetDissectorPorts()).
+ * A port shared by two dissectors (DNS over UDP and TCP) is added to
+ * 'ports_hash' once: the dissector of the other transport protocol is found
+ * by DetectProtocol() trying all of them.
+ */
+static UINT16 dissector_ports[PROTOCOL_COUNT][MAX_DISSECTOR_PORTS];
+static unsigned dissector_nports[PROTOCOL_COUNT];
+
+static port_entry_t ports_tables[2][PORTS_HASH_SIZE];
+static port_entry_t* volatile ports_hash = ports_tables[0];
+
+static void BuildPortsHash();
+
+void InitDissectors()
+{
+  unsigned i;
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    dissector_nports[i] = min(dissectors[i].nports, MAX_DISSECTOR_PORTS);
+
+    memcpy(dissector_ports[i],
+           dissectors[i].ports,
+           dissector_nports[i] * sizeof(UINT16));
+  }
+
+  BuildPortsHash();
+}
+
+BOOL SetDissectorPorts(UINT16 ports[PROTOCOL_COUNT][MAX_DISSECTOR_PORTS],
+                       const unsigned nports[PROTOCOL_COUNT])
+{
+  unsigned i;
+  unsigned j;
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    if ((nports[i] == 0) || (nports[i] > MAX_DISSECTOR_PORTS)) {
+      return FALSE;
+    }
+
+    for (j = 0; j < nports[i]; j++) {
+      if (ports[i][j] == 0) {
+        return FALSE;
+      }
+    }
+  }
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    memcpy(dissector_ports[i], ports[i], nports[i] * sizeof(UINT16));
+    dissector_nports[i] = nports[i];
+  }
+
+  BuildPortsHash();
+
+  return TRUE;
+}
+
+void BuildPortsHash()
+{
+  port_entry_t* table;
+  unsigned i;
+  unsigned j;
+  unsigned k;
+
+  /* Build the table which is not in use. A lookup which started before the
+   * previous replacement might still be walking it: at worst, it doesn't
+   * find the port (the table is never more than half full, so the walk
+   * ends).
+   */
+  table = (ports_hash == ports_tables[0]) ? ports_tables[1] :
+                                            ports_tables[0];
+
+  RtlZeroMemory(table, sizeof(ports_tables[0]));
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    for (j = 0; j < dissector_nports[i]; j++) {
+      k = PORT_HASH(dissector_ports[i][j]);
+
+      /* Skip the ports already added (by a previous dissector). */
+      while ((table[k].port != 0) &&
+             (table[k].port != dissector_ports[i][j])) {
+        k = (k + 1) & (PORTS_HASH_SIZE - 1);
+      }
+
+      if (table[k].port == 0) {
+        table[k].port = dissector_ports[i][j];
+        table[k].protocol = (UINT8) i;
+      }
+    }
+  }
+
+  InterlockedExchangePointer((PVOID volatile*) &ports_hash, table);
+}
+
+const dissector_t* GetDissector(protocol_t protocol)
+{
+  return &dissectors[protocol];
+}
+
+protocol_t DetectProtocol(UINT8 transport,
+                          UINT16 port,
+                          const UINT8* data,
+                          SIZE_T len)
+{
+  const dissector_t* dissector;
+  protocol_t protocol;
+  unsigned i;
+
+  /* Most of the time, the protocol is the one of the port. */
+  if ((protocol = GetProtocolForPort(port)) != PROTOCOL_UNKNOWN) {
+    dissector = &dissectors[protocol];
+
+    if ((dissector->transport == transport) &&
+        (dissector->detect(data, len))) {
+      return protocol;
+    }
+  }
+
+  /* Try the other dissectors of the transport protocol. */
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    dissector = &dissectors[i];
+
+    if ((i != (unsigned) protocol) &&
+        (dissector->transport == transport) &&
+        (dissector->detect(data, len))) {
+      return (protocol_t) i;
+    }
+  }
+
+  return PROTOCOL_UNKNOWN;
+}
+
+protocol_t GetProtocolForPort(UINT16 port)
+{
+  const port_entry_t* table;
+  unsigned i;
+
+  table = ports_hash;
+
+  i = PORT_HASH(port);
+
+  while (table[i].port != 0) {
+    if (table[i].port == port) {
+      return (protocol_t) table[i].protocol;
+    }
+
+    i = (i + 1) & (PORTS_HASH_SIZE - 1);
+  }
+
+  return PROTOCOL_UNKNOWN;
+}
+
+unsigned GetDissectorPorts(UINT8 transports, UINT16* ports, unsigned max)
+{
+  const dissector_t* dissector;
+  unsigned count;
+  unsigned i;
+  unsigned j;
+  unsigned k;
+
+  count = 0;
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    dissector = &dissectors[i];
+
+    if (dissector->transport & transports) {
+      for (j = 0; (j < dissector_nports[i]) && (count < max); j++) {
+        /* Skip the ports shared with a previous dissector. */
+        for (k = 0; k < count; k++) {
+          if (ports[k] == dissector_ports[i][j]) {
+            break;
+          }
+        }
+
+        if (k == count) {
+          ports[count++] = dissector_ports[i][j];
+        }
+      }
+    }
+  }
+
+  return count;
+}
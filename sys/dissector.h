@@ -0,0 +1,105 @@
+#ifndef DISSECTOR_H
+#define DISSECTOR_H
+
+#include "packet_pool.h"
+
+/* Index in the dissector registry. */
+typedef enum {
+  PROTOCOL_UNKNOWN,
+  PROTOCOL_HTTP,
+  PROTOCOL_TLS,
+  PROTOCOL_DNS,
+  PROTOCOL_DNS_TCP,
+  PROTOCOL_COUNT
+} protocol_t;
+
+/* Maximum number of ports of a dissector. */
+#define MAX_DISSECTOR_PORTS 8
+
+/* Transport protocols (can be OR'ed). */
+#define TRANSPORT_TCP 0x01
+#define TRANSPORT_UDP 0x02
+
+/* Capture the whole payload (up to the size of the packets of the packet
+ * pool).
+ */
+#define CAPTURE_ALL 0xffff
+
+/* Return TRUE if the first bytes of the payload belong to the protocol. */
+typedef BOOL (*detect_fn_t)(const UINT8* data, SIZE_T len);
+
+/* Build the compact record of the payload in 'record' (at most 'size' bytes,
+ * 'record' might be 'data'): only what the log function needs. Return its
+ * length or 0 to capture the payload as is.
+ */
+typedef SIZE_T (*compact_fn_t)(const UINT8* data,
+                               SIZE_T len,
+                               UINT8* record,
+                               SIZE_T size);
+
+/* Parse the payload and write the log record ('str': hostname of the server
+ * from the DNS cache).
+ */
+typedef void (*log_fn_t)(packet_t* packet,
+                         const char* local,
+                         const char* remote,
+                         const char* str);
+
+typedef struct {
+  const char* name;
+
+  UINT8 transport;
+
+  /* Default remote ports of the protocol (see SetDissectorPorts()): they are
+   * added to the filters and tried first.
+   */
+  const UINT16* ports;
+  unsigned nports;
+
+  detect_fn_t detect;
+
+  /* Maximum number of bytes of payload copied to the packet. */
+  UINT16 capture_len;
+
+  /* Compact record captured instead of the payload (NULL: none). */
+  compact_fn_t compact;
+
+  log_fn_t log;
+
+  /* Look up the remote address in the DNS cache before logging? If not,
+   * the packet is logged as soon as it is processed (DNS responses, which
+   * might add entries to the DNS cache).
+   */
+  BOOL resolve;
+} dissector_t;
+
+/* Set the default ports of the dissectors. */
+void InitDissectors();
+
+/* Replace the ports of all the dissectors ('nports[i]' ports in 'ports[i]'
+ * for each protocol, PROTOCOL_UNKNOWN is ignored). The lookups running at
+ * the same time (classify functions) see either the previous ports or the
+ * new ones.
+ */
+BOOL SetDissectorPorts(UINT16 ports[PROTOCOL_COUNT][MAX_DISSECTOR_PORTS],
+                       const unsigned nports[PROTOCOL_COUNT]);
+
+const dissector_t* GetDissector(protocol_t protocol);
+
+/* Detect the protocol of the first outbound payload of a TCP connection or
+ * of a UDP datagram.
+ */
+protocol_t DetectProtocol(UINT8 transport,
+                          UINT16 port,
+                          const UINT8* data,
+                          SIZE_T len);
+
+/* Protocol of the events without payload (connection close). */
+protocol_t GetProtocolForPort(UINT16 port);
+
+/* Get the remote ports of the dissectors of the transport protocols
+ * (returns the number of ports).
+ */
+unsigned GetDissectorPorts(UINT8 transports, UINT16* ports, unsigned max);
+
+#endif /* DISSECTOR_H */
@@ -0,0 +1,364 @@
+#include <stddef.h>
+#include <wdm.h>
+#include "dns_flow.h"
+#include "largemem.h"
+
+#define MAX_MESSAGE_SIZE 0xffff
+
+typedef struct {
+  /* Flow contexts. */
+  dns_flow_t* flows;
+  dns_flow_t** free_flows;
+  unsigned max_flows;
+  unsigned nfree_flows;
+
+  /* Packets (all allocated in a single block). */
+  memory_t arena;
+  packet_t** free_packets;
+  unsigned max_messages;
+  unsigned nfree_packets;
+
+  SIZE_T packet_size;
+  unsigned max_message_size;
+
+  KSPIN_LOCK spin_lock;
+} dns_flows_t;
+
+static dns_flows_t pool;
+
+static SIZE_T AppendToMessage(dns_flow_t* flow,
+                              const UINT8* data,
+                              SIZE_T len,
+                              BOOL* complete);
+
+BOOL InitDnsFlows(unsigned max_flows,
+                  unsigned max_messages,
+                  unsigned max_message_size,
+                  BOOL large_pages)
+{
+  UINT8* packet;
+  unsigned i;
+
+  pool.max_flows = 0;
+
+  /* Connections not followed? */
+  if (max_flows == 0) {
+    return TRUE;
+  }
+
+  if ((max_messages == 0) ||
+      (max_message_size == 0) ||
+      (max_message_size > MAX_MESSAGE_SIZE)) {
+    return FALSE;
+  }
+
+  if ((pool.flows = (dns_flow_t*) ExAllocatePoolWithTag(
+                                    NonPagedPool,
+                                    max_flows * sizeof(dns_flow_t),
+                                    PACKET_POOL_TAG
+                                  )) == NULL) {
+    return FALSE;
+  }
+
+  if ((pool.free_flows = (dns_flow_t**) ExAllocatePoolWithTag(
+                                          NonPagedPool,
+                                          max_flows * sizeof(dns_flow_t*),
+                                          PACKET_POOL_TAG
+                                        )) == NULL) {
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    return FALSE;
+  }
+
+  if ((pool.free_packets = (packet_t**) ExAllocatePoolWithTag(
+                                          NonPagedPool,
+                                          max_messages * sizeof(packet_t*),
+                                          PACKET_POOL_TAG
+                                        )) == NULL) {
+    ExFreePoolWithTag(pool.free_flows, PACKET_POOL_TAG);
+    pool.free_flows = NULL;
+
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    return FALSE;
+  }
+
+  /* Keep the packets aligned. */
+  pool.packet_size = (offsetof(packet_t, payload) + max_message_size +
+                      sizeof(LONGLONG) - 1) &
+                     ~(sizeof(LONGLONG) - 1);
+
+  if (!AllocMemory(&pool.arena,
+                   (SIZE_T) max_messages * pool.packet_size,
+                   large_pages)) {
+    ExFreePoolWithTag(pool.free_packets, PACKET_POOL_TAG);
+    pool.free_packets = NULL;
+
+    ExFreePoolWithTag(pool.free_flows, PACKET_POOL_TAG);
+    pool.free_flows = NULL;
+
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    return FALSE;
+  }
+
+  for (i = 0; i < max_flows; i++) {
+    pool.free_flows[i] = &pool.flows[i];
+  }
+
+  packet = (UINT8*) pool.arena.ptr;
+
+  for (i = 0; i < max_messages; i++) {
+    pool.free_packets[i] = (packet_t*) packet;
+    packet += pool.packet_size;
+  }
+
+  pool.max_flows = max_flows;
+  pool.nfree_flows = max_flows;
+
+  pool.max_messages = max_messages;
+  pool.nfree_packets = max_messages;
+
+  pool.max_message_size = max_message_size;
+
+  KeInitializeSpinLock(&pool.spin_lock);
+
+  return TRUE;
+}
+
+void FreeDnsFlows()
+{
+  if (pool.max_flows > 0) {
+    FreeMemory(&pool.arena);
+
+    ExFreePoolWithTag(pool.free_packets, PACKET_POOL_TAG);
+    pool.free_packets = NULL;
+
+    ExFreePoolWithTag(pool.free_flows, PACKET_POOL_TAG);
+    pool.free_flows = NULL;
+
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    pool.max_flows = 0;
+  }
+}
+
+dns_flow_t* NewDnsFlow(const packet_t* tuple)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  dns_flow_t* flow;
+
+  /* Connections not followed? */
+  if (pool.max_flows == 0) {
+    return NULL;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  if (pool.nfree_flows > 0) {
+    flow = pool.free_flows[--pool.nfree_flows];
+  } else {
+    flow = NULL;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  if (flow) {
+    memcpy(&flow->tuple, tuple, offsetof(packet_t, payload));
+
+    flow->packet = NULL;
+    flow->state = DNS_FLOW_LENGTH;
+    flow->remaining = 0;
+    flow->count = 0;
+    flow->messages = 0;
+  }
+
+  return flow;
+}
+
+void DeleteDnsFlow(dns_flow_t* flow)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  if (flow->packet) {
+    pool.free_packets[pool.nfree_packets++] = flow->packet;
+    flow->packet = NULL;
+  }
+
+  pool.free_flows[pool.nfree_flows++] = flow;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+BOOL IsDnsFlow(const void* context)
+{
+  return ((pool.max_flows > 0) &&
+          ((const dns_flow_t*) context >= pool.flows) &&
+          ((const dns_flow_t*) context < pool.flows + pool.max_flows));
+}
+
+BOOL AttachDnsFlowPacket(dns_flow_t* flow)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  packet_t* packet;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  if (pool.nfree_packets > 0) {
+    packet = pool.free_packets[--pool.nfree_packets];
+  } else {
+    packet = NULL;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  if (!packet) {
+    return FALSE;
+  }
+
+  memcpy(packet, &flow->tuple, offsetof(packet_t, payload));
+  packet->payloadlen = 0;
+
+  flow->packet = packet;
+
+  return TRUE;
+}
+
+SIZE_T ConsumeDnsFlowData(dns_flow_t* flow,
+                          const UINT8* data,
+                          SIZE_T len,
+                          BOOL* complete)
+{
+  const UINT8* ptr;
+  const UINT8* end;
+  SIZE_T n;
+
+  *complete = FALSE;
+
+  ptr = data;
+  end = data + len;
+
+  while (ptr < end) {
+    switch (flow->state) {
+      case DNS_FLOW_LENGTH:
+        /* The length is in network byte order. */
+        flow->remaining = (UINT16) ((flow->remaining << 8) | *ptr++);
+
+        if (++flow->count == 2) {
+          /* Empty messages are skipped. */
+          flow->state = (flow->remaining > 0) ? DNS_FLOW_MESSAGE :
+                                                DNS_FLOW_LENGTH;
+          flow->count = 0;
+        }
+
+        break;
+      case DNS_FLOW_MESSAGE:
+        /* A packet has to be attached first. */
+        if (!flow->packet) {
+          return ptr - data;
+        }
+
+        return (ptr - data) + AppendToMessage(flow, ptr, end - ptr, complete);
+      case DNS_FLOW_SKIP:
+        n = end - ptr;
+        if (n > flow->remaining) {
+          n = flow->remaining;
+        }
+
+        ptr += n;
+        flow->remaining = (UINT16) (flow->remaining - n);
+
+        if (flow->remaining == 0) {
+          flow->state = DNS_FLOW_LENGTH;
+        }
+
+        break;
+      default:
+        return len;
+    }
+  }
+
+  return len;
+}
+
+packet_t* TakeDnsFlowPacket(dns_flow_t* flow)
+{
+  packet_t* packet;
+
+  packet = flow->packet;
+  flow->packet = NULL;
+
+  flow->messages++;
+
+  return packet;
+}
+
+BOOL ReleaseDnsFlowPacket(packet_t* packet)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+
+  if ((pool.max_flows == 0) ||
+      ((UINT8*) packet < (UINT8*) pool.arena.ptr) ||
+      ((UINT8*) packet >= (UINT8*) pool.arena.ptr +
+                          (SIZE_T) pool.max_messages * pool.packet_size)) {
+    return FALSE;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  pool.free_packets[pool.nfree_packets++] = packet;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  return TRUE;
+}
+
+SIZE_T AppendToMessage(dns_flow_t* flow,
+                       const UINT8* data,
+                       SIZE_T len,
+                       BOOL* complete)
+{
+  packet_t* packet;
+  SIZE_T n;
+
+  packet = flow->packet;
+
+  n = pool.max_message_size - packet->payloadlen;
+  if (n > flow->remaining) {
+    n = flow->remaining;
+  }
+
+  if (n > len) {
+    n = len;
+  }
+
+  memcpy(packet->payload + packet->payloadlen, data, n);
+
+  packet->payloadlen = (UINT16) (packet->payloadlen + n);
+  flow->remaining = (UINT16) (flow->remaining - n);
+
+  if (flow->remaining == 0) {
+    *complete = TRUE;
+    flow->state = DNS_FLOW_LENGTH;
+  } else if (packet->payloadlen == pool.max_message_size) {
+    /* The answers which fit are still added to the DNS cache. */
+    *complete = TRUE;
+    flow->state = DNS_FLOW_SKIP;
+  }
+
+  return n;
+}
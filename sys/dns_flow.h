@@ -0,0 +1,90 @@
+#ifndef DNS_FLOW_H
+#define DNS_FLOW_H
+
+#include "packet_pool.h"
+
+typedef enum {
+  DNS_FLOW_LENGTH,  /* Length of the next message (2 bytes). */
+  DNS_FLOW_MESSAGE, /* Message. */
+  DNS_FLOW_SKIP,    /* Rest of a message which doesn't fit in the packet. */
+  DNS_FLOW_DONE     /* Not following the connection anymore. */
+} dns_flow_state_t;
+
+typedef struct {
+  /* Flow to which the context is associated. */
+  UINT64 flow_id;
+  UINT16 layer_id;
+  UINT32 callout_id;
+
+  /* Addresses and ports of the connection. */
+  packet_t tuple;
+
+  /* Packet in which the message is reassembled (NULL once it has been
+   * handed to the worker thread).
+   */
+  packet_t* packet;
+
+  dns_flow_state_t state;
+
+  /* Bytes of the message still to be received (DNS_FLOW_MESSAGE and
+   * DNS_FLOW_SKIP) or length being parsed (DNS_FLOW_LENGTH).
+   */
+  UINT16 remaining;
+
+  /* DNS_FLOW_LENGTH: number of bytes of the length already received. */
+  unsigned count;
+
+  /* Number of messages handed to the worker thread. */
+  unsigned messages;
+} dns_flow_t;
+
+/* Preallocate 'max_flows' flow contexts and 'max_messages' packets with room
+ * for 'max_message_size' bytes of DNS message. A flow only holds a packet
+ * while it is reassembling a message. The messages bigger than
+ * 'max_message_size' are truncated. If 'max_flows' is 0, the connections
+ * are not followed.
+ */
+BOOL InitDnsFlows(unsigned max_flows,
+                  unsigned max_messages,
+                  unsigned max_message_size,
+                  BOOL large_pages);
+void FreeDnsFlows();
+
+/* Get a flow context for the connection of 'tuple' (NULL if the connections
+ * are not followed or the memory budget is exhausted).
+ */
+dns_flow_t* NewDnsFlow(const packet_t* tuple);
+
+/* Return the flow context and its packet (if any) to the pool. */
+void DeleteDnsFlow(dns_flow_t* flow);
+
+/* Return TRUE if 'context' is a flow context of the pool. */
+BOOL IsDnsFlow(const void* context);
+
+/* Get an empty packet for the next message. Return FALSE if the memory
+ * budget is exhausted.
+ */
+BOOL AttachDnsFlowPacket(dns_flow_t* flow);
+
+/* Consume inbound data of the connection: the 2-byte length of each message
+ * is parsed and the message is appended to the packet. Return the number
+ * of bytes consumed, which is less than 'len' when:
+ * - A message has been completed (its last byte was received or the packet
+ *   is full): '*complete' is set to TRUE and the packet has to be taken
+ *   before passing the rest of the data.
+ * - A message begins and no packet is attached.
+ */
+SIZE_T ConsumeDnsFlowData(dns_flow_t* flow,
+                          const UINT8* data,
+                          SIZE_T len,
+                          BOOL* complete);
+
+/* Detach the packet from the flow context. */
+packet_t* TakeDnsFlowPacket(dns_flow_t* flow);
+
+/* If the packet belongs to the message pool, return it to the pool and
+ * return TRUE.
+ */
+BOOL ReleaseDnsFlowPacket(packet_t* packet);
+
+#endif /* DNS_FLOW_H */
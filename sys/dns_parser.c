@@ -0,0 +1,914 @@
+#include <ntddk.h>
+#include <ip2string.h>
+#include "dns_parser.h"
+#include "dnscache.h"
+#include "tls_parser.h"
+#include "logfile.h"
+
+#define DNS_HEADER_LEN 12
+#define HOST_NAME_MAX_LEN 255
+#define MAX_POINTERS 10
+
+/* Bytes of answers parsed per response (the following answers are
+ * ignored).
+ */
+#define MAX_ANSWERS_LEN (8 * 1024)
+
+/* Smallest CNAME record: name (pointer) + type, class, TTL and RDLENGTH +
+ * alias (pointer).
+ */
+#define MIN_CNAME_LEN (2 + 10 + 2)
+
+#define MAX_CNAMES ((MAX_ANSWERS_LEN / MIN_CNAME_LEN) + 1)
+
+/* Open-addressed hash table of the aliases (at most half full). */
+#define CNAMES_HASH_SIZE 2048
+
+C_ASSERT(2 * MAX_CNAMES <= CNAMES_HASH_SIZE);
+
+/* " [ALPN: " + protocols separated by ',' + "]" + NUL. */
+#define LOG_ALPN_SIZE 128
+
+/* SvcParamKeys (RFC 9460). */
+#define SVC_PARAM_ALPN 1
+#define SVC_PARAM_IPV4HINT 4
+#define SVC_PARAM_IPV6HINT 6
+
+#define FNV1A_OFFSET_BASIS 2166136261u
+#define FNV1A_PRIME 16777619u
+
+/* The names are referenced by their offset in the message (in compressed
+ * form) and only decompressed when they are added to the DNS cache or logged.
+ */
+typedef UINT16 dns_name_t;
+
+typedef struct {
+  /* Response which added the entry (the entries of the previous responses
+   * are free).
+   */
+  UINT32 generation;
+
+  /* Hash of the alias (lowercase). */
+  UINT32 hash;
+
+  dns_name_t alias;
+
+  /* Hostname at the beginning of the CNAME chain of the alias. */
+  dns_name_t hostname;
+} cname_t;
+
+/* The responses are only parsed by the worker thread. */
+static cname_t cnames[CNAMES_HASH_SIZE];
+static unsigned ncnames;
+static UINT32 generation;
+
+/* Last alias added (the address records usually follow the CNAME record of
+ * their name and point to its alias).
+ */
+static dns_name_t last_alias;
+static dns_name_t last_hostname;
+
+/* Decompressed name. */
+typedef struct {
+  /* Offset of the first label of the name (0: none). */
+  dns_name_t name;
+
+  char text[HOST_NAME_MAX_LEN + 1];
+  UINT16 len;
+} dns_text_t;
+
+static BOOL SkipDnsQuestions(const UINT8* end,
+                             UINT16 qdcount,
+                             const UINT8** ptr);
+
+static BOOL SkipDnsName(const UINT8* end, const UINT8** ptr);
+
+/* Check the name at '*ptr' and skip it ('name': offset of its first
+ * label).
+ */
+static BOOL CheckDnsName(const UINT8* data,
+                         const UINT8* end,
+                         const UINT8** ptr,
+                         dns_name_t* name);
+
+/* Skip the pointers at the beginning of the rest of a name. */
+static dns_name_t FirstDnsLabel(const UINT8* data, dns_name_t name);
+
+static BOOL EqualDnsNames(const UINT8* data,
+                          dns_name_t name1,
+                          dns_name_t name2);
+
+static const char* DecodeDnsName(const UINT8* data,
+                                 dns_name_t name,
+                                 dns_text_t* text);
+
+/* Parse the RDATA of a SVCB/HTTPS record: add the address hints to the DNS
+ * cache (with the hostname of the question) and log them.
+ */
+static BOOL ParseSvcbRecord(LARGE_INTEGER* system_time,
+                            const char* type,
+                            const UINT8* rdata,
+                            UINT16 rdlength,
+                            const char* name,
+                            const dns_text_t* hostname,
+                            LONGLONG expires,
+                            UINT32 ttl);
+
+/* Hash of the name in lowercase. */
+static UINT32 HashDnsName(const UINT8* data, dns_name_t name);
+
+static void AddCname(const UINT8* data, dns_name_t name, dns_name_t alias);
+
+/* Hostname at the beginning of the CNAME chain of the name (the name itself
+ * if it is not an alias).
+ */
+static dns_name_t FindHostname(const UINT8* data, dns_name_t name);
+
+__inline static UINT8 ToLower(UINT8 c)
+{
+  return ((c >= 'A') && (c <= 'Z')) ? (c | 0x20) : c;
+}
+
+BOOL ParseDnsResponse(LARGE_INTEGER* system_time,
+                      const UINT8* data,
+                      SIZE_T len)
+{
+  /* Format:
+   *
+   *   +---------------------+
+   *   |        Header       |
+   *   +---------------------+
+   *   |       Question      | the question for the name server
+   *   +---------------------+
+   *   |        Answer       | RRs answering the question
+   *   +---------------------+
+   *   |      Authority      | RRs pointing toward an authority
+   *   +---------------------+
+   *   |      Additional     | RRs holding additional information
+   *   +---------------------+
+   *
+   *
+   *
+   * The DNS header contains the following fields:
+   *
+   *                                   1  1  1  1  1  1
+   *     0  1  2  3  4  5  6  7  8  9  0  1  2  3  4  5
+   *   +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+   *   |                      ID                       |
+   *   +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+   *   |QR|   Opcode  |AA|TC|RD|RA|   Z    |   RCODE   |
+   *   +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+   *   |                    QDCOUNT                    |
+   *   +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+   *   |                    ANCOUNT                    |
+   *   +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+   *   |                    NSCOUNT                    |
+   *   +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+   *   |                    ARCOUNT                    |
+   *   +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+   *
+   */
+
+  const UINT8* end;
+  const UINT8* ptr;
+  const UINT8* tmpptr;
+  UINT16 qdcount;
+  UINT16 ancount;
+  UINT16 type, class, rdlength;
+  UINT32 ttl;
+  LONGLONG expires;
+  const UINT8* answers;
+  dns_name_t name;
+  dns_name_t alias;
+  dns_name_t hostname;
+  dns_text_t name_text;
+  dns_text_t hostname_text;
+  char ip[128];
+  UINT16 i;
+
+  /* If the DNS response is too small... */
+  if (len < DNS_HEADER_LEN) {
+    return FALSE;
+  }
+
+  /* If not a response... */
+  if ((data[2] & 0x80) == 0) {
+    return FALSE;
+  }
+
+  /* If not a standard query... */
+  if (((data[2] >> 3) & 0x0f) != 0) {
+    return FALSE;
+  }
+
+  /* If the message was truncated... */
+  if (((data[2] >> 1) & 0x01) != 0) {
+    return FALSE;
+  }
+
+  /* If the response code is not 0... */
+  if ((data[3] & 0x0f) != 0) {
+    return FALSE;
+  }
+
+  /* Get the number of questions. */
+  qdcount = (data[4] << 8) | data[5];
+
+  /* If no questions...*/
+  if (qdcount == 0) {
+    return FALSE;
+  }
+
+  /* Get the number of answers. */
+  ancount = (data[6] << 8) | data[7];
+
+  /* If no answers... */
+  if (ancount == 0) {
+    return FALSE;
+  }
+
+  end = data + len;
+  ptr = data + DNS_HEADER_LEN;
+
+  /* Skip DNS questions. */
+  if (!SkipDnsQuestions(end, qdcount, &ptr)) {
+    return FALSE;
+  }
+
+  /* Free the aliases of the previous response. */
+  if (++generation == 0) {
+    RtlZeroMemory(cnames, sizeof(cnames));
+    generation = 1;
+  }
+
+  ncnames = 0;
+  last_alias = 0;
+
+  answers = ptr;
+
+  /* Nothing decompressed yet. */
+  name_text.name = 0;
+  hostname_text.name = 0;
+
+  /* For each answer... */
+  for (i = 0; i < ancount; i++) {
+    /* Too many answers? */
+    if (ptr - answers >= MAX_ANSWERS_LEN) {
+      break;
+    }
+
+    /* Check name. */
+    if (!CheckDnsName(data, end, &ptr, &name)) {
+      return FALSE;
+    }
+
+    if (ptr + 10 > end) {
+      return FALSE;
+    }
+
+    /* Get type value. */
+    type = (ptr[0] << 8) | ptr[1];
+
+    /* Get class value. */
+    class = (ptr[2] << 8) | ptr[3];
+
+    /* Get TTL. */
+    ttl = ((UINT32) ptr[4] << 24) |
+          ((UINT32) ptr[5] << 16) |
+          ((UINT32) ptr[6] << 8) |
+          ptr[7];
+
+    /* System time is in 100-nanosecond intervals. */
+    expires = system_time->QuadPart + ((LONGLONG) ttl * 10000000);
+
+    /* Get RDLENGTH. */
+    rdlength = (ptr[8] << 8) | ptr[9];
+
+    if (ptr + 10 + rdlength > end) {
+      return FALSE;
+    }
+
+    switch (type) {
+      case 1: /* A record (IPv4). */
+        if ((class != 1) || (rdlength != 4)) {
+          break;
+        }
+
+        hostname = FindHostname(data, name);
+
+        DecodeDnsName(data, hostname, &hostname_text);
+
+        AddIPv4ToDnsCache(ptr + 10,
+                          hostname_text.text,
+                          hostname_text.len,
+                          expires);
+
+        Log(system_time,
+            "Hostname: '%s' -> '%s', address: %u.%u.%u.%u, TTL: %u.\r\n",
+            DecodeDnsName(data, name, &name_text),
+            hostname_text.text,
+            ptr[10],
+            ptr[11],
+            ptr[12],
+            ptr[13],
+            ttl);
+
+        break;
+      case 5: /* CNAME. */
+        if (class != 1) {
+          break;
+        }
+
+        /* Check alias. */
+        tmpptr = ptr + 10;
+        if (!CheckDnsName(data, end, &tmpptr, &alias)) {
+          break;
+        }
+
+        AddCname(data, name, alias);
+
+        Log(system_time,
+            "Alias: '%s' -> hostname: '%s'.\r\n",
+            DecodeDnsName(data, alias, &hostname_text),
+            DecodeDnsName(data, name, &name_text));
+
+        break;
+      case 28: /* AAAA record (IPv6). */
+        if ((class != 1) || (rdlength != 16)) {
+          break;
+        }
+
+        hostname = FindHostname(data, name);
+
+        DecodeDnsName(data, hostname, &hostname_text);
+
+        AddIPv6ToDnsCache(ptr + 10,
+                          hostname_text.text,
+                          hostname_text.len,
+                          expires);
+
+        RtlIpv6AddressToStringA((IN6_ADDR*) (ptr + 10), ip);
+        Log(system_time,
+            "Hostname: '%s' -> '%s', address: %s, TTL: %u.\r\n",
+            DecodeDnsName(data, name, &name_text),
+            hostname_text.text,
+            ip,
+            ttl);
+
+        break;
+      case 64: /* SVCB. */
+      case 65: /* HTTPS. */
+        if (class != 1) {
+          break;
+        }
+
+        hostname = FindHostname(data, name);
+
+        DecodeDnsName(data, hostname, &hostname_text);
+
+        ParseSvcbRecord(system_time,
+                        (type == 65) ? "HTTPS" : "SVCB",
+                        ptr + 10,
+                        rdlength,
+                        DecodeDnsName(data, name, &name_text),
+                        &hostname_text,
+                        expires,
+                        ttl);
+
+        break;
+    }
+
+    ptr += (10 + rdlength);
+  }
+
+  return TRUE;
+}
+
+SIZE_T BuildDnsRecord(const UINT8* data,
+                      SIZE_T len,
+                      UINT8* record,
+                      SIZE_T size)
+{
+  const UINT8* end;
+  const UINT8* ptr;
+  const UINT8* answers;
+  UINT16 qdcount;
+  UINT16 ancount;
+  UINT16 i;
+
+  if (len < DNS_HEADER_LEN) {
+    return 0;
+  }
+
+  qdcount = (data[4] << 8) | data[5];
+  ancount = (data[6] << 8) | data[7];
+
+  end = data + len;
+  ptr = data + DNS_HEADER_LEN;
+
+  if (!SkipDnsQuestions(end, qdcount, &ptr)) {
+    return 0;
+  }
+
+  answers = ptr;
+
+  /* Skip the answers (as many as ParseDnsResponse() parses). */
+  for (i = 0; (i < ancount) && (ptr - answers < MAX_ANSWERS_LEN); i++) {
+    if ((!SkipDnsName(end, &ptr)) ||
+        (ptr + 10 > end) ||
+        (ptr + 10 + ((ptr[8] << 8) | ptr[9]) > end)) {
+      return 0;
+    }
+
+    ptr += (10 + ((ptr[8] << 8) | ptr[9]));
+  }
+
+  len = ptr - data;
+
+  if (len > size) {
+    return 0;
+  }
+
+  if (record != data) {
+    memcpy(record, data, len);
+  }
+
+  /* Number of answers, NSCOUNT and ARCOUNT. */
+  record[6] = (UINT8) (i >> 8);
+  record[7] = (UINT8) i;
+  record[8] = 0;
+  record[9] = 0;
+  record[10] = 0;
+  record[11] = 0;
+
+  return len;
+}
+
+BOOL SkipDnsQuestions(const UINT8* end, UINT16 qdcount, const UINT8** ptr)
+{
+  const UINT8* p;
+  UINT16 i;
+
+  p = *ptr;
+
+  /* For each question... */
+  for (i = 0; i < qdcount; i++) {
+    /* Skip name. */
+    if (!SkipDnsName(end, &p)) {
+      return FALSE;
+    }
+
+    /* Skip QTYPE and QCLASS. */
+    if ((p += 4) > end) {
+      return FALSE;
+    }
+  }
+
+  *ptr = p;
+
+  return TRUE;
+}
+
+BOOL SkipDnsName(const UINT8* end, const UINT8** ptr)
+{
+  const UINT8* p;
+  UINT8 l;
+
+  if ((p = *ptr) == end) {
+    return FALSE;
+  }
+
+  while ((l = *p) != 0) {
+    switch (l & 0xc0) {
+      case 0: /* Not a pointer. */
+        if ((p += (1 + l)) >= end) {
+          return FALSE;
+        }
+
+        break;
+      case 0xc0: /* Pointer. */
+        if ((p += 2) > end) {
+          return FALSE;
+        }
+
+        *ptr = p;
+        return TRUE;
+      default:
+        return FALSE;
+    }
+  }
+
+  /* Skip '\0'. */
+  *ptr = p + 1;
+
+  return TRUE;
+}
+
+BOOL CheckDnsName(const UINT8* data,
+                  const UINT8* end,
+                  const UINT8** ptr,
+                  dns_name_t* name)
+{
+  const UINT8* p;
+  unsigned npointers;
+  UINT16 len;
+  UINT8 l;
+
+  if ((p = *ptr) == end) {
+    return FALSE;
+  }
+
+  npointers = 0;
+  len = 0;
+
+  while ((l = *p) != 0) {
+    switch (l & 0xc0) {
+      case 0: /* Not a pointer. */
+        /* Length of the decompressed name (with the dots). */
+        if ((p + 1 + l >= end) || (len + 1 + l > HOST_NAME_MAX_LEN + 1)) {
+          return FALSE;
+        }
+
+        /* First label? */
+        if (len == 0) {
+          *name = (dns_name_t) (p - data);
+        }
+
+        len += (1 + l);
+
+        p += (1 + l);
+        break;
+      case 0xc0: /* Pointer. */
+        if (p + 2 > end) {
+          return FALSE;
+        }
+
+        /* Too many pointers? */
+        if (++npointers > MAX_POINTERS) {
+          return FALSE;
+        }
+
+        /* First pointer? */
+        if (npointers == 1) {
+          *ptr = p + 2;
+        }
+
+        if ((p = data + (((l & 0x3f) << 8) | p[1])) >= end) {
+          return FALSE;
+        }
+
+        break;
+      default:
+        return FALSE;
+    }
+  }
+
+  if (len == 0) {
+    return FALSE;
+  }
+
+  if (npointers == 0) {
+    /* Skip '\0'. */
+    *ptr = p + 1;
+  }
+
+  return TRUE;
+}
+
+BOOL ParseSvcbRecord(LARGE_INTEGER* system_time,
+                     const char* type,
+                     const UINT8* rdata,
+                     UINT16 rdlength,
+                     const char* name,
+                     const dns_text_t* hostname,
+                     LONGLONG expires,
+                     UINT32 ttl)
+{
+  /* Format (RFC 9460):
+   *
+   *   SvcPriority (2 bytes, 0: alias mode)
+   *   TargetName (uncompressed name)
+   *   SvcParams: SvcParamKey (2 bytes) + length (2 bytes) + SvcParamValue
+   */
+
+  const UINT8* end;
+  const UINT8* ptr;
+  const UINT8* alpn;
+  const UINT8* ipv4;
+  const UINT8* ipv6;
+  UINT16 priority;
+  UINT16 key;
+  UINT16 len;
+  UINT16 alpnlen;
+  UINT16 ipv4len;
+  UINT16 ipv6len;
+  char protocols[LOG_ALPN_SIZE];
+  char ip[128];
+
+  if (rdlength < 3) {
+    return FALSE;
+  }
+
+  end = rdata + rdlength;
+
+  priority = (rdata[0] << 8) | rdata[1];
+
+  /* Skip TargetName. */
+  ptr = rdata + 2;
+  if (!SkipDnsName(end, &ptr)) {
+    return FALSE;
+  }
+
+  /* Alias mode (no parameters)? */
+  if (priority == 0) {
+    return TRUE;
+  }
+
+  alpn = NULL;
+  alpnlen = 0;
+  ipv4 = NULL;
+  ipv4len = 0;
+  ipv6 = NULL;
+  ipv6len = 0;
+
+  while (ptr < end) {
+    if (ptr + 4 > end) {
+      return FALSE;
+    }
+
+    key = (ptr[0] << 8) | ptr[1];
+    len = (ptr[2] << 8) | ptr[3];
+
+    if ((ptr += 4) + len > end) {
+      return FALSE;
+    }
+
+    switch (key) {
+      case SVC_PARAM_ALPN:
+        alpn = ptr;
+        alpnlen = len;
+        break;
+      case SVC_PARAM_IPV4HINT:
+        if ((len % 4) != 0) {
+          return FALSE;
+        }
+
+        ipv4 = ptr;
+        ipv4len = len;
+        break;
+      case SVC_PARAM_IPV6HINT:
+        if ((len % 16) != 0) {
+          return FALSE;
+        }
+
+        ipv6 = ptr;
+        ipv6len = len;
+        break;
+    }
+
+    ptr += len;
+  }
+
+  FormatAlpnList(alpn, alpnlen, protocols, sizeof(protocols));
+
+  Log(system_time,
+      "%s record: '%s' -> '%s', priority: %u%s, TTL: %u.\r\n",
+      type,
+      name,
+      hostname->text,
+      priority,
+      protocols,
+      ttl);
+
+  /* The clients connect to the hinted addresses directly. */
+  for (; ipv4len > 0; ipv4 += 4, ipv4len -= 4) {
+    AddIPv4ToDnsCache(ipv4, hostname->text, hostname->len, expires);
+
+    Log(system_time,
+        "Hostname: '%s' -> '%s', address: %u.%u.%u.%u (%s hint), "
+        "TTL: %u.\r\n",
+        name,
+        hostname->text,
+        ipv4[0],
+        ipv4[1],
+        ipv4[2],
+        ipv4[3],
+        type,
+        ttl);
+  }
+
+  for (; ipv6len > 0; ipv6 += 16, ipv6len -= 16) {
+    AddIPv6ToDnsCache(ipv6, hostname->text, hostname->len, expires);
+
+    RtlIpv6AddressToStringA((IN6_ADDR*) ipv6, ip);
+    Log(system_time,
+        "Hostname: '%s' -> '%s', address: %s (%s hint), TTL: %u.\r\n",
+        name,
+        hostname->text,
+        ip,
+        type,
+        ttl);
+  }
+
+  return TRUE;
+}
+
+/* Disable warning:
+ * Conditional expression is constant:
+ * do {
+ *   ...
+ * } while (1);
+ */
+#pragma warning(disable:4127)
+
+/* The functions below only see names which were checked by CheckDnsName()
+ * (the labels are inside the message and the pointers don't loop), given by
+ * the offset of their first label.
+ */
+
+dns_name_t FirstDnsLabel(const UINT8* data, dns_name_t name)
+{
+  while ((data[name] & 0xc0) == 0xc0) {
+    name = (dns_name_t) (((data[name] & 0x3f) << 8) | data[name + 1]);
+  }
+
+  return name;
+}
+
+BOOL EqualDnsNames(const UINT8* data, dns_name_t name1, dns_name_t name2)
+{
+  const UINT8* p1;
+  const UINT8* p2;
+  UINT8 l;
+  UINT8 i;
+
+  do {
+    /* Same labels (common suffix)? */
+    if (name1 == name2) {
+      return TRUE;
+    }
+
+    p1 = data + name1;
+    p2 = data + name2;
+
+    if ((l = *p1) != *p2) {
+      return FALSE;
+    }
+
+    if (l == 0) {
+      return TRUE;
+    }
+
+    /* Names are case-insensitive. */
+    for (i = 1; i <= l; i++) {
+      if (ToLower(p1[i]) != ToLower(p2[i])) {
+        return FALSE;
+      }
+    }
+
+    name1 = FirstDnsLabel(data, (dns_name_t) (name1 + 1 + l));
+    name2 = FirstDnsLabel(data, (dns_name_t) (name2 + 1 + l));
+  } while (TRUE);
+}
+
+const char* DecodeDnsName(const UINT8* data,
+                          dns_name_t name,
+                          dns_text_t* text)
+{
+  const UINT8* p;
+  UINT16 len;
+  UINT8 l;
+
+  /* Already decompressed? */
+  if (text->name == name) {
+    return text->text;
+  }
+
+  text->name = name;
+
+  p = data + name;
+  len = 0;
+
+  while ((l = *p) != 0) {
+    /* Pointer? */
+    if ((l & 0xc0) == 0xc0) {
+      p = data + (((l & 0x3f) << 8) | p[1]);
+    } else {
+      if (len > 0) {
+        text->text[len++] = '.';
+      }
+
+      memcpy(text->text + len, p + 1, l);
+      len += l;
+
+      p += (1 + l);
+    }
+  }
+
+  text->text[len] = 0;
+  text->len = len;
+
+  return text->text;
+}
+
+UINT32 HashDnsName(const UINT8* data, dns_name_t name)
+{
+  const UINT8* p;
+  UINT32 hash;
+  UINT8 l;
+  UINT8 i;
+
+  /* FNV-1a of the labels (with their lengths). */
+  hash = FNV1A_OFFSET_BASIS;
+
+  p = data + name;
+
+  while ((l = *p) != 0) {
+    /* Pointer? */
+    if ((l & 0xc0) == 0xc0) {
+      p = data + (((l & 0x3f) << 8) | p[1]);
+    } else {
+      for (i = 0; i <= l; i++) {
+        hash = (hash ^ ToLower(p[i])) * FNV1A_PRIME;
+      }
+
+      p += (1 + l);
+    }
+  }
+
+  return hash;
+}
+
+void AddCname(const UINT8* data, dns_name_t name, dns_name_t alias)
+{
+  cname_t* cname;
+  UINT32 hash;
+  unsigned i;
+
+  /* The alias resolves to the hostname of the chain of the name (the CNAME
+   * records of a chain come in order: hostname -> alias1, alias1 -> alias2,
+   * ...).
+   */
+  name = FindHostname(data, name);
+
+  hash = HashDnsName(data, alias);
+
+  i = hash & (CNAMES_HASH_SIZE - 1);
+
+  do {
+    cname = &cnames[i];
+
+    /* Free entry? */
+    if (cname->generation != generation) {
+      cname->generation = generation;
+      cname->hash = hash;
+      cname->alias = alias;
+      cname->hostname = name;
+
+      ncnames++;
+      break;
+    }
+
+    /* If the alias was already added, the last record wins. */
+    if ((cname->hash == hash) && (EqualDnsNames(data, cname->alias, alias))) {
+      cname->hostname = name;
+      break;
+    }
+
+    i = (i + 1) & (CNAMES_HASH_SIZE - 1);
+  } while (TRUE);
+
+  last_alias = alias;
+  last_hostname = name;
+}
+
+dns_name_t FindHostname(const UINT8* data, dns_name_t name)
+{
+  const cname_t* cname;
+  UINT32 hash;
+  unsigned i;
+
+  /* No aliases? */
+  if (ncnames == 0) {
+    return name;
+  }
+
+  /* Same labels as the last alias? */
+  if (name == last_alias) {
+    return last_hostname;
+  }
+
+  hash = HashDnsName(data, name);
+
+  i = hash & (CNAMES_HASH_SIZE - 1);
+
+  while ((cname = &cnames[i])->generation == generation) {
+    if ((cname->hash == hash) && (EqualDnsNames(data, cname->alias, name))) {
+      return cname->hostname;
+    }
+
+    i = (i + 1) & (CNAMES_HASH_SIZE - 1);
+  }
+
+  return name;
+}
@@ -0,0 +1,24 @@
+#ifndef DNS_PARSER_H
+#define DNS_PARSER_H
+
+#include <ntddk.h>
+
+/* Parse a DNS response: add the addresses of the answers to the DNS cache
+ * (with the hostname of the question) and log them.
+ */
+BOOL ParseDnsResponse(LARGE_INTEGER* system_time,
+                      const UINT8* data,
+                      SIZE_T len);
+
+/* Build the compact record of a DNS response in 'record' (at most 'size'
+ * bytes, 'record' might be 'data'): the response up to the end of the
+ * answers parsed by ParseDnsResponse() (the authority and additional records
+ * are removed). Return the length of the record or 0 if the response can't
+ * be parsed.
+ */
+SIZE_T BuildDnsRecord(const UINT8* data,
+                      SIZE_T len,
+                      UINT8* record,
+                      SIZE_T size);
+
+#endif /* DNS_PARSER_H */
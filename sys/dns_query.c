@@ -0,0 +1,462 @@
+#include <ntddk.h>
+#include <string.h>
+#include "dns_query.h"
+
+#define TAG '1gaT'
+
+#define DNS_HEADER_LEN 12
+#define MAX_LABEL_LEN 63
+#define MAX_NAME_LEN 255
+
+/* The table is set-associative: a query can only be in one of the
+ * QUERY_WAYS slots of its set, so the operations look at QUERY_WAYS slots
+ * at most.
+ */
+#define QUERY_WAYS 4
+
+/* Slot of the resolvers which don't have one of their own. */
+#define OTHER_RESOLVERS DNS_MAX_RESOLVERS
+
+#define FNV1A_OFFSET 2166136261u
+#define FNV1A_PRIME 16777619u
+
+typedef struct {
+  /* Performance counter when the query was sent (0: free slot). */
+  LONGLONG sent;
+
+  /* Hash of the question. */
+  UINT32 hash;
+
+  /* Transaction ID and local port. */
+  UINT16 id;
+  UINT16 port;
+
+  UINT8 ip_version;
+  UINT8 resolver;
+  UINT8 ip[16];
+} dns_query_t;
+
+typedef struct {
+  dns_query_t* queries;
+  unsigned nsets;
+
+  /* In performance counter ticks. */
+  LONGLONG frequency;
+  LONGLONG timeout;
+
+  dns_query_stats_t stats;
+
+  dns_resolver_stats_t resolvers[DNS_MAX_RESOLVERS + 1];
+  unsigned nresolvers;
+
+  KSPIN_LOCK spin_lock;
+} dns_queries_t;
+
+static dns_queries_t table;
+
+static BOOL HashQuestion(const UINT8* data, SIZE_T len, UINT32* hash);
+static dns_query_t* GetSet(UINT32 hash, UINT16 id, UINT16 port);
+static unsigned GetResolver(UINT8 ip_version, const UINT8* ip);
+static BOOL IsQueryFor(const dns_query_t* query,
+                       UINT32 hash,
+                       UINT16 id,
+                       UINT16 port,
+                       UINT8 ip_version,
+                       const UINT8* ip);
+static void AddLatency(dns_resolver_stats_t* resolver, LONGLONG ticks);
+
+BOOL InitDnsQueries(unsigned max_queries, unsigned timeout_ms)
+{
+  LARGE_INTEGER frequency;
+
+  table.queries = NULL;
+
+  /* Queries not tracked? */
+  if (max_queries == 0) {
+    return TRUE;
+  }
+
+  /* The number of sets has to be a power of 2. */
+  if ((max_queries < QUERY_WAYS) ||
+      ((max_queries & (max_queries - 1)) != 0) ||
+      (timeout_ms == 0)) {
+    return FALSE;
+  }
+
+  if ((table.queries = (dns_query_t*) ExAllocatePoolWithTag(
+                                        NonPagedPool,
+                                        max_queries * sizeof(dns_query_t),
+                                        TAG
+                                      )) == NULL) {
+    return FALSE;
+  }
+
+  RtlZeroMemory(table.queries, max_queries * sizeof(dns_query_t));
+
+  table.nsets = max_queries / QUERY_WAYS;
+
+  KeQueryPerformanceCounter(&frequency);
+
+  table.frequency = frequency.QuadPart;
+  table.timeout = (frequency.QuadPart * timeout_ms) / 1000;
+
+  RtlZeroMemory(&table.stats, sizeof(table.stats));
+  RtlZeroMemory(table.resolvers, sizeof(table.resolvers));
+  table.nresolvers = 0;
+
+  KeInitializeSpinLock(&table.spin_lock);
+
+  return TRUE;
+}
+
+void FreeDnsQueries()
+{
+  if (table.queries) {
+    ExFreePoolWithTag(table.queries, TAG);
+    table.queries = NULL;
+  }
+}
+
+BOOL DnsQueriesTracked()
+{
+  return (table.queries != NULL);
+}
+
+void AddDnsQuery(UINT8 ip_version,
+                 const UINT8* resolver,
+                 UINT16 port,
+                 const UINT8* data,
+                 SIZE_T len)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  dns_query_t* set;
+  dns_query_t* query;
+  dns_query_t* oldest;
+  dns_query_t* slot;
+  LONGLONG now;
+  UINT32 hash;
+  UINT16 id;
+  unsigned i;
+
+  /* Queries not tracked? */
+  if (!table.queries) {
+    return;
+  }
+
+  if ((len < DNS_HEADER_LEN) || (!HashQuestion(data, len, &hash))) {
+    return;
+  }
+
+  id = (data[0] << 8) | data[1];
+
+  set = GetSet(hash, id, port);
+
+  now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&table.spin_lock, &lock_handle);
+
+  slot = NULL;
+  oldest = NULL;
+
+  for (i = 0; i < QUERY_WAYS; i++) {
+    query = &set[i];
+
+    if (query->sent != 0) {
+      /* Expired? */
+      if (now - query->sent > table.timeout) {
+        table.stats.unanswered++;
+        table.resolvers[query->resolver].unanswered++;
+
+        query->sent = 0;
+      } else if (IsQueryFor(query, hash, id, port, ip_version, resolver)) {
+        /* Retransmission: the latency is measured from the first query. */
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        return;
+      } else {
+        if ((!oldest) || (query->sent < oldest->sent)) {
+          oldest = query;
+        }
+
+        continue;
+      }
+    }
+
+    if (!slot) {
+      slot = query;
+    }
+  }
+
+  /* Set full? */
+  if (!slot) {
+    table.stats.evicted++;
+    slot = oldest;
+  }
+
+  slot->sent = now;
+  slot->hash = hash;
+  slot->id = id;
+  slot->port = port;
+  slot->ip_version = ip_version;
+  slot->resolver = (UINT8) GetResolver(ip_version, resolver);
+  memcpy(slot->ip, resolver, (ip_version == 4) ? 4 : 16);
+
+  table.stats.queries++;
+  table.resolvers[slot->resolver].queries++;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+BOOL MatchDnsResponse(const packet_t* packet)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  dns_query_t* set;
+  dns_query_t* query;
+  LONGLONG now;
+  UINT32 hash;
+  UINT16 id;
+  unsigned i;
+
+  /* Queries not tracked? */
+  if (!table.queries) {
+    return TRUE;
+  }
+
+  now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+  if ((packet->payloadlen < DNS_HEADER_LEN) ||
+      (!HashQuestion(packet->payload, packet->payloadlen, &hash))) {
+    /* Acquire spin lock. */
+    KeAcquireInStackQueuedSpinLock(&table.spin_lock, &lock_handle);
+
+    table.stats.unsolicited++;
+
+    /* Release spin lock. */
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    return FALSE;
+  }
+
+  id = (packet->payload[0] << 8) | packet->payload[1];
+
+  set = GetSet(hash, id, packet->local_port);
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&table.spin_lock, &lock_handle);
+
+  for (i = 0; i < QUERY_WAYS; i++) {
+    query = &set[i];
+
+    if ((query->sent != 0) &&
+        (now - query->sent <= table.timeout) &&
+        (IsQueryFor(query,
+                    hash,
+                    id,
+                    packet->local_port,
+                    packet->ip_version,
+                    packet->remote_ip))) {
+      table.stats.answered++;
+      AddLatency(&table.resolvers[query->resolver], now - query->sent);
+
+      query->sent = 0;
+
+      /* Release spin lock. */
+      KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+      return TRUE;
+    }
+  }
+
+  table.stats.unsolicited++;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  return FALSE;
+}
+
+void GetDnsQueryStats(dns_query_stats_t* stats)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+
+  if (!table.queries) {
+    RtlZeroMemory(stats, sizeof(dns_query_stats_t));
+    return;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&table.spin_lock, &lock_handle);
+
+  *stats = table.stats;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+BOOL GetDnsResolverStats(unsigned i, dns_resolver_stats_t* stats)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  BOOL ret;
+
+  if (!table.queries) {
+    return FALSE;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&table.spin_lock, &lock_handle);
+
+  if (i < table.nresolvers) {
+    *stats = table.resolvers[i];
+    ret = TRUE;
+  } else if ((i == table.nresolvers) &&
+             (table.resolvers[OTHER_RESOLVERS].queries > 0)) {
+    /* The resolvers which don't have a slot of their own go last. */
+    *stats = table.resolvers[OTHER_RESOLVERS];
+    ret = TRUE;
+  } else {
+    ret = FALSE;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  return ret;
+}
+
+BOOL HashQuestion(const UINT8* data, SIZE_T len, UINT32* hash)
+{
+  const UINT8* ptr;
+  const UINT8* end;
+  UINT32 h;
+  SIZE_T namelen;
+  UINT8 n;
+  UINT8 c;
+  UINT8 i;
+
+  ptr = data + DNS_HEADER_LEN;
+  end = data + len;
+
+  h = FNV1A_OFFSET;
+  namelen = 0;
+
+  /* The name of the question is never compressed. The letters are hashed in
+   * lowercase, as some resolvers don't preserve the case of the question.
+   */
+  do {
+    if (ptr == end) {
+      return FALSE;
+    }
+
+    n = *ptr++;
+
+    if ((n > MAX_LABEL_LEN) ||
+        ((SIZE_T) (end - ptr) < n) ||
+        ((namelen += (SIZE_T) n + 1) > MAX_NAME_LEN)) {
+      return FALSE;
+    }
+
+    h = (h ^ n) * FNV1A_PRIME;
+
+    for (i = 0; i < n; i++) {
+      c = *ptr++;
+      h = (h ^ (((c >= 'A') && (c <= 'Z')) ? c | 0x20 : c)) * FNV1A_PRIME;
+    }
+  } while (n != 0);
+
+  /* QTYPE and QCLASS. */
+  if (end - ptr < 4) {
+    return FALSE;
+  }
+
+  for (i = 0; i < 4; i++) {
+    h = (h ^ ptr[i]) * FNV1A_PRIME;
+  }
+
+  *hash = h;
+
+  return TRUE;
+}
+
+dns_query_t* GetSet(UINT32 hash, UINT16 id, UINT16 port)
+{
+  /* The transaction ID and the port are random: mix them into the hash of
+   * the question.
+   */
+  hash ^= ((UINT32) id << 16) | port;
+  hash ^= hash >> 16;
+  hash *= 0x7feb352d;
+  hash ^= hash >> 15;
+
+  return &table.queries[(hash & (table.nsets - 1)) * QUERY_WAYS];
+}
+
+unsigned GetResolver(UINT8 ip_version, const UINT8* ip)
+{
+  dns_resolver_stats_t* resolver;
+  SIZE_T len;
+  unsigned i;
+
+  len = (ip_version == 4) ? 4 : 16;
+
+  for (i = 0; i < table.nresolvers; i++) {
+    resolver = &table.resolvers[i];
+
+    if ((resolver->ip_version == ip_version) &&
+        (memcmp(resolver->ip, ip, len) == 0)) {
+      return i;
+    }
+  }
+
+  /* No slots left? */
+  if (table.nresolvers == DNS_MAX_RESOLVERS) {
+    return OTHER_RESOLVERS;
+  }
+
+  resolver = &table.resolvers[table.nresolvers];
+
+  resolver->ip_version = ip_version;
+  memcpy(resolver->ip, ip, len);
+
+  return table.nresolvers++;
+}
+
+BOOL IsQueryFor(const dns_query_t* query,
+                UINT32 hash,
+                UINT16 id,
+                UINT16 port,
+                UINT8 ip_version,
+                const UINT8* ip)
+{
+  return ((query->hash == hash) &&
+          (query->id == id) &&
+          (query->port == port) &&
+          (query->ip_version == ip_version) &&
+          (memcmp(query->ip, ip, (ip_version == 4) ? 4 : 16) == 0));
+}
+
+void AddLatency(dns_resolver_stats_t* resolver, LONGLONG ticks)
+{
+  ULONGLONG latency;
+  ULONGLONG ms;
+  unsigned bin;
+
+  /* In microseconds. */
+  latency = (ULONGLONG) ((ticks * 1000000) / table.frequency);
+
+  resolver->answered++;
+  resolver->total_latency += latency;
+
+  if (latency > resolver->max_latency) {
+    resolver->max_latency = latency;
+  }
+
+  ms = latency / 1000;
+
+  bin = 0;
+  while ((bin < DNS_LATENCY_BINS - 1) && (ms >= ((ULONGLONG) 1 << bin))) {
+    bin++;
+  }
+
+  resolver->latency[bin]++;
+}
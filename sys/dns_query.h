@@ -0,0 +1,80 @@
+#ifndef DNS_QUERY_H
+#define DNS_QUERY_H
+
+#include "packet_pool.h"
+
+/* Resolvers with their own latency statistics (the others share a slot). */
+#define DNS_MAX_RESOLVERS 8
+
+/* Latency bins: bin 0 is below 1 ms, bin i is [2^(i-1), 2^i) ms and the
+ * last bin has the rest.
+ */
+#define DNS_LATENCY_BINS 14
+
+typedef struct {
+  /* Queries recorded. */
+  ULONGLONG queries;
+
+  /* Responses which matched a query. */
+  ULONGLONG answered;
+
+  /* Queries which expired without a response. */
+  ULONGLONG unanswered;
+
+  /* Queries overwritten before they expired (the table was full). */
+  ULONGLONG evicted;
+
+  /* Responses which didn't match any query. */
+  ULONGLONG unsolicited;
+} dns_query_stats_t;
+
+typedef struct {
+  /* Address of the resolver (IP version 0: the resolvers which don't have a
+   * slot of their own).
+   */
+  UINT8 ip_version;
+  UINT8 ip[16];
+
+  ULONGLONG queries;
+  ULONGLONG answered;
+  ULONGLONG unanswered;
+
+  /* Latency of the answered queries (in microseconds). */
+  ULONGLONG total_latency;
+  ULONGLONG max_latency;
+  ULONGLONG latency[DNS_LATENCY_BINS];
+} dns_resolver_stats_t;
+
+/* Allocate a table for 'max_queries' queries (a power of 2), which are
+ * forgotten 'timeout_ms' milliseconds after being sent. If 'max_queries' is
+ * 0, the queries are not tracked.
+ */
+BOOL InitDnsQueries(unsigned max_queries, unsigned timeout_ms);
+void FreeDnsQueries();
+
+/* Return TRUE if the queries are tracked. */
+BOOL DnsQueriesTracked();
+
+/* Record the DNS query 'data' sent from the local port 'port' to the
+ * resolver 'resolver'.
+ */
+void AddDnsQuery(UINT8 ip_version,
+                 const UINT8* resolver,
+                 UINT16 port,
+                 const UINT8* data,
+                 SIZE_T len);
+
+/* Look for the query of the DNS response of the packet (same transaction
+ * ID, local port, resolver and question), remove it and add the latency to
+ * the statistics of the resolver. Return FALSE if there is no such query.
+ */
+BOOL MatchDnsResponse(const packet_t* packet);
+
+void GetDnsQueryStats(dns_query_stats_t* stats);
+
+/* Get the statistics of the i-th resolver (return FALSE if there are less
+ * resolvers).
+ */
+BOOL GetDnsResolverStats(unsigned i, dns_resolver_stats_t* stats);
+
+#endif /* DNS_QUERY_H */
@@ -2,14 +2,41 @@
 #include <stdlib.h>
 #include <string.h>
 #include "dnscache.h"
+#include "largemem.h"
 
-#define MAX_BINS 32
+#define MAX_BINS DNS_CACHE_BINS
 
 #define HOST_NAME_MIN_LEN 8
 #define HOST_NAME_MAX_LEN 255
 
 #define TAG '1gaT'
 
+/* Negative lookup filter: blocked counting Bloom filter. Each address maps
+ * to one cache line of 8-bit counters and sets FILTER_HASHES of them.
+ */
+#define FILTER_BLOCK_SIZE 64
+#define FILTER_HASHES 4
+#define FILTER_ENTRIES_PER_BLOCK 8
+#define FILTER_MAX_COUNT 0xff
+
+/* Number of buckets by chain length for the statistics (the last slot
+ * counts the longer chains too).
+ */
+#define CHAIN_LENGTHS (DNS_CACHE_MAX_CHAIN + 1)
+
+/* The counters are per processor (each processor has its own cache line).
+ * Processors above the maximum share the slots.
+ */
+#define MAX_CPUS 64
+
+#define SNAPSHOT_MAGIC 0x434e4453 /* "SDNC" */
+#define SNAPSHOT_VERSION 1
+
+/* Each record is: expiration time (8 bytes), hostname length (1 byte),
+ * IP address and hostname.
+ */
+#define SNAPSHOT_RECORD_SIZE(ip_size) (sizeof(LONGLONG) + 1 + (ip_size))
+
 /* http://burtleburtle.net/bob/hash/doobs.html */
 #define mix(a, b, c)                      \
         {                                 \
@@ -37,9 +64,18 @@ typedef struct {
   UINT16 len;
 } hostname_t;
 
+/* Lookups don't take any lock: each bucket has a sequence counter which is
+ * odd while a writer is modifying the bucket. Readers walk the chain and
+ * retry if the counter changed. Writers are serialized by the cache lock.
+ */
 typedef struct cache_header_t {
   struct cache_header_t* prev;
   struct cache_header_t* next;
+
+  volatile LONG seq;
+
+  /* Number of entries in the chain. */
+  UINT32 len;
 } cache_header_t;
 
 typedef struct cache_time_t {
@@ -58,56 +94,358 @@ typedef struct cache_entry_t {
   struct cache_entry_t* older;
 
   hostname_t hostname;
+
+  /* System time when the DNS record expires. */
+  LONGLONG expires;
+
+  /* Set by the readers, cleared by the writer (second chance). */
+  volatile LONG referenced;
+
   UINT8 ip[1];
 } cache_entry_t;
 
+typedef struct {
+  UINT8* blocks;
+  UINT32 mask;
+
+  /* Counters which are not zero, saturated counters and sum over the
+   * blocks of (used counters in the block ^ FILTER_HASHES), kept up to
+   * date by the writer so that the statistics don't scan the filter.
+   */
+  unsigned used;
+  unsigned saturated;
+  UINT64 weight;
+
+  void* mem;
+} filter_t;
+
+typedef struct DECLSPEC_CACHEALIGN {
+  ULONGLONG inserts;
+  ULONGLONG overwrites;
+  ULONGLONG refreshes;
+  ULONGLONG hits;
+  ULONGLONG misses;
+  ULONGLONG evictions;
+
+  /* Lookups which have started and finished on this processor (see
+   * LookupsRunning()).
+   */
+  volatile LONG lookups_in;
+  volatile LONG lookups_out;
+} cache_counters_t;
+
+/* Buckets, entries and filter of a given size. */
 typedef struct {
   cache_header_t* buckets;
   cache_entry_t* entries;
+
+  /* Buckets and entries. */
+  memory_t mem;
+
   cache_entry_t* free;
-  cache_time_t time;
   unsigned nbuckets;
+  unsigned max;
+
+  filter_t filter;
+
+  /* Number of buckets by chain length. */
+  unsigned chains[CHAIN_LENGTHS];
+} cache_table_t;
+
+/* A resize moves the entries to new tables a few buckets at a time
+ * (MoveDnsCacheEntries()), so the lookups read both tables meanwhile.
+ */
+typedef struct {
+  /* Tables of the lookups: 'table' and, while the entries are moved to it,
+   * 'old' (NULL otherwise).
+   */
+  cache_table_t* volatile table;
+  cache_table_t* volatile old;
+
+  /* New tables, which replace 'table' once the oldest entries which don't
+   * fit in them have been dropped.
+   */
+  cache_table_t* resized;
+
+  /* Next bucket of 'old' to move, and time of the last call to
+   * MoveDnsCacheEntries() (the entries which have expired are dropped
+   * instead of being moved).
+   */
+  unsigned next_bucket;
+  LONGLONG now;
+
+  /* Previous tables, freed once the lookups which might read them have
+   * finished.
+   */
+  cache_table_t* retired;
+
+  cache_table_t tables[2];
+
+  cache_time_t time;
+  SIZE_T ip_size;
+
+  KSPIN_LOCK lock;
 
   page_t* bins[MAX_BINS];
 
   UINT32 (*hash)(const UINT8* ip, unsigned max);
+
+  /* Occupancy, kept up to date by the writer so the statistics don't walk
+   * the chains and the free lists (while a resize moves the entries, they
+   * are counted in both tables).
+   */
+  unsigned nentries;
+  unsigned bin_pages[MAX_BINS];
+  unsigned bin_free_slots[MAX_BINS];
+
+  cache_counters_t counters[MAX_CPUS];
 } dns_cache_t;
 
+/* The snapshot is a flat image which can be memory-mapped: the header is
+ * followed by the IPv4 records and then by the IPv6 records.
+ */
+typedef struct {
+  UINT32 magic;
+  UINT32 version;
+  UINT32 size;
+  UINT32 nipv4;
+  UINT32 nipv6;
+  UINT32 reserved;
+  LONGLONG timestamp;
+} snapshot_header_t;
+
+C_ASSERT(sizeof(snapshot_header_t) == DNS_CACHE_SNAPSHOT_HEADER_SIZE);
+C_ASSERT(sizeof(snapshot_header_t) + SNAPSHOT_RECORD_SIZE(16) +
+         HOST_NAME_MAX_LEN <= DNS_CACHE_SNAPSHOT_MIN_BUFFER);
+
 static dns_cache_t ipv4_cache;
 static dns_cache_t ipv6_cache;
 
+static dns_cache_policy_t policy = DNS_CACHE_POLICY_CLOCK;
+
 static UINT16 bins_max_len[MAX_BINS];
 static UINT8 bucket_indices[HOST_NAME_MAX_LEN + 1];
 
 static BOOL InitCache(dns_cache_t* ip_cache,
                       unsigned nbuckets,
                       unsigned max,
-                      SIZE_T ip_size);
+                      SIZE_T ip_size,
+                      BOOL large_pages);
 
 static void FreeCache(dns_cache_t* ip_cache);
 
+static BOOL InitTable(cache_table_t* table,
+                      unsigned nbuckets,
+                      unsigned max,
+                      SIZE_T ip_size,
+                      BOOL large_pages);
+
+static void FreeTable(cache_table_t* table);
+
+static void StartResize(dns_cache_t* ip_cache, cache_table_t* resized);
+static void PublishTables(dns_cache_t* ip_cache, cache_table_t* resized);
+static BOOL MoveEntries(dns_cache_t* ip_cache,
+                        unsigned count,
+                        LONGLONG now);
+
+static void MoveBucket(dns_cache_t* ip_cache, cache_header_t* oldheader);
+
+static void MoveCacheEntry(dns_cache_t* ip_cache, cache_entry_t* entry);
+static void MoveBucketOf(dns_cache_t* ip_cache, const UINT8* ip);
+static BOOL LookupsRunning(dns_cache_t* ip_cache);
+
 static BOOL AddIPToDnsCache(dns_cache_t* ip_cache,
                             const UINT8* ip,
                             SIZE_T ip_size,
                             const char* hostname,
-                            UINT16 hostnamelen);
+                            UINT16 hostnamelen,
+                            LONGLONG expires);
+
+static BOOL InsertIP(dns_cache_t* ip_cache,
+                     cache_header_t* header,
+                     const UINT8* ip,
+                     SIZE_T ip_size,
+                     const char* hostname,
+                     UINT16 hostnamelen,
+                     LONGLONG expires);
+
+static cache_entry_t* NewCacheEntry(dns_cache_t* ip_cache,
+                                    cache_header_t* header);
+
+static void LinkNewCacheEntry(cache_table_t* table,
+                              cache_header_t* header,
+                              cache_entry_t* entry,
+                              const UINT8* ip,
+                              SIZE_T ip_size,
+                              page_t* page,
+                              unsigned off,
+                              UINT16 hostnamelen,
+                              LONGLONG expires);
+
+static SIZE_T SaveCache(dns_cache_t* ip_cache,
+                        SIZE_T ip_size,
+                        dns_cache_snapshot_t* snapshot,
+                        UINT32* count,
+                        UINT8* buf,
+                        SIZE_T size);
+
+static BOOL LoadCache(dns_cache_t* ip_cache,
+                      SIZE_T ip_size,
+                      const UINT8** ptr,
+                      const UINT8* end,
+                      UINT32 count,
+                      LONGLONG now,
+                      unsigned* loaded,
+                      unsigned* expired);
 
 static const char* GetIPFromDnsCache(dns_cache_t* ip_cache,
                                      const UINT8* ip,
                                      SIZE_T ip_size,
                                      char* hostname);
 
+static unsigned GetIPBatchFromDnsCache(dns_cache_t* ip_cache,
+                                       const UINT8* const* ips,
+                                       SIZE_T ip_size,
+                                       unsigned count,
+                                       char** hostnames);
+
+static const char* LookupTables(dns_cache_t* ip_cache,
+                                const cache_table_t* table,
+                                const cache_table_t* old,
+                                const UINT8* ip,
+                                char* hostname);
+
+static const char* LookupTable(dns_cache_t* ip_cache,
+                               const cache_table_t* table,
+                               const UINT8* ip,
+                               char* hostname);
+
+static const char* LookupBucket(const cache_table_t* table,
+                                const cache_header_t* header,
+                                const UINT8* ip,
+                                SIZE_T ip_size,
+                                char* hostname);
+
 static void TouchCacheEntry(dns_cache_t* ip_cache,
                             cache_header_t* header,
                             cache_entry_t* entry);
 
+static void GetCacheStats(dns_cache_t* ip_cache, dns_cache_stats_t* stats);
+
+__inline static cache_counters_t* Counters(dns_cache_t* ip_cache)
+{
+  /* The counters are not updated atomically: if the thread is moved to
+   * another processor while updating them, an update might be lost.
+   */
+  return &ip_cache->counters[KeGetCurrentProcessorNumberEx(NULL) &
+                             (MAX_CPUS - 1)];
+}
+
 __inline static void UnlinkCacheEntry(cache_entry_t* entry)
 {
   entry->prev->next = entry->next;
   entry->next->prev = entry->prev;
 }
 
+__inline static void SetChainLength(cache_table_t* table,
+                                    cache_header_t* header,
+                                    UINT32 len)
+{
+  table->chains[(header->len < CHAIN_LENGTHS) ? header->len :
+                                                CHAIN_LENGTHS - 1]--;
+  table->chains[(len < CHAIN_LENGTHS) ? len : CHAIN_LENGTHS - 1]++;
+
+  header->len = len;
+}
+
+__inline static void BeginBucketWrite(cache_header_t* header)
+{
+  /* Make the sequence counter odd. */
+  InterlockedIncrement(&header->seq);
+}
+
+__inline static void EndBucketWrite(cache_header_t* header)
+{
+  /* Make the sequence counter even. */
+  InterlockedIncrement(&header->seq);
+}
+
+__inline static LONG BeginBucketRead(const cache_header_t* header)
+{
+  LONG seq;
+
+  /* Wait while there is a writer. */
+  while (((seq = header->seq) & 1) != 0) {
+    YieldProcessor();
+  }
+
+  KeMemoryBarrier();
+
+  return seq;
+}
+
+__inline static BOOL RetryBucketRead(const cache_header_t* header, LONG seq)
+{
+  KeMemoryBarrier();
+
+  return (header->seq != seq);
+}
+
+__inline static cache_table_t* BeginLookup(dns_cache_t* ip_cache,
+                                           cache_table_t** old)
+{
+  cache_table_t* table;
+
+  /* Count the lookup before reading the tables (InterlockedIncrement() is
+   * a memory barrier).
+   */
+  InterlockedIncrement(&Counters(ip_cache)->lookups_in);
+
+  table = ip_cache->table;
+
+  /* The previous tables are published before the new ones. */
+  KeMemoryBarrier();
+
+  *old = ip_cache->old;
+
+  return table;
+}
+
+__inline static void EndLookup(dns_cache_t* ip_cache)
+{
+  /* Maybe on another processor. */
+  InterlockedIncrement(&Counters(ip_cache)->lookups_out);
+}
+
+__inline static cache_header_t* Bucket(dns_cache_t* ip_cache,
+                                       const cache_table_t* table,
+                                       const UINT8* ip)
+{
+  return &table->buckets[ip_cache->hash(ip, table->nbuckets)];
+}
+
+/* The tables which are not in use. */
+__inline static cache_table_t* SpareTable(dns_cache_t* ip_cache)
+{
+  return &ip_cache->tables[(ip_cache->table == &ip_cache->tables[0]) ? 1 : 0];
+}
+
+__inline static BOOL InTable(const cache_table_t* table,
+                             const cache_entry_t* entry)
+{
+  return (((const UINT8*) entry >= (const UINT8*) table->entries) &&
+          ((const UINT8*) entry < (const UINT8*) table->mem.ptr +
+                                  table->mem.size));
+}
+
 static void MakeCacheEntryNewest(dns_cache_t* ip_cache, cache_entry_t* entry);
+static cache_entry_t* EvictCacheEntry(dns_cache_t* ip_cache,
+                                      cache_header_t* header);
+
+static void DropCacheEntry(dns_cache_t* ip_cache,
+                           cache_table_t* table,
+                           cache_header_t* header,
+                           cache_entry_t* entry);
 
 static BOOL SaveHost(dns_cache_t* ip_cache,
                      unsigned bin,
@@ -116,7 +454,42 @@ static BOOL SaveHost(dns_cache_t* ip_cache,
                      page_t** page,
                      unsigned* off);
 
-static void RemoveFromPage(hostname_t* host);
+static BOOL InitFilter(filter_t* filter, unsigned max);
+static void FreeFilter(filter_t* filter);
+static void AddToFilter(filter_t* filter, const UINT8* ip, SIZE_T ip_size);
+static void RemoveFromFilter(filter_t* filter,
+                             const UINT8* ip,
+                             SIZE_T ip_size);
+
+static BOOL MayBeInFilter(const filter_t* filter,
+                          const UINT8* ip,
+                          SIZE_T ip_size);
+
+static unsigned GetFilterFalsePositiveRate(const filter_t* filter);
+static void UpdateFilterWeight(filter_t* filter,
+                               const UINT8* block,
+                               int change);
+static UINT64 FilterHash(const UINT8* ip, SIZE_T ip_size);
+
+__inline static UINT8* FilterBlock(const filter_t* filter, UINT64 h)
+{
+  return filter->blocks + ((h >> 32) & filter->mask) * FILTER_BLOCK_SIZE;
+}
+
+__inline static BOOL TestFilterBlock(const UINT8* block, UINT64 h)
+{
+  unsigned i;
+
+  for (i = 0; i < FILTER_HASHES; i++, h >>= 6) {
+    if (block[h & (FILTER_BLOCK_SIZE - 1)] == 0) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static void RemoveFromPage(dns_cache_t* ip_cache, hostname_t* host);
 static void FreeBin(page_t* page);
 static UINT32 HashIPv4(const UINT8* ip, unsigned nbuckets);
 static UINT32 HashIPv6(const UINT8* ip, unsigned nbuckets);
@@ -136,7 +509,7 @@ __inline static void MemFree(void* ptr)
   ExFreePoolWithTag(ptr, TAG);
 }
 
-BOOL InitDnsCache(unsigned nbuckets, unsigned max)
+BOOL InitDnsCache(unsigned nbuckets, unsigned max, BOOL large_pages)
 {
   unsigned n;
   UINT16 step;
@@ -148,12 +521,12 @@ BOOL InitDnsCache(unsigned nbuckets, unsigned max)
   }
 
   /* Initialize IPv4 cache. */
-  if (!InitCache(&ipv4_cache, nbuckets, max, 4)) {
+  if (!InitCache(&ipv4_cache, nbuckets, max, 4, large_pages)) {
     return FALSE;
   }
 
   /* Initialize IPv6 cache. */
-  if (!InitCache(&ipv6_cache, nbuckets, max, 16)) {
+  if (!InitCache(&ipv6_cache, nbuckets, max, 16, large_pages)) {
     FreeCache(&ipv4_cache);
     return FALSE;
   }
@@ -197,18 +570,82 @@ void FreeDnsCache()
   FreeCache(&ipv6_cache);
 }
 
+BOOL ResizeDnsCache(unsigned nbuckets, unsigned max, BOOL large_pages)
+{
+  cache_table_t* ipv4_table;
+  cache_table_t* ipv6_table;
+
+  if (max == 0) {
+    return FALSE;
+  }
+
+  /* If the previous resize is not complete... */
+  if ((ipv4_cache.resized) || (ipv4_cache.old) || (ipv4_cache.retired) ||
+      (ipv6_cache.resized) || (ipv6_cache.old) || (ipv6_cache.retired)) {
+    return FALSE;
+  }
+
+  ipv4_table = SpareTable(&ipv4_cache);
+  ipv6_table = SpareTable(&ipv6_cache);
+
+  /* Allocate both tables before moving any entry (moving the entries
+   * doesn't allocate memory: the hostnames stay in their bins).
+   */
+  if (!InitTable(ipv4_table, nbuckets, max, 4, large_pages)) {
+    return FALSE;
+  }
+
+  if (!InitTable(ipv6_table, nbuckets, max, 16, large_pages)) {
+    FreeTable(ipv4_table);
+    return FALSE;
+  }
+
+  StartResize(&ipv4_cache, ipv4_table);
+  StartResize(&ipv6_cache, ipv6_table);
+
+  return TRUE;
+}
+
+BOOL MoveDnsCacheEntries(unsigned count, LONGLONG now)
+{
+  BOOL ipv4;
+  BOOL ipv6;
+
+  ipv4 = MoveEntries(&ipv4_cache, count, now);
+  ipv6 = MoveEntries(&ipv6_cache, count, now);
+
+  return ((ipv4) || (ipv6));
+}
+
+void SetDnsCachePolicy(dns_cache_policy_t new_policy)
+{
+  policy = new_policy;
+}
+
 BOOL AddIPv4ToDnsCache(const UINT8* ipv4,
                        const char* hostname,
-                       UINT16 hostnamelen)
+                       UINT16 hostnamelen,
+                       LONGLONG expires)
 {
-  return AddIPToDnsCache(&ipv4_cache, ipv4, 4, hostname, hostnamelen);
+  return AddIPToDnsCache(&ipv4_cache,
+                         ipv4,
+                         4,
+                         hostname,
+                         hostnamelen,
+                         expires);
 }
 
 BOOL AddIPv6ToDnsCache(const UINT8* ipv6,
                        const char* hostname,
-                       UINT16 hostnamelen)
+                       UINT16 hostnamelen,
+                       LONGLONG expires)
 {
-  return AddIPToDnsCache(&ipv6_cache, ipv6, 16, hostname, hostnamelen);
+  return AddIPToDnsCache(&ipv6_cache,
+                         ipv6,
+                         16,
+                         hostname,
+                         hostnamelen,
+                         expires);
 }
 
 const char* GetIPv4FromDnsCache(const UINT8* ipv4, char* hostname)
@@ -221,57 +658,195 @@ const char* GetIPv6FromDnsCache(const UINT8* ipv6, char* hostname)
   return GetIPFromDnsCache(&ipv6_cache, ipv6, 16, hostname);
 }
 
-BOOL InitCache(dns_cache_t* ip_cache,
-               unsigned nbuckets,
-               unsigned max,
-               SIZE_T ip_size)
+unsigned GetIPv4BatchFromDnsCache(const UINT8* const* ipv4,
+                                  unsigned count,
+                                  char** hostnames)
 {
-  cache_entry_t* entry;
-  cache_entry_t* next;
-  size_t sizeof_cache_entry;
-  unsigned i;
+  return GetIPBatchFromDnsCache(&ipv4_cache, ipv4, 4, count, hostnames);
+}
 
-  /* Allocate memory for the buckets. */
-  if ((ip_cache->buckets = (cache_header_t*)
-                           MemAlloc(nbuckets * sizeof(cache_header_t)))
-      == NULL) {
-    return FALSE;
+unsigned GetIPv6BatchFromDnsCache(const UINT8* const* ipv6,
+                                  unsigned count,
+                                  char** hostnames)
+{
+  return GetIPBatchFromDnsCache(&ipv6_cache, ipv6, 16, count, hostnames);
+}
+
+void GetDnsCacheStats(dns_cache_stats_t* ipv4_stats,
+                      dns_cache_stats_t* ipv6_stats)
+{
+  GetCacheStats(&ipv4_cache, ipv4_stats);
+  GetCacheStats(&ipv6_cache, ipv6_stats);
+}
+
+SIZE_T GetDnsCacheSnapshotSize()
+{
+  /* There are never more entries than the maximum of 'table'. */
+  return sizeof(snapshot_header_t) +
+         (ipv4_cache.table->max *
+          (SNAPSHOT_RECORD_SIZE(4) + HOST_NAME_MAX_LEN)) +
+         (ipv6_cache.table->max *
+          (SNAPSHOT_RECORD_SIZE(16) + HOST_NAME_MAX_LEN));
+}
+
+void BeginDnsCacheSnapshot(dns_cache_snapshot_t* snapshot, LONGLONG now)
+{
+  snapshot->now = now;
+  snapshot->family = 0;
+  snapshot->next = ipv4_cache.time.older;
+  snapshot->nipv4 = 0;
+  snapshot->nipv6 = 0;
+  snapshot->size = 0;
+}
+
+SIZE_T SaveDnsCache(dns_cache_snapshot_t* snapshot, UINT8* buf, SIZE_T size)
+{
+  SIZE_T off;
+
+  if (size < DNS_CACHE_SNAPSHOT_MIN_BUFFER) {
+    return 0;
   }
 
-  /* Calculate size of the cache entry. */
-  sizeof_cache_entry = offsetof(cache_entry_t, ip) + ip_size;
+  off = 0;
 
-  /* Allocate memory for all the entries. */
-  if ((ip_cache->entries = (cache_entry_t*) MemAlloc(max * sizeof_cache_entry))
-      == NULL) {
-    MemFree(ip_cache->buckets);
-    return FALSE;
+  /* The first piece starts with a placeholder for the header. */
+  if (snapshot->size == 0) {
+    memset(buf, 0, sizeof(snapshot_header_t));
+    off = sizeof(snapshot_header_t);
   }
 
-  for (i = 0; i < nbuckets; i++) {
-    ip_cache->buckets[i].prev = &ip_cache->buckets[i];
-    ip_cache->buckets[i].next = &ip_cache->buckets[i];
+  while (snapshot->family < 2) {
+    if (snapshot->family == 0) {
+      /* Save IPv4 entries. */
+      off += SaveCache(&ipv4_cache,
+                       4,
+                       snapshot,
+                       &snapshot->nipv4,
+                       buf + off,
+                       size - off);
+    } else {
+      /* Save IPv6 entries. */
+      off += SaveCache(&ipv6_cache,
+                       16,
+                       snapshot,
+                       &snapshot->nipv6,
+                       buf + off,
+                       size - off);
+    }
+
+    /* If the buffer is full... */
+    if (snapshot->next != NULL) {
+      break;
+    }
+
+    if (++snapshot->family == 1) {
+      snapshot->next = ipv6_cache.time.older;
+    }
   }
 
-  entry = ip_cache->entries;
+  snapshot->size += off;
 
-  for (i = 0; i + 1 < max; i++) {
-    next = (cache_entry_t*) ((UINT8*) entry + sizeof_cache_entry);
+  return off;
+}
 
-    entry->next = next;
-    entry = next;
+void GetDnsCacheSnapshotHeader(const dns_cache_snapshot_t* snapshot,
+                               UINT8* header)
+{
+  snapshot_header_t h;
+
+  h.magic = SNAPSHOT_MAGIC;
+  h.version = SNAPSHOT_VERSION;
+  h.size = (UINT32) snapshot->size;
+  h.nipv4 = snapshot->nipv4;
+  h.nipv6 = snapshot->nipv6;
+  h.reserved = 0;
+  h.timestamp = snapshot->now;
+
+  memcpy(header, &h, sizeof(snapshot_header_t));
+}
+
+BOOL LoadDnsCache(const UINT8* buf,
+                  SIZE_T len,
+                  LONGLONG now,
+                  unsigned* loaded,
+                  unsigned* expired)
+{
+  snapshot_header_t header;
+  const UINT8* ptr;
+  const UINT8* end;
+
+  *loaded = 0;
+  *expired = 0;
+
+  if (len < sizeof(snapshot_header_t)) {
+    return FALSE;
   }
 
-  entry->next = NULL;
+  memcpy(&header, buf, sizeof(snapshot_header_t));
+
+  if ((header.magic != SNAPSHOT_MAGIC) ||
+      (header.version != SNAPSHOT_VERSION) ||
+      (header.size != len)) {
+    return FALSE;
+  }
+
+  ptr = buf + sizeof(snapshot_header_t);
+  end = buf + len;
+
+  /* Load IPv4 entries. */
+  if (!LoadCache(&ipv4_cache,
+                 4,
+                 &ptr,
+                 end,
+                 header.nipv4,
+                 now,
+                 loaded,
+                 expired)) {
+    return FALSE;
+  }
+
+  /* Load IPv6 entries. */
+  return LoadCache(&ipv6_cache,
+                   16,
+                   &ptr,
+                   end,
+                   header.nipv6,
+                   now,
+                   loaded,
+                   expired);
+}
+
+BOOL InitCache(dns_cache_t* ip_cache,
+               unsigned nbuckets,
+               unsigned max,
+               SIZE_T ip_size,
+               BOOL large_pages)
+{
+  if (!InitTable(&ip_cache->tables[0], nbuckets, max, ip_size, large_pages)) {
+    return FALSE;
+  }
 
-  ip_cache->free = ip_cache->entries;
+  ip_cache->table = &ip_cache->tables[0];
+  ip_cache->old = NULL;
+  ip_cache->resized = NULL;
+  ip_cache->next_bucket = 0;
+  ip_cache->now = 0;
+  ip_cache->retired = NULL;
 
   ip_cache->time.older = &ip_cache->time;
   ip_cache->time.newer = &ip_cache->time;
 
-  ip_cache->nbuckets = nbuckets;
+  ip_cache->ip_size = ip_size;
 
   memset(ip_cache->bins, 0, sizeof(ip_cache->bins));
+  memset(ip_cache->counters, 0, sizeof(ip_cache->counters));
+
+  ip_cache->nentries = 0;
+
+  memset(ip_cache->bin_pages, 0, sizeof(ip_cache->bin_pages));
+  memset(ip_cache->bin_free_slots, 0, sizeof(ip_cache->bin_free_slots));
+
+  KeInitializeSpinLock(&ip_cache->lock);
 
   return TRUE;
 }
@@ -280,15 +855,14 @@ void FreeCache(dns_cache_t* ip_cache)
 {
   unsigned i;
 
-  if (ip_cache->buckets) {
-    MemFree(ip_cache->buckets);
-    ip_cache->buckets = NULL;
-  }
+  /* Both tables might be in use (during a resize). */
+  FreeTable(&ip_cache->tables[0]);
+  FreeTable(&ip_cache->tables[1]);
 
-  if (ip_cache->entries) {
-    MemFree(ip_cache->entries);
-    ip_cache->entries = NULL;
-  }
+  ip_cache->table = NULL;
+  ip_cache->old = NULL;
+  ip_cache->resized = NULL;
+  ip_cache->retired = NULL;
 
   for (i = 0; i < MAX_BINS; i++) {
     if (ip_cache->bins[i]) {
@@ -298,72 +872,416 @@ void FreeCache(dns_cache_t* ip_cache)
   }
 }
 
-BOOL AddIPToDnsCache(dns_cache_t* ip_cache,
-                     const UINT8* ip,
-                     SIZE_T ip_size,
-                     const char* hostname,
-                     UINT16 hostnamelen)
+BOOL InitTable(cache_table_t* table,
+               unsigned nbuckets,
+               unsigned max,
+               SIZE_T ip_size,
+               BOOL large_pages)
 {
-  cache_header_t* header;
   cache_entry_t* entry;
-  hostname_t* host;
-  page_t* page;
-  char* s;
-  unsigned off;
-  unsigned oldbin;
-  unsigned newbin;
+  cache_entry_t* next;
+  size_t sizeof_cache_entry;
+  size_t sizeof_buckets;
+  unsigned i;
 
-  /* If the hostname is too long... */
-  if (hostnamelen > HOST_NAME_MAX_LEN) {
+  /* Calculate size of the cache entry (keep the pointers aligned). */
+  sizeof_cache_entry = offsetof(cache_entry_t, ip) + ip_size;
+  sizeof_cache_entry = (sizeof_cache_entry + sizeof(LONGLONG) - 1) &
+                       ~(sizeof(LONGLONG) - 1);
+
+  /* The entries start in a new cache line. */
+  sizeof_buckets = nbuckets * sizeof(cache_header_t);
+  sizeof_buckets = (sizeof_buckets + FILTER_BLOCK_SIZE - 1) &
+                   ~((size_t) FILTER_BLOCK_SIZE - 1);
+
+  /* Allocate memory for the buckets and all the entries in a single block,
+   * so the random accesses of the lookups need as few TLB entries as
+   * possible (and a reader which takes the header of a chain for an entry
+   * doesn't read past the block).
+   */
+  if (!AllocMemory(&table->mem,
+                   sizeof_buckets + (max * sizeof_cache_entry),
+                   large_pages)) {
     return FALSE;
   }
 
-  header = &ip_cache->buckets[ip_cache->hash(ip, ip_cache->nbuckets)];
-  entry = (cache_entry_t*) header->next;
+  if (!InitFilter(&table->filter, max)) {
+    FreeMemory(&table->mem);
+    return FALSE;
+  }
 
-  while (entry != (cache_entry_t*) header) {
-    /* Same IP address? */
-    if (memcmp(ip, entry->ip, ip_size) == 0) {
-      host = &entry->hostname;
+  table->buckets = (cache_header_t*) table->mem.ptr;
+  table->entries = (cache_entry_t*) ((UINT8*) table->mem.ptr +
+                                     sizeof_buckets);
 
-      /* If the hostnames have the same length... */
-      if (hostnamelen == host->len) {
-        /* Same hostname? */
-        s = host->page->data + host->off;
-        if (memcmp(hostname, s, hostnamelen) == 0) {
-          /* Already inserted. */
-          TouchCacheEntry(ip_cache, header, entry);
+  for (i = 0; i < nbuckets; i++) {
+    table->buckets[i].prev = &table->buckets[i];
+    table->buckets[i].next = &table->buckets[i];
+    table->buckets[i].seq = 0;
+    table->buckets[i].len = 0;
+  }
 
-          return TRUE;
-        }
+  entry = table->entries;
 
-        /* Overwrite hostname. */
-        memcpy(s, hostname, hostnamelen);
+  for (i = 0; i + 1 < max; i++) {
+    next = (cache_entry_t*) ((UINT8*) entry + sizeof_cache_entry);
 
-        TouchCacheEntry(ip_cache, header, entry);
+    entry->next = next;
+    entry = next;
+  }
 
-        return TRUE;
-      }
+  entry->next = NULL;
 
-      oldbin = BucketIndex(host->len);
-      newbin = BucketIndex(hostnamelen);
+  table->free = table->entries;
 
-      /* If the hostnames are in the same bin... */
-      if (oldbin == newbin) {
-        s = host->page->data + host->off;
-        memcpy(s, hostname, hostnamelen);
-        host->len = hostnamelen;
+  table->nbuckets = nbuckets;
+  table->max = max;
 
-        TouchCacheEntry(ip_cache, header, entry);
+  memset(table->chains, 0, sizeof(table->chains));
+  table->chains[0] = nbuckets;
 
-        return TRUE;
+  return TRUE;
+}
+
+void FreeTable(cache_table_t* table)
+{
+  FreeMemory(&table->mem);
+
+  table->buckets = NULL;
+  table->entries = NULL;
+
+  FreeFilter(&table->filter);
+}
+
+void StartResize(dns_cache_t* ip_cache, cache_table_t* resized)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&ip_cache->lock, &lock_handle);
+
+  /* If the entries don't fit in the new tables, the oldest ones are
+   * dropped first (MoveEntries()).
+   */
+  if (ip_cache->nentries > resized->max) {
+    ip_cache->resized = resized;
+  } else {
+    PublishTables(ip_cache, resized);
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+void PublishTables(dns_cache_t* ip_cache, cache_table_t* resized)
+{
+  ip_cache->resized = NULL;
+  ip_cache->next_bucket = 0;
+
+  ip_cache->old = ip_cache->table;
+
+  /* A lookup which reads the new tables reads the previous ones too. */
+  KeMemoryBarrier();
+
+  ip_cache->table = resized;
+}
+
+BOOL MoveEntries(dns_cache_t* ip_cache, unsigned count, LONGLONG now)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  cache_table_t* table;
+  cache_table_t* old;
+  cache_header_t* header;
+  cache_entry_t* entry;
+
+  /* If there is no resize in progress... */
+  if ((!ip_cache->resized) && (!ip_cache->old) && (!ip_cache->retired)) {
+    return FALSE;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&ip_cache->lock, &lock_handle);
+
+  ip_cache->now = now;
+
+  /* Drop the oldest entries which don't fit in the new tables (even the
+   * ones which have been looked up since they were made the newest).
+   */
+  if (ip_cache->resized) {
+    table = ip_cache->table;
+
+    while ((count > 0) && (ip_cache->nentries > ip_cache->resized->max)) {
+      entry = (cache_entry_t*) ip_cache->time.older;
+      header = Bucket(ip_cache, table, entry->ip);
+
+      BeginBucketWrite(header);
+      DropCacheEntry(ip_cache, table, header, entry);
+      EndBucketWrite(header);
+
+      count--;
+    }
+
+    if (ip_cache->nentries <= ip_cache->resized->max) {
+      PublishTables(ip_cache, ip_cache->resized);
+    }
+  }
+
+  /* Move the entries of the next buckets of the previous tables. */
+  if ((old = ip_cache->old) != NULL) {
+    while ((count > 0) && (ip_cache->next_bucket < old->nbuckets)) {
+      MoveBucket(ip_cache, &old->buckets[ip_cache->next_bucket++]);
+      count--;
+    }
+
+    /* If all the entries have been moved, no new lookup reads the previous
+     * tables.
+     */
+    if (ip_cache->next_bucket == old->nbuckets) {
+      ip_cache->old = NULL;
+      ip_cache->retired = old;
+    }
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  /* Free the previous tables once the lookups which might still read them
+   * have finished (at PASSIVE_LEVEL, without the spin lock).
+   */
+  if ((ip_cache->retired) && (!LookupsRunning(ip_cache))) {
+    FreeTable(ip_cache->retired);
+    ip_cache->retired = NULL;
+  }
+
+  return ((ip_cache->resized) || (ip_cache->old) || (ip_cache->retired));
+}
+
+void MoveBucket(dns_cache_t* ip_cache, cache_header_t* oldheader)
+{
+  cache_table_t* old;
+  cache_entry_t* entry;
+
+  old = ip_cache->old;
+
+  /* A lookup which doesn't find an entry in the new tables and then reads
+   * this bucket retries if the entry has been moved meanwhile.
+   */
+  BeginBucketWrite(oldheader);
+
+  while ((entry = (cache_entry_t*) oldheader->next) !=
+         (cache_entry_t*) oldheader) {
+    /* If the entry has expired... */
+    if (entry->expires <= ip_cache->now) {
+      DropCacheEntry(ip_cache, old, oldheader, entry);
+      continue;
+    }
+
+    MoveCacheEntry(ip_cache, entry);
+
+    UnlinkCacheEntry(entry);
+    SetChainLength(old, oldheader, oldheader->len - 1);
+
+    RemoveFromFilter(&old->filter, entry->ip, ip_cache->ip_size);
+  }
+
+  EndBucketWrite(oldheader);
+}
+
+void MoveCacheEntry(dns_cache_t* ip_cache, cache_entry_t* entry)
+{
+  cache_table_t* table;
+  cache_header_t* header;
+  cache_entry_t* moved;
+
+  table = ip_cache->table;
+  header = Bucket(ip_cache, table, entry->ip);
+
+  /* The entries of both tables fit in the new ones, so there is a free
+   * entry. The hostname stays in its bin.
+   */
+  moved = table->free;
+  table->free = moved->next;
+
+  AddToFilter(&table->filter, entry->ip, ip_cache->ip_size);
+
+  BeginBucketWrite(header);
+
+  /* There are no duplicates in the cache, so the entry is linked without
+   * searching the bucket.
+   */
+  LinkNewCacheEntry(table,
+                    header,
+                    moved,
+                    entry->ip,
+                    ip_cache->ip_size,
+                    entry->hostname.page,
+                    entry->hostname.off,
+                    entry->hostname.len,
+                    entry->expires);
+
+  moved->referenced = entry->referenced;
+
+  EndBucketWrite(header);
+
+  /* The moved entry takes the place of the entry in the time list. */
+  moved->older = entry->older;
+  moved->newer = entry->newer;
+
+  moved->older->newer = moved;
+  moved->newer->older = moved;
+}
+
+void MoveBucketOf(dns_cache_t* ip_cache, const UINT8* ip)
+{
+  /* While the entries are moved, the bucket of the previous tables where
+   * the address would be is moved first, so that the address only has to
+   * be searched in the new tables.
+   */
+  if (ip_cache->old) {
+    MoveBucket(ip_cache, Bucket(ip_cache, ip_cache->old, ip));
+  }
+}
+
+BOOL LookupsRunning(dns_cache_t* ip_cache)
+{
+  ULONG in;
+  ULONG out;
+  unsigned i;
+
+  /* The previous tables have been unpublished before. */
+  KeMemoryBarrier();
+
+  /* Count the finished lookups first: each of them is counted as started
+   * too, so the numbers are only equal if no lookup which started before
+   * is still running.
+   */
+  out = 0;
+
+  for (i = 0; i < MAX_CPUS; i++) {
+    out += (ULONG) ip_cache->counters[i].lookups_out;
+  }
+
+  KeMemoryBarrier();
+
+  in = 0;
+
+  for (i = 0; i < MAX_CPUS; i++) {
+    in += (ULONG) ip_cache->counters[i].lookups_in;
+  }
+
+  return (in != out);
+}
+
+BOOL AddIPToDnsCache(dns_cache_t* ip_cache,
+                     const UINT8* ip,
+                     SIZE_T ip_size,
+                     const char* hostname,
+                     UINT16 hostnamelen,
+                     LONGLONG expires)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  cache_header_t* header;
+  BOOL ret;
+
+  /* If the hostname is too long... */
+  if (hostnamelen > HOST_NAME_MAX_LEN) {
+    return FALSE;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&ip_cache->lock, &lock_handle);
+
+  MoveBucketOf(ip_cache, ip);
+
+  header = Bucket(ip_cache, ip_cache->table, ip);
+
+  BeginBucketWrite(header);
+
+  ret = InsertIP(ip_cache,
+                 header,
+                 ip,
+                 ip_size,
+                 hostname,
+                 hostnamelen,
+                 expires);
+
+  EndBucketWrite(header);
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  return ret;
+}
+
+BOOL InsertIP(dns_cache_t* ip_cache,
+              cache_header_t* header,
+              const UINT8* ip,
+              SIZE_T ip_size,
+              const char* hostname,
+              UINT16 hostnamelen,
+              LONGLONG expires)
+{
+  cache_entry_t* entry;
+  hostname_t* host;
+  page_t* page;
+  char* s;
+  unsigned off;
+  unsigned oldbin;
+  unsigned newbin;
+
+  entry = (cache_entry_t*) header->next;
+
+  while (entry != (cache_entry_t*) header) {
+    /* Same IP address? */
+    if (memcmp(ip, entry->ip, ip_size) == 0) {
+      host = &entry->hostname;
+
+      entry->expires = expires;
+
+      /* If the hostnames have the same length... */
+      if (hostnamelen == host->len) {
+        /* Same hostname? */
+        s = host->page->data + host->off;
+        if (memcmp(hostname, s, hostnamelen) == 0) {
+          /* Already inserted. */
+          TouchCacheEntry(ip_cache, header, entry);
+
+          Counters(ip_cache)->refreshes++;
+
+          return TRUE;
+        }
+
+        Counters(ip_cache)->overwrites++;
+
+        /* Overwrite hostname. */
+        memcpy(s, hostname, hostnamelen);
+
+        TouchCacheEntry(ip_cache, header, entry);
+
+        return TRUE;
+      }
+
+      Counters(ip_cache)->overwrites++;
+
+      oldbin = BucketIndex(host->len);
+      newbin = BucketIndex(hostnamelen);
+
+      /* If the hostnames are in the same bin... */
+      if (oldbin == newbin) {
+        s = host->page->data + host->off;
+        memcpy(s, hostname, hostnamelen);
+        host->len = hostnamelen;
+
+        TouchCacheEntry(ip_cache, header, entry);
+
+        return TRUE;
       }
 
       if (!SaveHost(ip_cache, newbin, hostname, hostnamelen, &page, &off)) {
         return FALSE;
       }
 
-      RemoveFromPage(host);
+      RemoveFromPage(ip_cache, host);
 
       host->page = page;
       host->off = off;
@@ -387,28 +1305,71 @@ BOOL AddIPToDnsCache(dns_cache_t* ip_cache,
     return FALSE;
   }
 
+  entry = NewCacheEntry(ip_cache, header);
+
+  AddToFilter(&ip_cache->table->filter, ip, ip_size);
+
+  LinkNewCacheEntry(ip_cache->table,
+                    header,
+                    entry,
+                    ip,
+                    ip_size,
+                    page,
+                    off,
+                    hostnamelen,
+                    expires);
+
+  Counters(ip_cache)->inserts++;
+
+  return TRUE;
+}
+
+cache_entry_t* NewCacheEntry(dns_cache_t* ip_cache, cache_header_t* header)
+{
+  cache_table_t* table;
+  cache_entry_t* entry;
+  unsigned max;
+
+  table = ip_cache->table;
+
+  /* While the oldest entries which don't fit in the new tables are
+   * dropped, the entries are limited to the maximum of the new tables.
+   */
+  max = (ip_cache->resized) ? ip_cache->resized->max : table->max;
+
   /* If there is a free entry... */
-  if ((entry = ip_cache->free) != NULL) {
-    ip_cache->free = entry->next;
+  if ((ip_cache->nentries < max) && ((entry = table->free) != NULL)) {
+    table->free = entry->next;
 
     entry->newer = (cache_entry_t*) &ip_cache->time;
     entry->older = (cache_entry_t*) ip_cache->time.newer;
 
     entry->older->newer = entry;
     ip_cache->time.newer = (cache_time_t*) entry;
-  } else {
-    /* Free the oldest entry. */
-    entry = (cache_entry_t*) ip_cache->time.older;
 
-    UnlinkCacheEntry(entry);
-    MakeCacheEntryNewest(ip_cache, entry);
+    ip_cache->nentries++;
 
-    RemoveFromPage(&entry->hostname);
+    return entry;
   }
 
+  return EvictCacheEntry(ip_cache, header);
+}
+
+void LinkNewCacheEntry(cache_table_t* table,
+                       cache_header_t* header,
+                       cache_entry_t* entry,
+                       const UINT8* ip,
+                       SIZE_T ip_size,
+                       page_t* page,
+                       unsigned off,
+                       UINT16 hostnamelen,
+                       LONGLONG expires)
+{
   entry->hostname.page = page;
   entry->hostname.off = off;
   entry->hostname.len = hostnamelen;
+  entry->expires = expires;
+  entry->referenced = 0;
 
   memcpy(entry->ip, ip, ip_size);
 
@@ -418,7 +1379,87 @@ BOOL AddIPToDnsCache(dns_cache_t* ip_cache,
   entry->next->prev = entry;
   header->next = (cache_header_t*) entry;
 
-  return TRUE;
+  SetChainLength(table, header, header->len + 1);
+}
+
+cache_entry_t* EvictCacheEntry(dns_cache_t* ip_cache,
+                               cache_header_t* header)
+{
+  cache_table_t* table;
+  cache_header_t* oldheader;
+  cache_entry_t* entry;
+
+  /* Give a second chance to the entries which have been looked up since
+   * they were made the newest.
+   */
+  while (((entry = (cache_entry_t*) ip_cache->time.older)->referenced) &&
+         (policy == DNS_CACHE_POLICY_CLOCK)) {
+    entry->referenced = 0;
+
+    MakeCacheEntryNewest(ip_cache, entry);
+  }
+
+  /* While the entries are moved, the oldest entry might be in the previous
+   * tables: it is dropped, and a free entry of the new tables is taken.
+   */
+  if ((ip_cache->old) && (InTable(ip_cache->old, entry))) {
+    table = ip_cache->old;
+    oldheader = Bucket(ip_cache, table, entry->ip);
+
+    BeginBucketWrite(oldheader);
+    DropCacheEntry(ip_cache, table, oldheader, entry);
+    EndBucketWrite(oldheader);
+
+    Counters(ip_cache)->evictions++;
+
+    return NewCacheEntry(ip_cache, header);
+  }
+
+  table = ip_cache->table;
+  oldheader = Bucket(ip_cache, table, entry->ip);
+
+  /* The bucket of the evicted entry might be a different one. */
+  if (oldheader != header) {
+    BeginBucketWrite(oldheader);
+  }
+
+  UnlinkCacheEntry(entry);
+  SetChainLength(table, oldheader, oldheader->len - 1);
+
+  RemoveFromPage(ip_cache, &entry->hostname);
+  RemoveFromFilter(&table->filter, entry->ip, ip_cache->ip_size);
+
+  if (oldheader != header) {
+    EndBucketWrite(oldheader);
+  }
+
+  MakeCacheEntryNewest(ip_cache, entry);
+
+  Counters(ip_cache)->evictions++;
+
+  return entry;
+}
+
+void DropCacheEntry(dns_cache_t* ip_cache,
+                    cache_table_t* table,
+                    cache_header_t* header,
+                    cache_entry_t* entry)
+{
+  /* The caller writes the bucket. */
+  UnlinkCacheEntry(entry);
+  SetChainLength(table, header, header->len - 1);
+
+  RemoveFromPage(ip_cache, &entry->hostname);
+  RemoveFromFilter(&table->filter, entry->ip, ip_cache->ip_size);
+
+  /* Unlink entry from the time list. */
+  entry->older->newer = entry->newer;
+  entry->newer->older = entry->older;
+
+  entry->next = table->free;
+  table->free = entry;
+
+  ip_cache->nentries--;
 }
 
 const char* GetIPFromDnsCache(dns_cache_t* ip_cache,
@@ -426,30 +1467,450 @@ const char* GetIPFromDnsCache(dns_cache_t* ip_cache,
                               SIZE_T ip_size,
                               char* hostname)
 {
-  cache_header_t* header;
+  cache_table_t* table;
+  cache_table_t* old;
+  const char* found;
+
+  UNREFERENCED_PARAMETER(ip_size);
+
+  table = BeginLookup(ip_cache, &old);
+  found = LookupTables(ip_cache, table, old, ip, hostname);
+  EndLookup(ip_cache);
+
+  if (found) {
+    Counters(ip_cache)->hits++;
+  } else {
+    Counters(ip_cache)->misses++;
+  }
+
+  return found;
+}
+
+unsigned GetIPBatchFromDnsCache(dns_cache_t* ip_cache,
+                                const UINT8* const* ips,
+                                SIZE_T ip_size,
+                                unsigned count,
+                                char** hostnames)
+{
+  UINT64 hashes[DNS_CACHE_BATCH_SIZE];
+  const UINT8* blocks[DNS_CACHE_BATCH_SIZE];
+  const cache_header_t* headers[DNS_CACHE_BATCH_SIZE];
+  cache_counters_t* counters;
+  cache_table_t* table;
+  cache_table_t* old;
+  unsigned found;
+  unsigned total;
+  unsigned n;
+  unsigned i;
+
+  found = 0;
+  total = 0;
+
+  table = BeginLookup(ip_cache, &old);
+
+  /* While the entries are moved, each address is looked up in both
+   * tables.
+   */
+  if (old) {
+    for (; total < count; total++) {
+      if (LookupTables(ip_cache, table, old, ips[total], hostnames[total])) {
+        found++;
+      } else {
+        *hostnames[total] = 0;
+      }
+    }
+
+    count = 0;
+  }
+
+  while (count > 0) {
+    n = (count < DNS_CACHE_BATCH_SIZE) ? count : DNS_CACHE_BATCH_SIZE;
+
+    /* Hash all the addresses and prefetch their filter blocks. */
+    for (i = 0; i < n; i++) {
+      hashes[i] = FilterHash(ips[i], ip_size);
+      blocks[i] = FilterBlock(&table->filter, hashes[i]);
+
+      PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, blocks[i]);
+    }
+
+    /* Prefetch the buckets of the addresses which might be in the cache. */
+    for (i = 0; i < n; i++) {
+      if (TestFilterBlock(blocks[i], hashes[i])) {
+        headers[i] = Bucket(ip_cache, table, ips[i]);
+
+        PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, headers[i]);
+      } else {
+        headers[i] = NULL;
+      }
+    }
+
+    /* Prefetch the first entry of each chain. */
+    for (i = 0; i < n; i++) {
+      if (headers[i]) {
+        PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, headers[i]->next);
+      }
+    }
+
+    /* Probe. */
+    for (i = 0; i < n; i++) {
+      if ((headers[i]) &&
+          (LookupBucket(table, headers[i], ips[i], ip_size, hostnames[i]))) {
+        found++;
+      } else {
+        *hostnames[i] = 0;
+      }
+    }
+
+    ips += n;
+    hostnames += n;
+    total += n;
+    count -= n;
+  }
+
+  EndLookup(ip_cache);
+
+  counters = Counters(ip_cache);
+  counters->hits += found;
+  counters->misses += total - found;
+
+  return found;
+}
+
+const char* LookupTables(dns_cache_t* ip_cache,
+                         const cache_table_t* table,
+                         const cache_table_t* old,
+                         const UINT8* ip,
+                         char* hostname)
+{
+  const cache_header_t* oldheader;
+  LONG seq;
+
+  if (!old) {
+    return LookupTable(ip_cache, table, ip, hostname);
+  }
+
+  /* An entry which is not in the new tables yet is in the previous ones,
+   * unless it has been moved in between: then its bucket in the previous
+   * tables has changed, and the address is looked up again.
+   */
+  oldheader = Bucket(ip_cache, old, ip);
+
+  do {
+    seq = BeginBucketRead(oldheader);
+
+    if ((LookupTable(ip_cache, table, ip, hostname)) ||
+        (LookupTable(ip_cache, old, ip, hostname))) {
+      return hostname;
+    }
+  } while (RetryBucketRead(oldheader, seq));
+
+  return NULL;
+}
+
+const char* LookupTable(dns_cache_t* ip_cache,
+                        const cache_table_t* table,
+                        const UINT8* ip,
+                        char* hostname)
+{
+  /* Most of the misses are answered here. */
+  if (!MayBeInFilter(&table->filter, ip, ip_cache->ip_size)) {
+    return NULL;
+  }
+
+  return LookupBucket(table,
+                      Bucket(ip_cache, table, ip),
+                      ip,
+                      ip_cache->ip_size,
+                      hostname);
+}
+
+const char* LookupBucket(const cache_table_t* table,
+                         const cache_header_t* header,
+                         const UINT8* ip,
+                         SIZE_T ip_size,
+                         char* hostname)
+{
   cache_entry_t* entry;
+  cache_entry_t* found;
+  page_t* page;
+  unsigned off;
+  UINT16 len;
+  unsigned count;
+  LONG seq;
+
+  do {
+    seq = BeginBucketRead(header);
+
+    found = NULL;
+    len = 0;
+    count = 0;
+
+    entry = (cache_entry_t*) header->next;
+
+    /* The chain might be modified while we walk it, so don't walk more
+     * entries than there are in the cache.
+     */
+    while ((entry != (cache_entry_t*) header) &&
+           (entry != NULL) &&
+           (count++ < table->max)) {
+      /* Same IP address? */
+      if (memcmp(ip, entry->ip, ip_size) == 0) {
+        page = entry->hostname.page;
+        off = entry->hostname.off;
+        len = entry->hostname.len;
+
+        /* Don't read past the end of the page if the hostname is being
+         * modified.
+         */
+        if ((page != NULL) &&
+            (len <= HOST_NAME_MAX_LEN) &&
+            (off + len <= PAGE_SIZE - offsetof(page_t, data))) {
+          memcpy(hostname, page->data + off, len);
+          found = entry;
+        }
+
+        break;
+      }
+
+      entry = entry->next;
+    }
+  } while (RetryBucketRead(header, seq));
+
+  if (found) {
+    hostname[len] = 0;
+
+    if (!found->referenced) {
+      found->referenced = 1;
+    }
+
+    return hostname;
+  }
+
+  return NULL;
+}
+
+SIZE_T SaveCache(dns_cache_t* ip_cache,
+                 SIZE_T ip_size,
+                 dns_cache_snapshot_t* snapshot,
+                 UINT32* count,
+                 UINT8* buf,
+                 SIZE_T size)
+{
+  const cache_entry_t* entry;
   const hostname_t* host;
+  UINT8* ptr;
 
-  header = &ip_cache->buckets[ip_cache->hash(ip, ip_cache->nbuckets)];
-  entry = (cache_entry_t*) header->next;
+  ptr = buf;
 
-  while (entry != (cache_entry_t*) header) {
-    /* Same IP address? */
-    if (memcmp(ip, entry->ip, ip_size) == 0) {
+  /* Save the entries from the oldest to the newest, so the loader can
+   * append them to the time list in the same order. Only the caller adds
+   * entries, so no lock is needed (and 'buf' can be paged).
+   */
+  entry = (const cache_entry_t*) snapshot->next;
+
+  while (entry != (const cache_entry_t*) &ip_cache->time) {
+    /* If the entry has not expired yet... */
+    if (entry->expires > snapshot->now) {
       host = &entry->hostname;
 
-      memcpy(hostname, host->page->data + host->off, host->len);
-      hostname[host->len] = 0;
+      /* If the record doesn't fit, it goes in the next piece. */
+      if (SNAPSHOT_RECORD_SIZE(ip_size) + host->len >
+          (SIZE_T) (buf + size - ptr)) {
+        snapshot->next = entry;
+        return (SIZE_T) (ptr - buf);
+      }
 
-      TouchCacheEntry(ip_cache, header, entry);
+      memcpy(ptr, &entry->expires, sizeof(LONGLONG));
+      ptr[sizeof(LONGLONG)] = (UINT8) host->len;
+      memcpy(ptr + sizeof(LONGLONG) + 1, entry->ip, ip_size);
 
-      return hostname;
+      ptr += SNAPSHOT_RECORD_SIZE(ip_size);
+
+      memcpy(ptr, host->page->data + host->off, host->len);
+      ptr += host->len;
+
+      (*count)++;
     }
 
-    entry = entry->next;
+    entry = entry->newer;
   }
 
-  return NULL;
+  snapshot->next = NULL;
+
+  return (SIZE_T) (ptr - buf);
+}
+
+BOOL LoadCache(dns_cache_t* ip_cache,
+               SIZE_T ip_size,
+               const UINT8** ptr,
+               const UINT8* end,
+               UINT32 count,
+               LONGLONG now,
+               unsigned* loaded,
+               unsigned* expired)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  cache_header_t* header;
+  cache_entry_t* entry;
+  const UINT8* p;
+  const UINT8* ip;
+  LONGLONG expires;
+  page_t* page;
+  unsigned off;
+  UINT16 hostnamelen;
+  UINT32 skip;
+  UINT32 i;
+
+  /* If there are more entries than fit in the cache, skip the oldest
+   * ones.
+   */
+  skip = (count > ip_cache->table->max) ? count - ip_cache->table->max : 0;
+
+  p = *ptr;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&ip_cache->lock, &lock_handle);
+
+  for (i = 0; i < count; i++) {
+    if (p + SNAPSHOT_RECORD_SIZE(ip_size) > end) {
+      break;
+    }
+
+    memcpy(&expires, p, sizeof(LONGLONG));
+    hostnamelen = p[sizeof(LONGLONG)];
+    ip = p + sizeof(LONGLONG) + 1;
+
+    p += SNAPSHOT_RECORD_SIZE(ip_size);
+
+    if ((hostnamelen == 0) || (p + hostnamelen > end)) {
+      break;
+    }
+
+    if (i < skip) {
+      p += hostnamelen;
+      continue;
+    }
+
+    /* If the entry has expired... */
+    if (expires <= now) {
+      p += hostnamelen;
+      (*expired)++;
+
+      continue;
+    }
+
+    /* Save host in the corresponding bin. */
+    if (!SaveHost(ip_cache,
+                  BucketIndex(hostnamelen),
+                  (const char*) p,
+                  hostnamelen,
+                  &page,
+                  &off)) {
+      break;
+    }
+
+    p += hostnamelen;
+
+    MoveBucketOf(ip_cache, ip);
+
+    header = Bucket(ip_cache, ip_cache->table, ip);
+
+    BeginBucketWrite(header);
+
+    /* There are no duplicates in the snapshot, so the entry is linked
+     * without searching the bucket.
+     */
+    entry = NewCacheEntry(ip_cache, header);
+
+    AddToFilter(&ip_cache->table->filter, ip, ip_size);
+
+    LinkNewCacheEntry(ip_cache->table,
+                      header,
+                      entry,
+                      ip,
+                      ip_size,
+                      page,
+                      off,
+                      hostnamelen,
+                      expires);
+
+    EndBucketWrite(header);
+
+    (*loaded)++;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  *ptr = p;
+
+  return (i == count);
+}
+
+void GetCacheStats(dns_cache_t* ip_cache, dns_cache_stats_t* stats)
+{
+  const cache_counters_t* counters;
+  const cache_table_t* table;
+  unsigned i;
+
+  memset(stats, 0, sizeof(dns_cache_stats_t));
+
+  /* Sum the counters of all the processors. */
+  for (i = 0; i < MAX_CPUS; i++) {
+    counters = &ip_cache->counters[i];
+
+    stats->inserts += counters->inserts;
+    stats->overwrites += counters->overwrites;
+    stats->refreshes += counters->refreshes;
+    stats->hits += counters->hits;
+    stats->misses += counters->misses;
+    stats->evictions += counters->evictions;
+  }
+
+  /* The occupancy is read without the lock: while the writer inserts, the
+   * values might be off by one entry. During a resize, the chains are the
+   * ones of the new tables.
+   */
+  table = ip_cache->table;
+
+  stats->entries = ip_cache->nentries;
+  stats->max_entries = table->max;
+  stats->nbuckets = table->nbuckets;
+  stats->used_buckets = table->nbuckets - table->chains[0];
+
+  for (i = CHAIN_LENGTHS - 1; i > 0; i--) {
+    if (table->chains[i] > 0) {
+      stats->max_chain = i;
+      break;
+    }
+  }
+
+  if (stats->used_buckets > 0) {
+    stats->avg_chain = (stats->entries * 100) / stats->used_buckets;
+  }
+
+  stats->false_positive_rate =
+      GetFilterFalsePositiveRate(&table->filter);
+  stats->filter_saturated = table->filter.saturated;
+
+  /* Both tables during a resize. */
+  for (i = 0; i < 2; i++) {
+    table = &ip_cache->tables[i];
+
+    if (table->mem.ptr) {
+      stats->memory += table->mem.size +
+                       ((SIZE_T) (table->filter.mask + 1) * FILTER_BLOCK_SIZE);
+    }
+  }
+
+  for (i = 0; i < MAX_BINS; i++) {
+    stats->bin_max_len[i] = bins_max_len[i];
+    stats->bin_pages[i] = ip_cache->bin_pages[i];
+    stats->bin_free_slots[i] = ip_cache->bin_free_slots[i];
+
+    stats->memory += (SIZE_T) ip_cache->bin_pages[i] * PAGE_SIZE;
+  }
 }
 
 void TouchCacheEntry(dns_cache_t* ip_cache,
@@ -516,6 +1977,8 @@ BOOL SaveHost(dns_cache_t* ip_cache,
 
       pg->free = *((int*) s);
 
+      ip_cache->bin_free_slots[bin]--;
+
       memcpy(s, hostname, hostnamelen);
 
       return TRUE;
@@ -552,6 +2015,10 @@ BOOL SaveHost(dns_cache_t* ip_cache,
 
   ip_cache->bins[bin] = pg;
 
+  /* The first slot is taken now. */
+  ip_cache->bin_pages[bin]++;
+  ip_cache->bin_free_slots[bin] += count - 1;
+
   /* Save hostname. */
   memcpy(data, hostname, hostnamelen);
 
@@ -561,13 +2028,191 @@ BOOL SaveHost(dns_cache_t* ip_cache,
   return TRUE;
 }
 
-void RemoveFromPage(hostname_t* host)
+BOOL InitFilter(filter_t* filter, unsigned max)
+{
+  UINT32 nblocks;
+  SIZE_T size;
+
+  /* Number of blocks (power of two). */
+  nblocks = 1;
+  while (nblocks * FILTER_ENTRIES_PER_BLOCK < max) {
+    nblocks <<= 1;
+  }
+
+  size = (SIZE_T) nblocks * FILTER_BLOCK_SIZE;
+
+  /* Each block must be in a single cache line. */
+  if ((filter->mem = MemAlloc(size + FILTER_BLOCK_SIZE - 1)) == NULL) {
+    return FALSE;
+  }
+
+  filter->blocks = (UINT8*) (((ULONG_PTR) filter->mem + FILTER_BLOCK_SIZE - 1) &
+                             ~((ULONG_PTR) FILTER_BLOCK_SIZE - 1));
+
+  filter->mask = nblocks - 1;
+
+  filter->used = 0;
+  filter->saturated = 0;
+  filter->weight = 0;
+
+  memset(filter->blocks, 0, size);
+
+  return TRUE;
+}
+
+void FreeFilter(filter_t* filter)
+{
+  if (filter->mem) {
+    MemFree(filter->mem);
+    filter->mem = NULL;
+    filter->blocks = NULL;
+  }
+}
+
+void AddToFilter(filter_t* filter, const UINT8* ip, SIZE_T ip_size)
+{
+  UINT64 h;
+  UINT8* block;
+  UINT8* counter;
+  unsigned used;
+  unsigned i;
+
+  h = FilterHash(ip, ip_size);
+  block = FilterBlock(filter, h);
+
+  used = filter->used;
+
+  for (i = 0; i < FILTER_HASHES; i++, h >>= 6) {
+    counter = block + (h & (FILTER_BLOCK_SIZE - 1));
+
+    /* Saturated counters are never decremented. */
+    if (*counter < FILTER_MAX_COUNT) {
+      if (*counter == 0) {
+        filter->used++;
+      } else if (*counter == FILTER_MAX_COUNT - 1) {
+        filter->saturated++;
+      }
+
+      (*counter)++;
+    }
+  }
+
+  if (filter->used != used) {
+    UpdateFilterWeight(filter, block, (int) (filter->used - used));
+  }
+}
+
+void RemoveFromFilter(filter_t* filter, const UINT8* ip, SIZE_T ip_size)
+{
+  UINT64 h;
+  UINT8* block;
+  UINT8* counter;
+  unsigned used;
+  unsigned i;
+
+  h = FilterHash(ip, ip_size);
+  block = FilterBlock(filter, h);
+
+  used = filter->used;
+
+  for (i = 0; i < FILTER_HASHES; i++, h >>= 6) {
+    counter = block + (h & (FILTER_BLOCK_SIZE - 1));
+
+    if ((*counter > 0) && (*counter < FILTER_MAX_COUNT)) {
+      if (--(*counter) == 0) {
+        filter->used--;
+      }
+    }
+  }
+
+  if (filter->used != used) {
+    UpdateFilterWeight(filter, block, (int) (filter->used - used));
+  }
+}
+
+BOOL MayBeInFilter(const filter_t* filter, const UINT8* ip, SIZE_T ip_size)
+{
+  UINT64 h;
+
+  h = FilterHash(ip, ip_size);
+
+  return TestFilterBlock(FilterBlock(filter, h), h);
+}
+
+unsigned GetFilterFalsePositiveRate(const filter_t* filter)
+{
+  UINT64 full;
+  unsigned k;
+
+  /* An address which is not in the filter passes if its FILTER_HASHES
+   * counters are used, so the probability of a false positive is the
+   * average over the blocks of the fraction of used counters to the power
+   * of FILTER_HASHES (parts per million).
+   */
+  full = 1;
+
+  for (k = 0; k < FILTER_HASHES; k++) {
+    full *= FILTER_BLOCK_SIZE;
+  }
+
+  return (unsigned) (((filter->weight / ((UINT64) filter->mask + 1)) *
+                      1000000) / full);
+}
+
+void UpdateFilterWeight(filter_t* filter, const UINT8* block, int change)
+{
+  UINT64 before;
+  UINT64 after;
+  unsigned used;
+  unsigned i;
+
+  /* Used counters in the block, after and before the change. */
+  used = 0;
+
+  for (i = 0; i < FILTER_BLOCK_SIZE; i++) {
+    if (block[i] != 0) {
+      used++;
+    }
+  }
+
+  before = 1;
+  after = 1;
+
+  for (i = 0; i < FILTER_HASHES; i++) {
+    before *= (UINT64) (used - change);
+    after *= used;
+  }
+
+  filter->weight += after - before;
+}
+
+UINT64 FilterHash(const UINT8* ip, SIZE_T ip_size)
+{
+  UINT64 h;
+  UINT32 w;
+  SIZE_T i;
+
+  h = 0;
+
+  for (i = 0; i < ip_size; i += 4) {
+    memcpy(&w, ip + i, 4);
+
+    /* Multiplicative hashing (2^64 / golden ratio). */
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+  }
+
+  return (h ^ (h >> 29));
+}
+
+void RemoveFromPage(dns_cache_t* ip_cache, hostname_t* host)
 {
   int* next;
 
   next = (int*) (host->page->data + host->off);
   *next = host->page->free;
   host->page->free = host->off;
+
+  ip_cache->bin_free_slots[BucketIndex(host->len)]++;
 }
 
 void FreeBin(page_t* page)
@@ -585,7 +2230,8 @@ UINT32 HashIPv4(const UINT8* ip, unsigned nbuckets)
 {
   UINT32 a;
 
-  a = *((UINT32*) ip);
+  /* The address might not be aligned (records of a snapshot). */
+  memcpy(&a, ip, sizeof(UINT32));
 
   /* http://burtleburtle.net/bob/hash/integer.html */
   a = a ^ (a >> 4);
@@ -598,7 +2244,7 @@ UINT32 HashIPv6(const UINT8* ip, unsigned nbuckets)
 {
   /* http://burtleburtle.net/bob/hash/doobs.html */
 
-  static UINT32 initval = 0xdeaddead;
+  static const UINT32 initval = 0xdeaddead;
   UINT32 a, b, c;
 
   /* Set up the internal state. */
@@ -632,8 +2278,6 @@ UINT32 HashIPv6(const UINT8* ip, unsigned nbuckets)
   c += 16;
   mix(a, b, c);
 
-  initval = c; /* Save the last hash value. */
-
   /*-------------------------------------------- Report the result. */
   return (c % nbuckets);
 }
@@ -8,18 +8,154 @@
 
 #pragma warning(pop)
 
-BOOL InitDnsCache(unsigned nbuckets, unsigned max);
+#define DNS_CACHE_BATCH_SIZE 16
+
+/* Number of hostname bins (by hostname length). */
+#define DNS_CACHE_BINS 32
+
+/* Longer chains are reported as this length. */
+#define DNS_CACHE_MAX_CHAIN 31
+
+typedef enum {
+  /* Evict the entry which was inserted or refreshed least recently, unless
+   * it has been looked up since then (second chance).
+   */
+  DNS_CACHE_POLICY_CLOCK,
+
+  /* Evict the entry which was inserted or refreshed least recently. */
+  DNS_CACHE_POLICY_FIFO
+} dns_cache_policy_t;
+
+typedef struct {
+  /* Counters (summed over all the processors). */
+  ULONGLONG inserts;
+  ULONGLONG overwrites;
+  ULONGLONG refreshes;
+  ULONGLONG hits;
+  ULONGLONG misses;
+  ULONGLONG evictions;
+
+  /* Occupancy. */
+  unsigned entries;
+  unsigned max_entries;
+
+  /* Chain lengths (the average is in hundredths and only counts the
+   * non-empty buckets, the maximum is at most DNS_CACHE_MAX_CHAIN).
+   */
+  unsigned nbuckets;
+  unsigned used_buckets;
+  unsigned max_chain;
+  unsigned avg_chain;
+
+  /* Hostname bins. */
+  UINT16 bin_max_len[DNS_CACHE_BINS];
+  unsigned bin_pages[DNS_CACHE_BINS];
+  unsigned bin_free_slots[DNS_CACHE_BINS];
+
+  /* Bloom filter false-positive rate in parts per million and number of
+   * saturated counters (which are never decremented).
+   */
+  unsigned false_positive_rate;
+  unsigned filter_saturated;
+
+  /* Memory used by the cache (in bytes). */
+  SIZE_T memory;
+} dns_cache_stats_t;
+
+BOOL InitDnsCache(unsigned nbuckets, unsigned max, BOOL large_pages);
 void FreeDnsCache();
 
+/* Resize the caches without flushing them. The new tables are allocated
+ * here: if it fails (or the previous resize is not complete), the caches
+ * are not modified. Then MoveDnsCacheEntries() drops the oldest entries if
+ * they don't fit and moves the others to the new tables a few at a time.
+ * Meanwhile, the lookups stay lock-free (they read the new tables, then the
+ * previous ones) and the insertions go to the new tables.
+ */
+BOOL ResizeDnsCache(unsigned nbuckets, unsigned max, BOOL large_pages);
+
+/* Drop or move up to 'count' entries or buckets of entries (the ones which
+ * have expired at 'now' are dropped), and free the previous tables once no
+ * lookup can read them. Return TRUE while the resize is not complete. It
+ * must be called at PASSIVE_LEVEL by the only writer (the worker thread).
+ */
+BOOL MoveDnsCacheEntries(unsigned count, LONGLONG now);
+
+/* The default policy is DNS_CACHE_POLICY_CLOCK. */
+void SetDnsCachePolicy(dns_cache_policy_t policy);
+
 BOOL AddIPv4ToDnsCache(const UINT8* ipv4,
                        const char* hostname,
-                       UINT16 hostnamelen);
+                       UINT16 hostnamelen,
+                       LONGLONG expires);
 
 BOOL AddIPv6ToDnsCache(const UINT8* ipv6,
                        const char* hostname,
-                       UINT16 hostnamelen);
+                       UINT16 hostnamelen,
+                       LONGLONG expires);
 
 const char* GetIPv4FromDnsCache(const UINT8* ipv4, char* hostname);
 const char* GetIPv6FromDnsCache(const UINT8* ipv6, char* hostname);
 
+/* Batch lookups: the memory accesses of the lookups overlap. For each
+ * address, the hostname is set to an empty string if the address is not
+ * in the cache. Return the number of addresses found.
+ */
+unsigned GetIPv4BatchFromDnsCache(const UINT8* const* ipv4,
+                                  unsigned count,
+                                  char** hostnames);
+
+unsigned GetIPv6BatchFromDnsCache(const UINT8* const* ipv6,
+                                  unsigned count,
+                                  char** hostnames);
+
+void GetDnsCacheStats(dns_cache_stats_t* ipv4_stats,
+                      dns_cache_stats_t* ipv6_stats);
+
+/* Snapshot of the caches, saved in pieces so that only a small buffer is
+ * needed: BeginDnsCacheSnapshot(), then SaveDnsCache() until it returns 0
+ * and finally GetDnsCacheSnapshotHeader(), whose header overwrites the
+ * beginning of the snapshot (the first piece starts with a placeholder).
+ *
+ * The entries are walked without the cache locks, so the snapshot must be
+ * saved by the thread which adds the entries, or while none are added.
+ */
+#define DNS_CACHE_SNAPSHOT_HEADER_SIZE 32
+
+/* Smallest buffer which SaveDnsCache() accepts. */
+#define DNS_CACHE_SNAPSHOT_MIN_BUFFER 512
+
+typedef struct {
+  LONGLONG now;
+
+  /* Cache being saved (0: IPv4, 1: IPv6, 2: done) and next entry. */
+  unsigned family;
+  const void* next;
+
+  UINT32 nipv4;
+  UINT32 nipv6;
+  SIZE_T size;
+} dns_cache_snapshot_t;
+
+/* Size of the largest snapshot (when the caches are full of the longest
+ * hostnames).
+ */
+SIZE_T GetDnsCacheSnapshotSize();
+
+void BeginDnsCacheSnapshot(dns_cache_snapshot_t* snapshot, LONGLONG now);
+
+/* Copy the next records to 'buf'. Return the number of bytes copied (0 when
+ * the snapshot is complete).
+ */
+SIZE_T SaveDnsCache(dns_cache_snapshot_t* snapshot, UINT8* buf, SIZE_T size);
+
+void GetDnsCacheSnapshotHeader(const dns_cache_snapshot_t* snapshot,
+                               UINT8* header);
+
+BOOL LoadDnsCache(const UINT8* buf,
+                  SIZE_T len,
+                  LONGLONG now,
+                  unsigned* loaded,
+                  unsigned* expired);
+
 #endif /* DNS_CACHE_H */
@@ -0,0 +1,207 @@
+#include <ntddk.h>
+#include "dnssnapshot.h"
+#include "dnscache.h"
+#include "logfile.h"
+
+#define TAG '1gaT'
+
+#define SNAPSHOT_FILE L"inspect.dns"
+
+#define SNAPSHOT_BUFFER_SIZE (16 * 1024)
+
+static NTSTATUS OpenSnapshotFile(ACCESS_MASK access,
+                                 ULONG disposition,
+                                 HANDLE* hFile);
+
+NTSTATUS SaveDnsCacheSnapshot()
+{
+  IO_STATUS_BLOCK io_status_block;
+  LARGE_INTEGER now;
+  LARGE_INTEGER offset;
+  dns_cache_snapshot_t snapshot;
+  HANDLE hFile;
+  UINT8* buf;
+  SIZE_T size;
+  NTSTATUS status;
+
+  /* The snapshot is saved in pieces and the cache is walked without its
+   * locks (we run in the thread which adds the entries), so a small paged
+   * buffer is enough.
+   */
+  if ((buf = (UINT8*) ExAllocatePoolWithTag(PagedPool,
+                                            SNAPSHOT_BUFFER_SIZE,
+                                            TAG)) == NULL) {
+    return STATUS_NO_MEMORY;
+  }
+
+  status = OpenSnapshotFile(SYNCHRONIZE | FILE_WRITE_DATA,
+                            FILE_OVERWRITE_IF,
+                            &hFile);
+
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(buf, TAG);
+    return status;
+  }
+
+  KeQuerySystemTime(&now);
+
+  BeginDnsCacheSnapshot(&snapshot, now.QuadPart);
+
+  /* Append the pieces. */
+  while ((size = SaveDnsCache(&snapshot, buf, SNAPSHOT_BUFFER_SIZE)) > 0) {
+    status = ZwWriteFile(hFile,
+                         NULL,
+                         NULL,
+                         NULL,
+                         &io_status_block,
+                         buf,
+                         (ULONG) size,
+                         NULL,
+                         NULL);
+
+    if (!NT_SUCCESS(status)) {
+      break;
+    }
+  }
+
+  /* Write the header over the placeholder. */
+  if (NT_SUCCESS(status)) {
+    GetDnsCacheSnapshotHeader(&snapshot, buf);
+
+    offset.QuadPart = 0;
+
+    status = ZwWriteFile(hFile,
+                         NULL,
+                         NULL,
+                         NULL,
+                         &io_status_block,
+                         buf,
+                         DNS_CACHE_SNAPSHOT_HEADER_SIZE,
+                         &offset,
+                         NULL);
+  }
+
+  ZwClose(hFile);
+
+  ExFreePoolWithTag(buf, TAG);
+
+  return status;
+}
+
+NTSTATUS LoadDnsCacheSnapshot()
+{
+  IO_STATUS_BLOCK io_status_block;
+  FILE_STANDARD_INFORMATION info;
+  LARGE_INTEGER now;
+  LARGE_INTEGER start;
+  LARGE_INTEGER stop;
+  LARGE_INTEGER frequency;
+  HANDLE hFile;
+  UINT8* buf;
+  ULONG size;
+  unsigned loaded;
+  unsigned expired;
+  BOOL ret;
+  NTSTATUS status;
+
+  start = KeQueryPerformanceCounter(&frequency);
+
+  status = OpenSnapshotFile(SYNCHRONIZE | FILE_READ_DATA, FILE_OPEN, &hFile);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  status = ZwQueryInformationFile(hFile,
+                                  &io_status_block,
+                                  &info,
+                                  sizeof(FILE_STANDARD_INFORMATION),
+                                  FileStandardInformation);
+
+  if (!NT_SUCCESS(status)) {
+    ZwClose(hFile);
+    return status;
+  }
+
+  /* If the file is bigger than the largest snapshot of this cache, it
+   * was not written by us.
+   */
+  if (info.EndOfFile.QuadPart > (LONGLONG) GetDnsCacheSnapshotSize()) {
+    ZwClose(hFile);
+    return STATUS_INVALID_IMAGE_FORMAT;
+  }
+
+  size = (ULONG) info.EndOfFile.QuadPart;
+
+  if ((buf = (UINT8*) ExAllocatePoolWithTag(NonPagedPool, size, TAG))
+      == NULL) {
+    ZwClose(hFile);
+    return STATUS_NO_MEMORY;
+  }
+
+  status = ZwReadFile(hFile,
+                      NULL,
+                      NULL,
+                      NULL,
+                      &io_status_block,
+                      buf,
+                      size,
+                      NULL,
+                      NULL);
+
+  ZwClose(hFile);
+
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(buf, TAG);
+    return status;
+  }
+
+  KeQuerySystemTime(&now);
+
+  ret = LoadDnsCache(buf,
+                     io_status_block.Information,
+                     now.QuadPart,
+                     &loaded,
+                     &expired);
+
+  ExFreePoolWithTag(buf, TAG);
+
+  stop = KeQueryPerformanceCounter(NULL);
+
+  Log(&now,
+      "[DNS] Cache snapshot: %u entries loaded, %u expired, %I64u us%s.\r\n",
+      loaded,
+      expired,
+      ((stop.QuadPart - start.QuadPart) * 1000000) / frequency.QuadPart,
+      ret ? "" : " (truncated)");
+
+  return ret ? STATUS_SUCCESS : STATUS_INVALID_IMAGE_FORMAT;
+}
+
+NTSTATUS OpenSnapshotFile(ACCESS_MASK access,
+                          ULONG disposition,
+                          HANDLE* hFile)
+{
+  UNICODE_STRING name;
+  OBJECT_ATTRIBUTES attr;
+  IO_STATUS_BLOCK io_status_block;
+
+  RtlInitUnicodeString(&name, L"\\DosDevices\\C:\\" SNAPSHOT_FILE);
+
+  InitializeObjectAttributes(&attr,
+                             &name,
+                             OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                             NULL,
+                             NULL);
+
+  return ZwCreateFile(hFile,
+                      access,
+                      &attr,
+                      &io_status_block,
+                      NULL,
+                      FILE_ATTRIBUTE_NORMAL,
+                      0,
+                      disposition,
+                      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE,
+                      NULL,
+                      0);
+}
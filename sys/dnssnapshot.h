@@ -0,0 +1,14 @@
+#ifndef DNS_SNAPSHOT_H
+#define DNS_SNAPSHOT_H
+
+#pragma warning(push)
+#pragma warning(disable:4201) /* Unnamed struct/union. */
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+NTSTATUS SaveDnsCacheSnapshot();
+NTSTATUS LoadDnsCacheSnapshot();
+
+#endif /* DNS_SNAPSHOT_H */
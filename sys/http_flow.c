@@ -0,0 +1,544 @@
+#include <stddef.h>
+#include <wdm.h>
+#include "http_flow.h"
+#include "http_scanner.h"
+#include "largemem.h"
+
+#define MAX_HEADER_SIZE 0xffff
+
+/* Maximum number of hexadecimal digits of a chunk size. */
+#define MAX_CHUNK_SIZE_DIGITS 15
+
+/* Maximum number of digits of a Content-Length. */
+#define MAX_CONTENT_LENGTH_DIGITS 18
+
+typedef struct {
+  /* Flow contexts. */
+  http_flow_t* flows;
+  http_flow_t** free_flows;
+  unsigned max_flows;
+  unsigned nfree_flows;
+
+  /* Packets (all allocated in a single block). */
+  memory_t arena;
+  packet_t** free_packets;
+  unsigned max_headers;
+  unsigned nfree_packets;
+
+  SIZE_T packet_size;
+  unsigned max_header_size;
+
+  BOOL keep_alive;
+
+  KSPIN_LOCK spin_lock;
+} http_flows_t;
+
+static http_flows_t pool;
+
+static SIZE_T AppendToHeader(http_flow_t* flow,
+                             const UINT8* data,
+                             SIZE_T len,
+                             BOOL* complete);
+static void StartBody(http_flow_t* flow);
+static BOOL ParseContentLength(const http_field_t* field, UINT64* length);
+static BOOL IsChunked(const http_field_t* field);
+
+BOOL InitHttpFlows(unsigned max_flows,
+                   unsigned max_headers,
+                   unsigned max_header_size,
+                   BOOL keep_alive,
+                   BOOL large_pages)
+{
+  UINT8* packet;
+  unsigned i;
+
+  pool.max_flows = 0;
+
+  /* Connections not followed? */
+  if (max_flows == 0) {
+    return TRUE;
+  }
+
+  if ((max_headers == 0) ||
+      (max_header_size == 0) ||
+      (max_header_size > MAX_HEADER_SIZE)) {
+    return FALSE;
+  }
+
+  if ((pool.flows = (http_flow_t*) ExAllocatePoolWithTag(
+                                     NonPagedPool,
+                                     max_flows * sizeof(http_flow_t),
+                                     PACKET_POOL_TAG
+                                   )) == NULL) {
+    return FALSE;
+  }
+
+  if ((pool.free_flows = (http_flow_t**) ExAllocatePoolWithTag(
+                                           NonPagedPool,
+                                           max_flows * sizeof(http_flow_t*),
+                                           PACKET_POOL_TAG
+                                         )) == NULL) {
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    return FALSE;
+  }
+
+  if ((pool.free_packets = (packet_t**) ExAllocatePoolWithTag(
+                                          NonPagedPool,
+                                          max_headers * sizeof(packet_t*),
+                                          PACKET_POOL_TAG
+                                        )) == NULL) {
+    ExFreePoolWithTag(pool.free_flows, PACKET_POOL_TAG);
+    pool.free_flows = NULL;
+
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    return FALSE;
+  }
+
+  /* Keep the packets aligned. */
+  pool.packet_size = (offsetof(packet_t, payload) + max_header_size +
+                      sizeof(LONGLONG) - 1) &
+                     ~(sizeof(LONGLONG) - 1);
+
+  if (!AllocMemory(&pool.arena,
+                   (SIZE_T) max_headers * pool.packet_size,
+                   large_pages)) {
+    ExFreePoolWithTag(pool.free_packets, PACKET_POOL_TAG);
+    pool.free_packets = NULL;
+
+    ExFreePoolWithTag(pool.free_flows, PACKET_POOL_TAG);
+    pool.free_flows = NULL;
+
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    return FALSE;
+  }
+
+  for (i = 0; i < max_flows; i++) {
+    pool.free_flows[i] = &pool.flows[i];
+  }
+
+  packet = (UINT8*) pool.arena.ptr;
+
+  for (i = 0; i < max_headers; i++) {
+    pool.free_packets[i] = (packet_t*) packet;
+    packet += pool.packet_size;
+  }
+
+  pool.max_flows = max_flows;
+  pool.nfree_flows = max_flows;
+
+  pool.max_headers = max_headers;
+  pool.nfree_packets = max_headers;
+
+  pool.max_header_size = max_header_size;
+
+  pool.keep_alive = keep_alive;
+
+  KeInitializeSpinLock(&pool.spin_lock);
+
+  return TRUE;
+}
+
+void FreeHttpFlows()
+{
+  if (pool.max_flows > 0) {
+    FreeMemory(&pool.arena);
+
+    ExFreePoolWithTag(pool.free_packets, PACKET_POOL_TAG);
+    pool.free_packets = NULL;
+
+    ExFreePoolWithTag(pool.free_flows, PACKET_POOL_TAG);
+    pool.free_flows = NULL;
+
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    pool.max_flows = 0;
+  }
+}
+
+BOOL HttpFlowsKeepAlive()
+{
+  return (pool.max_flows > 0) && (pool.keep_alive);
+}
+
+http_flow_t* NewHttpFlow(const packet_t* tuple)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  http_flow_t* flow;
+
+  /* Connections not followed? */
+  if (pool.max_flows == 0) {
+    return NULL;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  if (pool.nfree_flows > 0) {
+    flow = pool.free_flows[--pool.nfree_flows];
+  } else {
+    flow = NULL;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  if (flow) {
+    memcpy(&flow->tuple, tuple, offsetof(packet_t, payload));
+
+    /* The request headers of the connection are captured as is. */
+    flow->tuple.flags = 0;
+
+    flow->packet = NULL;
+    flow->state = HTTP_FLOW_HEADER;
+    flow->remaining = 0;
+    flow->count = 0;
+    flow->requests = 0;
+  }
+
+  return flow;
+}
+
+void DeleteHttpFlow(http_flow_t* flow)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  if (flow->packet) {
+    pool.free_packets[pool.nfree_packets++] = flow->packet;
+    flow->packet = NULL;
+  }
+
+  pool.free_flows[pool.nfree_flows++] = flow;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+BOOL AttachHttpFlowPacket(http_flow_t* flow)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  packet_t* packet;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  if (pool.nfree_packets > 0) {
+    packet = pool.free_packets[--pool.nfree_packets];
+  } else {
+    packet = NULL;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  if (!packet) {
+    return FALSE;
+  }
+
+  memcpy(packet, &flow->tuple, offsetof(packet_t, payload));
+  packet->payloadlen = 0;
+
+  flow->packet = packet;
+
+  return TRUE;
+}
+
+SIZE_T ConsumeHttpFlowData(http_flow_t* flow,
+                           const UINT8* data,
+                           SIZE_T len,
+                           BOOL* complete)
+{
+  const UINT8* ptr;
+  const UINT8* end;
+  SIZE_T n;
+  UINT8 c;
+
+  *complete = FALSE;
+
+  ptr = data;
+  end = data + len;
+
+  while (ptr < end) {
+    switch (flow->state) {
+      case HTTP_FLOW_HEADER:
+        /* A packet has to be attached first. */
+        if (!flow->packet) {
+          return ptr - data;
+        }
+
+        return (ptr - data) + AppendToHeader(flow, ptr, end - ptr, complete);
+      case HTTP_FLOW_BODY:
+      case HTTP_FLOW_CHUNK_DATA:
+        /* Skip body. */
+        n = end - ptr;
+        if (n > flow->remaining) {
+          n = (SIZE_T) flow->remaining;
+        }
+
+        ptr += n;
+        flow->remaining -= n;
+
+        if (flow->remaining == 0) {
+          flow->state = (flow->state == HTTP_FLOW_BODY) ? HTTP_FLOW_HEADER :
+                                                          HTTP_FLOW_CHUNK_END;
+        }
+
+        break;
+      case HTTP_FLOW_CHUNK_SIZE:
+        c = *ptr++;
+
+        if (c == '\n') {
+          /* No digits? */
+          if (flow->count == 0) {
+            flow->state = HTTP_FLOW_DONE;
+          } else {
+            /* The last chunk is followed by the trailer. */
+            flow->state = (flow->remaining > 0) ? HTTP_FLOW_CHUNK_DATA :
+                                                  HTTP_FLOW_TRAILER;
+            flow->count = 0;
+          }
+        } else if (flow->count >= 0) {
+          if ((c >= '0') && (c <= '9')) {
+            c -= '0';
+          } else if (((c | 0x20) >= 'a') && ((c | 0x20) <= 'f')) {
+            c = (c | 0x20) - 'a' + 10;
+          } else if (flow->count > 0) {
+            /* Chunk extensions or line end: ignore the rest of the line. */
+            flow->count = -1;
+            break;
+          } else {
+            flow->state = HTTP_FLOW_DONE;
+            break;
+          }
+
+          if (flow->count == MAX_CHUNK_SIZE_DIGITS) {
+            flow->state = HTTP_FLOW_DONE;
+            break;
+          }
+
+          flow->remaining = (flow->remaining << 4) | c;
+          flow->count++;
+        }
+
+        break;
+      case HTTP_FLOW_CHUNK_END:
+        if (*ptr++ == '\n') {
+          flow->state = HTTP_FLOW_CHUNK_SIZE;
+          flow->remaining = 0;
+          flow->count = 0;
+        }
+
+        break;
+      case HTTP_FLOW_TRAILER:
+        c = *ptr++;
+
+        if (c == '\n') {
+          /* Empty line: end of the request. */
+          if (flow->count == 0) {
+            flow->state = HTTP_FLOW_HEADER;
+          } else {
+            flow->count = 0;
+          }
+        } else if (c != '\r') {
+          flow->count++;
+        }
+
+        break;
+      default:
+        return len;
+    }
+  }
+
+  return len;
+}
+
+packet_t* TakeHttpFlowPacket(http_flow_t* flow)
+{
+  packet_t* packet;
+
+  packet = flow->packet;
+  flow->packet = NULL;
+
+  flow->requests++;
+
+  return packet;
+}
+
+BOOL ReleaseHttpFlowPacket(packet_t* packet)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+
+  if ((pool.max_flows == 0) ||
+      ((UINT8*) packet < (UINT8*) pool.arena.ptr) ||
+      ((UINT8*) packet >= (UINT8*) pool.arena.ptr +
+                          (SIZE_T) pool.max_headers * pool.packet_size)) {
+    return FALSE;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  pool.free_packets[pool.nfree_packets++] = packet;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  return TRUE;
+}
+
+SIZE_T AppendToHeader(http_flow_t* flow,
+                      const UINT8* data,
+                      SIZE_T len,
+                      BOOL* complete)
+{
+  packet_t* packet;
+  SIZE_T skipped;
+  SIZE_T n;
+  SIZE_T end;
+
+  packet = flow->packet;
+
+  /* Skip the empty lines before the request line. */
+  skipped = 0;
+  if (packet->payloadlen == 0) {
+    while ((skipped < len) &&
+           ((data[skipped] == '\r') || (data[skipped] == '\n'))) {
+      skipped++;
+    }
+
+    data += skipped;
+    len -= skipped;
+  }
+
+  n = pool.max_header_size - packet->payloadlen;
+  if (n > len) {
+    n = len;
+  }
+
+  memcpy(packet->payload + packet->payloadlen, data, n);
+
+  /* The end of the header might span the previous data. */
+  end = FindEndOfHttpHeader(packet->payload,
+                            packet->payloadlen + n,
+                            (packet->payloadlen > 2) ?
+                              packet->payloadlen - 2 :
+                              0);
+
+  if (end != 0) {
+    n = end - packet->payloadlen;
+    packet->payloadlen = (UINT16) end;
+
+    *complete = TRUE;
+
+    StartBody(flow);
+  } else {
+    packet->payloadlen = (UINT16) (packet->payloadlen + n);
+
+    /* If the header doesn't fit, the body can't be found. */
+    if (packet->payloadlen == pool.max_header_size) {
+      *complete = TRUE;
+      flow->state = HTTP_FLOW_DONE;
+    }
+  }
+
+  return skipped + n;
+}
+
+void StartBody(http_flow_t* flow)
+{
+  http_field_t fields[HTTP_NUMBER_HEADERS];
+  const packet_t* packet;
+
+  if (!pool.keep_alive) {
+    flow->state = HTTP_FLOW_DONE;
+    return;
+  }
+
+  packet = flow->packet;
+
+  /* After a CONNECT or an upgrade, the data is not HTTP anymore. */
+  if ((packet->payloadlen >= 8) &&
+      (memcmp(packet->payload, "CONNECT ", 8) == 0)) {
+    flow->state = HTTP_FLOW_DONE;
+    return;
+  }
+
+  ParseHttpHeaders(packet->payload, packet->payloadlen, 0, fields);
+
+  if (fields[HTTP_HEADER_UPGRADE].value) {
+    flow->state = HTTP_FLOW_DONE;
+  } else if (fields[HTTP_HEADER_TRANSFER_ENCODING].value) {
+    /* With another transfer coding, the body would last until the connection
+     * is closed.
+     */
+    if (IsChunked(&fields[HTTP_HEADER_TRANSFER_ENCODING])) {
+      flow->state = HTTP_FLOW_CHUNK_SIZE;
+      flow->remaining = 0;
+      flow->count = 0;
+    } else {
+      flow->state = HTTP_FLOW_DONE;
+    }
+  } else if (fields[HTTP_HEADER_CONTENT_LENGTH].value) {
+    if (ParseContentLength(&fields[HTTP_HEADER_CONTENT_LENGTH],
+                           &flow->remaining)) {
+      flow->state = (flow->remaining > 0) ? HTTP_FLOW_BODY : HTTP_FLOW_HEADER;
+    } else {
+      flow->state = HTTP_FLOW_DONE;
+    }
+  } else {
+    /* No body. */
+    flow->state = HTTP_FLOW_HEADER;
+  }
+}
+
+BOOL ParseContentLength(const http_field_t* field, UINT64* length)
+{
+  SIZE_T i;
+
+  if (field->len > MAX_CONTENT_LENGTH_DIGITS) {
+    return FALSE;
+  }
+
+  *length = 0;
+
+  for (i = 0; i < field->len; i++) {
+    if ((field->value[i] < '0') || (field->value[i] > '9')) {
+      return FALSE;
+    }
+
+    *length = (*length * 10) + (field->value[i] - '0');
+  }
+
+  return TRUE;
+}
+
+BOOL IsChunked(const http_field_t* field)
+{
+  static const char chunked[] = "chunked";
+  const UINT8* value;
+  SIZE_T i;
+
+  /* "chunked" has to be the last transfer coding. */
+  if (field->len < sizeof(chunked) - 1) {
+    return FALSE;
+  }
+
+  value = field->value + field->len - (sizeof(chunked) - 1);
+
+  for (i = 0; i < sizeof(chunked) - 1; i++) {
+    if ((value[i] | 0x20) != (UINT8) chunked[i]) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,99 @@
+#ifndef HTTP_FLOW_H
+#define HTTP_FLOW_H
+
+#include "packet_pool.h"
+
+typedef enum {
+  HTTP_FLOW_HEADER,     /* Request header. */
+  HTTP_FLOW_BODY,       /* Body with Content-Length. */
+  HTTP_FLOW_CHUNK_SIZE, /* Chunked body: size line. */
+  HTTP_FLOW_CHUNK_DATA, /* Chunked body: data. */
+  HTTP_FLOW_CHUNK_END,  /* Chunked body: line feed after the data. */
+  HTTP_FLOW_TRAILER,    /* Chunked body: trailer fields. */
+  HTTP_FLOW_DONE        /* Not following the connection anymore. */
+} http_flow_state_t;
+
+typedef struct {
+  /* Flow to which the context is associated. */
+  UINT64 flow_id;
+  UINT16 layer_id;
+  UINT32 callout_id;
+
+  /* Addresses and ports of the connection. */
+  packet_t tuple;
+
+  /* Packet in which the request header is accumulated (NULL once it has been
+   * handed to the worker thread).
+   */
+  packet_t* packet;
+
+  http_flow_state_t state;
+
+  /* Body bytes to skip (HTTP_FLOW_BODY and HTTP_FLOW_CHUNK_DATA) or size
+   * being parsed (HTTP_FLOW_CHUNK_SIZE).
+   */
+  UINT64 remaining;
+
+  /* HTTP_FLOW_CHUNK_SIZE: number of digits, or -1 after the chunk extensions
+   * have been reached.
+   * HTTP_FLOW_TRAILER: length of the current line.
+   */
+  int count;
+
+  /* Number of request headers handed to the worker thread. */
+  unsigned requests;
+} http_flow_t;
+
+/* Preallocate 'max_flows' flow contexts and 'max_headers' packets with room
+ * for 'max_header_size' bytes of request header. No more memory is used,
+ * whatever the number of connections. A flow only holds a packet while it is
+ * accumulating a request header. If 'keep_alive' is TRUE, the connections
+ * are followed until they are closed (every request is logged), otherwise
+ * only until the end of the first request header. If 'max_flows' is 0, the
+ * connections are not followed.
+ */
+BOOL InitHttpFlows(unsigned max_flows,
+                   unsigned max_headers,
+                   unsigned max_header_size,
+                   BOOL keep_alive,
+                   BOOL large_pages);
+void FreeHttpFlows();
+
+/* Return TRUE if the connections are followed until they are closed. */
+BOOL HttpFlowsKeepAlive();
+
+/* Get a flow context for the connection of 'tuple' (NULL if the connections
+ * are not followed or the memory budget is exhausted).
+ */
+http_flow_t* NewHttpFlow(const packet_t* tuple);
+
+/* Return the flow context and its packet (if any) to the pool. */
+void DeleteHttpFlow(http_flow_t* flow);
+
+/* Get an empty packet for the next request header. Return FALSE if the
+ * memory budget is exhausted.
+ */
+BOOL AttachHttpFlowPacket(http_flow_t* flow);
+
+/* Consume outbound data of the connection. The request header bytes are
+ * appended to the packet, the body bytes are skipped without being copied.
+ * Return the number of bytes consumed, which is less than 'len' when:
+ * - A request header has been completed (the end of the header was reached
+ *   or the packet is full): '*complete' is set to TRUE and the packet has
+ *   to be taken before passing the rest of the data.
+ * - A request header begins and no packet is attached.
+ */
+SIZE_T ConsumeHttpFlowData(http_flow_t* flow,
+                           const UINT8* data,
+                           SIZE_T len,
+                           BOOL* complete);
+
+/* Detach the packet from the flow context. */
+packet_t* TakeHttpFlowPacket(http_flow_t* flow);
+
+/* If the packet belongs to the request header pool, return it to the pool and
+ * return TRUE.
+ */
+BOOL ReleaseHttpFlowPacket(packet_t* packet);
+
+#endif /* HTTP_FLOW_H */
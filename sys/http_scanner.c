@@ -0,0 +1,664 @@
+#include <ntddk.h>
+#include <string.h>
+#include "http_scanner.h"
+
+/* Scan 16 bytes at a time with SSE2 on x64 (the kernel saves the XMM
+ * registers). AVX2 would require saving the extended processor state, which
+ * costs more than it saves for packets of less than 2 KB.
+ */
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+
+#define USE_SSE2
+#endif
+
+#define MAX_LINES 32
+
+/* Fields of the records: method, path and the known headers. */
+#define RECORD_FIELDS (2 + HTTP_NUMBER_HEADERS)
+
+/* Offset of the fields which are not present in a record. */
+#define NO_FIELD 0xffff
+
+/* The known headers are identified with a perfect hash:
+ * (length + first character + last character) % 16 (in lowercase).
+ */
+#define HEADERS_HASH_SIZE 16
+
+typedef struct {
+  const char* name;
+  SIZE_T len;
+} header_name_t;
+
+/* Field of a record. */
+typedef struct {
+  UINT16 off;
+  UINT16 len;
+} record_field_t;
+
+static const header_name_t header_names[HTTP_NUMBER_HEADERS] = {
+  {"host", 4},
+  {"user-agent", 10},
+  {"referer", 7},
+  {"content-type", 12},
+  {"content-length", 14},
+  {"upgrade", 7},
+  {"transfer-encoding", 17}
+};
+
+static const UINT8 headers_hash[HEADERS_HASH_SIZE] = {
+  HTTP_HEADER_HOST,              /*  0: host */
+  HTTP_HEADER_UPGRADE,           /*  1: upgrade */
+  HTTP_NUMBER_HEADERS,           /*  2 */
+  HTTP_HEADER_USER_AGENT,        /*  3: user-agent */
+  HTTP_HEADER_CONTENT_TYPE,      /*  4: content-type */
+  HTTP_NUMBER_HEADERS,           /*  5 */
+  HTTP_NUMBER_HEADERS,           /*  6 */
+  HTTP_NUMBER_HEADERS,           /*  7 */
+  HTTP_NUMBER_HEADERS,           /*  8 */
+  HTTP_HEADER_CONTENT_LENGTH,    /*  9: content-length */
+  HTTP_NUMBER_HEADERS,           /* 10 */
+  HTTP_HEADER_REFERER,           /* 11: referer */
+  HTTP_HEADER_TRANSFER_ENCODING, /* 12: transfer-encoding */
+  HTTP_NUMBER_HEADERS,           /* 13 */
+  HTTP_NUMBER_HEADERS,           /* 14 */
+  HTTP_NUMBER_HEADERS            /* 15 */
+};
+
+static http_header_t FindHttpHeader(const UINT8* name, SIZE_T len);
+static void ParseHttpHeader(const UINT8* data,
+                            const UINT8* end,
+                            const http_line_t* line,
+                            http_field_t* fields);
+
+/* Return FALSE to stop scanning. */
+static BOOL AddLine(const UINT8* data,
+                    SIZE_T len,
+                    SIZE_T pos,
+                    http_line_t* lines,
+                    unsigned* nlines,
+                    unsigned max);
+
+__inline static UINT8 ToLower(UINT8 c)
+{
+  return ((c >= 'A') && (c <= 'Z')) ? (c | 0x20) : c;
+}
+
+__inline static void AddColon(SIZE_T pos,
+                              http_line_t* lines,
+                              unsigned nlines)
+{
+  /* Only the first colon of the line. */
+  if ((nlines > 0) && (lines[nlines - 1].colon == HTTP_NO_COLON)) {
+    lines[nlines - 1].colon = (UINT32) pos;
+  }
+}
+
+#ifdef USE_SSE2
+/* Index the line feeds and the colons of the block of 16 bytes at 'pos'
+ * (bitmasks). Return FALSE to stop scanning.
+ */
+__inline static BOOL IndexBlock(const UINT8* data,
+                                SIZE_T len,
+                                SIZE_T pos,
+                                unsigned long lfmask,
+                                unsigned long colonmask,
+                                http_line_t* lines,
+                                unsigned* nlines,
+                                unsigned max)
+{
+  unsigned long mask;
+  unsigned long bit;
+  unsigned long colonbit;
+
+  /* Process the line feeds in order. */
+  while (lfmask != 0) {
+    _BitScanForward(&bit, lfmask);
+
+    /* First colon before the line feed. */
+    if ((mask = colonmask & ((1ul << bit) - 1)) != 0) {
+      _BitScanForward(&colonbit, mask);
+      AddColon(pos + colonbit, lines, *nlines);
+    }
+
+    if (!AddLine(data, len, pos + bit, lines, nlines, max)) {
+      return FALSE;
+    }
+
+    lfmask &= (lfmask - 1);
+    colonmask &= ~((2ul << bit) - 1);
+  }
+
+  /* First colon after the last line feed. */
+  if (colonmask != 0) {
+    _BitScanForward(&colonbit, colonmask);
+    AddColon(pos + colonbit, lines, *nlines);
+  }
+
+  return TRUE;
+}
+#endif /* USE_SSE2 */
+
+const UINT8* FindHttpDelimiter(const UINT8* ptr, const UINT8* end)
+{
+#ifdef USE_SSE2
+  __m128i limit;
+  __m128i v;
+  unsigned long mask;
+  unsigned long bit;
+
+  limit = _mm_set1_epi8(' ' + 1);
+
+  while (end - ptr >= 16) {
+    v = _mm_loadu_si128((const __m128i*) ptr);
+
+    /* The bytes > ' ' are the ones which are equal to max(byte, ' ' + 1)
+     * (unsigned comparison).
+     */
+    mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, limit), v)) &
+           0xffff;
+
+    if (mask != 0) {
+      _BitScanForward(&bit, mask);
+      return ptr + bit;
+    }
+
+    ptr += 16;
+  }
+#endif /* USE_SSE2 */
+
+  while ((ptr < end) && (*ptr > ' ')) {
+    ptr++;
+  }
+
+  return ptr;
+}
+
+unsigned IndexHttpLines(const UINT8* data,
+                        SIZE_T len,
+                        SIZE_T off,
+                        http_line_t* lines,
+                        unsigned max)
+{
+  unsigned nlines;
+  SIZE_T pos;
+
+#ifdef USE_SSE2
+  __m128i lf;
+  __m128i colon;
+  __m128i v;
+  unsigned long keep;
+#endif /* USE_SSE2 */
+
+  nlines = 0;
+  pos = off;
+
+#ifdef USE_SSE2
+  if (len >= 16) {
+    lf = _mm_set1_epi8('\n');
+    colon = _mm_set1_epi8(':');
+
+    while (len - pos >= 16) {
+      v = _mm_loadu_si128((const __m128i*) (data + pos));
+
+      if (!IndexBlock(data,
+                      len,
+                      pos,
+                      _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)),
+                      _mm_movemask_epi8(_mm_cmpeq_epi8(v, colon)),
+                      lines,
+                      &nlines,
+                      max)) {
+        return nlines;
+      }
+
+      pos += 16;
+    }
+
+    /* The last block overlaps the previous one (the bytes which have already
+     * been scanned are masked out), so that the end of the data, which is
+     * most of a short request, is not scanned byte by byte.
+     */
+    if (pos < len) {
+      keep = (0xffff << (pos - (len - 16))) & 0xffff;
+      pos = len - 16;
+
+      v = _mm_loadu_si128((const __m128i*) (data + pos));
+
+      IndexBlock(data,
+                 len,
+                 pos,
+                 _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)) & keep,
+                 _mm_movemask_epi8(_mm_cmpeq_epi8(v, colon)) & keep,
+                 lines,
+                 &nlines,
+                 max);
+    }
+
+    return nlines;
+  }
+#endif /* USE_SSE2 */
+
+  for (; pos < len; pos++) {
+    switch (data[pos]) {
+      case '\n':
+        if (!AddLine(data, len, pos, lines, &nlines, max)) {
+          return nlines;
+        }
+
+        break;
+      case ':':
+        AddColon(pos, lines, nlines);
+        break;
+    }
+  }
+
+  return nlines;
+}
+
+BOOL AddLine(const UINT8* data,
+             SIZE_T len,
+             SIZE_T pos,
+             http_line_t* lines,
+             unsigned* nlines,
+             unsigned max)
+{
+  http_line_t* line;
+
+  /* The line feed of the last line has been found. */
+  if (*nlines == max) {
+    return FALSE;
+  }
+
+  line = &lines[(*nlines)++];
+
+  line->off = (UINT32) (pos + 1);
+  line->colon = HTTP_NO_COLON;
+
+  /* End of the HTTP header? */
+  if ((pos + 1 < len) &&
+      ((data[pos + 1] == '\r') || (data[pos + 1] == '\n'))) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+SIZE_T FindEndOfHttpHeader(const UINT8* data, SIZE_T len, SIZE_T off)
+{
+  const UINT8* ptr;
+  const UINT8* end;
+
+  ptr = data + off;
+  end = data + len;
+
+  while ((ptr < end) &&
+         ((ptr = (const UINT8*) memchr(ptr, '\n', end - ptr)) != NULL)) {
+    ptr++;
+
+    if (ptr < end) {
+      if (*ptr == '\n') {
+        return ptr + 1 - data;
+      } else if ((*ptr == '\r') && (ptr + 1 < end) && (ptr[1] == '\n')) {
+        return ptr + 2 - data;
+      }
+    }
+  }
+
+  return 0;
+}
+
+const char* GetHttpHeaderName(http_header_t header)
+{
+  static const char* names[HTTP_NUMBER_HEADERS] = {
+    "Host",
+    "User-Agent",
+    "Referer",
+    "Content-Type",
+    "Content-Length",
+    "Upgrade",
+    "Transfer-Encoding"
+  };
+
+  return names[header];
+}
+
+/* Disable warning:
+ * Conditional expression is constant:
+ * do {
+ *   ...
+ * } while (1);
+ */
+#pragma warning(disable:4127)
+
+void ParseHttpHeaders(const UINT8* data,
+                      SIZE_T len,
+                      SIZE_T off,
+                      http_field_t* fields)
+{
+  http_line_t lines[MAX_LINES + 1];
+  unsigned nlines;
+  unsigned i;
+
+  for (i = 0; i < HTTP_NUMBER_HEADERS; i++) {
+    fields[i].value = NULL;
+    fields[i].len = 0;
+  }
+
+  do {
+    /* Index the next lines (plus one, where the last line ends). */
+    nlines = IndexHttpLines(data, len, off, lines, MAX_LINES + 1);
+
+    for (i = 0; i < nlines; i++) {
+      /* End of HTTP header? */
+      if ((lines[i].off == len) ||
+          (data[lines[i].off] == '\r') ||
+          (data[lines[i].off] == '\n')) {
+        return;
+      }
+
+      /* If the end of the line has not been indexed (it is either in the
+       * next chunk or after the end of the data)...
+       */
+      if (i + 1 == nlines) {
+        break;
+      }
+
+      ParseHttpHeader(data,
+                      data + lines[i + 1].off - 1,
+                      &lines[i],
+                      fields);
+    }
+
+    /* If all the lines have been indexed... */
+    if (nlines <= MAX_LINES) {
+      return;
+    }
+
+    /* Continue with the last line. */
+    off = lines[MAX_LINES - 1].off;
+  } while (1);
+}
+
+void ParseHttpHeader(const UINT8* data,
+                     const UINT8* end,
+                     const http_line_t* line,
+                     http_field_t* fields)
+{
+  const UINT8* name;
+  const UINT8* ptr;
+  http_header_t header;
+
+  if ((line->colon == HTTP_NO_COLON) || (line->colon == line->off)) {
+    return;
+  }
+
+  name = data + line->off;
+
+  if ((header = FindHttpHeader(name, line->colon - line->off)) ==
+      HTTP_NUMBER_HEADERS) {
+    return;
+  }
+
+  /* Only the first one. */
+  if (fields[header].value) {
+    return;
+  }
+
+  /* Skip spaces after header name. */
+  ptr = data + line->colon + 1;
+  while ((ptr < end) && ((*ptr == ' ') || (*ptr == '\t'))) {
+    ptr++;
+  }
+
+  if (header == HTTP_HEADER_HOST) {
+    /* The host ends at the first space or control character. */
+    end = FindHttpDelimiter(ptr, end);
+  } else {
+    /* Skip trailing spaces and carriage return. */
+    while ((end > ptr) && (end[-1] <= ' ')) {
+      end--;
+    }
+  }
+
+  if (end > ptr) {
+    fields[header].value = ptr;
+    fields[header].len = end - ptr;
+  }
+}
+
+http_header_t FindHttpHeader(const UINT8* name, SIZE_T len)
+{
+  const header_name_t* header_name;
+  http_header_t header;
+  SIZE_T i;
+
+  header = (http_header_t) headers_hash[(len +
+                                         ToLower(name[0]) +
+                                         ToLower(name[len - 1])) &
+                                        (HEADERS_HASH_SIZE - 1)];
+
+  if (header == HTTP_NUMBER_HEADERS) {
+    return HTTP_NUMBER_HEADERS;
+  }
+
+  header_name = &header_names[header];
+
+  if (len != header_name->len) {
+    return HTTP_NUMBER_HEADERS;
+  }
+
+  for (i = 0; i < len; i++) {
+    if (ToLower(name[i]) != (UINT8) header_name->name[i]) {
+      return HTTP_NUMBER_HEADERS;
+    }
+  }
+
+  return header;
+}
+
+BOOL ParseHttpRequest(const UINT8* data,
+                      SIZE_T len,
+                      const UINT8** method,
+                      SIZE_T* methodlen,
+                      const UINT8** path,
+                      SIZE_T* pathlen,
+                      http_field_t* fields)
+{
+  const UINT8* end;
+  const UINT8* ptr;
+
+  end = data + len;
+  ptr = data;
+
+  /* Find method. */
+  while (ptr < end) {
+    if (*ptr > ' ') {
+      *method = ptr++;
+      break;
+    } else {
+      switch (*ptr) {
+        case '\r':
+        case '\n':
+          ptr++;
+          break;
+        default:
+          return FALSE;
+      }
+    }
+  }
+
+  /* Find end of method. */
+  ptr = FindHttpDelimiter(ptr, end);
+
+  if (ptr == end) {
+    return FALSE;
+  }
+
+  *methodlen = ptr - *method;
+
+  /* Skip space after method. */
+  ptr++;
+
+  /* Find beginning of path. */
+  while ((ptr < end) && ((*ptr == ' ') || (*ptr == '\t'))) {
+    ptr++;
+  }
+
+  if (ptr == end) {
+    return FALSE;
+  }
+
+  *path = ptr++;
+
+  /* Find end of path. */
+  ptr = FindHttpDelimiter(ptr, end);
+
+  if (ptr == end) {
+    return FALSE;
+  }
+
+  *pathlen = ptr - *path;
+
+  /* Skip space after path. */
+  ptr++;
+
+  if (ptr == end) {
+    return FALSE;
+  }
+
+  /* Parse the headers. */
+  ParseHttpHeaders(data, len, ptr - data, fields);
+
+  return TRUE;
+}
+
+SIZE_T BuildHttpRecord(const UINT8* data,
+                       SIZE_T len,
+                       UINT8* record,
+                       SIZE_T size)
+{
+  http_field_t fields[RECORD_FIELDS];
+  record_field_t table[RECORD_FIELDS];
+  unsigned order[RECORD_FIELDS];
+  unsigned count;
+  unsigned i;
+  unsigned j;
+  SIZE_T off;
+
+  /* The partial request headers are not pre-parsed (their connections might
+   * be followed).
+   */
+  if (FindEndOfHttpHeader(data, len, 0) == 0) {
+    return 0;
+  }
+
+  /* The method and the path are the first two fields. */
+  if (!ParseHttpRequest(data,
+                        len,
+                        &fields[0].value,
+                        &fields[0].len,
+                        &fields[1].value,
+                        &fields[1].len,
+                        fields + 2)) {
+    return 0;
+  }
+
+  /* Sort the fields which are present by their position in the request, so
+   * that moving them to the beginning of the record never overwrites the
+   * fields which have not been moved yet (when 'record' is 'data').
+   */
+  count = 0;
+  off = 0;
+
+  for (i = 0; i < RECORD_FIELDS; i++) {
+    if (fields[i].value) {
+      for (j = count;
+           (j > 0) && (fields[order[j - 1]].value > fields[i].value);
+           j--) {
+        order[j] = order[j - 1];
+      }
+
+      order[j] = i;
+      count++;
+
+      off += fields[i].len;
+    }
+
+    table[i].off = NO_FIELD;
+    table[i].len = 0;
+  }
+
+  /* If the record doesn't fit... */
+  if ((off + sizeof(table) > size) || (off >= NO_FIELD)) {
+    return 0;
+  }
+
+  off = 0;
+
+  for (i = 0; i < count; i++) {
+    j = order[i];
+
+    memmove(record + off, fields[j].value, fields[j].len);
+
+    table[j].off = (UINT16) off;
+    table[j].len = (UINT16) fields[j].len;
+
+    off += fields[j].len;
+  }
+
+  /* The table follows the fields (it might not be aligned). */
+  memcpy(record + off, table, sizeof(table));
+
+  return off + sizeof(table);
+}
+
+BOOL ParseHttpRecord(const UINT8* record,
+                     SIZE_T len,
+                     const UINT8** method,
+                     SIZE_T* methodlen,
+                     const UINT8** path,
+                     SIZE_T* pathlen,
+                     http_field_t* fields)
+{
+  record_field_t table[RECORD_FIELDS];
+  SIZE_T off;
+  unsigned i;
+
+  if (len < sizeof(table)) {
+    return FALSE;
+  }
+
+  off = len - sizeof(table);
+
+  memcpy(table, record + off, sizeof(table));
+
+  /* The method and the path are always present. */
+  for (i = 0; i < RECORD_FIELDS; i++) {
+    if (table[i].off == NO_FIELD) {
+      if (i < 2) {
+        return FALSE;
+      }
+
+      fields[i - 2].value = NULL;
+      fields[i - 2].len = 0;
+    } else {
+      if ((SIZE_T) table[i].off + table[i].len > off) {
+        return FALSE;
+      }
+
+      if (i == 0) {
+        *method = record + table[i].off;
+        *methodlen = table[i].len;
+      } else if (i == 1) {
+        *path = record + table[i].off;
+        *pathlen = table[i].len;
+      } else {
+        fields[i - 2].value = record + table[i].off;
+        fields[i - 2].len = table[i].len;
+      }
+    }
+  }
+
+  return TRUE;
+}
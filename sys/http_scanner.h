@@ -0,0 +1,105 @@
+#ifndef HTTP_SCANNER_H
+#define HTTP_SCANNER_H
+
+#pragma warning(push)
+#pragma warning(disable:4201) /* Unnamed struct/union. */
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#define HTTP_NO_COLON ((UINT32) -1)
+
+typedef enum {
+  HTTP_HEADER_HOST,
+  HTTP_HEADER_USER_AGENT,
+  HTTP_HEADER_REFERER,
+  HTTP_HEADER_CONTENT_TYPE,
+  HTTP_HEADER_CONTENT_LENGTH,
+  HTTP_HEADER_UPGRADE,
+  HTTP_HEADER_TRANSFER_ENCODING,
+  HTTP_NUMBER_HEADERS
+} http_header_t;
+
+typedef struct {
+  /* NULL if the header is not present. */
+  const UINT8* value;
+  SIZE_T len;
+} http_field_t;
+
+typedef struct {
+  /* Offset of the beginning of the line. */
+  UINT32 off;
+
+  /* Offset of the first colon of the line (HTTP_NO_COLON if none). */
+  UINT32 colon;
+} http_line_t;
+
+/* Return a pointer to the first byte <= ' ' in [ptr, end) or 'end' if there
+ * is none.
+ */
+const UINT8* FindHttpDelimiter(const UINT8* ptr, const UINT8* end);
+
+/* Index the lines which start after the line feeds found at or after
+ * 'data + off', in a single pass. The scan stops after the first empty line
+ * (end of the HTTP header), which is also indexed, and when the line feed
+ * after the 'max'-th line is found. Return the number of lines.
+ */
+unsigned IndexHttpLines(const UINT8* data,
+                        SIZE_T len,
+                        SIZE_T off,
+                        http_line_t* lines,
+                        unsigned max);
+
+/* Return the length of the HTTP header (up to and including the empty line)
+ * or 0 if its end is not in 'data'. Only the line feeds found at or after
+ * 'data + off' are considered, so that a growing buffer can be rescanned
+ * from 'previous length - 2'.
+ */
+SIZE_T FindEndOfHttpHeader(const UINT8* data, SIZE_T len, SIZE_T off);
+
+/* Return the name of the header. */
+const char* GetHttpHeaderName(http_header_t header);
+
+/* Extract the values of the known headers of the lines which start after
+ * the line feeds found at or after 'data + off' (up to the end of the HTTP
+ * header). The header names are case-insensitive. If a header appears more
+ * than once, the first one is used.
+ */
+void ParseHttpHeaders(const UINT8* data,
+                      SIZE_T len,
+                      SIZE_T off,
+                      http_field_t* fields);
+
+/* Parse the request line and the known headers of an HTTP request. */
+BOOL ParseHttpRequest(const UINT8* data,
+                      SIZE_T len,
+                      const UINT8** method,
+                      SIZE_T* methodlen,
+                      const UINT8** path,
+                      SIZE_T* pathlen,
+                      http_field_t* fields);
+
+/* Build the compact record of an HTTP request in 'record' (at most 'size'
+ * bytes, 'record' might be 'data'): the method, the path and the values of
+ * the known headers, followed by their offsets and lengths. Return the
+ * length of the record or 0 if the request line can't be parsed, the end of
+ * the request header is not in 'data' or the record doesn't fit.
+ */
+SIZE_T BuildHttpRecord(const UINT8* data,
+                       SIZE_T len,
+                       UINT8* record,
+                       SIZE_T size);
+
+/* Get the fields of a record built by BuildHttpRecord() (the same as
+ * ParseHttpRequest() on the request).
+ */
+BOOL ParseHttpRecord(const UINT8* record,
+                     SIZE_T len,
+                     const UINT8** method,
+                     SIZE_T* methodlen,
+                     const UINT8** path,
+                     SIZE_T* pathlen,
+                     http_field_t* fields);
+
+#endif /* HTTP_SCANNER_H */
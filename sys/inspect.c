@@ -11,9 +11,99 @@
 #include "inspect.h"
 #include "worker_thread.h"
 #include "packet_pool.h"
+#include "dissector.h"
+#include "http_flow.h"
+#include "http_scanner.h"
+#include "dns_flow.h"
+#include "dns_query.h"
+#include "tls_flow.h"
+#include "classifier.h"
 #include "utils.h"
 
-#define MAX_PAYLOAD_SIZE (MAX_PACKET_SIZE - offsetof(packet_t, payload))
+#define UDP_HEADER_LEN 8
+
+/* Maximum number of datagrams taken from a chain of net buffer lists. */
+#define MAX_DATAGRAMS 32
+
+/* DNS header, longest name, QTYPE and QCLASS. */
+#define MAX_DNS_QUESTION_LEN (12 + 255 + 4)
+
+typedef struct {
+  /* Room for the payload in the packets of the pool. */
+  ULONG max_payload_size;
+
+  BOOL capture_records;
+  BOOL drop_unsolicited;
+} inspect_settings_t;
+
+static inspect_settings_t settings = {
+  MAX_PACKET_SIZE - offsetof(packet_t, payload),
+  CAPTURE_RECORDS,
+  DNS_DROP_UNSOLICITED
+};
+
+static classify_stats_t classify_stats;
+
+static BOOL StartHttpFlow(
+  _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+  _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+  _In_ const FWPS_FILTER* filter,
+  _In_ const FWPS_STREAM_DATA* streamData,
+  _In_ const packet_t* packet,
+  _Out_ BOOL* more
+);
+
+static BOOL ContinueHttpFlow(_In_ http_flow_t* flow,
+                             _In_ const FWPS_STREAM_DATA* streamData);
+
+static void EndHttpFlow(_In_ http_flow_t* flow);
+
+static BOOL FeedHttpFlow(_In_ void* flow,
+                         _In_ const UINT8* data,
+                         _In_ SIZE_T len);
+
+static BOOL StartDnsFlow(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
+                         _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+                         _In_ const FWPS_FILTER* filter,
+                         _In_ const packet_t* packet);
+
+static BOOL ContinueDnsFlow(_In_ dns_flow_t* flow,
+                            _In_ const FWPS_STREAM_DATA* streamData);
+
+static void EndDnsFlow(_In_ dns_flow_t* flow);
+
+static BOOL FeedDnsFlow(_In_ void* flow,
+                        _In_ const UINT8* data,
+                        _In_ SIZE_T len);
+
+static BOOL StartTlsFlow(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
+                         _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+                         _In_ const FWPS_FILTER* filter,
+                         _In_ const FWPS_STREAM_DATA* streamData,
+                         _In_ const packet_t* packet,
+                         _Out_ BOOL* more);
+
+static BOOL ContinueTlsFlow(_In_ tls_flow_t* flow,
+                            _In_ const FWPS_STREAM_DATA* streamData);
+
+static void EndTlsFlow(_In_ tls_flow_t* flow);
+
+static BOOL FeedTlsFlow(_In_ void* flow,
+                        _In_ const UINT8* data,
+                        _In_ SIZE_T len);
+
+static void RecordDnsQuery(
+  _In_ const FWPS_INCOMING_VALUES* inFixedValues,
+  _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+  _In_ NET_BUFFER_LIST* nbl
+);
+
+/* Pass the data of the stream to 'feed' (which returns FALSE to stop). */
+static BOOL ProcessStream(_In_ const FWPS_STREAM_DATA* streamData,
+                          _In_ BOOL (*feed)(void* flow,
+                                            const UINT8* data,
+                                            SIZE_T len),
+                          _In_ void* flow);
 
 
 /*******************************************************************************
@@ -24,9 +114,8 @@
  *******************************************************************************
  *******************************************************************************/
 
-static BOOL FillPacket(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
-                       _Inout_opt_ void* layerData,
-                       _Out_ packet_t* packet)
+static BOOL FillTuple(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
+                      _Out_ packet_t* packet)
 {
   const FWPS_INCOMING_VALUE* values;
   UINT localAddrIndex;
@@ -34,8 +123,6 @@ static BOOL FillPacket(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
   UINT localPortIndex;
   UINT remotePortIndex;
   UINT32 addr;
-  NET_BUFFER* nb;
-  const UINT8* payload;
 
   if (!GetNetwork4TupleIndexesForLayer(inFixedValues->layerId,
                                        &localAddrIndex,
@@ -71,65 +158,112 @@ static BOOL FillPacket(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
            16);
   }
 
-  if (layerData) {
-    switch (packet->remote_port) {
-      case 80: /* HTTP. */
-        nb = NET_BUFFER_LIST_FIRST_NB(
-               ((FWPS_STREAM_CALLOUT_IO_PACKET0*) layerData)->streamData
-                                                            ->netBufferListChain
-             );
-
-        /* Get pointer to payload. */
-        if ((payload = NdisGetDataBuffer(nb,
-                                         nb->DataLength,
-                                         NULL,
-                                         2,
-                                         0)) == NULL) {
-          return FALSE;
-        }
+  return TRUE;
+}
+
+static BOOL FillPayload(_In_ NET_BUFFER* nb,
+                        _In_ UINT8 transport,
+                        _Inout_ packet_t* packet)
+{
+  const UINT8* payload;
+  protocol_t protocol;
+  const dissector_t* dissector;
+  ULONG len;
+  SIZE_T capture_len;
+
+  /* Nothing beyond the room of the packet is looked at. */
+  len = (nb->DataLength < settings.max_payload_size) ?
+          nb->DataLength :
+          settings.max_payload_size;
 
-        packet->payloadlen = (UINT16) ((nb->DataLength < MAX_PAYLOAD_SIZE) ?
-                                        nb->DataLength :
-                                        MAX_PAYLOAD_SIZE);
+  if (len == 0) {
+    return FALSE;
+  }
 
-        memcpy(packet->payload, payload, packet->payloadlen);
+  /* Get pointer to payload (if the data is not contiguous, it is gathered
+   * in the packet).
+   */
+  if ((payload = NdisGetDataBuffer(nb,
+                                   len,
+                                   packet->payload,
+                                   1,
+                                   0)) == NULL) {
+    return FALSE;
+  }
 
-        break;
-      case 443: /* HTTPS. */
-        if (((FWPS_STREAM_CALLOUT_IO_PACKET0*) layerData)->streamData) {
-          nb = NET_BUFFER_LIST_FIRST_NB(
-                 ((FWPS_STREAM_CALLOUT_IO_PACKET0*) layerData)
-                   ->streamData->netBufferListChain
-               );
+  /* Detect the protocol from the payload. */
+  if ((protocol = DetectProtocol(transport,
+                                 packet->remote_port,
+                                 payload,
+                                 len)) == PROTOCOL_UNKNOWN) {
+    return FALSE;
+  }
 
-          /* Payload won't be processed. */
-          packet->payloadlen = (UINT16) nb->DataLength;
-        } else {
-          return FALSE;
-        }
+  packet->protocol = (UINT8) protocol;
 
-        break;
-      case 53: /* DNS. */
-        nb = NET_BUFFER_LIST_FIRST_NB((NET_BUFFER_LIST*) layerData);
+  dissector = GetDissector(protocol);
 
-        /* Get pointer to payload. */
-        if ((payload = NdisGetDataBuffer(nb,
-                                         nb->DataLength,
-                                         NULL,
-                                         2,
-                                         0)) == NULL) {
-          return FALSE;
-        }
+  /* Capture only what the dissector logs, if it can be pre-parsed. */
+  if ((settings.capture_records) &&
+      (dissector->compact) &&
+      ((capture_len = dissector->compact(payload,
+                                         len,
+                                         packet->payload,
+                                         settings.max_payload_size)) > 0)) {
+    packet->flags |= PACKET_FLAG_RECORD;
+    packet->payloadlen = (UINT16) capture_len;
 
-        packet->payloadlen = (UINT16) ((nb->DataLength < MAX_PAYLOAD_SIZE) ?
-                                        nb->DataLength :
-                                        MAX_PAYLOAD_SIZE);
+    return TRUE;
+  }
+
+  capture_len = dissector->capture_len;
+  if (capture_len > len) {
+    capture_len = len;
+  }
+
+  packet->payloadlen = (UINT16) capture_len;
+
+  /* Contiguous data? */
+  if (payload != packet->payload) {
+    memcpy(packet->payload, payload, capture_len);
+  }
+
+  return TRUE;
+}
+
+static BOOL FillPacket(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
+                       _Inout_opt_ void* layerData,
+                       _Out_ packet_t* packet)
+{
+  const FWPS_STREAM_DATA* streamData;
+
+  if (!FillTuple(inFixedValues, packet)) {
+    return FALSE;
+  }
 
-        memcpy(packet->payload, payload, packet->payloadlen);
+  packet->flags = 0;
 
-        break;
+  /* Stream layer? (the datagrams are filled by FillDatagrams()) */
+  if ((layerData) &&
+      ((inFixedValues->layerId == FWPS_LAYER_STREAM_V4) ||
+       (inFixedValues->layerId == FWPS_LAYER_STREAM_V6))) {
+    streamData = ((FWPS_STREAM_CALLOUT_IO_PACKET0*) layerData)->streamData;
+    if (!streamData) {
+      return FALSE;
+    }
+
+    if (!FillPayload(NET_BUFFER_LIST_FIRST_NB(streamData->netBufferListChain),
+                     TRANSPORT_TCP,
+                     packet)) {
+      return FALSE;
     }
   } else {
+    /* Connection closed: there is no payload to look at. */
+    if ((packet->protocol = (UINT8) GetProtocolForPort(packet->remote_port)) ==
+        PROTOCOL_UNKNOWN) {
+      return FALSE;
+    }
+
     packet->payloadlen = 0;
   }
 
@@ -138,6 +272,55 @@ static BOOL FillPacket(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
   return TRUE;
 }
 
+static unsigned FillDatagrams(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
+                              _In_ NET_BUFFER_LIST* nbl,
+                              _Inout_ packet_t** packets,
+                              _In_ unsigned count)
+{
+  packet_t tuple;
+  NET_BUFFER* nb;
+  packet_t* packet;
+  unsigned used;
+
+  /* All the datagrams of the chain have the same addresses and ports. */
+  if (!FillTuple(inFixedValues, &tuple)) {
+    return 0;
+  }
+
+  tuple.flags = 0;
+
+  KeQuerySystemTime(&tuple.timestamp);
+
+  used = 0;
+
+  for (; (nbl) && (used < count); nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+    for (nb = NET_BUFFER_LIST_FIRST_NB(nbl);
+         (nb) && (used < count);
+         nb = NET_BUFFER_NEXT_NB(nb)) {
+      packet = packets[used];
+
+      memcpy(packet, &tuple, offsetof(packet_t, payload));
+
+      /* If the datagram is ignored, the packet is used for the next one. */
+      if (FillPayload(nb, TRANSPORT_UDP, packet)) {
+        /* DNS response without query? */
+        if ((packet->protocol == PROTOCOL_DNS) &&
+            (!MatchDnsResponse(packet))) {
+          packet->flags |= PACKET_FLAG_UNSOLICITED;
+
+          if (settings.drop_unsolicited) {
+            continue;
+          }
+        }
+
+        used++;
+      }
+    }
+  }
+
+  return used;
+}
+
 
 /*******************************************************************************
  *******************************************************************************
@@ -172,25 +355,83 @@ void StreamClassify(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
                     _In_ UINT64 flowContext,
                     _Inout_ FWPS_CLASSIFY_OUT* classifyOut)
 {
+  FWPS_STREAM_CALLOUT_IO_PACKET0* pkt;
   packet_t* packet;
-
-  UNREFERENCED_PARAMETER(inMetaValues);
+  BOOL more;
 
 #if(NTDDI_VERSION >= NTDDI_WIN7)
   UNREFERENCED_PARAMETER(classifyContext);
 #endif
 
-  UNREFERENCED_PARAMETER(filter);
-  UNREFERENCED_PARAMETER(flowContext);
-
 #if DEBUG
   DbgPrint("StreamClassify()");
 #endif
 
+  InterlockedIncrement64(&classify_stats.stream);
+
+  pkt = (FWPS_STREAM_CALLOUT_IO_PACKET0*) layerData;
+
+  more = FALSE;
+
+  /* Following this connection? */
+  if (flowContext != 0) {
+    if (IsDnsFlow((void*) (ULONG_PTR) flowContext)) {
+      more = ContinueDnsFlow((dns_flow_t*) (ULONG_PTR) flowContext,
+                             pkt->streamData);
+    } else if (IsTlsFlow((void*) (ULONG_PTR) flowContext)) {
+      more = ContinueTlsFlow((tls_flow_t*) (ULONG_PTR) flowContext,
+                             pkt->streamData);
+    } else {
+      more = ContinueHttpFlow((http_flow_t*) (ULONG_PTR) flowContext,
+                              pkt->streamData);
+    }
+
   /* Get packet from the packet pool. */
-  if ((packet = PopPacket()) != NULL) {
+  } else if ((packet = PopPacket()) != NULL) {
     if (FillPacket(inFixedValues, layerData, packet)) {
-      if (!GivePacketToWorkerThread(packet)) {
+      /* DNS over TCP: the query is not logged, the responses are followed. */
+      if (packet->protocol == PROTOCOL_DNS_TCP) {
+        more = StartDnsFlow(inFixedValues, inMetaValues, filter, packet);
+
+        /* Return packet to packet pool. */
+        PushPacket(packet);
+
+      /* Follow the connection if every request has to be logged or the
+       * request header doesn't fit in the first segment (the records are
+       * only built from whole request headers).
+       */
+      } else if ((packet->protocol == PROTOCOL_HTTP) &&
+                 ((HttpFlowsKeepAlive()) ||
+                  (((packet->flags & PACKET_FLAG_RECORD) == 0) &&
+                   ((packet->payloadlen < pkt->streamData->dataLength) ||
+                    (FindEndOfHttpHeader(packet->payload,
+                                         packet->payloadlen,
+                                         0) == 0)))) &&
+                 (StartHttpFlow(inFixedValues,
+                                inMetaValues,
+                                filter,
+                                pkt->streamData,
+                                packet,
+                                &more))) {
+        /* Return packet to packet pool. */
+        PushPacket(packet);
+
+      /* Follow the connection if the first TLS record (the ClientHello,
+       * with the server name and what the fingerprint is computed from)
+       * doesn't fit in the first segment.
+       */
+      } else if ((packet->protocol == PROTOCOL_TLS) &&
+                 (GetTlsRecordSize(packet->payload, packet->payloadlen) >
+                  packet->payloadlen) &&
+                 (StartTlsFlow(inFixedValues,
+                               inMetaValues,
+                               filter,
+                               pkt->streamData,
+                               packet,
+                               &more))) {
+        /* Return packet to packet pool. */
+        PushPacket(packet);
+      } else if (!GivePacketToWorkerThread(packet)) {
         /* Return packet to packet pool. */
         PushPacket(packet);
       }
@@ -200,19 +441,492 @@ void StreamClassify(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
     }
   }
 
-  FWPS_STREAM_CALLOUT_IO_PACKET0* pkt =
-                                  (FWPS_STREAM_CALLOUT_IO_PACKET0*) layerData;
+  /* Keep getting the data of the connection only while it is followed. */
+  pkt->streamAction = more ? FWPS_STREAM_ACTION_NONE :
+                             FWPS_STREAM_ACTION_ALLOW_CONNECTION;
 
-  /* If we want to get all the data, use:
-   * pkt-> streamAction = FWP_ACTION_CONTINUE;
-   */
-  pkt->streamAction = FWPS_STREAM_ACTION_ALLOW_CONNECTION;
   pkt->countBytesEnforced = 0;
   pkt->countBytesRequired = 0;
 
   classifyOut->actionType = FWP_ACTION_CONTINUE;
 }
 
+void StreamFlowDelete(_In_ UINT16 layerId,
+                      _In_ UINT32 calloutId,
+                      _In_ UINT64 flowContext)
+{
+  UNREFERENCED_PARAMETER(layerId);
+  UNREFERENCED_PARAMETER(calloutId);
+
+  /* If the connection was closed before the end of the request header (or of
+   * the DNS message or of the TLS record), the partial data is discarded.
+   */
+  if (IsDnsFlow((void*) (ULONG_PTR) flowContext)) {
+    DeleteDnsFlow((dns_flow_t*) (ULONG_PTR) flowContext);
+  } else if (IsTlsFlow((void*) (ULONG_PTR) flowContext)) {
+    DeleteTlsFlow((tls_flow_t*) (ULONG_PTR) flowContext);
+  } else {
+    DeleteHttpFlow((http_flow_t*) (ULONG_PTR) flowContext);
+  }
+}
+
+BOOL StartHttpFlow(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
+                   _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+                   _In_ const FWPS_FILTER* filter,
+                   _In_ const FWPS_STREAM_DATA* streamData,
+                   _In_ const packet_t* packet,
+                   _Out_ BOOL* more)
+{
+  http_flow_t* flow;
+  unsigned requests;
+
+  if (!FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues,
+                                      FWPS_METADATA_FIELD_FLOW_HANDLE)) {
+    return FALSE;
+  }
+
+  /* Memory budget exhausted? */
+  if ((flow = NewHttpFlow(packet)) == NULL) {
+    return FALSE;
+  }
+
+  *more = FALSE;
+
+  /* Nothing left to follow after this segment? (e.g. the whole header is in
+   * the segment, in more than one net buffer or beyond the room of the
+   * packet).
+   */
+  if (!ProcessStream(streamData, FeedHttpFlow, flow)) {
+    requests = flow->requests;
+    DeleteHttpFlow(flow);
+
+    return (requests > 0);
+  }
+
+  flow->flow_id = inMetaValues->flowHandle;
+  flow->layer_id = inFixedValues->layerId;
+  flow->callout_id = filter->action.calloutId;
+
+  if (!NT_SUCCESS(FwpsFlowAssociateContext(flow->flow_id,
+                                           flow->layer_id,
+                                           flow->callout_id,
+                                           (UINT64) (ULONG_PTR) flow))) {
+    /* If no request has been logged, log the first segment. */
+    requests = flow->requests;
+    DeleteHttpFlow(flow);
+
+    return (requests > 0);
+  }
+
+  *more = TRUE;
+  return TRUE;
+}
+
+BOOL ContinueHttpFlow(_In_ http_flow_t* flow,
+                      _In_ const FWPS_STREAM_DATA* streamData)
+{
+  /* Already finished (the context is being removed)? */
+  if (flow->state == HTTP_FLOW_DONE) {
+    return FALSE;
+  }
+
+  if (streamData) {
+    /* Ignore the inbound data. */
+    if ((streamData->flags & FWPS_STREAM_FLAG_SEND) == 0) {
+      return TRUE;
+    }
+
+    /* Until the client closes its side of the connection. */
+    if ((ProcessStream(streamData, FeedHttpFlow, flow)) &&
+        ((streamData->flags & FWPS_STREAM_FLAG_SEND_DISCONNECT) == 0)) {
+      return TRUE;
+    }
+  }
+
+  /* Log the partial request header (if any). */
+  if ((flow->packet) && (flow->packet->payloadlen > 0)) {
+    EndHttpFlow(flow);
+  }
+
+  flow->state = HTTP_FLOW_DONE;
+
+  /* The flow context is returned to the pool by StreamFlowDelete(). */
+  FwpsFlowRemoveContext(flow->flow_id, flow->layer_id, flow->callout_id);
+
+  return FALSE;
+}
+
+void EndHttpFlow(_In_ http_flow_t* flow)
+{
+  packet_t* packet;
+
+  packet = TakeHttpFlowPacket(flow);
+
+  if (!GivePacketToWorkerThread(packet)) {
+    /* Return packet to the request header pool. */
+    ReleaseHttpFlowPacket(packet);
+  }
+}
+
+BOOL FeedHttpFlow(_In_ void* flow,
+                  _In_ const UINT8* data,
+                  _In_ SIZE_T len)
+{
+  http_flow_t* http_flow;
+  SIZE_T n;
+  BOOL complete;
+
+  http_flow = (http_flow_t*) flow;
+
+  while (len > 0) {
+    if (http_flow->state == HTTP_FLOW_DONE) {
+      return FALSE;
+    }
+
+    /* Beginning of a request header? */
+    if ((http_flow->state == HTTP_FLOW_HEADER) && (!http_flow->packet)) {
+      /* Stop following the connection if the memory budget is exhausted. */
+      if (!AttachHttpFlowPacket(http_flow)) {
+        http_flow->state = HTTP_FLOW_DONE;
+        return FALSE;
+      }
+
+      KeQuerySystemTime(&http_flow->packet->timestamp);
+    }
+
+    n = ConsumeHttpFlowData(http_flow, data, len, &complete);
+
+    if (complete) {
+      EndHttpFlow(http_flow);
+    }
+
+    data += n;
+    len -= n;
+  }
+
+  return (http_flow->state != HTTP_FLOW_DONE);
+}
+
+BOOL StartDnsFlow(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
+                  _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+                  _In_ const FWPS_FILTER* filter,
+                  _In_ const packet_t* packet)
+{
+  dns_flow_t* flow;
+
+  if (!FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues,
+                                      FWPS_METADATA_FIELD_FLOW_HANDLE)) {
+    return FALSE;
+  }
+
+  /* Memory budget exhausted? */
+  if ((flow = NewDnsFlow(packet)) == NULL) {
+    return FALSE;
+  }
+
+  flow->flow_id = inMetaValues->flowHandle;
+  flow->layer_id = inFixedValues->layerId;
+  flow->callout_id = filter->action.calloutId;
+
+  if (!NT_SUCCESS(FwpsFlowAssociateContext(flow->flow_id,
+                                           flow->layer_id,
+                                           flow->callout_id,
+                                           (UINT64) (ULONG_PTR) flow))) {
+    DeleteDnsFlow(flow);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+BOOL ContinueDnsFlow(_In_ dns_flow_t* flow,
+                     _In_ const FWPS_STREAM_DATA* streamData)
+{
+  /* Already finished (the context is being removed)? */
+  if (flow->state == DNS_FLOW_DONE) {
+    return FALSE;
+  }
+
+  if (streamData) {
+    /* Ignore the outbound data (queries). */
+    if ((streamData->flags & FWPS_STREAM_FLAG_RECEIVE) == 0) {
+      return TRUE;
+    }
+
+    /* Until the server closes its side of the connection. */
+    if ((ProcessStream(streamData, FeedDnsFlow, flow)) &&
+        ((streamData->flags & FWPS_STREAM_FLAG_RECEIVE_DISCONNECT) == 0)) {
+      return TRUE;
+    }
+  }
+
+  /* Log the partial message (if any): the complete answers are still
+   * added to the DNS cache.
+   */
+  if ((flow->packet) && (flow->packet->payloadlen > 0)) {
+    EndDnsFlow(flow);
+  }
+
+  flow->state = DNS_FLOW_DONE;
+
+  /* The flow context is returned to the pool by StreamFlowDelete(). */
+  FwpsFlowRemoveContext(flow->flow_id, flow->layer_id, flow->callout_id);
+
+  return FALSE;
+}
+
+void EndDnsFlow(_In_ dns_flow_t* flow)
+{
+  packet_t* packet;
+
+  packet = TakeDnsFlowPacket(flow);
+
+  if (!GivePacketToWorkerThread(packet)) {
+    /* Return packet to the message pool. */
+    ReleaseDnsFlowPacket(packet);
+  }
+}
+
+BOOL FeedDnsFlow(_In_ void* flow,
+                 _In_ const UINT8* data,
+                 _In_ SIZE_T len)
+{
+  dns_flow_t* dns_flow;
+  SIZE_T n;
+  BOOL complete;
+
+  dns_flow = (dns_flow_t*) flow;
+
+  while (len > 0) {
+    if (dns_flow->state == DNS_FLOW_DONE) {
+      return FALSE;
+    }
+
+    /* Beginning of a message? */
+    if ((dns_flow->state == DNS_FLOW_MESSAGE) && (!dns_flow->packet)) {
+      /* Stop following the connection if the memory budget is exhausted. */
+      if (!AttachDnsFlowPacket(dns_flow)) {
+        dns_flow->state = DNS_FLOW_DONE;
+        return FALSE;
+      }
+
+      KeQuerySystemTime(&dns_flow->packet->timestamp);
+    }
+
+    n = ConsumeDnsFlowData(dns_flow, data, len, &complete);
+
+    if (complete) {
+      EndDnsFlow(dns_flow);
+    }
+
+    data += n;
+    len -= n;
+  }
+
+  return (dns_flow->state != DNS_FLOW_DONE);
+}
+
+BOOL StartTlsFlow(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
+                  _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+                  _In_ const FWPS_FILTER* filter,
+                  _In_ const FWPS_STREAM_DATA* streamData,
+                  _In_ const packet_t* packet,
+                  _Out_ BOOL* more)
+{
+  tls_flow_t* flow;
+  unsigned records;
+
+  if (!FWPS_IS_METADATA_FIELD_PRESENT(inMetaValues,
+                                      FWPS_METADATA_FIELD_FLOW_HANDLE)) {
+    return FALSE;
+  }
+
+  /* Memory budget exhausted? */
+  if ((flow = NewTlsFlow(packet)) == NULL) {
+    return FALSE;
+  }
+
+  *more = FALSE;
+
+  /* Nothing left to follow after this segment? (the record is in the
+   * segment, in more than one net buffer or beyond the room of the packet).
+   */
+  if (!ProcessStream(streamData, FeedTlsFlow, flow)) {
+    records = flow->records;
+    DeleteTlsFlow(flow);
+
+    return (records > 0);
+  }
+
+  flow->flow_id = inMetaValues->flowHandle;
+  flow->layer_id = inFixedValues->layerId;
+  flow->callout_id = filter->action.calloutId;
+
+  if (!NT_SUCCESS(FwpsFlowAssociateContext(flow->flow_id,
+                                           flow->layer_id,
+                                           flow->callout_id,
+                                           (UINT64) (ULONG_PTR) flow))) {
+    /* Log the first segment. */
+    DeleteTlsFlow(flow);
+    return FALSE;
+  }
+
+  *more = TRUE;
+  return TRUE;
+}
+
+BOOL ContinueTlsFlow(_In_ tls_flow_t* flow,
+                     _In_ const FWPS_STREAM_DATA* streamData)
+{
+  /* Already finished (the context is being removed)? */
+  if (flow->state == TLS_FLOW_DONE) {
+    return FALSE;
+  }
+
+  if (streamData) {
+    /* Ignore the inbound data. */
+    if ((streamData->flags & FWPS_STREAM_FLAG_SEND) == 0) {
+      return TRUE;
+    }
+
+    /* Until the end of the record or until the client closes its side of
+     * the connection.
+     */
+    if ((ProcessStream(streamData, FeedTlsFlow, flow)) &&
+        ((streamData->flags & FWPS_STREAM_FLAG_SEND_DISCONNECT) == 0)) {
+      return TRUE;
+    }
+  }
+
+  /* Log the partial record (if any): the extensions before the end are
+   * still parsed.
+   */
+  if ((flow->packet) && (flow->packet->payloadlen > 0)) {
+    EndTlsFlow(flow);
+  }
+
+  flow->state = TLS_FLOW_DONE;
+
+  /* The flow context is returned to the pool by StreamFlowDelete(). */
+  FwpsFlowRemoveContext(flow->flow_id, flow->layer_id, flow->callout_id);
+
+  return FALSE;
+}
+
+void EndTlsFlow(_In_ tls_flow_t* flow)
+{
+  packet_t* packet;
+
+  packet = TakeTlsFlowPacket(flow);
+
+  if (!GivePacketToWorkerThread(packet)) {
+    /* Return packet to the record pool. */
+    ReleaseTlsFlowPacket(packet);
+  }
+}
+
+BOOL FeedTlsFlow(_In_ void* flow,
+                 _In_ const UINT8* data,
+                 _In_ SIZE_T len)
+{
+  tls_flow_t* tls_flow;
+  SIZE_T n;
+  BOOL complete;
+
+  tls_flow = (tls_flow_t*) flow;
+
+  while (len > 0) {
+    if (tls_flow->state == TLS_FLOW_DONE) {
+      return FALSE;
+    }
+
+    /* Beginning of the record? */
+    if (!tls_flow->packet) {
+      /* Stop following the connection if the memory budget is exhausted. */
+      if (!AttachTlsFlowPacket(tls_flow)) {
+        tls_flow->state = TLS_FLOW_DONE;
+        return FALSE;
+      }
+
+      KeQuerySystemTime(&tls_flow->packet->timestamp);
+    }
+
+    n = ConsumeTlsFlowData(tls_flow, data, len, &complete);
+
+    if (complete) {
+      EndTlsFlow(tls_flow);
+    }
+
+    data += n;
+    len -= n;
+  }
+
+  return (tls_flow->state != TLS_FLOW_DONE);
+}
+
+BOOL ProcessStream(_In_ const FWPS_STREAM_DATA* streamData,
+                   _In_ BOOL (*feed)(void* flow,
+                                     const UINT8* data,
+                                     SIZE_T len),
+                   _In_ void* flow)
+{
+  NET_BUFFER_LIST* nbl;
+  NET_BUFFER* nb;
+  MDL* mdl;
+  const UINT8* data;
+  SIZE_T remaining;
+  SIZE_T nbremaining;
+  SIZE_T offset;
+  SIZE_T len;
+
+  remaining = streamData->dataLength;
+
+  /* Walk the buffers of the stream data in place (the HTTP body is skipped
+   * without being copied).
+   */
+  for (nbl = streamData->netBufferListChain;
+       (nbl) && (remaining > 0);
+       nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+    for (nb = NET_BUFFER_LIST_FIRST_NB(nbl);
+         (nb) && (remaining > 0);
+         nb = NET_BUFFER_NEXT_NB(nb)) {
+      nbremaining = NET_BUFFER_DATA_LENGTH(nb);
+      offset = NET_BUFFER_CURRENT_MDL_OFFSET(nb);
+
+      for (mdl = NET_BUFFER_CURRENT_MDL(nb);
+           (mdl) && (nbremaining > 0) && (remaining > 0);
+           mdl = mdl->Next) {
+        if ((data = (const UINT8*) MmGetSystemAddressForMdlSafe(
+                                     mdl,
+                                     LowPagePriority | MdlMappingNoExecute
+                                   )) == NULL) {
+          return FALSE;
+        }
+
+        len = MmGetMdlByteCount(mdl) - offset;
+
+        if (len > nbremaining) {
+          len = nbremaining;
+        }
+
+        if (len > remaining) {
+          len = remaining;
+        }
+
+        if (!feed(flow, data + offset, len)) {
+          return FALSE;
+        }
+
+        nbremaining -= len;
+        remaining -= len;
+        offset = 0;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
 
 /*******************************************************************************
  *******************************************************************************
@@ -247,7 +961,11 @@ void DatagramClassify(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
                       _In_ UINT64 flowContext,
                       _Inout_ FWPS_CLASSIFY_OUT* classifyOut)
 {
-  packet_t* packet;
+  packet_t* packets[MAX_DATAGRAMS];
+  NET_BUFFER_LIST* nbl;
+  NET_BUFFER* nb;
+  unsigned count;
+  unsigned used;
 
 #if(NTDDI_VERSION >= NTDDI_WIN7)
   UNREFERENCED_PARAMETER(classifyContext);
@@ -260,6 +978,8 @@ void DatagramClassify(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
   DbgPrint("DatagramClassify()");
 #endif
 
+  InterlockedIncrement64(&classify_stats.datagram);
+
   /* ipHeaderSize is not applicable to the outbound path at the
    * FWPS_LAYER_DATAGRAM_DATA_V4/FWPS_LAYER_DATAGRAM_DATA_V6
    * layers.
@@ -268,23 +988,99 @@ void DatagramClassify(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
         inMetaValues,
         FWPS_METADATA_FIELD_IP_HEADER_SIZE
       )) {
-    /* Get packet from the packet pool. */
-    if ((packet = PopPacket()) != NULL) {
-      if (FillPacket(inFixedValues, layerData, packet)) {
-        if (!GivePacketToWorkerThread(packet)) {
-          /* Return packet to packet pool. */
-          PushPacket(packet);
-        }
-      } else {
-        /* Return packet to packet pool. */
-        PushPacket(packet);
+    /* The stack might indicate a chain of datagrams: count them. */
+    count = 0;
+
+    for (nbl = (NET_BUFFER_LIST*) layerData;
+         (nbl) && (count < MAX_DATAGRAMS);
+         nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+      for (nb = NET_BUFFER_LIST_FIRST_NB(nbl);
+           (nb) && (count < MAX_DATAGRAMS);
+           nb = NET_BUFFER_NEXT_NB(nb)) {
+        count++;
+      }
+    }
+
+    /* Get packets from the packet pool. */
+    if ((count > 0) && ((count = PopPackets(packets, count)) > 0)) {
+      used = FillDatagrams(inFixedValues,
+                           (NET_BUFFER_LIST*) layerData,
+                           packets,
+                           count);
+
+      if (used > 0) {
+        used = GivePacketsToWorkerThread(packets, used);
+      }
+
+      /* Return the packets which were not used to packet pool. */
+      if (used < count) {
+        PushPackets(packets + used, count - used);
       }
     }
+  } else if ((layerData) && (DnsQueriesTracked())) {
+    /* Outbound: record the DNS queries to match the responses. */
+    RecordDnsQuery(inFixedValues, inMetaValues, (NET_BUFFER_LIST*) layerData);
   }
 
   classifyOut->actionType = FWP_ACTION_CONTINUE;
 }
 
+void RecordDnsQuery(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
+                    _In_ const FWPS_INCOMING_METADATA_VALUES* inMetaValues,
+                    _In_ NET_BUFFER_LIST* nbl)
+{
+  UINT8 storage[UDP_HEADER_LEN + MAX_DNS_QUESTION_LEN];
+  packet_t tuple;
+  NET_BUFFER* nb;
+  const UINT8* data;
+  ULONG offset;
+  ULONG len;
+
+  if (!FillTuple(inFixedValues, &tuple)) {
+    return;
+  }
+
+  /* The outbound data begins with the transport header. */
+  offset = FWPS_IS_METADATA_FIELD_PRESENT(
+             inMetaValues,
+             FWPS_METADATA_FIELD_TRANSPORT_HEADER_SIZE
+           ) ? inMetaValues->transportHeaderSize : UDP_HEADER_LEN;
+
+  if (offset > UDP_HEADER_LEN) {
+    return;
+  }
+
+  for (; nbl; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+    for (nb = NET_BUFFER_LIST_FIRST_NB(nbl); nb; nb = NET_BUFFER_NEXT_NB(nb)) {
+      /* Only the header and the question are needed. */
+      len = (nb->DataLength < sizeof(storage)) ? nb->DataLength :
+                                                 sizeof(storage);
+
+      if (len <= offset) {
+        continue;
+      }
+
+      /* Get pointer to the datagram (if the data is not contiguous, it is
+       * gathered in 'storage').
+       */
+      if ((data = NdisGetDataBuffer(nb, len, storage, 1, 0)) == NULL) {
+        continue;
+      }
+
+      data += offset;
+      len -= offset;
+
+      if (IsDnsQuery(data, len)) {
+        AddDnsQuery(tuple.ip_version,
+                    tuple.remote_ip,
+                    tuple.local_port,
+                    data,
+                    len);
+      }
+    }
+  }
+}
+
 
 /*******************************************************************************
  *******************************************************************************
@@ -334,6 +1130,8 @@ void AleClosureClassify(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
   DbgPrint("AleClosureClassify()");
 #endif
 
+  InterlockedIncrement64(&classify_stats.closure);
+
   /* Get packet from the packet pool. */
   if ((packet = PopPacket()) != NULL) {
     if (FillPacket(inFixedValues, layerData, packet)) {
@@ -349,3 +1147,21 @@ void AleClosureClassify(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
 
   classifyOut->actionType = FWP_ACTION_CONTINUE;
 }
+
+void InitInspect(unsigned max_packet_size,
+                 BOOL capture_records,
+                 BOOL drop_unsolicited)
+{
+  settings.max_payload_size =
+    (ULONG) (max_packet_size - offsetof(packet_t, payload));
+
+  settings.capture_records = capture_records;
+  settings.drop_unsolicited = drop_unsolicited;
+}
+
+void GetClassifyStats(_Out_ classify_stats_t* stats)
+{
+  stats->stream = classify_stats.stream;
+  stats->datagram = classify_stats.datagram;
+  stats->closure = classify_stats.closure;
+}
@@ -1,9 +1,146 @@
 #ifndef INSPECT_H
 #define INSPECT_H
 
+/* The settings below are the defaults: each of them can be overridden by a
+ * value of the 'Parameters' registry key of the service (its name is between
+ * brackets, see config.c).
+ */
+
+/* Packets of the packet pool, which is shared by the callouts and the worker
+ * thread [MaxPackets, MaxPacketSize].
+ */
 #define MAX_PACKETS 1000
 #define MAX_PACKET_SIZE 1800
 
+/* The payloads of the dissectors which can be pre-parsed (HTTP requests,
+ * DNS responses) are captured as compact records built at classify time:
+ * the method, the path and the known headers of the HTTP requests and the
+ * DNS responses up to the end of the answers. Otherwise, the payload is
+ * copied as is (up to the capture length of the dissector)
+ * [CaptureRecords].
+ */
+#define CAPTURE_RECORDS 1
+
+/* Back the packet pool and the DNS cache with large pages (when the
+ * allocations are big enough) [LargePages].
+ */
+#define USE_LARGE_PAGES 1
+
+/* Interval at which the statistics are written to the log file
+ * (0: never) [StatsEveryMs].
+ */
+#define LOG_STATS_EVERY_MS (60 * 1000)
+
+/* Log file (NT path) [LogFile], size of its buffer [LogBufferSize] and
+ * interval at which the buffer is written to the file [FlushLogsEveryMs].
+ */
+#define LOG_FILE L"\\DosDevices\\C:\\inspect.log"
+#define LOG_BUFFER_SIZE (8 * 1024)
+#define FLUSH_LOGS_EVERY_MS 1000
+
+/* DNS cache: number of buckets [DnsBuckets] and entries [DnsEntries] of the
+ * IPv4 and IPv6 tables.
+ */
+#define DNS_BUCKETS 127
+#define DNS_ENTRIES 1000
+
+/* The TCP connections to the ports of the dissectors (dissector.c, the
+ * ports can be replaced with [HTTPPorts], [HTTPSPorts] and [DNSPorts]) are
+ * inspected. The protocol of a connection is detected from its first
+ * outbound bytes, not from the port, so HTTP on 8443 is logged as such and
+ * the connections which don't match any dissector are ignored. If
+ * INSPECT_ALL_TCP_PORTS is set, every TCP connection is inspected
+ * [InspectAllTcpPorts].
+ */
+#define INSPECT_ALL_TCP_PORTS 0
+
+/* The filters only let through to the callouts the traffic which might be
+ * inspected: the ports of the dissectors (see INSPECT_ALL_TCP_PORTS), TCP
+ * or UDP, the inbound datagrams (and the outbound DNS queries, see
+ * DNS_MAX_QUERIES) and, unless INSPECT_LOOPBACK is set, not the loopback
+ * traffic [InspectLoopback].
+ */
+#define INSPECT_LOOPBACK 0
+
+/* The traffic with the hosts of these subnets (e.g. the local networks) is
+ * not inspected: the filter engine permits it before the callouts are
+ * invoked. IPv4 and IPv6 subnets in CIDR notation separated by spaces or
+ * commas, at most 16 of each, e.g. "10.0.0.0/8, 192.168.0.0/16, fd00::/8"
+ * [ExcludedSubnets].
+ */
+#define EXCLUDED_SUBNETS ""
+
+/* Reassembly of HTTP request headers which don't fit in the first segment:
+ * the connection is followed until the end of the header or
+ * HTTP_MAX_HEADER_SIZE bytes. At most HTTP_MAX_FLOWS connections are
+ * followed and HTTP_MAX_HEADERS request headers are reassembled at the same
+ * time, the other connections are truncated as usual (0: disabled)
+ * [HttpMaxFlows, HttpMaxHeaders, HttpMaxHeaderSize].
+ */
+#define HTTP_MAX_FLOWS 0
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_HEADER_SIZE (8 * 1024)
+
+/* Follow every HTTP connection until it is closed (skipping the request
+ * bodies) and log all the requests, not only the first one (requires
+ * HTTP_MAX_FLOWS > 0) [HttpKeepAlive].
+ */
+#define HTTP_KEEP_ALIVE 0
+
+/* Headers which are added to the HTTP log records besides Host (part of the
+ * URL): the sum of User-Agent 2, Referer 4, Content-Type 8,
+ * Content-Length 16, Upgrade 32 and Transfer-Encoding 64 (bit n is the
+ * header n of http_header_t) [HttpLogHeaders].
+ */
+#define HTTP_LOG_HEADERS (2 | 4 | 8 | 16 | 32)
+
+/* DNS over TCP (used when the response doesn't fit in a UDP datagram): the
+ * connections are followed until they are closed and the inbound messages
+ * (preceded by their 2-byte length) are reassembled up to
+ * DNS_TCP_MAX_MESSAGE_SIZE bytes (only the answers which fit are added to
+ * the DNS cache). At most DNS_TCP_MAX_FLOWS connections are followed and
+ * DNS_TCP_MAX_MESSAGES messages are reassembled at the same time
+ * (0: disabled) [DnsTcpMaxFlows, DnsTcpMaxMessages, DnsTcpMaxMessageSize].
+ */
+#define DNS_TCP_MAX_FLOWS 32
+#define DNS_TCP_MAX_MESSAGES 16
+#define DNS_TCP_MAX_MESSAGE_SIZE (16 * 1024)
+
+/* Reassembly of TLS ClientHellos which don't fit in the first segment (the
+ * server name and the fingerprint are taken from the whole ClientHello):
+ * the connection is followed until the end of the first record of the
+ * client or TLS_MAX_RECORD_SIZE bytes (header included). At most
+ * TLS_MAX_FLOWS connections are followed and TLS_MAX_RECORDS records are
+ * reassembled at the same time, the other ClientHellos are truncated as
+ * usual (0: disabled) [TlsMaxFlows, TlsMaxRecords, TlsMaxRecordSize]. A
+ * truncated ClientHello, or one spanning several records, has no JA3
+ * fingerprint.
+ */
+#define TLS_MAX_FLOWS 32
+#define TLS_MAX_RECORDS 16
+#define TLS_MAX_RECORD_SIZE (8 * 1024)
+
+/* The outbound DNS queries over UDP are recorded (at most DNS_MAX_QUERIES,
+ * a power of 2, during DNS_QUERY_TIMEOUT_MS) to match the responses with
+ * them: the latency of each resolver is added to the statistics and the
+ * responses which don't match any query are unsolicited (0: disabled).
+ * Unsolicited responses are dropped if DNS_DROP_UNSOLICITED is set,
+ * otherwise they are flagged in the log file (and added to the DNS cache)
+ * [DnsMaxQueries, DnsQueryTimeoutMs, DnsDropUnsolicited].
+ */
+#define DNS_MAX_QUERIES 1024
+#define DNS_QUERY_TIMEOUT_MS (5 * 1000)
+#define DNS_DROP_UNSOLICITED 0
+
+/* Number of invocations of the classify functions (the traffic which the
+ * filters let through).
+ */
+typedef struct {
+  LONG64 stream;
+  LONG64 datagram;
+  LONG64 closure;
+} classify_stats_t;
+
 NTSTATUS StreamNotify(_In_ FWPS_CALLOUT_NOTIFY_TYPE notifyType,
                       _In_ const GUID* filterKey,
                       _Inout_ const FWPS_FILTER* filter);
@@ -18,6 +155,10 @@ void StreamClassify(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
                     _In_ UINT64 flowContext,
                     _Inout_ FWPS_CLASSIFY_OUT* classifyOut);
 
+void StreamFlowDelete(_In_ UINT16 layerId,
+                      _In_ UINT32 calloutId,
+                      _In_ UINT64 flowContext);
+
 NTSTATUS DatagramNotify(_In_ FWPS_CALLOUT_NOTIFY_TYPE notifyType,
                         _In_ const GUID* filterKey,
                         _Inout_ const FWPS_FILTER* filter);
@@ -46,4 +187,14 @@ void AleClosureClassify(_In_ const FWPS_INCOMING_VALUES* inFixedValues,
                         _In_ UINT64 flowContext,
                         _Inout_ FWPS_CLASSIFY_OUT* classifyOut);
 
+/* Settings of the classify functions (before the callouts are registered,
+ * and again with the same 'max_packet_size' when the configuration is
+ * reloaded).
+ */
+void InitInspect(unsigned max_packet_size,
+                 BOOL capture_records,
+                 BOOL drop_unsolicited);
+
+void GetClassifyStats(_Out_ classify_stats_t* stats);
+
 #endif /* INSPECT_H */
@@ -0,0 +1,15 @@
+#ifndef INSPECT_IOCTL_H
+#define INSPECT_IOCTL_H
+
+/* Shared with the user mode tools (include <winioctl.h> before). */
+
+#define INSPECT_DEVICE_NAME L"\\Device\\inspect"
+#define INSPECT_SYMBOLIC_LINK L"\\DosDevices\\inspect"
+
+/* Read the 'Parameters' registry key again and apply the settings which can
+ * be changed while the driver runs (no input or output buffer).
+ */
+#define IOCTL_INSPECT_RELOAD_CONFIG \
+  CTL_CODE(FILE_DEVICE_NETWORK, 0x800, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#endif /* INSPECT_IOCTL_H */
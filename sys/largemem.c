@@ -0,0 +1,89 @@
+#include <ntddk.h>
+#include "largemem.h"
+
+#define TAG '1gaT'
+
+/* Don't round up allocations smaller than half a large page: more than
+ * half of the memory would be wasted.
+ */
+#define MIN_LARGE_PAGES_SIZE (LARGE_PAGE_SIZE / 2)
+
+BOOL AllocMemory(memory_t* mem, SIZE_T size, BOOL large_pages)
+{
+  PHYSICAL_ADDRESS lowest;
+  PHYSICAL_ADDRESS highest;
+  PHYSICAL_ADDRESS skip;
+  SIZE_T rounded;
+  MDL* mdl;
+
+  if ((large_pages) && (size >= MIN_LARGE_PAGES_SIZE)) {
+    /* Physical memory in chunks of the large page size from the large page
+     * cache of the memory manager, so that each chunk is mapped with a
+     * large page (not executable). Systems which don't support
+     * MM_ALLOCATE_FAST_LARGE_PAGES fail the allocation and the non-paged
+     * pool is used instead.
+     */
+    rounded = (size + LARGE_PAGE_SIZE - 1) & ~((SIZE_T) LARGE_PAGE_SIZE - 1);
+
+    lowest.QuadPart = 0;
+    highest.QuadPart = -1;
+    skip.QuadPart = LARGE_PAGE_SIZE;
+
+    if ((mdl = MmAllocatePagesForMdlEx(lowest,
+                                       highest,
+                                       skip,
+                                       rounded,
+                                       MmCached,
+                                       MM_ALLOCATE_FAST_LARGE_PAGES |
+                                       MM_ALLOCATE_REQUIRE_CONTIGUOUS_CHUNKS |
+                                       MM_ALLOCATE_FULLY_REQUIRED))
+        != NULL) {
+      if (MmGetMdlByteCount(mdl) == rounded) {
+        if ((mem->ptr = MmMapLockedPagesSpecifyCache(
+                          mdl,
+                          KernelMode,
+                          MmCached,
+                          NULL,
+                          FALSE,
+                          NormalPagePriority | MdlMappingNoExecute
+                        )) != NULL) {
+          mem->size = rounded;
+          mem->mdl = mdl;
+          mem->large_pages = TRUE;
+
+          return TRUE;
+        }
+      }
+
+      MmFreePagesFromMdl(mdl);
+      ExFreePool(mdl);
+    }
+  }
+
+  if ((mem->ptr = ExAllocatePoolWithTag(NonPagedPool, size, TAG)) == NULL) {
+    return FALSE;
+  }
+
+  mem->size = size;
+  mem->mdl = NULL;
+  mem->large_pages = FALSE;
+
+  return TRUE;
+}
+
+void FreeMemory(memory_t* mem)
+{
+  if (mem->ptr) {
+    if (mem->large_pages) {
+      MmUnmapLockedPages(mem->ptr, mem->mdl);
+      MmFreePagesFromMdl(mem->mdl);
+      ExFreePool(mem->mdl);
+
+      mem->mdl = NULL;
+    } else {
+      ExFreePoolWithTag(mem->ptr, TAG);
+    }
+
+    mem->ptr = NULL;
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef LARGEMEM_H
+#define LARGEMEM_H
+
+#pragma warning(push)
+#pragma warning(disable:4201) /* Unnamed struct/union. */
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+typedef struct {
+  void* ptr;
+  SIZE_T size;
+
+  /* Physical pages (large pages only). */
+  MDL* mdl;
+
+  BOOL large_pages;
+} memory_t;
+
+/* Allocate non-paged memory, backed by large pages if 'large_pages' is TRUE,
+ * the allocation is big enough and the memory manager can allocate them
+ * (MM_ALLOCATE_FAST_LARGE_PAGES, the mapping is not executable). Otherwise,
+ * fall back to the non-paged pool.
+ */
+BOOL AllocMemory(memory_t* mem, SIZE_T size, BOOL large_pages);
+void FreeMemory(memory_t* mem);
+
+#endif /* LARGEMEM_H */
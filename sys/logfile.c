@@ -6,8 +6,6 @@
 #define MIN_REMAINING 512
 #define TAG '1gaT'
 
-#define LOG_FILE L"inspect.log"
-
 #define WRITE_TO_FILE 1
 
 #if WRITE_TO_FILE
@@ -20,77 +18,79 @@
   } logfile_t;
 
   static logfile_t logfile;
+
+  static NTSTATUS OpenFile(logfile_t* file, const WCHAR* path, SIZE_T size);
+  static void CloseFile(logfile_t* file);
+  static BOOL FlushFile(logfile_t* file);
 #endif /* WRITE_TO_FILE */
 
-NTSTATUS OpenLogFile(SIZE_T log_buffer_size)
+NTSTATUS OpenLogFile(const WCHAR* path, SIZE_T log_buffer_size)
 {
 #if WRITE_TO_FILE
-  UNICODE_STRING name;
-  OBJECT_ATTRIBUTES attr;
-  IO_STATUS_BLOCK io_status_block;
-  NTSTATUS status;
-
-  if (log_buffer_size < MIN_LOG_BUFFER_SIZE) {
-    log_buffer_size = MIN_LOG_BUFFER_SIZE;
-  }
-
-  if ((logfile.buf = (char*) ExAllocatePoolWithTag(NonPagedPool,
-                                                   log_buffer_size,
-                                                   TAG)) == NULL) {
-    return STATUS_NO_MEMORY;
-  }
+  return OpenFile(&logfile, path, log_buffer_size);
+#else
+  UNREFERENCED_PARAMETER(path);
+  UNREFERENCED_PARAMETER(log_buffer_size);
 
-  RtlInitUnicodeString(&name, L"\\DosDevices\\C:\\" LOG_FILE);
+  return STATUS_SUCCESS;
+#endif
+}
 
-  InitializeObjectAttributes(&attr,
-                             &name,
-                             OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-                             NULL,
-                             NULL);
+void CloseLogFile()
+{
+#if WRITE_TO_FILE
+  CloseFile(&logfile);
+#endif
+}
 
-  status = ZwCreateFile(&logfile.hFile,
-                        SYNCHRONIZE | FILE_APPEND_DATA,
-                        &attr,
-                        &io_status_block,
-                        NULL,
-                        FILE_ATTRIBUTE_NORMAL,
-                        FILE_SHARE_READ,
-                        FILE_OPEN_IF,
-                        FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE,
-                        NULL,
-                        0);
+NTSTATUS ReopenLogFile(const WCHAR* path, SIZE_T log_buffer_size)
+{
+#if WRITE_TO_FILE
+  logfile_t newfile;
+  NTSTATUS status;
 
+  status = OpenFile(&newfile, path, log_buffer_size);
   if (!NT_SUCCESS(status)) {
-    ExFreePoolWithTag(logfile.buf, TAG);
-    logfile.buf = NULL;
-
     return status;
   }
 
-  logfile.bufsize = log_buffer_size;
-  logfile.used = 0;
+  CloseFile(&logfile);
+
+  logfile = newfile;
 #else
+  UNREFERENCED_PARAMETER(path);
   UNREFERENCED_PARAMETER(log_buffer_size);
 #endif
 
   return STATUS_SUCCESS;
 }
 
-void CloseLogFile()
+BOOL ResizeLogBuffer(SIZE_T log_buffer_size)
 {
 #if WRITE_TO_FILE
-  if (logfile.buf) {
-    if (logfile.hFile) {
-      FlushLog();
+  char* buf;
 
-      ZwClose(logfile.hFile);
-      logfile.hFile = NULL;
-    }
+  if (log_buffer_size < MIN_LOG_BUFFER_SIZE) {
+    log_buffer_size = MIN_LOG_BUFFER_SIZE;
+  }
 
-    ExFreePoolWithTag(logfile.buf, TAG);
-    logfile.buf = NULL;
+  if ((buf = (char*) ExAllocatePoolWithTag(NonPagedPool,
+                                           log_buffer_size,
+                                           TAG)) == NULL) {
+    return FALSE;
   }
-#endif /* WRITE_TO_FILE */
+
+  FlushFile(&logfile);
+
+  ExFreePoolWithTag(logfile.buf, TAG);
+
+  logfile.buf = buf;
+  logfile.bufsize = log_buffer_size;
+#else
+  UNREFERENCED_PARAMETER(log_buffer_size);
+#endif
+
+  return TRUE;
 }
 
 BOOL Log(LARGE_INTEGER* system_time, const char* format, ...)
@@ -196,28 +196,101 @@ BOOL Log(LARGE_INTEGER* system_time, const char* format, ...)
 BOOL FlushLog()
 {
 #if WRITE_TO_FILE
+  return FlushFile(&logfile);
+#else
+  return TRUE;
+#endif
+}
+
+#if WRITE_TO_FILE
+NTSTATUS OpenFile(logfile_t* file, const WCHAR* path, SIZE_T size)
+{
+  UNICODE_STRING name;
+  OBJECT_ATTRIBUTES attr;
+  IO_STATUS_BLOCK io_status_block;
+  NTSTATUS status;
+
+  if (size < MIN_LOG_BUFFER_SIZE) {
+    size = MIN_LOG_BUFFER_SIZE;
+  }
+
+  if ((file->buf = (char*) ExAllocatePoolWithTag(NonPagedPool,
+                                                 size,
+                                                 TAG)) == NULL) {
+    return STATUS_NO_MEMORY;
+  }
+
+  RtlInitUnicodeString(&name, path);
+
+  InitializeObjectAttributes(&attr,
+                             &name,
+                             OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                             NULL,
+                             NULL);
+
+  status = ZwCreateFile(&file->hFile,
+                        SYNCHRONIZE | FILE_APPEND_DATA,
+                        &attr,
+                        &io_status_block,
+                        NULL,
+                        FILE_ATTRIBUTE_NORMAL,
+                        FILE_SHARE_READ,
+                        FILE_OPEN_IF,
+                        FILE_SYNCHRONOUS_IO_NONALERT |
+                          FILE_NON_DIRECTORY_FILE,
+                        NULL,
+                        0);
+
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(file->buf, TAG);
+    file->buf = NULL;
+
+    return status;
+  }
+
+  file->bufsize = size;
+  file->used = 0;
+
+  return STATUS_SUCCESS;
+}
+
+void CloseFile(logfile_t* file)
+{
+  if (file->buf) {
+    if (file->hFile) {
+      FlushFile(file);
+
+      ZwClose(file->hFile);
+      file->hFile = NULL;
+    }
+
+    ExFreePoolWithTag(file->buf, TAG);
+    file->buf = NULL;
+  }
+}
+
+BOOL FlushFile(logfile_t* file)
+{
   IO_STATUS_BLOCK io_status_block;
   NTSTATUS status;
 
   /* If the buffer is empty... */
-  if (logfile.used == 0) {
+  if (file->used == 0) {
     return TRUE;
   }
 
-  status = ZwWriteFile(logfile.hFile,
+  status = ZwWriteFile(file->hFile,
                        NULL,
                        NULL,
                        NULL,
                        &io_status_block,
-                       logfile.buf,
-                       logfile.used,
+                       file->buf,
+                       file->used,
                        NULL,
                        NULL);
 
-  logfile.used = 0;
+  file->used = 0;
 
   return (status == STATUS_SUCCESS);
-#else
-  return TRUE;
-#endif
 }
+#endif /* WRITE_TO_FILE */
@@ -8,9 +8,19 @@
 
 #pragma warning(pop)
 
-NTSTATUS OpenLogFile(SIZE_T log_buffer_size);
+/* 'path' is an NT path (e.g. L"\\DosDevices\\C:\\inspect.log"). */
+NTSTATUS OpenLogFile(const WCHAR* path, SIZE_T log_buffer_size);
 void CloseLogFile();
 
+/* Open another log file and close the current one after flushing it (if
+ * the new file can't be opened, the current one is kept). Called by the
+ * thread which logs, like ResizeLogBuffer().
+ */
+NTSTATUS ReopenLogFile(const WCHAR* path, SIZE_T log_buffer_size);
+
+/* Replace the buffer of the log file after flushing it. */
+BOOL ResizeLogBuffer(SIZE_T log_buffer_size);
+
 BOOL Log(LARGE_INTEGER* system_time, const char* format, ...);
 BOOL FlushLog();
 
@@ -0,0 +1,193 @@
+#include <ntddk.h>
+#include <string.h>
+#include "md5.h"
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define STEP(f, a, b, c, d, x, t, s)    \
+  (a) += f((b), (c), (d)) + (x) + (t);  \
+  (a) = ROTATE_LEFT((a), (s)) + (b);
+
+static void Transform(UINT32* state, const UINT8* block);
+
+__inline static UINT32 GetUint32(const UINT8* ptr)
+{
+  return (UINT32) ptr[0] |
+         ((UINT32) ptr[1] << 8) |
+         ((UINT32) ptr[2] << 16) |
+         ((UINT32) ptr[3] << 24);
+}
+
+__inline static void PutUint32(UINT8* ptr, UINT32 n)
+{
+  ptr[0] = (UINT8) n;
+  ptr[1] = (UINT8) (n >> 8);
+  ptr[2] = (UINT8) (n >> 16);
+  ptr[3] = (UINT8) (n >> 24);
+}
+
+void Md5Init(md5_t* ctx)
+{
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+
+  ctx->count = 0;
+}
+
+void Md5Update(md5_t* ctx, const void* data, SIZE_T len)
+{
+  const UINT8* ptr;
+  SIZE_T used;
+  SIZE_T n;
+
+  ptr = (const UINT8*) data;
+
+  used = (SIZE_T) (ctx->count & 63);
+  ctx->count += len;
+
+  /* Complete the buffered block. */
+  if (used > 0) {
+    n = 64 - used;
+
+    if (len < n) {
+      memcpy(ctx->buffer + used, ptr, len);
+      return;
+    }
+
+    memcpy(ctx->buffer + used, ptr, n);
+    Transform(ctx->state, ctx->buffer);
+
+    ptr += n;
+    len -= n;
+  }
+
+  /* Process the full blocks in place. */
+  for (; len >= 64; ptr += 64, len -= 64) {
+    Transform(ctx->state, ptr);
+  }
+
+  memcpy(ctx->buffer, ptr, len);
+}
+
+void Md5Final(md5_t* ctx, UINT8* digest)
+{
+  static const UINT8 padding[64] = {0x80};
+  UINT8 bits[8];
+  SIZE_T used;
+  unsigned i;
+
+  /* Length in bits (little-endian). */
+  for (i = 0; i < 8; i++) {
+    bits[i] = (UINT8) ((ctx->count << 3) >> (i * 8));
+  }
+
+  /* Pad up to 56 bytes (mod 64). */
+  used = (SIZE_T) (ctx->count & 63);
+  Md5Update(ctx, padding, (used < 56) ? (56 - used) : (120 - used));
+
+  Md5Update(ctx, bits, 8);
+
+  for (i = 0; i < 4; i++) {
+    PutUint32(digest + (i * 4), ctx->state[i]);
+  }
+}
+
+void Transform(UINT32* state, const UINT8* block)
+{
+  UINT32 x[16];
+  UINT32 a, b, c, d;
+  unsigned i;
+
+  for (i = 0; i < 16; i++) {
+    x[i] = GetUint32(block + (i * 4));
+  }
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+
+  /* Round 1. */
+  STEP(F, a, b, c, d, x[ 0], 0xd76aa478,  7)
+  STEP(F, d, a, b, c, x[ 1], 0xe8c7b756, 12)
+  STEP(F, c, d, a, b, x[ 2], 0x242070db, 17)
+  STEP(F, b, c, d, a, x[ 3], 0xc1bdceee, 22)
+  STEP(F, a, b, c, d, x[ 4], 0xf57c0faf,  7)
+  STEP(F, d, a, b, c, x[ 5], 0x4787c62a, 12)
+  STEP(F, c, d, a, b, x[ 6], 0xa8304613, 17)
+  STEP(F, b, c, d, a, x[ 7], 0xfd469501, 22)
+  STEP(F, a, b, c, d, x[ 8], 0x698098d8,  7)
+  STEP(F, d, a, b, c, x[ 9], 0x8b44f7af, 12)
+  STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17)
+  STEP(F, b, c, d, a, x[11], 0x895cd7be, 22)
+  STEP(F, a, b, c, d, x[12], 0x6b901122,  7)
+  STEP(F, d, a, b, c, x[13], 0xfd987193, 12)
+  STEP(F, c, d, a, b, x[14], 0xa679438e, 17)
+  STEP(F, b, c, d, a, x[15], 0x49b40821, 22)
+
+  /* Round 2. */
+  STEP(G, a, b, c, d, x[ 1], 0xf61e2562,  5)
+  STEP(G, d, a, b, c, x[ 6], 0xc040b340,  9)
+  STEP(G, c, d, a, b, x[11], 0x265e5a51, 14)
+  STEP(G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20)
+  STEP(G, a, b, c, d, x[ 5], 0xd62f105d,  5)
+  STEP(G, d, a, b, c, x[10], 0x02441453,  9)
+  STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14)
+  STEP(G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20)
+  STEP(G, a, b, c, d, x[ 9], 0x21e1cde6,  5)
+  STEP(G, d, a, b, c, x[14], 0xc33707d6,  9)
+  STEP(G, c, d, a, b, x[ 3], 0xf4d50d87, 14)
+  STEP(G, b, c, d, a, x[ 8], 0x455a14ed, 20)
+  STEP(G, a, b, c, d, x[13], 0xa9e3e905,  5)
+  STEP(G, d, a, b, c, x[ 2], 0xfcefa3f8,  9)
+  STEP(G, c, d, a, b, x[ 7], 0x676f02d9, 14)
+  STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20)
+
+  /* Round 3. */
+  STEP(H, a, b, c, d, x[ 5], 0xfffa3942,  4)
+  STEP(H, d, a, b, c, x[ 8], 0x8771f681, 11)
+  STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16)
+  STEP(H, b, c, d, a, x[14], 0xfde5380c, 23)
+  STEP(H, a, b, c, d, x[ 1], 0xa4beea44,  4)
+  STEP(H, d, a, b, c, x[ 4], 0x4bdecfa9, 11)
+  STEP(H, c, d, a, b, x[ 7], 0xf6bb4b60, 16)
+  STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23)
+  STEP(H, a, b, c, d, x[13], 0x289b7ec6,  4)
+  STEP(H, d, a, b, c, x[ 0], 0xeaa127fa, 11)
+  STEP(H, c, d, a, b, x[ 3], 0xd4ef3085, 16)
+  STEP(H, b, c, d, a, x[ 6], 0x04881d05, 23)
+  STEP(H, a, b, c, d, x[ 9], 0xd9d4d039,  4)
+  STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11)
+  STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16)
+  STEP(H, b, c, d, a, x[ 2], 0xc4ac5665, 23)
+
+  /* Round 4. */
+  STEP(I, a, b, c, d, x[ 0], 0xf4292244,  6)
+  STEP(I, d, a, b, c, x[ 7], 0x432aff97, 10)
+  STEP(I, c, d, a, b, x[14], 0xab9423a7, 15)
+  STEP(I, b, c, d, a, x[ 5], 0xfc93a039, 21)
+  STEP(I, a, b, c, d, x[12], 0x655b59c3,  6)
+  STEP(I, d, a, b, c, x[ 3], 0x8f0ccc92, 10)
+  STEP(I, c, d, a, b, x[10], 0xffeff47d, 15)
+  STEP(I, b, c, d, a, x[ 1], 0x85845dd1, 21)
+  STEP(I, a, b, c, d, x[ 8], 0x6fa87e4f,  6)
+  STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10)
+  STEP(I, c, d, a, b, x[ 6], 0xa3014314, 15)
+  STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21)
+  STEP(I, a, b, c, d, x[ 4], 0xf7537e82,  6)
+  STEP(I, d, a, b, c, x[11], 0xbd3af235, 10)
+  STEP(I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15)
+  STEP(I, b, c, d, a, x[ 9], 0xeb86d391, 21)
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
@@ -0,0 +1,24 @@
+#ifndef MD5_H
+#define MD5_H
+
+#pragma warning(push)
+#pragma warning(disable:4201) /* Unnamed struct/union. */
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#define MD5_DIGEST_LEN 16
+
+typedef struct {
+  UINT32 state[4];
+  UINT64 count;
+  UINT8 buffer[64];
+} md5_t;
+
+/* MD5 (RFC 1321), computed incrementally. */
+void Md5Init(md5_t* ctx);
+void Md5Update(md5_t* ctx, const void* data, SIZE_T len);
+void Md5Final(md5_t* ctx, UINT8* digest);
+
+#endif /* MD5_H */
@@ -1,18 +1,33 @@
 #include <wdm.h>
 #include "packet_pool.h"
+#include "largemem.h"
+
+/* The first block and one more each time the pool grows. */
+#define MAX_ARENAS (1 + PACKET_POOL_MAX_GROWTHS)
 
 typedef struct {
   packet_t** packets;
   unsigned max_packets;
   unsigned count;
 
+  /* The packets are allocated in a single block, plus one more block each
+   * time the pool grows.
+   */
+  memory_t arenas[MAX_ARENAS];
+  unsigned narenas;
+
+  SIZE_T packet_size;
+
   KSPIN_LOCK spin_lock;
 } packet_pool_t;
 
 static packet_pool_t pool;
 
-BOOL InitPacketPool(unsigned max_packets, unsigned max_packet_size)
+BOOL InitPacketPool(unsigned max_packets,
+                    unsigned max_packet_size,
+                    BOOL large_pages)
 {
+  UINT8* packet;
   unsigned i;
 
   if ((max_packets < MIN_PACKETS) || (max_packet_size < sizeof(packet_t))) {
@@ -27,27 +42,33 @@ BOOL InitPacketPool(unsigned max_packets, unsigned max_packet_size)
     return FALSE;
   }
 
+  /* Keep the packets aligned. */
+  max_packet_size = (max_packet_size + sizeof(LONGLONG) - 1) &
+                    ~(sizeof(LONGLONG) - 1);
+
+  if (!AllocMemory(&pool.arenas[0],
+                   (SIZE_T) max_packets * max_packet_size,
+                   large_pages)) {
+    ExFreePoolWithTag(pool.packets, PACKET_POOL_TAG);
+    pool.packets = NULL;
+
+    return FALSE;
+  }
+
   /* Create packets. */
+  packet = (UINT8*) pool.arenas[0].ptr;
+
   for (i = 0; i < max_packets; i++) {
-    if ((pool.packets[i] = (packet_t*) ExAllocatePoolWithTag(
-                                         NonPagedPool,
-                                         max_packet_size,
-                                         PACKET_POOL_TAG
-                                       )) == NULL) {
-      for (; i > 0; i--) {
-        ExFreePoolWithTag(pool.packets[i - 1], PACKET_POOL_TAG);
-      }
-
-      ExFreePoolWithTag(pool.packets, PACKET_POOL_TAG);
-      pool.packets = NULL;
-
-      return FALSE;
-    }
+    pool.packets[i] = (packet_t*) packet;
+    packet += max_packet_size;
   }
 
   pool.max_packets = max_packets;
   pool.count = max_packets;
 
+  pool.narenas = 1;
+  pool.packet_size = max_packet_size;
+
   KeInitializeSpinLock(&pool.spin_lock);
 
   return TRUE;
@@ -58,17 +79,79 @@ void FreePacketPool()
   unsigned i;
 
   if (pool.packets) {
-    for (i = 0; i < pool.max_packets; i++) {
-      if (pool.packets[i]) {
-        ExFreePoolWithTag(pool.packets[i], PACKET_POOL_TAG);
-      }
+    for (i = 0; i < pool.narenas; i++) {
+      FreeMemory(&pool.arenas[i]);
     }
 
+    pool.narenas = 0;
+
     ExFreePoolWithTag(pool.packets, PACKET_POOL_TAG);
     pool.packets = NULL;
   }
 }
 
+NTSTATUS GrowPacketPool(unsigned max_packets, BOOL large_pages)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  packet_t** packets;
+  packet_t** old;
+  memory_t* arena;
+  UINT8* packet;
+  unsigned added;
+  unsigned i;
+
+  if (max_packets <= pool.max_packets) {
+    return STATUS_SUCCESS;
+  }
+
+  if (pool.narenas == MAX_ARENAS) {
+    return STATUS_QUOTA_EXCEEDED;
+  }
+
+  if ((packets = (packet_t**) ExAllocatePoolWithTag(
+                                NonPagedPool,
+                                max_packets * sizeof(packet_t*),
+                                PACKET_POOL_TAG
+                              )) == NULL) {
+    return STATUS_NO_MEMORY;
+  }
+
+  added = max_packets - pool.max_packets;
+  arena = &pool.arenas[pool.narenas];
+
+  if (!AllocMemory(arena, (SIZE_T) added * pool.packet_size, large_pages)) {
+    ExFreePoolWithTag(packets, PACKET_POOL_TAG);
+    return STATUS_NO_MEMORY;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  /* The free packets followed by the new ones. */
+  memcpy(packets, pool.packets, pool.count * sizeof(packet_t*));
+
+  packet = (UINT8*) arena->ptr;
+
+  for (i = 0; i < added; i++) {
+    packets[pool.count++] = (packet_t*) packet;
+    packet += pool.packet_size;
+  }
+
+  /* Swap the arrays (the old one is freed after releasing the lock). */
+  old = pool.packets;
+  pool.packets = packets;
+
+  pool.max_packets = max_packets;
+  pool.narenas++;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  ExFreePoolWithTag(old, PACKET_POOL_TAG);
+
+  return STATUS_SUCCESS;
+}
+
 void PushPacket(packet_t* packet)
 {
   KLOCK_QUEUE_HANDLE lock_handle;
@@ -109,3 +192,45 @@ packet_t* PopPacket()
 
   return packet;
 }
+
+void PushPackets(packet_t** packets, unsigned count)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  unsigned i;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  for (i = 0; (i < count) && (pool.count < pool.max_packets); i++) {
+    pool.packets[pool.count] = packets[i];
+    pool.count++;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+unsigned PopPackets(packet_t** packets, unsigned count)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  unsigned i;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(&pool.spin_lock, &lock_handle);
+
+  if (count > pool.count) {
+    count = pool.count;
+  }
+
+  for (i = 0; i < count; i++) {
+    pool.count--;
+
+    packets[i] = pool.packets[pool.count];
+    pool.packets[pool.count] = NULL;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+
+  return count;
+}
@@ -9,11 +9,28 @@
 #pragma warning(pop)
 
 #define MIN_PACKETS 32
+
+/* Maximum number of times the pool can grow. */
+#define PACKET_POOL_MAX_GROWTHS 7
 #define PACKET_POOL_TAG '1gaT'
 
+/* DNS response which doesn't match any query (dns_query.h). */
+#define PACKET_FLAG_UNSOLICITED 0x01
+
+/* The payload is the compact record built by the dissector at classify time
+ * (dissector.h).
+ */
+#define PACKET_FLAG_RECORD 0x02
+
 typedef struct {
   UINT8 ip_version;
 
+  /* protocol_t (dissector.h). */
+  UINT8 protocol;
+
+  /* PACKET_FLAG_*. */
+  UINT8 flags;
+
   UINT8 local_ip[16];
   UINT8 remote_ip[16];
 
@@ -26,10 +43,27 @@ typedef struct {
   UINT8 payload[1];
 } packet_t;
 
-BOOL InitPacketPool(unsigned max_packets, unsigned max_packet_size);
+BOOL InitPacketPool(unsigned max_packets,
+                    unsigned max_packet_size,
+                    BOOL large_pages);
 void FreePacketPool();
 
+/* Add packets to the pool up to 'max_packets' (the packets in use are not
+ * touched, so the pool doesn't shrink). Return STATUS_QUOTA_EXCEEDED if the
+ * pool has already grown PACKET_POOL_MAX_GROWTHS times (the driver has to be
+ * reloaded) and STATUS_NO_MEMORY if the allocations fail. If it fails, the
+ * pool is not modified.
+ */
+NTSTATUS GrowPacketPool(unsigned max_packets, BOOL large_pages);
+
 void PushPacket(packet_t* packet);
 packet_t* PopPacket();
 
+/* Batch versions (a single acquisition of the spin lock). PopPackets()
+ * returns the number of packets taken, which is less than 'count' if the
+ * pool doesn't have so many.
+ */
+void PushPackets(packet_t** packets, unsigned count);
+unsigned PopPackets(packet_t** packets, unsigned count);
+
 #endif /* PACKET_POOL_H */
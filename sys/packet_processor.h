@@ -3,6 +3,29 @@
 
 #include "packet_pool.h"
 
-void ProcessPacket(packet_t* packet);
+#define PACKET_BATCH_SIZE 8
+
+void ProcessPackets(packet_t** packets, unsigned count);
+
+/* Set the headers which are added to the HTTP log records (bit n for the
+ * header n of http_header_t).
+ */
+void SetLoggedHttpHeaders(unsigned headers);
+
+/* Log formatters of the dissectors (dissector.c). */
+void LogHttp(packet_t* packet,
+             const char* local,
+             const char* remote,
+             const char* str);
+
+void LogHttps(packet_t* packet,
+              const char* local,
+              const char* remote,
+              const char* str);
+
+void LogDns(packet_t* packet,
+            const char* local,
+            const char* remote,
+            const char* str);
 
 #endif /* PACKET_PROCESSOR_H */
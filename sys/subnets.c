@@ -0,0 +1,99 @@
+#include <ntddk.h>
+#include <ip2string.h>
+#include "subnets.h"
+
+BOOL AddSubnets(_Inout_ subnets_t* subnets, _In_ const char* str)
+{
+  const char* end;
+  IN_ADDR ipv4;
+  IN6_ADDR ipv6;
+  UINT32 addr;
+  UINT32 mask;
+  unsigned prefix;
+  unsigned max;
+  unsigned digits;
+  UINT8* bytes;
+  unsigned i;
+  BOOL is_ipv4;
+
+  while (*str) {
+    /* Skip separator. */
+    if ((*str == ' ') || (*str == ',')) {
+      str++;
+      continue;
+    }
+
+    if (NT_SUCCESS(RtlIpv4StringToAddressA(str, TRUE, &end, &ipv4))) {
+      is_ipv4 = TRUE;
+      max = 32;
+    } else if (NT_SUCCESS(RtlIpv6StringToAddressA(str, &end, &ipv6))) {
+      is_ipv4 = FALSE;
+      max = 128;
+    } else {
+      return FALSE;
+    }
+
+    /* Prefix length (a single address if there is none). */
+    if (*end == '/') {
+      prefix = 0;
+      digits = 0;
+
+      while ((*++end >= '0') && (*end <= '9')) {
+        if (++digits > 3) {
+          return FALSE;
+        }
+
+        prefix = (prefix * 10) + (*end - '0');
+      }
+
+      if ((digits == 0) || (prefix > max)) {
+        return FALSE;
+      }
+    } else {
+      prefix = max;
+    }
+
+    if ((*end) && (*end != ' ') && (*end != ',')) {
+      return FALSE;
+    }
+
+    if (is_ipv4) {
+      if (subnets->nipv4 == MAX_SUBNETS) {
+        return FALSE;
+      }
+
+      /* In host byte order. */
+      memcpy(&addr, &ipv4, 4);
+      mask = (prefix > 0) ? (0xffffffffu << (32 - prefix)) : 0;
+
+      subnets->ipv4[subnets->nipv4].addr =
+        RtlUlongByteSwap(addr) & mask;
+
+      subnets->ipv4[subnets->nipv4].mask = mask;
+
+      subnets->nipv4++;
+    } else {
+      if (subnets->nipv6 == MAX_SUBNETS) {
+        return FALSE;
+      }
+
+      bytes = subnets->ipv6[subnets->nipv6].addr;
+
+      memcpy(bytes, &ipv6, 16);
+
+      /* Clear the bits after the prefix. */
+      for (i = prefix; i < 128; i++) {
+        bytes[i / 8] &= (UINT8) ~(0x80 >> (i % 8));
+      }
+
+      subnets->ipv6[subnets->nipv6].prefixLength =
+        (UINT8) prefix;
+
+      subnets->nipv6++;
+    }
+
+    str = end;
+  }
+
+  return TRUE;
+}
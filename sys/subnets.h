@@ -0,0 +1,36 @@
+#ifndef SUBNETS_H
+#define SUBNETS_H
+
+#include <ntddk.h>
+
+#pragma warning(push)
+#pragma warning(disable:4201) /* Unnamed struct/union. */
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include <fwpmk.h>
+
+/* Of each address family. */
+#define MAX_SUBNETS 16
+
+/* Conditions of the filters: the IPv4 addresses and masks are in host byte
+ * order, the bits after the prefix are cleared.
+ */
+typedef struct {
+  FWP_V4_ADDR_AND_MASK ipv4[MAX_SUBNETS];
+  unsigned nipv4;
+
+  FWP_V6_ADDR_AND_MASK ipv6[MAX_SUBNETS];
+  unsigned nipv6;
+} subnets_t;
+
+/* Add the subnets of 'str': IPv4 and IPv6 subnets in CIDR notation (a
+ * single address without prefix length) separated by spaces or commas.
+ * Return FALSE if the list is invalid or if there are too many subnets (the
+ * subnets before the error are added).
+ */
+BOOL AddSubnets(_Inout_ subnets_t* subnets, _In_ const char* str);
+
+#endif /* SUBNETS_H */
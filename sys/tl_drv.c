@@ -9,27 +9,81 @@
 #pragma warning(pop)
 
 #include <fwpmk.h>
+#include <ip2string.h>
+#include <ntstrsafe.h>
 #include "inspect.h"
 #include "worker_thread.h"
 #include "packet_pool.h"
+#include "http_flow.h"
+#include "dns_flow.h"
+#include "dns_query.h"
+#include "tls_flow.h"
+#include "packet_processor.h"
+#include "dissector.h"
 #include "dnscache.h"
+#include "dnssnapshot.h"
 #include "logfile.h"
+#include "config.h"
+#include "inspect_ioctl.h"
+#include "subnets.h"
 
 #define INITGUID
 #include <guiddef.h>
 
-#define NUMBER_BUCKETS 127
-#define MAX_DNS_ENTRIES 1000
-#define LOG_BUFFER_SIZE (8 * 1024)
+#define TAG '1gaT'
+
+#define MAX_FILTER_PORTS 16
+
+/* Ports + IP protocol, direction and flags. */
+#define MAX_FILTER_CONDITIONS (MAX_FILTER_PORTS + 3)
+
+/* The filters of the excluded subnets permit their traffic before the
+ * callout filters (auto-weighted, so below any explicit weight) of the
+ * sublayer are evaluated.
+ */
+#define EXCLUSION_WEIGHT 15
+
+/* Conditions of the callout filters (can be OR'ed). */
+#define CONDITION_INBOUND 0x01
+#define CONDITION_NOT_LOOPBACK 0x02
+
+/* The stream and endpoint closure layers don't have the loopback flag: the
+ * loopback addresses are excluded.
+ */
+#define LOOPBACK_SUBNETS "127.0.0.0/8 ::1/128"
 
 typedef struct {
   const GUID* layerKey;
   const GUID* calloutKey;
   FWPS_CALLOUT_NOTIFY_FN notifyFn;
   FWPS_CALLOUT_CLASSIFY_FN classifyFn;
+  FWPS_CALLOUT_FLOW_DELETE_NOTIFY_FN flowDeleteFn;
   wchar_t* name;
   wchar_t* description;
   UINT32* calloutId;
+
+  /* The filter matches the ports of the dissectors of these transport
+   * protocols (0: every port, the ports of the stream layer are left out if
+   * every TCP connection is inspected).
+   */
+  UINT8 transports;
+
+  /* IP protocol of the filter (0: any, the stream layer is only TCP). */
+  UINT8 ipProtocol;
+
+  /* CONDITION_* (CONDITION_INBOUND is left out if the DNS queries are
+   * recorded, CONDITION_NOT_LOOPBACK if the loopback traffic is inspected).
+   */
+  UINT8 conditions;
+
+  /* AF_INET or AF_INET6 (excluded subnets). */
+  UINT16 family;
+
+  /* Filters of the callout (0: none), replaced when the configuration is
+   * reloaded.
+   */
+  UINT64 filterId;
+  UINT64 exclusionFilterId;
 } callout_t;
 
 /* Callout and sublayer GUIDs. */
@@ -103,76 +157,129 @@ static UINT32 layerStreamV4, layerStreamV6;
 static UINT32 layerDatagramV4, layerDatagramV6;
 static UINT32 layerAleClosureV4, layerAleClosureV6;
 
+static subnets_t excludedSubnets;
+
+static config_t driverConfig;
+
 static callout_t callouts[] = {
   {
     &FWPM_LAYER_STREAM_V4,
     &TL_LAYER_STREAM_V4,
     StreamNotify,
     StreamClassify,
+    StreamFlowDelete,
     L"StreamLayerV4",
     L"Intercepts the first outbound packet with payload of each connection.",
-    &layerStreamV4
+    &layerStreamV4,
+    TRANSPORT_TCP,
+    0,
+    0,
+    AF_INET
   },
   {
     &FWPM_LAYER_STREAM_V6,
     &TL_LAYER_STREAM_V6,
     StreamNotify,
     StreamClassify,
+    StreamFlowDelete,
     L"StreamLayerV6",
     L"Intercepts the first outbound packet with payload of each connection.",
-    &layerStreamV6
+    &layerStreamV6,
+    TRANSPORT_TCP,
+    0,
+    0,
+    AF_INET6
   },
   {
     &FWPM_LAYER_DATAGRAM_DATA_V4,
     &TL_LAYER_DATAGRAM_V4,
     DatagramNotify,
     DatagramClassify,
+    NULL,
     L"DatagramLayerV4",
-    L"Intercepts inbound UDP data.",
-    &layerDatagramV4
+    L"Intercepts inbound UDP data and outbound DNS queries.",
+    &layerDatagramV4,
+    TRANSPORT_UDP,
+    IPPROTO_UDP,
+    CONDITION_INBOUND | CONDITION_NOT_LOOPBACK,
+    AF_INET
   },
   {
     &FWPM_LAYER_DATAGRAM_DATA_V6,
     &TL_LAYER_DATAGRAM_V6,
     DatagramNotify,
     DatagramClassify,
+    NULL,
     L"DatagramLayerV6",
-    L"Intercepts inbound UDP data.",
-    &layerDatagramV6
+    L"Intercepts inbound UDP data and outbound DNS queries.",
+    &layerDatagramV6,
+    TRANSPORT_UDP,
+    IPPROTO_UDP,
+    CONDITION_INBOUND | CONDITION_NOT_LOOPBACK,
+    AF_INET6
   },
   {
     &FWPM_LAYER_ALE_ENDPOINT_CLOSURE_V4,
     &TL_LAYER_ALE_EP_CLOSURE_V4,
     AleClosureNotify,
     AleClosureClassify,
+    NULL,
     L"AleLayerEndpointClosureV4",
-    L"Intercepts connection close",
-    &layerAleClosureV4
+    L"Intercepts TCP connection close",
+    &layerAleClosureV4,
+    TRANSPORT_TCP,
+    IPPROTO_TCP,
+    0,
+    AF_INET
   },
   {
     &FWPM_LAYER_ALE_ENDPOINT_CLOSURE_V6,
     &TL_LAYER_ALE_EP_CLOSURE_V6,
     AleClosureNotify,
     AleClosureClassify,
+    NULL,
     L"AleLayerEndpointClosureV6",
-    L"Intercepts connection close",
-    &layerAleClosureV6
+    L"Intercepts TCP connection close",
+    &layerAleClosureV6,
+    TRANSPORT_TCP,
+    IPPROTO_TCP,
+    0,
+    AF_INET6
   }
 };
 
 
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_UNLOAD EvtDriverUnload;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtIoDeviceControl;
+
+/* Subnets whose traffic is not inspected. */
+static BOOL SetExcludedSubnets(_In_ const config_t* config)
+{
+  excludedSubnets.nipv4 = 0;
+  excludedSubnets.nipv6 = 0;
+
+  if (!config->inspect_loopback) {
+    AddSubnets(&excludedSubnets, LOOPBACK_SUBNETS);
+  }
+
+  return AddSubnets(&excludedSubnets, config->excluded_subnets);
+}
 
 static NTSTATUS AddFilter(_In_ const wchar_t* filterName,
                           _In_ const wchar_t* filterDesc,
                           _In_ UINT64 context,
                           _In_ const GUID* layerKey,
-                          _In_ const GUID* calloutKey)
+                          _In_ const GUID* calloutKey,
+                          _In_ UINT8 ipProtocol,
+                          _In_ UINT8 conditions,
+                          _In_opt_ const UINT16* ports,
+                          _In_ unsigned nports,
+                          _Out_ UINT64* filterId)
 {
   FWPM_FILTER filter = {0};
-  static const UINT16 PORTS[] = {80, 443, 53};
-  FWPM_FILTER_CONDITION filterConditions[ARRAYSIZE(PORTS)];
+  FWPM_FILTER_CONDITION filterConditions[MAX_FILTER_CONDITIONS];
+  unsigned n;
 
   filter.displayData.name = (wchar_t*) filterName;
   filter.displayData.description = (wchar_t*) filterDesc;
@@ -184,69 +291,189 @@ static NTSTATUS AddFilter(_In_ const wchar_t* filterName,
 
   filter.action.type = FWP_ACTION_CALLOUT_INSPECTION;
 
-  for (size_t i = 0; i < ARRAYSIZE(PORTS); i++) {
-    filterConditions[i].fieldKey = FWPM_CONDITION_IP_REMOTE_PORT;
-    filterConditions[i].matchType = FWP_MATCH_EQUAL;
-    filterConditions[i].conditionValue.type = FWP_UINT16;
-    filterConditions[i].conditionValue.uint16 = PORTS[i];
+  /* Conditions on the same field are OR'ed, on different fields AND'ed. */
+  for (n = 0; n < nports; n++) {
+    filterConditions[n].fieldKey = FWPM_CONDITION_IP_REMOTE_PORT;
+    filterConditions[n].matchType = FWP_MATCH_EQUAL;
+    filterConditions[n].conditionValue.type = FWP_UINT16;
+    filterConditions[n].conditionValue.uint16 = ports[n];
   }
 
-  filter.filterCondition = filterConditions;
-  filter.numFilterConditions = ARRAYSIZE(PORTS);
+  if (ipProtocol != 0) {
+    filterConditions[n].fieldKey = FWPM_CONDITION_IP_PROTOCOL;
+    filterConditions[n].matchType = FWP_MATCH_EQUAL;
+    filterConditions[n].conditionValue.type = FWP_UINT8;
+    filterConditions[n].conditionValue.uint8 = ipProtocol;
+    n++;
+  }
+
+  if (conditions & CONDITION_INBOUND) {
+    filterConditions[n].fieldKey = FWPM_CONDITION_DIRECTION;
+    filterConditions[n].matchType = FWP_MATCH_EQUAL;
+    filterConditions[n].conditionValue.type = FWP_UINT32;
+    filterConditions[n].conditionValue.uint32 = FWP_DIRECTION_INBOUND;
+    n++;
+  }
+
+  if (conditions & CONDITION_NOT_LOOPBACK) {
+    filterConditions[n].fieldKey = FWPM_CONDITION_FLAGS;
+    filterConditions[n].matchType = FWP_MATCH_FLAGS_NONE_SET;
+    filterConditions[n].conditionValue.type = FWP_UINT32;
+    filterConditions[n].conditionValue.uint32 = FWP_CONDITION_FLAG_IS_LOOPBACK;
+    n++;
+  }
+
+  /* Without conditions, the filter matches all the traffic of the layer. */
+  filter.filterCondition = (n > 0) ? filterConditions : NULL;
+  filter.numFilterConditions = n;
 
   filter.subLayerKey = TL_INSPECT_SUBLAYER;
   filter.weight.type = FWP_EMPTY; /* Auto-weight. */
 
-  return FwpmFilterAdd(hEngine, &filter, NULL, NULL);
+  return FwpmFilterAdd(hEngine, &filter, NULL, filterId);
 }
 
-static NTSTATUS RegisterCallout(_In_ const GUID* layerKey,
-                                _In_ const GUID* calloutKey,
-                                _Inout_ void* deviceObject,
-                                _In_ FWPS_CALLOUT_NOTIFY_FN notifyFn,
-                                _In_ FWPS_CALLOUT_CLASSIFY_FN classifyFn,
-                                _In_ wchar_t* calloutName,
-                                _In_ wchar_t* calloutDescription,
-                                _Out_ UINT32* calloutId)
+static NTSTATUS AddExclusionFilter(_In_ const GUID* layerKey,
+                                   _In_ UINT16 family,
+                                   _Out_ UINT64* filterId)
+{
+  FWPM_FILTER filter = {0};
+  FWPM_FILTER_CONDITION filterConditions[MAX_SUBNETS];
+  unsigned n;
+
+  if (family == AF_INET) {
+    for (n = 0; n < excludedSubnets.nipv4; n++) {
+      filterConditions[n].fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
+      filterConditions[n].matchType = FWP_MATCH_EQUAL;
+      filterConditions[n].conditionValue.type = FWP_V4_ADDR_MASK;
+      filterConditions[n].conditionValue.v4AddrMask =
+        &excludedSubnets.ipv4[n];
+    }
+  } else {
+    for (n = 0; n < excludedSubnets.nipv6; n++) {
+      filterConditions[n].fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
+      filterConditions[n].matchType = FWP_MATCH_EQUAL;
+      filterConditions[n].conditionValue.type = FWP_V6_ADDR_MASK;
+      filterConditions[n].conditionValue.v6AddrMask =
+        &excludedSubnets.ipv6[n];
+    }
+  }
+
+  /* Nothing to exclude? */
+  if (n == 0) {
+    *filterId = 0;
+    return STATUS_SUCCESS;
+  }
+
+  filter.displayData.name = L"Excluded subnets";
+  filter.displayData.description = L"Traffic which is not inspected";
+
+  filter.layerKey = *layerKey;
+
+  /* Terminating action: the callout filters are not evaluated (the filters
+   * of the other sublayers still are).
+   */
+  filter.action.type = FWP_ACTION_PERMIT;
+
+  /* Conditions on the same field are OR'ed. */
+  filter.filterCondition = filterConditions;
+  filter.numFilterConditions = n;
+
+  filter.subLayerKey = TL_INSPECT_SUBLAYER;
+  filter.weight.type = FWP_UINT8;
+  filter.weight.uint8 = EXCLUSION_WEIGHT;
+
+  return FwpmFilterAdd(hEngine, &filter, NULL, filterId);
+}
+
+static NTSTATUS AddCalloutFilters(_Inout_ callout_t* callout,
+                                  _In_ const config_t* config)
+{
+  UINT16 ports[MAX_FILTER_PORTS];
+  unsigned nports;
+  UINT8 transports;
+  UINT8 conditions;
+  NTSTATUS status;
+
+  transports = callout->transports;
+  conditions = callout->conditions;
+
+  /* Every TCP connection is inspected? (the stream layer is only TCP) */
+  if ((config->inspect_all_tcp_ports) && (callout->ipProtocol == 0)) {
+    transports = 0;
+  }
+
+  /* The outbound datagrams are needed to record the DNS queries. */
+  if (DnsQueriesTracked()) {
+    conditions = (UINT8) (conditions & ~CONDITION_INBOUND);
+  }
+
+  if (config->inspect_loopback) {
+    conditions = (UINT8) (conditions & ~CONDITION_NOT_LOOPBACK);
+  }
+
+  /* Add filter. */
+  nports = GetDissectorPorts(transports, ports, ARRAYSIZE(ports));
+
+  status = AddFilter(L"HTTP/HTTPS/DNS",
+                     L"Filter HTTP/HTTPS/DNS",
+                     0,
+                     callout->layerKey,
+                     callout->calloutKey,
+                     callout->ipProtocol,
+                     conditions,
+                     ports,
+                     nports,
+                     &callout->filterId);
+
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  /* Add filter of the excluded subnets. */
+  return AddExclusionFilter(callout->layerKey,
+                            callout->family,
+                            &callout->exclusionFilterId);
+}
+
+static NTSTATUS RegisterCallout(_Inout_ callout_t* callout,
+                                _Inout_ void* deviceObject)
 {
   FWPS_CALLOUT sCallout = {0};
   FWPM_CALLOUT mCallout = {0};
   NTSTATUS status;
 
   /* Register callout with the filter engine. */
-  sCallout.calloutKey = *calloutKey;
-  sCallout.notifyFn = notifyFn;
-  sCallout.classifyFn = classifyFn;
+  sCallout.calloutKey = *callout->calloutKey;
+  sCallout.notifyFn = callout->notifyFn;
+  sCallout.classifyFn = callout->classifyFn;
+  sCallout.flowDeleteFn = callout->flowDeleteFn;
 
-  status = FwpsCalloutRegister(deviceObject, &sCallout, calloutId);
+  status = FwpsCalloutRegister(deviceObject, &sCallout, callout->calloutId);
   if (!NT_SUCCESS(status)) {
     return status;
   }
 
   /* Add callout. */
-  mCallout.applicableLayer = *layerKey;
-  mCallout.calloutKey = *calloutKey;
-  mCallout.displayData.name = calloutName;
-  mCallout.displayData.description = calloutDescription;
+  mCallout.applicableLayer = *callout->layerKey;
+  mCallout.calloutKey = *callout->calloutKey;
+  mCallout.displayData.name = callout->name;
+  mCallout.displayData.description = callout->description;
 
   status = FwpmCalloutAdd(hEngine, &mCallout, NULL, NULL);
   if (!NT_SUCCESS(status)) {
-    FwpsCalloutUnregisterById(*calloutId);
-    *calloutId = 0;
+    FwpsCalloutUnregisterById(*callout->calloutId);
+    *callout->calloutId = 0;
 
     return status;
   }
 
-  /* Add filter. */
-  status = AddFilter(L"HTTP/HTTPS/DNS",
-                     L"Filter HTTP/HTTPS/DNS",
-                     0,
-                     layerKey,
-                     calloutKey);
+  /* Add filters. */
+  status = AddCalloutFilters(callout, &driverConfig);
 
   if (!NT_SUCCESS(status)) {
-    FwpsCalloutUnregisterById(*calloutId);
-    *calloutId = 0;
+    FwpsCalloutUnregisterById(*callout->calloutId);
+    *callout->calloutId = 0;
 
     return status;
   }
@@ -260,6 +487,12 @@ static NTSTATUS RegisterCallouts(_Inout_ void* deviceObject)
   FWPM_SUBLAYER TLInspectSubLayer;
   NTSTATUS status;
 
+  /* Subnets whose traffic is not inspected. */
+  if (!SetExcludedSubnets(&driverConfig)) {
+    DbgPrint("Invalid excluded subnets.");
+    return STATUS_INVALID_PARAMETER;
+  }
+
   /* If session.flags is set to FWPM_SESSION_FLAG_DYNAMIC, any WFP objects
    * added during the session are automatically deleted when the session ends.
    */
@@ -304,14 +537,7 @@ static NTSTATUS RegisterCallouts(_Inout_ void* deviceObject)
 
   /* Register callouts. */
   for (size_t i = 0; i < ARRAYSIZE(callouts); i++) {
-    status = RegisterCallout(callouts[i].layerKey,
-                             callouts[i].calloutKey,
-                             deviceObject,
-                             callouts[i].notifyFn,
-                             callouts[i].classifyFn,
-                             callouts[i].name,
-                             callouts[i].description,
-                             callouts[i].calloutId);
+    status = RegisterCallout(&callouts[i], deviceObject);
 
     if (!NT_SUCCESS(status)) {
       FwpmTransactionAbort(hEngine);
@@ -339,14 +565,106 @@ static NTSTATUS RegisterCallouts(_Inout_ void* deviceObject)
   return STATUS_SUCCESS;
 }
 
+/* Replace the filters of the callouts in a single transaction: the traffic
+ * is either classified by the previous filters or by the new ones. The
+ * callouts stay registered, so the flow contexts are kept.
+ */
+static NTSTATUS UpdateFilters(_In_ config_t* config)
+{
+  subnets_t previousSubnets;
+  UINT64 filterIds[ARRAYSIZE(callouts)][2];
+  NTSTATUS status;
+  size_t i;
+
+  previousSubnets = excludedSubnets;
+
+  if (!SetExcludedSubnets(config)) {
+    DbgPrint("Invalid excluded subnets.");
+
+    excludedSubnets = previousSubnets;
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  /* The ports of the filters are the ports of the dissectors. */
+  if (!SetDissectorPorts(config->ports, config->nports)) {
+    excludedSubnets = previousSubnets;
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  /* Begin transaction with the current session. */
+  status = FwpmTransactionBegin(hEngine, 0);
+
+  if (NT_SUCCESS(status)) {
+    for (i = 0; i < ARRAYSIZE(callouts); i++) {
+      filterIds[i][0] = callouts[i].filterId;
+      filterIds[i][1] = callouts[i].exclusionFilterId;
+    }
+
+    for (i = 0; i < ARRAYSIZE(callouts); i++) {
+      status = FwpmFilterDeleteById(hEngine, callouts[i].filterId);
+
+      if ((NT_SUCCESS(status)) && (callouts[i].exclusionFilterId != 0)) {
+        status = FwpmFilterDeleteById(hEngine, callouts[i].exclusionFilterId);
+      }
+
+      if (NT_SUCCESS(status)) {
+        status = AddCalloutFilters(&callouts[i], config);
+      }
+
+      if (!NT_SUCCESS(status)) {
+        break;
+      }
+    }
+
+    if (NT_SUCCESS(status)) {
+      status = FwpmTransactionCommit(hEngine);
+    }
+
+    if (!NT_SUCCESS(status)) {
+      FwpmTransactionAbort(hEngine);
+      _Analysis_assume_lock_not_held_(hEngine);
+
+      /* The previous filters are still there. */
+      for (i = 0; i < ARRAYSIZE(callouts); i++) {
+        callouts[i].filterId = filterIds[i][0];
+        callouts[i].exclusionFilterId = filterIds[i][1];
+      }
+    }
+  }
+
+  if (!NT_SUCCESS(status)) {
+    SetDissectorPorts(driverConfig.ports, driverConfig.nports);
+    excludedSubnets = previousSubnets;
+
+    return status;
+  }
+
+  return STATUS_SUCCESS;
+}
+
+static void UnregisterCallout(_In_ UINT32 calloutId)
+{
+  LARGE_INTEGER interval;
+
+  /* While flow contexts are associated with the callout, the filter engine
+   * deletes them (calling the flowDeleteFn) and the callout has to be
+   * unregistered again.
+   */
+  interval.QuadPart = -10 * 1000 * 10; /* 10 ms. */
+
+  while (FwpsCalloutUnregisterById(calloutId) == STATUS_DEVICE_BUSY) {
+    KeDelayExecutionThread(KernelMode, FALSE, &interval);
+  }
+}
+
 static void UnregisterCallouts()
 {
-  FwpsCalloutUnregisterById(layerStreamV4);
-  FwpsCalloutUnregisterById(layerStreamV6);
-  FwpsCalloutUnregisterById(layerDatagramV4);
-  FwpsCalloutUnregisterById(layerDatagramV6);
-  FwpsCalloutUnregisterById(layerAleClosureV4);
-  FwpsCalloutUnregisterById(layerAleClosureV6);
+  UnregisterCallout(layerStreamV4);
+  UnregisterCallout(layerStreamV6);
+  UnregisterCallout(layerDatagramV4);
+  UnregisterCallout(layerDatagramV6);
+  UnregisterCallout(layerAleClosureV4);
+  UnregisterCallout(layerAleClosureV6);
 
   FwpmEngineClose(hEngine);
   hEngine = NULL;
@@ -362,17 +680,318 @@ void EvtDriverUnload(_In_ WDFDRIVER driverObject)
   UnregisterCallouts();
   StopWorkerThread();
   FreeWorkerThread();
+  SaveDnsCacheSnapshot();
   CloseLogFile();
   FreeDnsCache();
+  FreeDnsQueries();
+  FreeTlsFlows();
+  FreeDnsFlows();
+  FreeHttpFlows();
   FreePacketPool();
 }
 
+/* Run by the worker thread (the only user of the DNS cache and the log
+ * file).
+ */
+static NTSTATUS ResizeDnsCacheInWorkerThread(_In_ void* context)
+{
+  const config_t* config = (const config_t*) context;
+  LARGE_INTEGER now;
+
+  KeQuerySystemTime(&now);
+
+  /* If the entries are still being moved by the previous resize... */
+  if (MoveDnsCacheEntries(0, now.QuadPart)) {
+    return STATUS_DEVICE_BUSY;
+  }
+
+  /* The entries are moved by the worker thread between the packets. */
+  if (!ResizeDnsCache(config->dns_buckets,
+                      config->dns_entries,
+                      config->large_pages)) {
+    return STATUS_NO_MEMORY;
+  }
+
+  return STATUS_SUCCESS;
+}
+
+static NTSTATUS ReopenLogFileInWorkerThread(_In_ void* context)
+{
+  const config_t* config = (const config_t*) context;
+
+  return ReopenLogFile(config->log_file, config->log_buffer_size);
+}
+
+static NTSTATUS ResizeLogBufferInWorkerThread(_In_ void* context)
+{
+  const config_t* config = (const config_t*) context;
+
+  if (!ResizeLogBuffer(config->log_buffer_size)) {
+    return STATUS_NO_MEMORY;
+  }
+
+  return STATUS_SUCCESS;
+}
+
+/* Log a warning if the registry value 'name' changes a setting which is
+ * only applied when the driver is loaded.
+ */
+static void WarnLoadTimeSetting(_In_ const char* name,
+                                _In_ unsigned value,
+                                _In_ unsigned current)
+{
+  if (value != current) {
+    DbgPrint("%s ignored (%u, kept %u), applied when the driver is reloaded.",
+             name,
+             value,
+             current);
+  }
+}
+
+/* The tables of the flows and of the queries and the size of the packets
+ * are only set when the driver is loaded, and the packet pool doesn't
+ * shrink: log a warning for each of them which 'config' changes and keep
+ * the current value.
+ */
+static void KeepLoadTimeSettings(_Inout_ config_t* config)
+{
+  if (config->max_packets < driverConfig.max_packets) {
+    WarnLoadTimeSetting("MaxPackets",
+                        config->max_packets,
+                        driverConfig.max_packets);
+
+    config->max_packets = driverConfig.max_packets;
+  }
+
+  WarnLoadTimeSetting("MaxPacketSize",
+                      config->max_packet_size,
+                      driverConfig.max_packet_size);
+
+  WarnLoadTimeSetting("HttpMaxFlows",
+                      config->http_max_flows,
+                      driverConfig.http_max_flows);
+
+  WarnLoadTimeSetting("HttpMaxHeaders",
+                      config->http_max_headers,
+                      driverConfig.http_max_headers);
+
+  WarnLoadTimeSetting("HttpMaxHeaderSize",
+                      config->http_max_header_size,
+                      driverConfig.http_max_header_size);
+
+  WarnLoadTimeSetting("HttpKeepAlive",
+                      (unsigned) config->http_keep_alive,
+                      (unsigned) driverConfig.http_keep_alive);
+
+  WarnLoadTimeSetting("DnsTcpMaxFlows",
+                      config->dns_tcp_max_flows,
+                      driverConfig.dns_tcp_max_flows);
+
+  WarnLoadTimeSetting("DnsTcpMaxMessages",
+                      config->dns_tcp_max_messages,
+                      driverConfig.dns_tcp_max_messages);
+
+  WarnLoadTimeSetting("DnsTcpMaxMessageSize",
+                      config->dns_tcp_max_message_size,
+                      driverConfig.dns_tcp_max_message_size);
+
+  WarnLoadTimeSetting("TlsMaxFlows",
+                      config->tls_max_flows,
+                      driverConfig.tls_max_flows);
+
+  WarnLoadTimeSetting("TlsMaxRecords",
+                      config->tls_max_records,
+                      driverConfig.tls_max_records);
+
+  WarnLoadTimeSetting("TlsMaxRecordSize",
+                      config->tls_max_record_size,
+                      driverConfig.tls_max_record_size);
+
+  WarnLoadTimeSetting("DnsMaxQueries",
+                      config->dns_max_queries,
+                      driverConfig.dns_max_queries);
+
+  WarnLoadTimeSetting("DnsQueryTimeoutMs",
+                      config->dns_query_timeout_ms,
+                      driverConfig.dns_query_timeout_ms);
+
+  config->max_packet_size = driverConfig.max_packet_size;
+
+  config->http_max_flows = driverConfig.http_max_flows;
+  config->http_max_headers = driverConfig.http_max_headers;
+  config->http_max_header_size = driverConfig.http_max_header_size;
+  config->http_keep_alive = driverConfig.http_keep_alive;
+
+  config->dns_tcp_max_flows = driverConfig.dns_tcp_max_flows;
+  config->dns_tcp_max_messages = driverConfig.dns_tcp_max_messages;
+  config->dns_tcp_max_message_size = driverConfig.dns_tcp_max_message_size;
+
+  config->tls_max_flows = driverConfig.tls_max_flows;
+  config->tls_max_records = driverConfig.tls_max_records;
+  config->tls_max_record_size = driverConfig.tls_max_record_size;
+
+  config->dns_max_queries = driverConfig.dns_max_queries;
+  config->dns_query_timeout_ms = driverConfig.dns_query_timeout_ms;
+}
+
+/* Read the 'Parameters' registry key again and apply the new settings
+ * without stopping the inspection: the packets keep being queued while the
+ * worker thread resizes the DNS cache or switches the log file. The
+ * settings which can't be applied keep their previous value.
+ */
+static NTSTATUS ReloadConfig()
+{
+  config_t* config;
+  WDFKEY parametersKey;
+  NTSTATUS status;
+  NTSTATUS result;
+
+  /* Too big for the stack. */
+  if ((config = (config_t*) ExAllocatePoolWithTag(PagedPool,
+                                                  sizeof(config_t),
+                                                  TAG)) == NULL) {
+    return STATUS_NO_MEMORY;
+  }
+
+  status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(),
+                                              KEY_READ,
+                                              WDF_NO_OBJECT_ATTRIBUTES,
+                                              &parametersKey);
+
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(config, TAG);
+    return status;
+  }
+
+  GetDefaultConfig(config);
+  ReadConfig(parametersKey, config);
+
+  WdfRegistryClose(parametersKey);
+
+  KeepLoadTimeSettings(config);
+
+  /* Filters and ports of the dissectors (nothing is applied if they
+   * fail).
+   */
+  status = UpdateFilters(config);
+  if (!NT_SUCCESS(status)) {
+    DbgPrint("Error updating filters.");
+
+    ExFreePoolWithTag(config, TAG);
+    return status;
+  }
+
+  InitInspect(config->max_packet_size,
+              config->capture_records,
+              config->dns_drop_unsolicited);
+
+  /* Packet pool (the queue of the worker thread first, it has to hold all
+   * the packets).
+   */
+  if (config->max_packets > driverConfig.max_packets) {
+    if (!GrowWorkerThreadQueue(config->max_packets)) {
+      result = STATUS_NO_MEMORY;
+    } else {
+      result = GrowPacketPool(config->max_packets, config->large_pages);
+    }
+
+    if (!NT_SUCCESS(result)) {
+      if (result == STATUS_QUOTA_EXCEEDED) {
+        DbgPrint("The packet pool can't grow any more until the driver is "
+                 "reloaded.");
+      } else {
+        DbgPrint("Error growing packet pool.");
+      }
+
+      config->max_packets = driverConfig.max_packets;
+      status = result;
+    }
+  }
+
+  SetWorkerThreadIntervals(config->stats_interval_ms,
+                           config->flush_interval_ms);
+
+  SetLoggedHttpHeaders(config->http_log_headers);
+
+  /* DNS cache (the entries are kept). */
+  if ((config->dns_buckets != driverConfig.dns_buckets) ||
+      (config->dns_entries != driverConfig.dns_entries)) {
+    result = RunInWorkerThread(ResizeDnsCacheInWorkerThread, config);
+    if (!NT_SUCCESS(result)) {
+      DbgPrint("Error resizing DNS cache.");
+
+      config->dns_buckets = driverConfig.dns_buckets;
+      config->dns_entries = driverConfig.dns_entries;
+      status = result;
+    }
+  }
+
+  /* Log file. */
+  if (wcscmp(config->log_file, driverConfig.log_file) != 0) {
+    result = RunInWorkerThread(ReopenLogFileInWorkerThread, config);
+    if (!NT_SUCCESS(result)) {
+      DbgPrint("Error opening log file.");
+
+      RtlStringCbCopyW(config->log_file,
+                       sizeof(config->log_file),
+                       driverConfig.log_file);
+
+      config->log_buffer_size = driverConfig.log_buffer_size;
+      status = result;
+    }
+  } else if (config->log_buffer_size != driverConfig.log_buffer_size) {
+    result = RunInWorkerThread(ResizeLogBufferInWorkerThread, config);
+    if (!NT_SUCCESS(result)) {
+      DbgPrint("Error resizing log buffer.");
+
+      config->log_buffer_size = driverConfig.log_buffer_size;
+      status = result;
+    }
+  }
+
+  memcpy(&driverConfig, config, sizeof(config_t));
+
+  ExFreePoolWithTag(config, TAG);
+
+  return status;
+}
+
+_Function_class_(EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL)
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+void EvtIoDeviceControl(_In_ WDFQUEUE queue,
+                        _In_ WDFREQUEST request,
+                        _In_ size_t outputBufferLength,
+                        _In_ size_t inputBufferLength,
+                        _In_ ULONG ioControlCode)
+{
+  NTSTATUS status;
+
+  UNREFERENCED_PARAMETER(queue);
+  UNREFERENCED_PARAMETER(outputBufferLength);
+  UNREFERENCED_PARAMETER(inputBufferLength);
+
+  switch (ioControlCode) {
+    case IOCTL_INSPECT_RELOAD_CONFIG:
+      status = ReloadConfig();
+      break;
+    default:
+      status = STATUS_INVALID_DEVICE_REQUEST;
+  }
+
+  WdfRequestComplete(request, status);
+}
+
 static NTSTATUS InitDriverObjects(_Inout_ DRIVER_OBJECT* driverObject,
                                   _In_ const UNICODE_STRING* registryPath,
                                   _Out_ WDFDRIVER* pDriver,
                                   _Out_ WDFDEVICE* pDevice)
 {
   WDF_DRIVER_CONFIG config;
+  WDF_IO_QUEUE_CONFIG queueConfig;
+  WDF_OBJECT_ATTRIBUTES queueAttributes;
+  DECLARE_CONST_UNICODE_STRING(deviceName, INSPECT_DEVICE_NAME);
+  DECLARE_CONST_UNICODE_STRING(symbolicLink, INSPECT_SYMBOLIC_LINK);
   NTSTATUS status;
 
   /* Initialize 'config'. */
@@ -391,10 +1010,12 @@ static NTSTATUS InitDriverObjects(_Inout_ DRIVER_OBJECT* driverObject,
     return status;
   }
 
-  /* Allocate a WDFDEVICE_INIT structure. */
+  /* Allocate a WDFDEVICE_INIT structure (only the administrators can open the
+   * control device).
+   */
   PWDFDEVICE_INIT pInit =
                     WdfControlDeviceInitAllocate(*pDriver,
-                                                 &SDDL_DEVOBJ_KERNEL_ONLY);
+                                                 &SDDL_DEVOBJ_SYS_ALL_ADM_ALL);
 
   if (!pInit) {
     return STATUS_INSUFFICIENT_RESOURCES;
@@ -402,7 +1023,12 @@ static NTSTATUS InitDriverObjects(_Inout_ DRIVER_OBJECT* driverObject,
 
   WdfDeviceInitSetDeviceType(pInit, FILE_DEVICE_NETWORK);
   WdfDeviceInitSetCharacteristics(pInit, FILE_DEVICE_SECURE_OPEN, FALSE);
-  WdfDeviceInitSetCharacteristics(pInit, FILE_AUTOGENERATED_DEVICE_NAME, TRUE);
+
+  status = WdfDeviceInitAssignName(pInit, &deviceName);
+  if (!NT_SUCCESS(status)) {
+    WdfDeviceInitFree(pInit);
+    return status;
+  }
 
   /* Create framework device object. */
   status = WdfDeviceCreate(&pInit, WDF_NO_OBJECT_ATTRIBUTES, pDevice);
@@ -411,8 +1037,30 @@ static NTSTATUS InitDriverObjects(_Inout_ DRIVER_OBJECT* driverObject,
     return status;
   }
 
-  /* Inform framework that we have finished initializing the device object. */
-  WdfControlFinishInitializing(*pDevice);
+  status = WdfDeviceCreateSymbolicLink(*pDevice, &symbolicLink);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  /* The requests are processed one at a time, at PASSIVE_LEVEL (the filter
+   * engine and the registry).
+   */
+  WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig,
+                                         WdfIoQueueDispatchSequential);
+
+  queueConfig.EvtIoDeviceControl = EvtIoDeviceControl;
+
+  WDF_OBJECT_ATTRIBUTES_INIT(&queueAttributes);
+  queueAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+  status = WdfIoQueueCreate(*pDevice,
+                            &queueConfig,
+                            &queueAttributes,
+                            WDF_NO_HANDLE);
+
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
 
   return STATUS_SUCCESS;
 }
@@ -428,37 +1076,145 @@ NTSTATUS DriverEntry(DRIVER_OBJECT* driverObject, UNICODE_STRING* registryPath)
   /* Request NX Non-Paged Pool when available. */
   ExInitializeDriverRuntime(DrvRtPoolNxOptIn);
 
+  /* Initialize driver objects. */
+  status = InitDriverObjects(driverObject, registryPath, &driver, &device);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  /* Open 'Parameters' registry key and retrieve a handle to the registry-key
+   * object.
+   */
+  status = WdfDriverOpenParametersRegistryKey(driver,
+                                              KEY_READ,
+                                              WDF_NO_OBJECT_ATTRIBUTES,
+                                              &parametersKey);
+
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  /* Read the configuration (the defaults are used for the missing
+   * values).
+   */
+  GetDefaultConfig(&driverConfig);
+  ReadConfig(parametersKey, &driverConfig);
+
+  WdfRegistryClose(parametersKey);
+
+  /* Set the ports of the dissectors. */
+  InitDissectors();
+  SetDissectorPorts(driverConfig.ports, driverConfig.nports);
+
+  InitInspect(driverConfig.max_packet_size,
+              driverConfig.capture_records,
+              driverConfig.dns_drop_unsolicited);
+
+  SetLoggedHttpHeaders(driverConfig.http_log_headers);
+
   /* Initialize packet pool. */
-  if (!InitPacketPool(MAX_PACKETS, MAX_PACKET_SIZE)) {
+  if (!InitPacketPool(driverConfig.max_packets,
+                      driverConfig.max_packet_size,
+                      driverConfig.large_pages)) {
     DbgPrint("Error initializing packet pool.");
     return STATUS_NO_MEMORY;
   }
 
+  /* Initialize HTTP flows. */
+  if (!InitHttpFlows(driverConfig.http_max_flows,
+                     driverConfig.http_max_headers,
+                     driverConfig.http_max_header_size,
+                     driverConfig.http_keep_alive,
+                     driverConfig.large_pages)) {
+    DbgPrint("Error initializing HTTP flows.");
+
+    FreePacketPool();
+    return STATUS_NO_MEMORY;
+  }
+
+  /* Initialize DNS over TCP flows. */
+  if (!InitDnsFlows(driverConfig.dns_tcp_max_flows,
+                    driverConfig.dns_tcp_max_messages,
+                    driverConfig.dns_tcp_max_message_size,
+                    driverConfig.large_pages)) {
+    DbgPrint("Error initializing DNS flows.");
+
+    FreeHttpFlows();
+    FreePacketPool();
+    return STATUS_NO_MEMORY;
+  }
+
+  /* Initialize TLS flows. */
+  if (!InitTlsFlows(driverConfig.tls_max_flows,
+                    driverConfig.tls_max_records,
+                    driverConfig.tls_max_record_size,
+                    driverConfig.large_pages)) {
+    DbgPrint("Error initializing TLS flows.");
+
+    FreeDnsFlows();
+    FreeHttpFlows();
+    FreePacketPool();
+    return STATUS_NO_MEMORY;
+  }
+
+  /* Initialize DNS query tracking. */
+  if (!InitDnsQueries(driverConfig.dns_max_queries,
+                      driverConfig.dns_query_timeout_ms)) {
+    DbgPrint("Error initializing DNS queries.");
+
+    FreeTlsFlows();
+    FreeDnsFlows();
+    FreeHttpFlows();
+    FreePacketPool();
+    return STATUS_NO_MEMORY;
+  }
+
   /* Initialize DNS cache. */
-  if (!InitDnsCache(NUMBER_BUCKETS, MAX_DNS_ENTRIES)) {
+  if (!InitDnsCache(driverConfig.dns_buckets,
+                    driverConfig.dns_entries,
+                    driverConfig.large_pages)) {
     DbgPrint("Error initializing DNS cache.");
 
+    FreeDnsQueries();
+    FreeTlsFlows();
+    FreeDnsFlows();
+    FreeHttpFlows();
     FreePacketPool();
     return STATUS_NO_MEMORY;
   }
 
   /* Open log file. */
-  status = OpenLogFile(LOG_BUFFER_SIZE);
+  status = OpenLogFile(driverConfig.log_file, driverConfig.log_buffer_size);
   if (!NT_SUCCESS(status)) {
     DbgPrint("Error opening log file.");
 
     FreeDnsCache();
+    FreeDnsQueries();
+    FreeTlsFlows();
+    FreeDnsFlows();
+    FreeHttpFlows();
     FreePacketPool();
 
     return status;
   }
 
+  /* Warm up the DNS cache with the snapshot saved by the previous instance
+   * (if any).
+   */
+  LoadDnsCacheSnapshot();
+
   /* Initialize worker thread. */
-  if (!InitWorkerThread(MAX_PACKETS)) {
+  if (!InitWorkerThread(driverConfig.max_packets,
+                        driverConfig.stats_interval_ms,
+                        driverConfig.flush_interval_ms)) {
     DbgPrint("Error initializing worker thread.");
 
     CloseLogFile();
     FreeDnsCache();
+    FreeDnsQueries();
+    FreeTlsFlows();
+    FreeDnsFlows();
+    FreeHttpFlows();
     FreePacketPool();
 
     return STATUS_NO_MEMORY;
@@ -472,36 +1228,10 @@ NTSTATUS DriverEntry(DRIVER_OBJECT* driverObject, UNICODE_STRING* registryPath)
     FreeWorkerThread();
     CloseLogFile();
     FreeDnsCache();
-    FreePacketPool();
-
-    return status;
-  }
-
-  /* Initialize driver objects. */
-  status = InitDriverObjects(driverObject, registryPath, &driver, &device);
-  if (!NT_SUCCESS(status)) {
-    StopWorkerThread();
-    FreeWorkerThread();
-    CloseLogFile();
-    FreeDnsCache();
-    FreePacketPool();
-
-    return status;
-  }
-
-  /* Open 'Parameters' registry key and retrieve a handle to the registry-key
-   * object.
-   */
-  status = WdfDriverOpenParametersRegistryKey(driver,
-                                              KEY_READ,
-                                              WDF_NO_OBJECT_ATTRIBUTES,
-                                              &parametersKey);
-
-  if (!NT_SUCCESS(status)) {
-    StopWorkerThread();
-    FreeWorkerThread();
-    CloseLogFile();
-    FreeDnsCache();
+    FreeDnsQueries();
+    FreeTlsFlows();
+    FreeDnsFlows();
+    FreeHttpFlows();
     FreePacketPool();
 
     return status;
@@ -518,10 +1248,19 @@ NTSTATUS DriverEntry(DRIVER_OBJECT* driverObject, UNICODE_STRING* registryPath)
     FreeWorkerThread();
     CloseLogFile();
     FreeDnsCache();
+    FreeDnsQueries();
+    FreeTlsFlows();
+    FreeDnsFlows();
+    FreeHttpFlows();
     FreePacketPool();
 
     return status;
   }
 
+  /* Inform framework that we have finished initializing the device object
+   * (the control requests are only accepted from now on).
+   */
+  WdfControlFinishInitializing(device);
+
   return STATUS_SUCCESS;
 }
@@ -0,0 +1,351 @@
+#include <stddef.h>
+#include <wdm.h>
+#include "tls_flow.h"
+#include "largemem.h"
+
+#define MAX_RECORD_SIZE 0xffff
+
+typedef struct {
+  /* Flow contexts. */
+  tls_flow_t* flows;
+  tls_flow_t** free_flows;
+  unsigned max_flows;
+  unsigned nfree_flows;
+
+  /* Packets (all allocated in a single block). */
+  memory_t arena;
+  packet_t** free_packets;
+  unsigned max_records;
+  unsigned nfree_packets;
+
+  SIZE_T packet_size;
+  unsigned max_record_size;
+
+  KSPIN_LOCK spin_lock;
+} tls_flows_t;
+
+static tls_flows_t pool;
+
+static SIZE_T AppendToRecord(tls_flow_t* flow,
+                             const UINT8* data,
+                             SIZE_T len,
+                             BOOL* complete);
+
+BOOL InitTlsFlows(unsigned max_flows,
+                  unsigned max_records,
+                  unsigned max_record_size,
+                  BOOL large_pages)
+{
+  UINT8* packet;
+  unsigned i;
+
+  pool.max_flows = 0;
+
+  /* Connections not followed? */
+  if (max_flows == 0) {
+    return TRUE;
+  }
+
+  if ((max_records == 0) ||
+      (max_record_size < TLS_RECORD_HEADER_LEN) ||
+      (max_record_size > MAX_RECORD_SIZE)) {
+    return FALSE;
+  }
+
+  if ((pool.flows = (tls_flow_t*) ExAllocatePoolWithTag(
+                                    NonPagedPool,
+                                    max_flows * sizeof(tls_flow_t),
+                                    PACKET_POOL_TAG
+                                  )) == NULL) {
+    return FALSE;
+  }
+
+  if ((pool.free_flows = (tls_flow_t**) ExAllocatePoolWithTag(
+                                          NonPagedPool,
+                                          max_flows * sizeof(tls_flow_t*),
+                                          PACKET_POOL_TAG
+                                        )) == NULL) {
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    return FALSE;
+  }
+
+  if ((pool.free_packets = (packet_t**) ExAllocatePoolWithTag(
+                                          NonPagedPool,
+                                          max_records * sizeof(packet_t*),
+                                          PACKET_POOL_TAG
+                                        )) == NULL) {
+    ExFreePoolWithTag(pool.free_flows, PACKET_POOL_TAG);
+    pool.free_flows = NULL;
+
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    return FALSE;
+  }
+
+  /* Keep the packets aligned. */
+  pool.packet_size = (offsetof(packet_t, payload) + max_record_size +
+                      sizeof(LONGLONG) - 1) &
+                     ~(sizeof(LONGLONG) - 1);
+
+  if (!AllocMemory(&pool.arena,
+                   (SIZE_T) max_records * pool.packet_size,
+                   large_pages)) {
+    ExFreePoolWithTag(pool.free_packets, PACKET_POOL_TAG);
+    pool.free_packets = NULL;
+
+    ExFreePoolWithTag(pool.free_flows, PACKET_POOL_TAG);
+    pool.free_flows = NULL;
+
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    return FALSE;
+  }
+
+  for (i = 0; i < max_flows; i++) {
+    pool.free_flows[i] = &pool.flows[i];
+  }
+
+  packet = (UINT8*) pool.arena.ptr;
+
+  for (i = 0; i < max_records; i++) {
+    pool.free_packets[i] = (packet_t*) packet;
+    packet += pool.packet_size;
+  }
+
+  pool.max_flows = max_flows;
+  pool.nfree_flows = max_flows;
+
+  pool.max_records = max_records;
+  pool.nfree_packets = max_records;
+
+  pool.max_record_size = max_record_size;
+
+  KeInitializeSpinLock(&pool.spin_lock);
+
+  return TRUE;
+}
+
+void FreeTlsFlows()
+{
+  if (pool.max_flows > 0) {
+    FreeMemory(&pool.arena);
+
+    ExFreePoolWithTag(pool.free_packets, PACKET_POOL_TAG);
+    pool.free_packets = NULL;
+
+    ExFreePoolWithTag(pool.free_flows, PACKET_POOL_TAG);
+    pool.free_flows = NULL;
+
+    ExFreePoolWithTag(pool.flows, PACKET_POOL_TAG);
+    pool.flows = NULL;
+
+    pool.max_flows = 0;
+  }
+}
+
+tls_flow_t* NewTlsFlow(const packet_t* tuple)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  tls_flow_t* flow;
+
+  /* Connections not followed? */
+  if (pool.max_flows == 0) {
+    return NULL;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  if (pool.nfree_flows > 0) {
+    flow = pool.free_flows[--pool.nfree_flows];
+  } else {
+    flow = NULL;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  if (flow) {
+    memcpy(&flow->tuple, tuple, offsetof(packet_t, payload));
+
+    flow->packet = NULL;
+    flow->state = TLS_FLOW_RECORD;
+    flow->records = 0;
+  }
+
+  return flow;
+}
+
+void DeleteTlsFlow(tls_flow_t* flow)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  if (flow->packet) {
+    pool.free_packets[pool.nfree_packets++] = flow->packet;
+    flow->packet = NULL;
+  }
+
+  pool.free_flows[pool.nfree_flows++] = flow;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+BOOL IsTlsFlow(const void* context)
+{
+  return ((pool.max_flows > 0) &&
+          ((const tls_flow_t*) context >= pool.flows) &&
+          ((const tls_flow_t*) context < pool.flows + pool.max_flows));
+}
+
+BOOL AttachTlsFlowPacket(tls_flow_t* flow)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  packet_t* packet;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  if (pool.nfree_packets > 0) {
+    packet = pool.free_packets[--pool.nfree_packets];
+  } else {
+    packet = NULL;
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  if (!packet) {
+    return FALSE;
+  }
+
+  memcpy(packet, &flow->tuple, offsetof(packet_t, payload));
+  packet->payloadlen = 0;
+
+  flow->packet = packet;
+
+  return TRUE;
+}
+
+SIZE_T ConsumeTlsFlowData(tls_flow_t* flow,
+                          const UINT8* data,
+                          SIZE_T len,
+                          BOOL* complete)
+{
+  *complete = FALSE;
+
+  switch (flow->state) {
+    case TLS_FLOW_RECORD:
+      /* A packet has to be attached first. */
+      if (!flow->packet) {
+        return 0;
+      }
+
+      return AppendToRecord(flow, data, len, complete);
+    default:
+      return len;
+  }
+}
+
+packet_t* TakeTlsFlowPacket(tls_flow_t* flow)
+{
+  packet_t* packet;
+
+  packet = flow->packet;
+  flow->packet = NULL;
+
+  flow->records++;
+
+  return packet;
+}
+
+BOOL ReleaseTlsFlowPacket(packet_t* packet)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+
+  if ((pool.max_flows == 0) ||
+      ((UINT8*) packet < (UINT8*) pool.arena.ptr) ||
+      ((UINT8*) packet >= (UINT8*) pool.arena.ptr +
+                          (SIZE_T) pool.max_records * pool.packet_size)) {
+    return FALSE;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&pool.spin_lock, &lock_handle);
+
+  pool.free_packets[pool.nfree_packets++] = packet;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  return TRUE;
+}
+
+SIZE_T AppendToRecord(tls_flow_t* flow,
+                      const UINT8* data,
+                      SIZE_T len,
+                      BOOL* complete)
+{
+  packet_t* packet;
+  SIZE_T consumed;
+  SIZE_T size;
+  SIZE_T n;
+
+  packet = flow->packet;
+
+  consumed = 0;
+
+  /* The header first (it has the size of the record). */
+  if (packet->payloadlen < TLS_RECORD_HEADER_LEN) {
+    consumed = TLS_RECORD_HEADER_LEN - packet->payloadlen;
+    if (consumed > len) {
+      consumed = len;
+    }
+
+    memcpy(packet->payload + packet->payloadlen, data, consumed);
+    packet->payloadlen = (UINT16) (packet->payloadlen + consumed);
+
+    if (packet->payloadlen < TLS_RECORD_HEADER_LEN) {
+      return consumed;
+    }
+  }
+
+  size = GetTlsRecordSize(packet->payload, packet->payloadlen);
+  if (size > pool.max_record_size) {
+    size = pool.max_record_size;
+  }
+
+  n = size - packet->payloadlen;
+  if (n > len - consumed) {
+    n = len - consumed;
+  }
+
+  memcpy(packet->payload + packet->payloadlen, data + consumed, n);
+  packet->payloadlen = (UINT16) (packet->payloadlen + n);
+
+  /* Only the first record is reassembled (a truncated ClientHello still
+   * has the extensions before the end).
+   */
+  if (packet->payloadlen == size) {
+    *complete = TRUE;
+    flow->state = TLS_FLOW_DONE;
+  }
+
+  return consumed + n;
+}
+
+SIZE_T GetTlsRecordSize(const UINT8* data, SIZE_T len)
+{
+  if (len < TLS_RECORD_HEADER_LEN) {
+    return 0;
+  }
+
+  return TLS_RECORD_HEADER_LEN + (((SIZE_T) data[3] << 8) | data[4]);
+}
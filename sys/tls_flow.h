@@ -0,0 +1,90 @@
+#ifndef TLS_FLOW_H
+#define TLS_FLOW_H
+
+#include "packet_pool.h"
+
+/* Header of a TLS record: content type, version and length (2 bytes, in
+ * network byte order).
+ */
+#define TLS_RECORD_HEADER_LEN 5
+
+typedef enum {
+  TLS_FLOW_RECORD, /* First record of the client (ClientHello). */
+  TLS_FLOW_DONE    /* Not following the connection anymore. */
+} tls_flow_state_t;
+
+typedef struct {
+  /* Flow to which the context is associated. */
+  UINT64 flow_id;
+  UINT16 layer_id;
+  UINT32 callout_id;
+
+  /* Addresses and ports of the connection. */
+  packet_t tuple;
+
+  /* Packet in which the record is reassembled (NULL once it has been handed
+   * to the worker thread).
+   */
+  packet_t* packet;
+
+  tls_flow_state_t state;
+
+  /* Number of records handed to the worker thread (0 or 1). */
+  unsigned records;
+} tls_flow_t;
+
+/* Preallocate 'max_flows' flow contexts and 'max_records' packets with room
+ * for 'max_record_size' bytes of TLS record. A flow only holds a packet
+ * while it is reassembling the first record of the client (the ClientHello,
+ * header included), the records bigger than 'max_record_size' are
+ * truncated. If 'max_flows' is 0, the connections are not followed.
+ */
+BOOL InitTlsFlows(unsigned max_flows,
+                  unsigned max_records,
+                  unsigned max_record_size,
+                  BOOL large_pages);
+void FreeTlsFlows();
+
+/* Get a flow context for the connection of 'tuple' (NULL if the connections
+ * are not followed or the memory budget is exhausted).
+ */
+tls_flow_t* NewTlsFlow(const packet_t* tuple);
+
+/* Return the flow context and its packet (if any) to the pool. */
+void DeleteTlsFlow(tls_flow_t* flow);
+
+/* Return TRUE if 'context' is a flow context of the pool. */
+BOOL IsTlsFlow(const void* context);
+
+/* Get an empty packet for the record. Return FALSE if the memory budget is
+ * exhausted.
+ */
+BOOL AttachTlsFlowPacket(tls_flow_t* flow);
+
+/* Consume outbound data of the connection: the first record is appended to
+ * the packet. Return the number of bytes consumed, which is less than 'len'
+ * when:
+ * - The record has been completed (its last byte was received or the packet
+ *   is full): '*complete' is set to TRUE, the packet has to be taken and the
+ *   connection is not followed anymore.
+ * - No packet is attached.
+ */
+SIZE_T ConsumeTlsFlowData(tls_flow_t* flow,
+                          const UINT8* data,
+                          SIZE_T len,
+                          BOOL* complete);
+
+/* Detach the packet from the flow context. */
+packet_t* TakeTlsFlowPacket(tls_flow_t* flow);
+
+/* If the packet belongs to the record pool, return it to the pool and
+ * return TRUE.
+ */
+BOOL ReleaseTlsFlowPacket(packet_t* packet);
+
+/* Size of the TLS record at the beginning of 'data', header included (0 if
+ * 'data' is shorter than the header).
+ */
+SIZE_T GetTlsRecordSize(const UINT8* data, SIZE_T len);
+
+#endif /* TLS_FLOW_H */
@@ -0,0 +1,394 @@
+#include <ntddk.h>
+#include "tls_parser.h"
+
+#define TLS_RECORD_HEADER_LEN 5
+#define TLS_HANDSHAKE_HEADER_LEN 4
+#define TLS_RANDOM_LEN 32
+
+#define TLS_CONTENT_TYPE_HANDSHAKE 22
+#define TLS_HANDSHAKE_CLIENT_HELLO 1
+
+#define TLS_EXTENSION_SERVER_NAME 0
+#define TLS_EXTENSION_SUPPORTED_GROUPS 10
+#define TLS_EXTENSION_EC_POINT_FORMATS 11
+#define TLS_EXTENSION_ALPN 16
+
+#define TLS_SERVER_NAME_HOST_NAME 0
+
+static void ParseServerName(const UINT8* ptr,
+                            const UINT8* end,
+                            tls_client_hello_t* hello);
+static void ParseAlpn(const UINT8* ptr,
+                      const UINT8* end,
+                      tls_client_hello_t* hello);
+static void HashList(md5_t* ctx,
+                     const UINT8* ptr,
+                     SIZE_T len,
+                     unsigned size,
+                     unsigned stride);
+static void HashNumber(md5_t* ctx, UINT16 n, BOOL* first);
+
+__inline static UINT16 GetUint16(const UINT8* ptr)
+{
+  return (UINT16) ((ptr[0] << 8) | ptr[1]);
+}
+
+/* GREASE values (RFC 8701): 0x0a0a, 0x1a1a, ..., 0xfafa. */
+__inline static BOOL IsGrease(UINT16 n)
+{
+  return ((n & 0x0f0f) == 0x0a0a) && ((n >> 8) == (n & 0xff));
+}
+
+/* Skip a vector whose length is encoded in 'lenlen' bytes. */
+__inline static BOOL SkipVector(const UINT8** ptr,
+                                const UINT8* end,
+                                unsigned lenlen)
+{
+  SIZE_T len;
+
+  if ((SIZE_T) (end - *ptr) < lenlen) {
+    return FALSE;
+  }
+
+  len = (lenlen == 1) ? **ptr : GetUint16(*ptr);
+
+  if ((SIZE_T) (end - *ptr) < lenlen + len) {
+    return FALSE;
+  }
+
+  *ptr += (lenlen + len);
+
+  return TRUE;
+}
+
+BOOL ParseTlsClientHello(const UINT8* data,
+                         SIZE_T len,
+                         tls_client_hello_t* hello)
+{
+  const UINT8* ptr;
+  const UINT8* end;
+  const UINT8* extensions_end;
+  const UINT8* record_end;
+  const UINT8* ciphers;
+  UINT16 type;
+  UINT16 extlen;
+
+  hello->server_name = NULL;
+  hello->server_namelen = 0;
+  hello->alpn = NULL;
+  hello->alpnlen = 0;
+  hello->ciphers = NULL;
+  hello->cipherslen = 0;
+  hello->extensions = NULL;
+  hello->extensionslen = 0;
+  hello->groups = NULL;
+  hello->groupslen = 0;
+  hello->point_formats = NULL;
+  hello->point_formatslen = 0;
+  hello->complete = FALSE;
+
+  /* Record header + handshake header + version. */
+  if ((len < TLS_RECORD_HEADER_LEN + TLS_HANDSHAKE_HEADER_LEN + 2) ||
+      (data[0] != TLS_CONTENT_TYPE_HANDSHAKE) ||
+      (data[1] != 3) ||
+      (data[TLS_RECORD_HEADER_LEN] != TLS_HANDSHAKE_CLIENT_HELLO)) {
+    return FALSE;
+  }
+
+  /* The ClientHello might not fit in the data (bigger than the packets, or
+   * spanning several records): parse up to the end of the record or of the
+   * data, whichever comes first.
+   */
+  record_end = data + TLS_RECORD_HEADER_LEN + GetUint16(data + 3);
+  end = (record_end < data + len) ? record_end : data + len;
+
+  ptr = data + TLS_RECORD_HEADER_LEN + TLS_HANDSHAKE_HEADER_LEN;
+
+  if (end - ptr < 2) {
+    return FALSE;
+  }
+
+  hello->version = GetUint16(ptr);
+  ptr += 2;
+
+  /* Skip random. */
+  if ((SIZE_T) (end - ptr) < TLS_RANDOM_LEN) {
+    return TRUE;
+  }
+
+  ptr += TLS_RANDOM_LEN;
+
+  /* Skip session id, cipher suites and compression methods. */
+  if (!SkipVector(&ptr, end, 1)) {
+    return TRUE;
+  }
+
+  ciphers = ptr;
+
+  if (!SkipVector(&ptr, end, 2)) {
+    return TRUE;
+  }
+
+  hello->ciphers = ciphers + 2;
+  hello->cipherslen = ptr - hello->ciphers;
+
+  if (!SkipVector(&ptr, end, 1)) {
+    return TRUE;
+  }
+
+  /* No extensions? */
+  if (end - ptr < 2) {
+    hello->complete = (ptr == record_end);
+    return TRUE;
+  }
+
+  extensions_end = ptr + 2 + GetUint16(ptr);
+  if (extensions_end <= end) {
+    end = extensions_end;
+
+    hello->extensions = ptr + 2;
+    hello->extensionslen = extensions_end - hello->extensions;
+  }
+
+  ptr += 2;
+
+  /* Walk the extensions by length. */
+  while (end - ptr >= 4) {
+    type = GetUint16(ptr);
+    extlen = GetUint16(ptr + 2);
+
+    ptr += 4;
+
+    /* Truncated extension? */
+    if ((SIZE_T) (end - ptr) < extlen) {
+      return TRUE;
+    }
+
+    switch (type) {
+      case TLS_EXTENSION_SERVER_NAME:
+        ParseServerName(ptr, ptr + extlen, hello);
+        break;
+      case TLS_EXTENSION_SUPPORTED_GROUPS:
+        if ((extlen >= 2) && (GetUint16(ptr) <= extlen - 2)) {
+          hello->groups = ptr + 2;
+          hello->groupslen = GetUint16(ptr);
+        }
+
+        break;
+      case TLS_EXTENSION_EC_POINT_FORMATS:
+        if ((extlen >= 1) && (*ptr <= extlen - 1)) {
+          hello->point_formats = ptr + 1;
+          hello->point_formatslen = *ptr;
+        }
+
+        break;
+      case TLS_EXTENSION_ALPN:
+        ParseAlpn(ptr, ptr + extlen, hello);
+        break;
+    }
+
+    ptr += extlen;
+  }
+
+  /* All the extensions have been walked? */
+  hello->complete = (hello->extensions) && (ptr == end);
+
+  return TRUE;
+}
+
+BOOL GetTlsFingerprint(const tls_client_hello_t* hello, UINT8* digest)
+{
+  md5_t ctx;
+  BOOL first;
+
+  if (!hello->complete) {
+    return FALSE;
+  }
+
+  Md5Init(&ctx);
+
+  first = TRUE;
+  HashNumber(&ctx, hello->version, &first);
+  Md5Update(&ctx, ",", 1);
+
+  HashList(&ctx, hello->ciphers, hello->cipherslen, 2, 2);
+  Md5Update(&ctx, ",", 1);
+
+  /* Extension types: type (2 bytes) + data (2-byte length). */
+  HashList(&ctx, hello->extensions, hello->extensionslen, 2, 0);
+  Md5Update(&ctx, ",", 1);
+
+  HashList(&ctx, hello->groups, hello->groupslen, 2, 2);
+  Md5Update(&ctx, ",", 1);
+
+  HashList(&ctx, hello->point_formats, hello->point_formatslen, 1, 1);
+
+  Md5Final(&ctx, digest);
+
+  return TRUE;
+}
+
+void FormatAlpnList(const UINT8* alpn, SIZE_T len, char* buf, size_t size)
+{
+  const UINT8* end;
+  char* dest;
+  UINT8 idlen;
+  UINT8 i;
+
+  *buf = 0;
+
+  /* Each length byte becomes a separator:
+   * " [ALPN: " + identifiers separated by ',' + "]" + NUL.
+   */
+  if ((!alpn) || (len == 0) || (len + 9 > size)) {
+    return;
+  }
+
+  end = alpn + len;
+
+  memcpy(buf, " [ALPN: ", 8);
+  dest = buf + 8;
+
+  while (alpn < end) {
+    idlen = *alpn++;
+
+    if ((idlen == 0) || ((SIZE_T) (end - alpn) < idlen)) {
+      *buf = 0;
+      return;
+    }
+
+    if (dest != buf + 8) {
+      *dest++ = ',';
+    }
+
+    /* Printable characters, without spaces (the log fields are separated
+     * by spaces).
+     */
+    for (i = 0; i < idlen; i++) {
+      if ((alpn[i] <= ' ') || (alpn[i] >= 0x7f)) {
+        *buf = 0;
+        return;
+      }
+
+      *dest++ = (char) alpn[i];
+    }
+
+    alpn += idlen;
+  }
+
+  *dest++ = ']';
+  *dest = 0;
+}
+
+void ParseServerName(const UINT8* ptr,
+                     const UINT8* end,
+                     tls_client_hello_t* hello)
+{
+  const UINT8* list_end;
+  UINT16 namelen;
+
+  if (end - ptr < 2) {
+    return;
+  }
+
+  list_end = ptr + 2 + GetUint16(ptr);
+  if (list_end > end) {
+    return;
+  }
+
+  ptr += 2;
+
+  /* Entries: type (1 byte) + name (2-byte length). */
+  while (list_end - ptr >= 3) {
+    namelen = GetUint16(ptr + 1);
+
+    if ((SIZE_T) (list_end - (ptr + 3)) < namelen) {
+      return;
+    }
+
+    if ((*ptr == TLS_SERVER_NAME_HOST_NAME) && (namelen > 0)) {
+      hello->server_name = ptr + 3;
+      hello->server_namelen = namelen;
+
+      return;
+    }
+
+    ptr += (3 + namelen);
+  }
+}
+
+void ParseAlpn(const UINT8* ptr,
+               const UINT8* end,
+               tls_client_hello_t* hello)
+{
+  SIZE_T listlen;
+
+  if (end - ptr < 2) {
+    return;
+  }
+
+  listlen = GetUint16(ptr);
+  if ((listlen == 0) || ((SIZE_T) (end - (ptr + 2)) < listlen)) {
+    return;
+  }
+
+  hello->alpn = ptr + 2;
+  hello->alpnlen = listlen;
+}
+
+/* Hash the values of 'size' bytes separated by '-'. If 'stride' is 0, the
+ * values are followed by a 2-byte length and data (extensions).
+ */
+void HashList(md5_t* ctx,
+              const UINT8* ptr,
+              SIZE_T len,
+              unsigned size,
+              unsigned stride)
+{
+  const UINT8* end;
+  UINT16 n;
+  BOOL first;
+
+  end = ptr + len;
+  first = TRUE;
+
+  while ((SIZE_T) (end - ptr) >= size) {
+    if (size == 2) {
+      n = GetUint16(ptr);
+
+      if (!IsGrease(n)) {
+        HashNumber(ctx, n, &first);
+      }
+    } else {
+      HashNumber(ctx, *ptr, &first);
+    }
+
+    if (stride == 0) {
+      /* The extensions have already been validated. */
+      ptr += (4 + GetUint16(ptr + 2));
+    } else {
+      ptr += stride;
+    }
+  }
+}
+
+void HashNumber(md5_t* ctx, UINT16 n, BOOL* first)
+{
+  char digits[6];
+  char* ptr;
+
+  ptr = digits + sizeof(digits);
+
+  do {
+    *--ptr = (char) ('0' + (n % 10));
+    n /= 10;
+  } while (n > 0);
+
+  if (!*first) {
+    *--ptr = '-';
+  }
+
+  *first = FALSE;
+
+  Md5Update(ctx, ptr, digits + sizeof(digits) - ptr);
+}
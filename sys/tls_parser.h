@@ -0,0 +1,70 @@
+#ifndef TLS_PARSER_H
+#define TLS_PARSER_H
+
+#pragma warning(push)
+#pragma warning(disable:4201) /* Unnamed struct/union. */
+
+#include <fwpsk.h>
+
+#pragma warning(pop)
+
+#include "md5.h"
+
+typedef struct {
+  /* Version of the ClientHello (legacy_version). */
+  UINT16 version;
+
+  /* Host name of the server_name extension (NULL if not present). */
+  const UINT8* server_name;
+  SIZE_T server_namelen;
+
+  /* Protocol name list of the ALPN extension, without its length (NULL if
+   * not present): sequence of 1-byte length + protocol name.
+   */
+  const UINT8* alpn;
+  SIZE_T alpnlen;
+
+  /* Cipher suites (2 bytes each). */
+  const UINT8* ciphers;
+  SIZE_T cipherslen;
+
+  /* Extensions block, without its length. */
+  const UINT8* extensions;
+  SIZE_T extensionslen;
+
+  /* Supported groups (2 bytes each) and EC point formats (1 byte each). */
+  const UINT8* groups;
+  SIZE_T groupslen;
+  const UINT8* point_formats;
+  SIZE_T point_formatslen;
+
+  /* TRUE if the whole ClientHello was parsed (not truncated). */
+  BOOL complete;
+} tls_client_hello_t;
+
+/* Parse the TLS ClientHello at the beginning of 'data'. The fields point to
+ * 'data', nothing is copied. If the ClientHello doesn't fit in 'data', the
+ * extensions found before the end are still returned. Return FALSE if 'data'
+ * doesn't start with a ClientHello.
+ */
+BOOL ParseTlsClientHello(const UINT8* data,
+                         SIZE_T len,
+                         tls_client_hello_t* hello);
+
+/* Compute the JA3 fingerprint of the ClientHello: MD5 of
+ * "version,ciphers,extensions,groups,point formats" (decimal values joined
+ * with '-', GREASE values excluded). The string is hashed as it is
+ * generated, it is never built. Return FALSE if the ClientHello is
+ * truncated.
+ */
+BOOL GetTlsFingerprint(const tls_client_hello_t* hello, UINT8* digest);
+
+/* Format a list of ALPN protocol identifiers (1-byte length + identifier,
+ * as in the ALPN extension and in the alpn parameter of SVCB records) as
+ * " [ALPN: h2,http/1.1]". 'buf' is empty if the list is empty, if an
+ * identifier is empty, runs past the end or has a character which is not
+ * printable (space included), or if 'size' is smaller than 'len' + 9.
+ */
+void FormatAlpnList(const UINT8* alpn, SIZE_T len, char* buf, size_t size);
+
+#endif /* TLS_PARSER_H */
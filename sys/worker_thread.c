@@ -1,26 +1,76 @@
+#include <ip2string.h>
 #include "worker_thread.h"
+#include "inspect.h"
 #include "packet_processor.h"
 #include "logfile.h"
+#include "dnssnapshot.h"
+#include "dnscache.h"
+#include "http_flow.h"
+#include "dns_flow.h"
+#include "dns_query.h"
+#include "tls_flow.h"
 
-#define FLUSH_LOGS_EVERY_MS 1000
+#define SAVE_DNS_CACHE_EVERY_MS (5 * 60 * 1000)
+
+/* Buckets of the DNS cache moved per iteration while it is resized (the
+ * packets are processed in between).
+ */
+#define DNS_CACHE_MOVE_BUCKETS 256
+
+/* The share of the lookups answered by the DNS cache during this period
+ * after the driver starts (which the snapshot should raise) is logged.
+ */
+#define STARTUP_ATTRIBUTION_MS (60 * 1000)
 
 typedef struct {
+  /* Ring buffer of queued packets: 'count' packets from 'head' (the
+   * oldest), so the packets are processed in arrival order (the segments
+   * of a TCP flow must be).
+   */
   packet_t** packets;
   unsigned max_packets;
+  unsigned head;
   unsigned count;
 
+  unsigned stats_interval_ms;
+  unsigned flush_interval_ms;
+
+  /* At the previous statistics (to compute the rates). */
+  classify_stats_t classify_stats;
+
   void* thread;
   BOOL running;
 
   KSPIN_LOCK spin_lock;
   KSEMAPHORE semaphore;
+
+  /* Function requested by RunInWorkerThread(). */
+  worker_fn_t fn;
+  void* fn_context;
+  NTSTATUS fn_status;
+
+  KEVENT fn_request;
+  KEVENT fn_done;
 } worker_thread_t;
 
 static worker_thread_t worker;
 
 static void ThreadProc(void* context);
-
-BOOL InitWorkerThread(unsigned max_packets)
+static void ReleasePacket(packet_t* packet);
+static void QueuePacket(packet_t* packet);
+static void LogStats(LONG64 elapsed_ms);
+static void LogStartupAttribution();
+static void LogClassifyStats(LARGE_INTEGER* system_time, LONG64 elapsed_ms);
+static void LogDnsCacheStats(LARGE_INTEGER* system_time,
+                             const char* family,
+                             const dns_cache_stats_t* stats);
+static void LogDnsQueryStats(LARGE_INTEGER* system_time);
+static void LogDnsResolverStats(LARGE_INTEGER* system_time,
+                                const dns_resolver_stats_t* stats);
+
+BOOL InitWorkerThread(unsigned max_packets,
+                      unsigned stats_interval_ms,
+                      unsigned flush_interval_ms)
 {
   if (max_packets < MIN_PACKETS) {
     return FALSE;
@@ -35,13 +85,25 @@ BOOL InitWorkerThread(unsigned max_packets)
   }
 
   worker.max_packets = max_packets;
+  worker.head = 0;
   worker.count = 0;
 
+  worker.stats_interval_ms = stats_interval_ms;
+  worker.flush_interval_ms = flush_interval_ms;
+  RtlZeroMemory(&worker.classify_stats, sizeof(classify_stats_t));
+
   worker.thread = NULL;
   worker.running = FALSE;
 
   KeInitializeSpinLock(&worker.spin_lock);
-  KeInitializeSemaphore(&worker.semaphore, 0, max_packets);
+
+  /* The worker thread takes several packets per wake-up, so the count of
+   * the semaphore might be higher than the number of queued packets.
+   */
+  KeInitializeSemaphore(&worker.semaphore, 0, MAXLONG);
+
+  KeInitializeEvent(&worker.fn_request, SynchronizationEvent, FALSE);
+  KeInitializeEvent(&worker.fn_done, SynchronizationEvent, FALSE);
 
   return TRUE;
 }
@@ -51,8 +113,9 @@ void FreeWorkerThread()
   unsigned i;
 
   if (worker.packets) {
+    /* The packets belong to the packet pools. */
     for (i = 0; i < worker.count; i++) {
-      ExFreePoolWithTag(worker.packets[i], PACKET_POOL_TAG);
+      ReleasePacket(worker.packets[(worker.head + i) % worker.max_packets]);
     }
 
     ExFreePoolWithTag(worker.packets, PACKET_POOL_TAG);
@@ -60,6 +123,72 @@ void FreeWorkerThread()
   }
 }
 
+BOOL GrowWorkerThreadQueue(unsigned max_packets)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  packet_t** packets;
+  packet_t** old;
+  unsigned i;
+
+  if (max_packets <= worker.max_packets) {
+    return TRUE;
+  }
+
+  if ((packets = (packet_t**) ExAllocatePoolWithTag(
+                                NonPagedPool,
+                                max_packets * sizeof(packet_t*),
+                                PACKET_POOL_TAG
+                              )) == NULL) {
+    return FALSE;
+  }
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLock(&worker.spin_lock, &lock_handle);
+
+  /* The queued packets go to the beginning of the new ring. */
+  for (i = 0; i < worker.count; i++) {
+    packets[i] = worker.packets[(worker.head + i) % worker.max_packets];
+  }
+
+  /* Swap the arrays (the old one is freed after releasing the lock). */
+  old = worker.packets;
+  worker.packets = packets;
+
+  worker.max_packets = max_packets;
+  worker.head = 0;
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+  ExFreePoolWithTag(old, PACKET_POOL_TAG);
+
+  return TRUE;
+}
+
+void SetWorkerThreadIntervals(unsigned stats_interval_ms,
+                              unsigned flush_interval_ms)
+{
+  /* Read by the worker thread on each iteration. */
+  worker.stats_interval_ms = stats_interval_ms;
+  worker.flush_interval_ms = flush_interval_ms;
+}
+
+NTSTATUS RunInWorkerThread(worker_fn_t fn, void* context)
+{
+  if (!worker.running) {
+    return STATUS_DEVICE_NOT_READY;
+  }
+
+  worker.fn = fn;
+  worker.fn_context = context;
+
+  KeSetEvent(&worker.fn_request, IO_NO_INCREMENT, FALSE);
+
+  KeWaitForSingleObject(&worker.fn_done, Executive, KernelMode, FALSE, NULL);
+
+  return worker.fn_status;
+}
+
 NTSTATUS StartWorkerThread()
 {
   HANDLE thread;
@@ -107,8 +236,7 @@ BOOL GivePacketToWorkerThread(packet_t* packet)
   KeAcquireInStackQueuedSpinLockAtDpcLevel(&worker.spin_lock, &lock_handle);
 
   if (worker.count < worker.max_packets) {
-    worker.packets[worker.count] = packet;
-    worker.count++;
+    QueuePacket(packet);
 
     /* Release spin lock. */
     KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
@@ -124,6 +252,46 @@ BOOL GivePacketToWorkerThread(packet_t* packet)
   }
 }
 
+unsigned GivePacketsToWorkerThread(packet_t** packets, unsigned count)
+{
+  KLOCK_QUEUE_HANDLE lock_handle;
+  unsigned i;
+
+  /* Acquire spin lock. */
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(&worker.spin_lock, &lock_handle);
+
+  if (count > worker.max_packets - worker.count) {
+    count = worker.max_packets - worker.count;
+  }
+
+  for (i = 0; i < count; i++) {
+    QueuePacket(packets[i]);
+  }
+
+  /* Release spin lock. */
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+
+  if (count > 0) {
+    KeReleaseSemaphore(&worker.semaphore, IO_NO_INCREMENT, count, FALSE);
+  }
+
+  return count;
+}
+
+void QueuePacket(packet_t* packet)
+{
+  unsigned tail;
+
+  /* Called with the spin lock held and room in the queue. */
+  tail = worker.head + worker.count;
+  if (tail >= worker.max_packets) {
+    tail -= worker.max_packets;
+  }
+
+  worker.packets[tail] = packet;
+  worker.count++;
+}
+
 /* Disable warning:
  * Conditional expression is constant:
  * do {
@@ -136,20 +304,56 @@ void ThreadProc(void* context)
 {
   KLOCK_QUEUE_HANDLE lock_handle;
   LARGE_INTEGER timeout;
-  packet_t* packet;
+  LARGE_INTEGER system_time;
+  void* objects[2];
+  packet_t* packets[PACKET_BATCH_SIZE];
+  unsigned count;
+  unsigned i;
+  unsigned stats_interval_ms;
+  ULONGLONG start;
+  ULONGLONG last_save;
+  ULONGLONG last_stats;
+  ULONGLONG now;
+  BOOL attribution_logged;
+  BOOL resizing;
 
   UNREFERENCED_PARAMETER(context);
 
-  timeout = RtlConvertLongToLargeInteger(-10000 * FLUSH_LOGS_EVERY_MS);
+  /* A function requested by RunInWorkerThread() goes before the packets. */
+  objects[0] = &worker.fn_request;
+  objects[1] = &worker.semaphore;
+
+  start = KeQueryInterruptTime();
+  last_save = start;
+  last_stats = start;
+  attribution_logged = FALSE;
+  resizing = FALSE;
 
   do {
+    /* The intervals might be changed by SetWorkerThreadIntervals(). While
+     * the DNS cache is resized, don't wait if there are no packets.
+     */
+    timeout.QuadPart = (resizing) ?
+                       0 :
+                       -10000 * (LONGLONG) worker.flush_interval_ms;
+
+    stats_interval_ms = worker.stats_interval_ms;
+
     /* Wait for packet. */
-    switch (KeWaitForSingleObject(&worker.semaphore,
-                                  Executive,
-                                  KernelMode,
-                                  FALSE,
-                                  &timeout)) {
-      case STATUS_SUCCESS:
+    switch (KeWaitForMultipleObjects(2,
+                                     objects,
+                                     WaitAny,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     &timeout,
+                                     NULL)) {
+      case STATUS_WAIT_0:
+        worker.fn_status = worker.fn(worker.fn_context);
+
+        KeSetEvent(&worker.fn_done, IO_NO_INCREMENT, FALSE);
+        break;
+      case STATUS_WAIT_1:
         if (!worker.running) {
           return;
         }
@@ -158,17 +362,30 @@ void ThreadProc(void* context)
         KeAcquireInStackQueuedSpinLock(&worker.spin_lock, &lock_handle);
 
         if (worker.count > 0) {
-          worker.count--;
-          packet = worker.packets[worker.count];
+          /* Take as many packets as possible (in arrival order). */
+          count = (worker.count < PACKET_BATCH_SIZE) ? worker.count :
+                                                       PACKET_BATCH_SIZE;
+
+          for (i = 0; i < count; i++) {
+            packets[i] = worker.packets[worker.head];
+
+            if (++worker.head == worker.max_packets) {
+              worker.head = 0;
+            }
+          }
+
+          worker.count -= count;
 
           /* Release spin lock. */
           KeReleaseInStackQueuedSpinLock(&lock_handle);
 
-          /* Process packet. */
-          ProcessPacket(packet);
+          /* Process packets. */
+          ProcessPackets(packets, count);
 
-          /* Return packet to the packet pool. */
-          PushPacket(packet);
+          /* Return packets to the packet pools. */
+          for (i = 0; i < count; i++) {
+            ReleasePacket(packets[i]);
+          }
         } else {
           /* Release spin lock. */
           KeReleaseInStackQueuedSpinLock(&lock_handle);
@@ -180,8 +397,249 @@ void ThreadProc(void* context)
           return;
         }
 
-        FlushLog();
+        if (!resizing) {
+          FlushLog();
+        }
+
         break;
     }
+
+    /* Move the next entries of the DNS cache if it is being resized (by a
+     * function requested by RunInWorkerThread()).
+     */
+    KeQuerySystemTime(&system_time);
+    resizing = MoveDnsCacheEntries(DNS_CACHE_MOVE_BUCKETS,
+                                   system_time.QuadPart);
+
+    /* Save a snapshot of the DNS cache periodically (interrupt time is in
+     * 100-nanosecond units).
+     */
+    now = KeQueryInterruptTime();
+    if (now - last_save >= (ULONGLONG) SAVE_DNS_CACHE_EVERY_MS * 10000) {
+      SaveDnsCacheSnapshot();
+      last_save = now;
+    }
+
+    if ((stats_interval_ms != 0) &&
+        (now - last_stats >= (ULONGLONG) stats_interval_ms * 10000)) {
+      LogStats((LONG64) ((now - last_stats) / 10000));
+      last_stats = now;
+    }
+
+    if ((!attribution_logged) &&
+        (now - start >= (ULONGLONG) STARTUP_ATTRIBUTION_MS * 10000)) {
+      LogStartupAttribution();
+      attribution_logged = TRUE;
+    }
   } while (TRUE);
 }
+
+void ReleasePacket(packet_t* packet)
+{
+  /* Reassembled HTTP request header, DNS message or TLS record? */
+  if ((!ReleaseHttpFlowPacket(packet)) &&
+      (!ReleaseDnsFlowPacket(packet)) &&
+      (!ReleaseTlsFlowPacket(packet))) {
+    PushPacket(packet);
+  }
+}
+
+void LogStats(LONG64 elapsed_ms)
+{
+  LARGE_INTEGER system_time;
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+
+  KeQuerySystemTime(&system_time);
+
+  LogClassifyStats(&system_time, elapsed_ms);
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+
+  LogDnsCacheStats(&system_time, "IPv4", &ipv4_stats);
+  LogDnsCacheStats(&system_time, "IPv6", &ipv6_stats);
+
+  if (DnsQueriesTracked()) {
+    LogDnsQueryStats(&system_time);
+  }
+}
+
+void LogStartupAttribution()
+{
+  LARGE_INTEGER system_time;
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  ULONGLONG hits;
+  ULONGLONG lookups;
+
+  KeQuerySystemTime(&system_time);
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+
+  hits = ipv4_stats.hits + ipv6_stats.hits;
+  lookups = hits + ipv4_stats.misses + ipv6_stats.misses;
+
+  Log(&system_time,
+      "[DNS] Startup attribution: %I64u of %I64u lookups (%I64u%%) found "
+      "a hostname in the first %u s.\r\n",
+      hits,
+      lookups,
+      (lookups > 0) ? (hits * 100) / lookups : 0,
+      STARTUP_ATTRIBUTION_MS / 1000);
+}
+
+void LogClassifyStats(LARGE_INTEGER* system_time, LONG64 elapsed_ms)
+{
+  classify_stats_t stats;
+  classify_stats_t* last;
+
+  GetClassifyStats(&stats);
+
+  last = &worker.classify_stats;
+
+  /* Rates per second since the previous statistics. */
+  Log(system_time,
+      "[STATS] Classify calls: stream %I64d (%I64d/s), datagram %I64d "
+      "(%I64d/s), closure %I64d (%I64d/s).\r\n",
+      stats.stream,
+      (stats.stream - last->stream) * 1000 / elapsed_ms,
+      stats.datagram,
+      (stats.datagram - last->datagram) * 1000 / elapsed_ms,
+      stats.closure,
+      (stats.closure - last->closure) * 1000 / elapsed_ms);
+
+  *last = stats;
+}
+
+void LogDnsCacheStats(LARGE_INTEGER* system_time,
+                      const char* family,
+                      const dns_cache_stats_t* stats)
+{
+  unsigned i;
+
+  Log(system_time,
+      "[STATS] DNS cache %s: %u/%u entries (%Iu bytes), %I64u inserts, "
+      "%I64u overwrites, %I64u refreshes, %I64u evictions, %I64u hits, "
+      "%I64u misses.\r\n",
+      family,
+      stats->entries,
+      stats->max_entries,
+      stats->memory,
+      stats->inserts,
+      stats->overwrites,
+      stats->refreshes,
+      stats->evictions,
+      stats->hits,
+      stats->misses);
+
+  Log(system_time,
+      "[STATS] DNS cache %s: %u/%u buckets used, chain length: "
+      "max %u, average %u.%02u, filter false-positive rate: %u.%04u%% "
+      "(%u saturated counters).\r\n",
+      family,
+      stats->used_buckets,
+      stats->nbuckets,
+      stats->max_chain,
+      stats->avg_chain / 100,
+      stats->avg_chain % 100,
+      stats->false_positive_rate / 10000,
+      stats->false_positive_rate % 10000,
+      stats->filter_saturated);
+
+  /* Only the bins which have pages. */
+  for (i = 0; i < DNS_CACHE_BINS; i++) {
+    if (stats->bin_pages[i] > 0) {
+      Log(system_time,
+          "[STATS] DNS cache %s: bin %u (<= %u bytes): %u pages, "
+          "%u free slots.\r\n",
+          family,
+          i,
+          stats->bin_max_len[i],
+          stats->bin_pages[i],
+          stats->bin_free_slots[i]);
+    }
+  }
+}
+
+void LogDnsQueryStats(LARGE_INTEGER* system_time)
+{
+  dns_query_stats_t stats;
+  dns_resolver_stats_t resolver;
+  unsigned i;
+
+  GetDnsQueryStats(&stats);
+
+  Log(system_time,
+      "[STATS] DNS queries: %I64u sent, %I64u answered, %I64u unanswered, "
+      "%I64u evicted, %I64u unsolicited responses.\r\n",
+      stats.queries,
+      stats.answered,
+      stats.unanswered,
+      stats.evicted,
+      stats.unsolicited);
+
+  for (i = 0; GetDnsResolverStats(i, &resolver); i++) {
+    LogDnsResolverStats(system_time, &resolver);
+  }
+}
+
+void LogDnsResolverStats(LARGE_INTEGER* system_time,
+                         const dns_resolver_stats_t* stats)
+{
+  char ip[64];
+  ULONGLONG average;
+  unsigned i;
+
+  if (stats->ip_version == 4) {
+    RtlIpv4AddressToStringA((const IN_ADDR*) stats->ip, ip);
+  } else if (stats->ip_version == 6) {
+    RtlIpv6AddressToStringA((const IN6_ADDR*) stats->ip, ip);
+  } else {
+    /* The resolvers which don't have a slot of their own. */
+    RtlCopyMemory(ip, "other", sizeof("other"));
+  }
+
+  /* Latencies in microseconds. */
+  average = (stats->answered > 0) ? stats->total_latency / stats->answered :
+                                    0;
+
+  Log(system_time,
+      "[STATS] DNS resolver %s: %I64u queries, %I64u answered, "
+      "%I64u unanswered, latency: average %I64u.%03u ms, "
+      "max %I64u.%03u ms.\r\n",
+      ip,
+      stats->queries,
+      stats->answered,
+      stats->unanswered,
+      average / 1000,
+      (unsigned) (average % 1000),
+      stats->max_latency / 1000,
+      (unsigned) (stats->max_latency % 1000));
+
+  /* Only the bins which have responses. */
+  for (i = 0; i < DNS_LATENCY_BINS; i++) {
+    if (stats->latency[i] > 0) {
+      if (i == 0) {
+        Log(system_time,
+            "[STATS] DNS resolver %s: latency < 1 ms: %I64u responses.\r\n",
+            ip,
+            stats->latency[i]);
+      } else if (i < DNS_LATENCY_BINS - 1) {
+        Log(system_time,
+            "[STATS] DNS resolver %s: latency %u-%u ms: "
+            "%I64u responses.\r\n",
+            ip,
+            1u << (i - 1),
+            1u << i,
+            stats->latency[i]);
+      } else {
+        Log(system_time,
+            "[STATS] DNS resolver %s: latency >= %u ms: "
+            "%I64u responses.\r\n",
+            ip,
+            1u << (i - 1),
+            stats->latency[i]);
+      }
+    }
+  }
+}
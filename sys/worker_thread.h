@@ -10,12 +10,40 @@
 
 #include "packet_pool.h"
 
-BOOL InitWorkerThread(unsigned max_packets);
+/* Log the statistics every 'stats_interval_ms' milliseconds (0: never) and
+ * flush the log file every 'flush_interval_ms' milliseconds.
+ */
+BOOL InitWorkerThread(unsigned max_packets,
+                      unsigned stats_interval_ms,
+                      unsigned flush_interval_ms);
 void FreeWorkerThread();
 
+/* Function run by the worker thread (see RunInWorkerThread()). */
+typedef NTSTATUS (*worker_fn_t)(void* context);
+
+/* Let the queue of the worker thread hold up to 'max_packets' packets (it
+ * doesn't shrink).
+ */
+BOOL GrowWorkerThreadQueue(unsigned max_packets);
+
+void SetWorkerThreadIntervals(unsigned stats_interval_ms,
+                              unsigned flush_interval_ms);
+
+/* Run 'fn' in the worker thread between two batches of packets (for the
+ * state only the worker thread touches: the log file and the DNS cache) and
+ * return its status. The packets which arrive meanwhile are queued. One
+ * call at a time, at PASSIVE_LEVEL.
+ */
+NTSTATUS RunInWorkerThread(worker_fn_t fn, void* context);
+
 NTSTATUS StartWorkerThread();
 void StopWorkerThread();
 
 BOOL GivePacketToWorkerThread(packet_t* packet);
 
+/* Give the packets in a single acquisition of the spin lock. Return the
+ * number of packets taken (the first ones).
+ */
+unsigned GivePacketsToWorkerThread(packet_t** packets, unsigned count);
+
 #endif /* WORKER_THREAD_H */
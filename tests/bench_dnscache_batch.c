@@ -0,0 +1,148 @@
+/* Batch lookups of the DNS cache (sys/dnscache.c): time per lookup of
+ * random addresses one at a time and in batches of DNS_CACHE_BATCH_SIZE,
+ * for caches from L2 size to well beyond the last level cache, where the
+ * batches overlap the memory latency of the lookups. A quarter of the
+ * addresses are not in the cache.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "../sys/dnscache.h"
+#include "test_util.h"
+
+#define NLOOKUPS (1 << 22)
+
+static const unsigned sizes[] = {16384, 262144, 1048576, 4194304};
+
+static UINT8 (*ips)[4];
+
+static double Now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static double Single(unsigned* found)
+{
+  char hostname[256];
+  double start;
+  unsigned i;
+
+  *found = 0;
+
+  start = Now();
+
+  for (i = 0; i < NLOOKUPS; i++) {
+    if (GetIPv4FromDnsCache(ips[i], hostname)) {
+      (*found)++;
+    }
+  }
+
+  return (Now() - start) * 1e9 / NLOOKUPS;
+}
+
+static double Batch(unsigned* found)
+{
+  char hostname[DNS_CACHE_BATCH_SIZE][256];
+  char* hostnames[DNS_CACHE_BATCH_SIZE];
+  const UINT8* ptrs[DNS_CACHE_BATCH_SIZE];
+  double start;
+  unsigned i;
+  unsigned j;
+
+  for (j = 0; j < DNS_CACHE_BATCH_SIZE; j++) {
+    hostnames[j] = hostname[j];
+  }
+
+  *found = 0;
+
+  start = Now();
+
+  for (i = 0; i < NLOOKUPS; i += DNS_CACHE_BATCH_SIZE) {
+    for (j = 0; j < DNS_CACHE_BATCH_SIZE; j++) {
+      ptrs[j] = ips[i + j];
+    }
+
+    *found += GetIPv4BatchFromDnsCache(ptrs,
+                                       DNS_CACHE_BATCH_SIZE,
+                                       hostnames);
+  }
+
+  return (Now() - start) * 1e9 / NLOOKUPS;
+}
+
+int main()
+{
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  char hostname[64];
+  UINT8 ip[4];
+  double single;
+  double batch;
+  unsigned found_single;
+  unsigned found_batch;
+  unsigned seed;
+  unsigned size;
+  unsigned len;
+  unsigned s;
+  unsigned i;
+
+  if ((ips = malloc(NLOOKUPS * sizeof(*ips))) == NULL) {
+    return 1;
+  }
+
+  printf("%8s %10s %10s %10s %8s\n",
+         "entries",
+         "memory MB",
+         "single ns",
+         "batch ns",
+         "speedup");
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size = sizes[s];
+
+    if (!InitDnsCache(size / 2, size, FALSE)) {
+      return 1;
+    }
+
+    for (i = 0; i < size; i++) {
+      MakeAddress(i, ip);
+      len = (unsigned) sprintf(hostname, "host%u.example.com", i);
+
+      AddIPv4ToDnsCache(ip, hostname, (UINT16) len, 0x7fffffffffffffffLL);
+    }
+
+    /* Addresses in [size, 4 * size / 3) are not in the cache. */
+    seed = 42;
+
+    for (i = 0; i < NLOOKUPS; i++) {
+      MakeAddress(Random(&seed) % (size + (size / 3)), ips[i]);
+    }
+
+    single = Single(&found_single);
+    batch = Batch(&found_batch);
+
+    if (found_single != found_batch) {
+      fprintf(stderr, "Single and batch lookups disagree.\n");
+      return 1;
+    }
+
+    GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+
+    printf("%8u %10u %10.1f %10.1f %7.2fx\n",
+           size,
+           (unsigned) (ipv4_stats.memory >> 20),
+           single,
+           batch,
+           single / batch);
+
+    FreeDnsCache();
+  }
+
+  free(ips);
+
+  return 0;
+}
@@ -0,0 +1,163 @@
+/* Miss path of the DNS cache (sys/dnscache.c, included to reach the
+ * filter): time per lookup of addresses which are not in the cache, with
+ * single and batch lookups, compared to the hits, for caches from a few
+ * thousand entries (in L2) to a million. The false-positive rate of the
+ * filter is measured and compared to the estimate of the statistics.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "../sys/dnscache.c"
+#include "test_util.h"
+
+#define NLOOKUPS (1 << 22)
+
+/* The cache holds 10.x.y.z, the misses are 11.x.y.z. */
+#define ABSENT (1 << 24)
+
+static const unsigned sizes[] = {4096, 65536, 1048576};
+
+static double Now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static UINT8 (*ips)[4];
+
+static void MakeAddresses(unsigned size, BOOL present)
+{
+  unsigned seed;
+  unsigned i;
+
+  seed = 42;
+
+  for (i = 0; i < NLOOKUPS; i++) {
+    MakeAddress((Random(&seed) % size) + (present ? 0 : ABSENT), ips[i]);
+  }
+}
+
+static double Single()
+{
+  char hostname[256];
+  double start;
+  unsigned i;
+
+  start = Now();
+
+  for (i = 0; i < NLOOKUPS; i++) {
+    GetIPv4FromDnsCache(ips[i], hostname);
+  }
+
+  return (Now() - start) * 1e9 / NLOOKUPS;
+}
+
+static double Batch()
+{
+  char hostname[DNS_CACHE_BATCH_SIZE][256];
+  char* hostnames[DNS_CACHE_BATCH_SIZE];
+  const UINT8* ptrs[DNS_CACHE_BATCH_SIZE];
+  double start;
+  unsigned i;
+  unsigned j;
+
+  for (j = 0; j < DNS_CACHE_BATCH_SIZE; j++) {
+    hostnames[j] = hostname[j];
+  }
+
+  start = Now();
+
+  for (i = 0; i < NLOOKUPS; i += DNS_CACHE_BATCH_SIZE) {
+    for (j = 0; j < DNS_CACHE_BATCH_SIZE; j++) {
+      ptrs[j] = ips[i + j];
+    }
+
+    GetIPv4BatchFromDnsCache(ptrs, DNS_CACHE_BATCH_SIZE, hostnames);
+  }
+
+  return (Now() - start) * 1e9 / NLOOKUPS;
+}
+
+int main()
+{
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  char hostname[64];
+  UINT8 ip[4];
+  double miss_single;
+  double miss_batch;
+  double hit_single;
+  double hit_batch;
+  unsigned passed;
+  unsigned size;
+  unsigned len;
+  unsigned s;
+  unsigned i;
+
+  if ((ips = malloc(NLOOKUPS * sizeof(*ips))) == NULL) {
+    return 1;
+  }
+
+  printf("%8s %11s %11s %10s %10s %9s %9s\n",
+         "entries",
+         "miss ns",
+         "miss batch",
+         "hit ns",
+         "hit batch",
+         "FP est.",
+         "FP meas.");
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size = sizes[s];
+
+    if (!InitDnsCache(size / 2, size, FALSE)) {
+      return 1;
+    }
+
+    for (i = 0; i < size; i++) {
+      MakeAddress(i, ip);
+      len = (unsigned) sprintf(hostname, "host%u.example.com", i);
+
+      AddIPv4ToDnsCache(ip, hostname, (UINT16) len, 0x7fffffffffffffffLL);
+    }
+
+    MakeAddresses(size, FALSE);
+
+    miss_single = Single();
+    miss_batch = Batch();
+
+    /* Misses which pass the filter. */
+    passed = 0;
+
+    for (i = 0; i < NLOOKUPS; i++) {
+      if (MayBeInFilter(&ipv4_cache.table->filter, ips[i], 4)) {
+        passed++;
+      }
+    }
+
+    MakeAddresses(size, TRUE);
+
+    hit_single = Single();
+    hit_batch = Batch();
+
+    GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+
+    printf("%8u %11.1f %11.1f %10.1f %10.1f %8.3f%% %8.3f%%\n",
+           size,
+           miss_single,
+           miss_batch,
+           hit_single,
+           hit_batch,
+           ipv4_stats.false_positive_rate / 10000.0,
+           passed * 100.0 / NLOOKUPS);
+
+    FreeDnsCache();
+  }
+
+  free(ips);
+
+  return 0;
+}
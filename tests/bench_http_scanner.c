@@ -0,0 +1,161 @@
+/* HTTP scanner (sys/http_scanner.c): cycles per request to index the lines
+ * of the request header with a byte loop and with IndexHttpLines(), and to
+ * parse the whole request with ParseHttpRequest(), for a short request
+ * (Host first) to a long one (Host last).
+ */
+
+#include <stdio.h>
+#include <x86intrin.h>
+#include "../sys/http_scanner.h"
+
+#define NRUNS 30
+#define NITERATIONS 100000
+#define MAX_LINES 33
+
+static const char* requests[] = {
+  "GET / HTTP/1.1\r\n"
+  "Host: a.io\r\n"
+  "\r\n",
+
+  "GET / HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "Accept: */*\r\n"
+  "\r\n",
+
+  "GET /index.html HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "User-Agent: curl/8.4.0\r\n"
+  "Accept: */*\r\n"
+  "\r\n",
+
+  "GET /static/js/app.5f3c2a.js HTTP/1.1\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+  "Firefox/115.0\r\n"
+  "Accept: */*\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Referer: http://www.example.com/index.html\r\n"
+  "Connection: keep-alive\r\n"
+  "Cookie: session=0123456789abcdef0123456789abcdef\r\n"
+  "Cache-Control: no-cache\r\n"
+  "Host: www.example.com\r\n"
+  "\r\n"
+};
+
+/* Results (so that the calls are not optimized away). */
+static volatile SIZE_T sink;
+
+static unsigned IndexLines(const UINT8* data,
+                           SIZE_T len,
+                           SIZE_T off,
+                           http_line_t* lines,
+                           unsigned max)
+{
+  unsigned nlines;
+  SIZE_T pos;
+
+  nlines = 0;
+
+  for (pos = off; pos < len; pos++) {
+    if (data[pos] == '\n') {
+      if (nlines == max) {
+        break;
+      }
+
+      lines[nlines].off = (UINT32) (pos + 1);
+      lines[nlines].colon = HTTP_NO_COLON;
+      nlines++;
+
+      if ((pos + 1 < len) &&
+          ((data[pos + 1] == '\r') || (data[pos + 1] == '\n'))) {
+        break;
+      }
+    } else if ((data[pos] == ':') &&
+               (nlines > 0) &&
+               (lines[nlines - 1].colon == HTTP_NO_COLON)) {
+      lines[nlines - 1].colon = (UINT32) pos;
+    }
+  }
+
+  return nlines;
+}
+
+/* Minimum over the runs of the average number of cycles. */
+static double Measure(const UINT8* data, SIZE_T len, unsigned what)
+{
+  http_line_t lines[MAX_LINES];
+  http_field_t fields[HTTP_NUMBER_HEADERS];
+  const UINT8* method;
+  const UINT8* path;
+  SIZE_T methodlen;
+  SIZE_T pathlen;
+  UINT64 start;
+  double cycles;
+  double best;
+  unsigned r;
+  unsigned i;
+
+  best = 1e30;
+
+  for (r = 0; r < NRUNS; r++) {
+    start = __rdtsc();
+
+    for (i = 0; i < NITERATIONS; i++) {
+      switch (what) {
+        case 0:
+          sink += IndexLines(data, len, 0, lines, MAX_LINES);
+          break;
+        case 1:
+          sink += IndexHttpLines(data, len, 0, lines, MAX_LINES);
+          break;
+        default:
+          sink += ParseHttpRequest(data,
+                                   len,
+                                   &method,
+                                   &methodlen,
+                                   &path,
+                                   &pathlen,
+                                   fields);
+      }
+    }
+
+    cycles = (double) (__rdtsc() - start) / NITERATIONS;
+
+    if (cycles < best) {
+      best = cycles;
+    }
+  }
+
+  return best;
+}
+
+int main()
+{
+  http_line_t lines[MAX_LINES];
+  const UINT8* data;
+  SIZE_T len;
+  unsigned r;
+
+  printf("%6s %6s %10s %10s %10s\n",
+         "bytes",
+         "lines",
+         "byte loop",
+         "scanner",
+         "request");
+
+  for (r = 0; r < sizeof(requests) / sizeof(requests[0]); r++) {
+    data = (const UINT8*) requests[r];
+    len = strlen(requests[r]);
+
+    printf("%6zu %6u %10.1f %10.1f %10.1f\n",
+           len,
+           IndexHttpLines(data, len, 0, lines, MAX_LINES),
+           Measure(data, len, 0),
+           Measure(data, len, 1),
+           Measure(data, len, 2));
+  }
+
+  printf("(cycles per request, time stamp counter)\n");
+
+  return 0;
+}
@@ -0,0 +1,202 @@
+/* JA3 fingerprints (GetTlsFingerprint() in sys/tls_parser.c, sys/md5.c):
+ * cycles per byte of MD5 for 16 bytes to 64 KB, and cycles per fingerprint
+ * of ClientHellos of OpenSSL and Chrome (GREASE), computed by the driver
+ * (the string is hashed as it is generated) and by building the JA3 string
+ * with sprintf() first.
+ */
+
+#include <stdio.h>
+#include <x86intrin.h>
+#include "../sys/tls_parser.h"
+#include "tls_hello.h"
+
+#define NRUNS 30
+#define MAX_DATA 65536
+#define MAX_JA3 4096
+
+static const SIZE_T sizes[] = {16, 64, 256, 1024, MAX_DATA};
+
+/* Results (so that the calls are not optimized away). */
+static volatile SIZE_T sink;
+
+static UINT8 data[MAX_DATA];
+
+__inline static UINT16 GetUint16(const UINT8* ptr)
+{
+  return (UINT16) ((ptr[0] << 8) | ptr[1]);
+}
+
+__inline static BOOL IsGrease(UINT16 n)
+{
+  return ((n & 0x0f0f) == 0x0a0a) && ((n >> 8) == (n & 0xff));
+}
+
+/* Append the values of 'size' bytes separated by '-' (stride 0: extension
+ * types).
+ */
+static SIZE_T PrintList(char* s,
+                        const UINT8* ptr,
+                        SIZE_T len,
+                        unsigned size,
+                        unsigned stride)
+{
+  const UINT8* end;
+  SIZE_T n;
+  unsigned value;
+
+  end = ptr + len;
+  n = 0;
+
+  while ((SIZE_T) (end - ptr) >= size) {
+    value = (size == 2) ? GetUint16(ptr) : *ptr;
+
+    if ((size == 1) || (!IsGrease((UINT16) value))) {
+      n += sprintf(s + n, (n == 0) ? "%u" : "-%u", value);
+    }
+
+    ptr += (stride == 0) ? 4 + GetUint16(ptr + 2) : stride;
+  }
+
+  return n;
+}
+
+/* JA3 string built first, then hashed. */
+static void BuildFingerprint(const tls_client_hello_t* hello, UINT8* digest)
+{
+  char s[MAX_JA3];
+  md5_t ctx;
+  SIZE_T n;
+
+  n = sprintf(s, "%u,", hello->version);
+  n += PrintList(s + n, hello->ciphers, hello->cipherslen, 2, 2);
+  s[n++] = ',';
+  n += PrintList(s + n, hello->extensions, hello->extensionslen, 2, 0);
+  s[n++] = ',';
+  n += PrintList(s + n, hello->groups, hello->groupslen, 2, 2);
+  s[n++] = ',';
+  n += PrintList(s + n,
+                 hello->point_formats,
+                 hello->point_formatslen,
+                 1,
+                 1);
+
+  Md5Init(&ctx);
+  Md5Update(&ctx, s, n);
+  Md5Final(&ctx, digest);
+}
+
+/* Minimum over the runs of the average number of cycles. */
+static double MeasureMd5(SIZE_T len, unsigned iterations)
+{
+  UINT8 digest[MD5_DIGEST_LEN];
+  md5_t ctx;
+  UINT64 start;
+  double cycles;
+  double best;
+  unsigned r;
+  unsigned i;
+
+  best = 1e30;
+
+  for (r = 0; r < NRUNS; r++) {
+    start = __rdtsc();
+
+    for (i = 0; i < iterations; i++) {
+      Md5Init(&ctx);
+      Md5Update(&ctx, data, len);
+      Md5Final(&ctx, digest);
+      sink += digest[0];
+    }
+
+    cycles = (double) (__rdtsc() - start) / iterations;
+
+    if (cycles < best) {
+      best = cycles;
+    }
+  }
+
+  return best;
+}
+
+static double MeasureJa3(const tls_client_hello_t* hello, BOOL build)
+{
+  UINT8 digest[MD5_DIGEST_LEN];
+  UINT64 start;
+  double cycles;
+  double best;
+  unsigned r;
+  unsigned i;
+
+  best = 1e30;
+
+  for (r = 0; r < NRUNS; r++) {
+    start = __rdtsc();
+
+    for (i = 0; i < 100000; i++) {
+      if (build) {
+        BuildFingerprint(hello, digest);
+      } else {
+        GetTlsFingerprint(hello, digest);
+      }
+
+      sink += digest[0];
+    }
+
+    cycles = (double) (__rdtsc() - start) / 100000;
+
+    if (cycles < best) {
+      best = cycles;
+    }
+  }
+
+  return best;
+}
+
+static void PrintJa3(const char* name, const UINT8* hello, SIZE_T len)
+{
+  tls_client_hello_t parsed;
+  UINT8 digest[2][MD5_DIGEST_LEN];
+
+  if (!ParseTlsClientHello(hello, len, &parsed)) {
+    return;
+  }
+
+  /* Both compute the same fingerprint. */
+  GetTlsFingerprint(&parsed, digest[0]);
+  BuildFingerprint(&parsed, digest[1]);
+
+  printf("%-8s %10.1f %10.1f%s\n",
+         name,
+         MeasureJa3(&parsed, FALSE),
+         MeasureJa3(&parsed, TRUE),
+         (memcmp(digest[0], digest[1], MD5_DIGEST_LEN) == 0) ?
+           "" :
+           " (different fingerprints)");
+}
+
+int main()
+{
+  double cycles;
+  unsigned i;
+
+  for (i = 0; i < MAX_DATA; i++) {
+    data[i] = (UINT8) i;
+  }
+
+  printf("%8s %10s %10s\n", "bytes", "MD5", "per byte");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    cycles = MeasureMd5(sizes[i], (unsigned) (10000000 / (sizes[i] + 64)));
+
+    printf("%8zu %10.1f %10.2f\n", sizes[i], cycles, cycles / sizes[i]);
+  }
+
+  printf("\n%-8s %10s %10s\n", "hello", "JA3", "string");
+
+  PrintJa3("openssl", openssl_hello, sizeof(openssl_hello));
+  PrintJa3("chrome", grease_hello, sizeof(grease_hello));
+
+  printf("(cycles, time stamp counter)\n");
+
+  return 0;
+}
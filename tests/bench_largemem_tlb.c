@@ -0,0 +1,205 @@
+/* Large pages (sys/largemem.c): random dependent reads, one per 4 KB page
+ * (so nearly every read misses the TLB with small pages), over buffers of
+ * 64 MB to 1 GB allocated with and without large pages. Prints the time per
+ * read, the data TLB misses per read (if the processor counters can be
+ * read) and how much of the buffer is backed by huge pages.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../sys/largemem.h"
+#include "test_util.h"
+
+#define NREADS (1 << 22)
+
+static const SIZE_T sizes[] = {64 << 20, 256 << 20, 1024 << 20};
+
+/* End of the chain (so the reads are not optimized away). */
+static void* volatile sink;
+
+static double Now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int OpenTlbCounter()
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Memory of the process backed by huge pages (in MB). */
+static unsigned long HugePagesMB()
+{
+  FILE* file;
+  char line[256];
+  unsigned long kb;
+  unsigned long total;
+
+  if ((file = fopen("/proc/self/smaps_rollup", "r")) == NULL) {
+    return 0;
+  }
+
+  total = 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    if ((sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) ||
+        (sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1)) {
+      total += kb;
+    }
+  }
+
+  fclose(file);
+
+  return total >> 10;
+}
+
+/* Link one slot per page in a random cycle and follow it. */
+static void Run(SIZE_T size, BOOL large_pages, int counter)
+{
+  memory_t mem;
+  unsigned seed;
+  unsigned long long misses;
+  unsigned* order;
+  void** slot;
+  void** p;
+  size_t npages;
+  size_t i;
+  size_t j;
+  unsigned tmp;
+  unsigned long huge;
+  double start;
+  double elapsed;
+
+  if (!AllocMemory(&mem, size, large_pages)) {
+    printf("%6zu MB: allocation failed.\n", size >> 20);
+    return;
+  }
+
+  npages = size / PAGE_SIZE;
+
+  if ((order = malloc(npages * sizeof(unsigned))) == NULL) {
+    FreeMemory(&mem);
+    return;
+  }
+
+  /* Touch the whole buffer (for the huge page count). */
+  memset(mem.ptr, 0, size);
+
+  seed = 1;
+
+  for (i = 0; i < npages; i++) {
+    order[i] = (unsigned) i;
+  }
+
+  for (i = npages - 1; i > 0; i--) {
+    j = Random(&seed) % (i + 1);
+
+    tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  /* Slot at a random cache line of each page. */
+  for (i = 0; i < npages; i++) {
+    slot = (void**) ((char*) mem.ptr + ((size_t) order[i] * PAGE_SIZE) +
+                     ((order[i] % 64) * 64));
+
+    *slot = (char*) mem.ptr +
+            ((size_t) order[(i + 1) % npages] * PAGE_SIZE) +
+            ((order[(i + 1) % npages] % 64) * 64);
+  }
+
+  huge = HugePagesMB();
+
+  p = (void**) ((char*) mem.ptr + ((size_t) order[0] * PAGE_SIZE) +
+                ((order[0] % 64) * 64));
+
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  start = Now();
+
+  for (i = 0; i < NREADS; i++) {
+    p = (void**) *p;
+  }
+
+  elapsed = Now() - start;
+
+  sink = p;
+
+  misses = 0;
+
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+      misses = 0;
+    }
+  }
+
+  printf("%6zu MB %6s %9.1f ",
+         size >> 20,
+         mem.large_pages ? "large" : "small",
+         elapsed * 1e9 / NREADS);
+
+  if (counter >= 0) {
+    printf("%11.3f ", (double) misses / NREADS);
+  } else {
+    printf("%11s ", "n/a");
+  }
+
+  printf("%8lu\n", huge);
+
+  free(order);
+  FreeMemory(&mem);
+}
+
+int main()
+{
+  int counter;
+  unsigned s;
+
+  counter = OpenTlbCounter();
+
+  printf("%9s %6s %9s %11s %8s\n",
+         "buffer",
+         "pages",
+         "ns/read",
+         "TLB misses",
+         "huge MB");
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    Run(sizes[s], FALSE, counter);
+    Run(sizes[s], TRUE, counter);
+  }
+
+  if (counter < 0) {
+    printf("(no access to the TLB counters: perf_event_open failed)\n");
+  } else {
+    close(counter);
+  }
+
+  return 0;
+}
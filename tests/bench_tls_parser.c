@@ -0,0 +1,123 @@
+/* TLS ClientHello parser (sys/tls_parser.c): cycles per ClientHello and
+ * throughput to parse it with ParseTlsClientHello() and to parse it and
+ * compute its JA3 fingerprint with GetTlsFingerprint(), for the smallest
+ * ClientHello and one of OpenSSL (517 bytes).
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <x86intrin.h>
+#include "../sys/tls_parser.h"
+#include "tls_hello.h"
+
+#define NRUNS 30
+#define NITERATIONS 100000
+
+/* Results (so that the calls are not optimized away). */
+static volatile SIZE_T sink;
+
+/* Minimum over the runs of the average number of cycles. */
+static double Measure(const UINT8* data, SIZE_T len, BOOL fingerprint)
+{
+  tls_client_hello_t hello;
+  UINT8 digest[MD5_DIGEST_LEN];
+  UINT64 start;
+  double cycles;
+  double best;
+  unsigned r;
+  unsigned i;
+
+  best = 1e30;
+
+  for (r = 0; r < NRUNS; r++) {
+    start = __rdtsc();
+
+    for (i = 0; i < NITERATIONS; i++) {
+      sink += ParseTlsClientHello(data, len, &hello);
+
+      if (fingerprint) {
+        sink += GetTlsFingerprint(&hello, digest);
+        sink += digest[0];
+      } else {
+        sink += hello.server_namelen;
+      }
+    }
+
+    cycles = (double) (__rdtsc() - start) / NITERATIONS;
+
+    if (cycles < best) {
+      best = cycles;
+    }
+  }
+
+  return best;
+}
+
+static double Now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/* Time stamp counter frequency (cycles per nanosecond). */
+static double GetFrequency()
+{
+  UINT64 cycles;
+  double start;
+  double now;
+
+  start = Now();
+  cycles = __rdtsc();
+
+  do {
+    now = Now();
+  } while (now - start < 0.1);
+
+  return (double) (__rdtsc() - cycles) / ((now - start) * 1e9);
+}
+
+static void Print(const char* name,
+                  const UINT8* data,
+                  SIZE_T len,
+                  double frequency)
+{
+  double parse;
+  double ja3;
+
+  parse = Measure(data, len, FALSE);
+  ja3 = Measure(data, len, TRUE);
+
+  printf("%-8s %6zu %10.1f %10.1f %10.0f %10.0f\n",
+         name,
+         len,
+         parse,
+         ja3,
+         len * frequency * 1000 / parse,
+         len * frequency * 1000 / ja3);
+}
+
+int main()
+{
+  double frequency;
+
+  frequency = GetFrequency();
+
+  printf("%-8s %6s %10s %10s %10s %10s\n",
+         "hello",
+         "bytes",
+         "parse",
+         "+ JA3",
+         "MB/s",
+         "MB/s");
+
+  Print("minimal", minimal_hello, sizeof(minimal_hello), frequency);
+  Print("openssl", openssl_hello, sizeof(openssl_hello), frequency);
+
+  printf("(cycles per ClientHello, time stamp counter at %.2f GHz)\n",
+         frequency);
+
+  return 0;
+}
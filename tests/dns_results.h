@@ -0,0 +1,160 @@
+#ifndef TESTS_DNS_RESULTS_H
+#define TESTS_DNS_RESULTS_H
+
+/* Results of the DNS parser (sys/dns_parser.c, included by the test before
+ * this file): the addresses added to the DNS cache and the log lines,
+ * recorded by replacements of AddIPv4ToDnsCache(), AddIPv6ToDnsCache() and
+ * Log(), and compared with the results expected by the test.
+ */
+
+#include <stdarg.h>
+#include "test.h"
+
+#define MAX_RESULTS 1024
+#define MAX_LINE 640
+
+#define SYSTEM_TIME 132000000000000000ll
+
+typedef struct {
+  UINT8 address[16];
+  BOOL ipv6;
+  char hostname[HOST_NAME_MAX_LEN + 1];
+  LONGLONG expires;
+} insert_t;
+
+typedef struct {
+  insert_t inserts[MAX_RESULTS];
+  unsigned ninserts;
+
+  char lines[MAX_RESULTS][MAX_LINE];
+  unsigned nlines;
+} results_t;
+
+/* Results of the parser (DNS cache and log). */
+static results_t parsed;
+
+static void AddInsert(results_t* results,
+                      const UINT8* address,
+                      BOOL ipv6,
+                      const char* hostname,
+                      LONGLONG expires)
+{
+  insert_t* insert;
+
+  if (results->ninserts == MAX_RESULTS) {
+    CHECK(results->ninserts < MAX_RESULTS);
+    return;
+  }
+
+  insert = &results->inserts[results->ninserts++];
+
+  memset(insert, 0, sizeof(insert_t));
+  memcpy(insert->address, address, ipv6 ? 16 : 4);
+  insert->ipv6 = ipv6;
+  snprintf(insert->hostname, sizeof(insert->hostname), "%s", hostname);
+  insert->expires = expires;
+}
+
+static void AddLine(results_t* results, const char* format, va_list ap)
+{
+  if (results->nlines == MAX_RESULTS) {
+    CHECK(results->nlines < MAX_RESULTS);
+    return;
+  }
+
+  vsnprintf(results->lines[results->nlines++], MAX_LINE, format, ap);
+}
+
+BOOL AddIPv4ToDnsCache(const UINT8* ipv4,
+                       const char* hostname,
+                       UINT16 hostnamelen,
+                       LONGLONG expires)
+{
+  CHECK(strlen(hostname) == hostnamelen);
+
+  AddInsert(&parsed, ipv4, FALSE, hostname, expires);
+
+  return TRUE;
+}
+
+BOOL AddIPv6ToDnsCache(const UINT8* ipv6,
+                       const char* hostname,
+                       UINT16 hostnamelen,
+                       LONGLONG expires)
+{
+  CHECK(strlen(hostname) == hostnamelen);
+
+  AddInsert(&parsed, ipv6, TRUE, hostname, expires);
+
+  return TRUE;
+}
+
+BOOL Log(LARGE_INTEGER* system_time, const char* format, ...)
+{
+  va_list ap;
+
+  CHECK(system_time->QuadPart == SYSTEM_TIME);
+
+  va_start(ap, format);
+  AddLine(&parsed, format, ap);
+  va_end(ap);
+
+  return TRUE;
+}
+
+static void Expect(results_t* results, const char* format, ...)
+{
+  va_list ap;
+
+  va_start(ap, format);
+  AddLine(results, format, ap);
+  va_end(ap);
+}
+
+static BOOL SameResults(const results_t* expected)
+{
+  const insert_t* insert;
+  unsigned i;
+
+  if ((parsed.ninserts != expected->ninserts) ||
+      (parsed.nlines != expected->nlines)) {
+    fprintf(stderr,
+            "%u inserts, %u lines (expected: %u, %u)\n",
+            parsed.ninserts,
+            parsed.nlines,
+            expected->ninserts,
+            expected->nlines);
+    return FALSE;
+  }
+
+  for (i = 0; i < parsed.ninserts; i++) {
+    insert = &expected->inserts[i];
+
+    if ((memcmp(parsed.inserts[i].address, insert->address, 16) != 0) ||
+        (parsed.inserts[i].ipv6 != insert->ipv6) ||
+        (strcmp(parsed.inserts[i].hostname, insert->hostname) != 0) ||
+        (parsed.inserts[i].expires != insert->expires)) {
+      fprintf(stderr,
+              "Insert %u: '%s' (expected: '%s')\n",
+              i,
+              parsed.inserts[i].hostname,
+              insert->hostname);
+      return FALSE;
+    }
+  }
+
+  for (i = 0; i < parsed.nlines; i++) {
+    if (strcmp(parsed.lines[i], expected->lines[i]) != 0) {
+      fprintf(stderr,
+              "Line %u: %s (expected: %s)\n",
+              i,
+              parsed.lines[i],
+              expected->lines[i]);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+#endif /* TESTS_DNS_RESULTS_H */
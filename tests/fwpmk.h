@@ -0,0 +1,18 @@
+#ifndef TESTS_FWPMK_H
+#define TESTS_FWPMK_H
+
+/* Address conditions of the filters (subnets.c). */
+
+#include "fwpsk.h"
+
+typedef struct {
+  UINT32 addr;
+  UINT32 mask;
+} FWP_V4_ADDR_AND_MASK;
+
+typedef struct {
+  UINT8 addr[16];
+  UINT8 prefixLength;
+} FWP_V6_ADDR_AND_MASK;
+
+#endif /* TESTS_FWPMK_H */
@@ -0,0 +1,69 @@
+#ifndef TESTS_FWPSK_H
+#define TESTS_FWPSK_H
+
+/* The tests are built on Linux from the sources of the driver, with the
+ * user-mode replacements of the simulator (../dnssim/fwpsk.h) and the
+ * definitions used by the other modules.
+ */
+
+#include "../dnssim/fwpsk.h"
+
+typedef union {
+  LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef void* PVOID;
+
+/* Annotations of the prototypes. */
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Inout_
+#define _Inout_opt_
+
+typedef LONG NTSTATUS;
+typedef UINT16 WCHAR;
+
+#define STATUS_SUCCESS ((NTSTATUS) 0)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS) 0xc000000d)
+#define STATUS_NO_MEMORY ((NTSTATUS) 0xc0000017)
+#define STATUS_QUOTA_EXCEEDED ((NTSTATUS) 0xc0000044)
+#define NT_SUCCESS(status) ((NTSTATUS) (status) >= 0)
+
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#define RtlZeroMemory(dest, len) memset((dest), 0, (len))
+#define RtlUlongByteSwap(value) __builtin_bswap32(value)
+
+#define KeAcquireInStackQueuedSpinLockAtDpcLevel KeAcquireInStackQueuedSpinLock
+#define KeReleaseInStackQueuedSpinLockFromDpcLevel \
+        KeReleaseInStackQueuedSpinLock
+
+static inline PVOID InterlockedExchangePointer(PVOID volatile* target,
+                                               PVOID value)
+{
+  return __sync_lock_test_and_set(target, value);
+}
+
+/* x64: the SSE2 paths of the driver are built and tested too. */
+#if defined(__x86_64__) && !defined(_M_AMD64)
+#define _M_AMD64
+#endif
+
+static inline unsigned char _BitScanForward(unsigned long* index,
+                                            unsigned long mask)
+{
+  if (mask == 0) {
+    return 0;
+  }
+
+  *index = (unsigned long) __builtin_ctzl(mask);
+
+  return 1;
+}
+
+#endif /* TESTS_FWPSK_H */
@@ -0,0 +1,85 @@
+#ifndef TESTS_IP2STRING_H
+#define TESTS_IP2STRING_H
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "fwpsk.h"
+
+typedef struct in_addr IN_ADDR;
+typedef struct in6_addr IN6_ADDR;
+
+static inline char* RtlIpv6AddressToStringA(const IN6_ADDR* addr, char* s)
+{
+  inet_ntop(AF_INET6, addr, s, INET6_ADDRSTRLEN);
+
+  return s + strlen(s);
+}
+
+/* Strict: four decimal numbers (at most 3 digits each) separated by dots.
+ * 'end' points to the character after the address.
+ */
+static inline NTSTATUS RtlIpv4StringToAddressA(const char* s,
+                                               BOOL strict,
+                                               const char** end,
+                                               IN_ADDR* addr)
+{
+  UINT8 bytes[4];
+  unsigned value;
+  unsigned digits;
+  unsigned i;
+
+  UNREFERENCED_PARAMETER(strict);
+
+  for (i = 0; i < 4; i++) {
+    if ((i > 0) && (*s++ != '.')) {
+      return STATUS_INVALID_PARAMETER;
+    }
+
+    value = 0;
+
+    for (digits = 0; (*s >= '0') && (*s <= '9'); digits++, s++) {
+      value = (value * 10) + (*s - '0');
+    }
+
+    if ((digits == 0) || (digits > 3) || (value > 255)) {
+      return STATUS_INVALID_PARAMETER;
+    }
+
+    bytes[i] = (UINT8) value;
+  }
+
+  memcpy(addr, bytes, 4);
+  *end = s;
+
+  return STATUS_SUCCESS;
+}
+
+/* The longest run of hexadecimal digits, colons and dots must be an IPv6
+ * address.
+ */
+static inline NTSTATUS RtlIpv6StringToAddressA(const char* s,
+                                               const char** end,
+                                               IN6_ADDR* addr)
+{
+  char str[INET6_ADDRSTRLEN];
+  size_t len;
+
+  len = strspn(s, "0123456789abcdefABCDEF:.");
+
+  if (len >= sizeof(str)) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  memcpy(str, s, len);
+  str[len] = 0;
+
+  if (inet_pton(AF_INET6, str, addr) != 1) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  *end = s + len;
+
+  return STATUS_SUCCESS;
+}
+
+#endif /* TESTS_IP2STRING_H */
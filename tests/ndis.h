@@ -0,0 +1,263 @@
+#ifndef TESTS_NDIS_H
+#define TESTS_NDIS_H
+
+/* Net buffers and the definitions of the callouts (inspect.c), which need
+ * them. A net buffer is a chain of MDLs (../dnssim/fwpsk.h) mapped at 'va'.
+ */
+
+#include <time.h>
+#include "fwpsk.h"
+
+#define NTDDI_WIN7 0x06010000
+#define NTDDI_VERSION NTDDI_WIN7
+
+typedef unsigned int UINT;
+typedef int64_t LONG64;
+
+typedef UINT16 ADDRESS_FAMILY;
+
+#define AF_UNSPEC 0
+#define AF_INET 2
+#define AF_INET6 23
+
+typedef struct {
+  UINT32 Data1;
+  UINT16 Data2;
+  UINT16 Data3;
+  UINT8 Data4[8];
+} GUID;
+
+/* 100-nanosecond intervals since January 1, 1601. */
+static inline void KeQuerySystemTime(LARGE_INTEGER* time)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  time->QuadPart = 116444736000000000LL +
+                   ((LONGLONG) now.tv_sec * 10000000) +
+                   (now.tv_nsec / 100);
+}
+
+static inline LONG64 InterlockedIncrement64(volatile LONG64* addend)
+{
+  return __sync_add_and_fetch(addend, 1);
+}
+
+#define LowPagePriority 0
+
+#define MmGetSystemAddressForMdlSafe(mdl, priority) ((mdl)->va)
+
+/* Net buffers. */
+typedef struct _NET_BUFFER {
+  struct _NET_BUFFER* Next;
+  MDL* CurrentMdl;
+  ULONG CurrentMdlOffset;
+  ULONG DataLength;
+} NET_BUFFER;
+
+typedef struct _NET_BUFFER_LIST {
+  struct _NET_BUFFER_LIST* Next;
+  NET_BUFFER* FirstNetBuffer;
+} NET_BUFFER_LIST;
+
+#define NET_BUFFER_NEXT_NB(nb) ((nb)->Next)
+#define NET_BUFFER_CURRENT_MDL(nb) ((nb)->CurrentMdl)
+#define NET_BUFFER_CURRENT_MDL_OFFSET(nb) ((nb)->CurrentMdlOffset)
+#define NET_BUFFER_DATA_LENGTH(nb) ((nb)->DataLength)
+#define NET_BUFFER_LIST_FIRST_NB(nbl) ((nbl)->FirstNetBuffer)
+#define NET_BUFFER_LIST_NEXT_NBL(nbl) ((nbl)->Next)
+
+/* The first 'len' bytes of the net buffer: in place if they are in the
+ * current MDL, otherwise gathered in 'storage' (NULL: not gathered).
+ */
+static inline void* NdisGetDataBuffer(NET_BUFFER* nb,
+                                      ULONG len,
+                                      void* storage,
+                                      UINT align_multiple,
+                                      UINT align_offset)
+{
+  MDL* mdl;
+  ULONG offset;
+  ULONG copied;
+  ULONG n;
+
+  UNREFERENCED_PARAMETER(align_multiple);
+  UNREFERENCED_PARAMETER(align_offset);
+
+  if ((len == 0) || (len > nb->DataLength)) {
+    return NULL;
+  }
+
+  mdl = nb->CurrentMdl;
+  offset = nb->CurrentMdlOffset;
+
+  if (mdl->size - offset >= len) {
+    return (UINT8*) mdl->va + offset;
+  }
+
+  if (!storage) {
+    return NULL;
+  }
+
+  for (copied = 0; copied < len; mdl = mdl->Next, offset = 0) {
+    n = (ULONG) mdl->size - offset;
+    if (n > len - copied) {
+      n = len - copied;
+    }
+
+    memcpy((UINT8*) storage + copied, (UINT8*) mdl->va + offset, n);
+    copied += n;
+  }
+
+  return storage;
+}
+
+/* Callouts. */
+typedef enum {
+  FWPS_LAYER_STREAM_V4 = 20,
+  FWPS_LAYER_STREAM_V6 = 22,
+  FWPS_LAYER_DATAGRAM_DATA_V4 = 24,
+  FWPS_LAYER_DATAGRAM_DATA_V6 = 26,
+  FWPS_LAYER_ALE_ENDPOINT_CLOSURE_V4 = 50,
+  FWPS_LAYER_ALE_ENDPOINT_CLOSURE_V6 = 51
+} FWPS_BUILTIN_LAYERS;
+
+#define FWPS_FIELD_STREAM_V4_IP_LOCAL_ADDRESS 0
+#define FWPS_FIELD_STREAM_V4_IP_REMOTE_ADDRESS 2
+#define FWPS_FIELD_STREAM_V4_IP_LOCAL_PORT 3
+#define FWPS_FIELD_STREAM_V4_IP_REMOTE_PORT 4
+#define FWPS_FIELD_STREAM_V6_IP_LOCAL_ADDRESS 0
+#define FWPS_FIELD_STREAM_V6_IP_REMOTE_ADDRESS 2
+#define FWPS_FIELD_STREAM_V6_IP_LOCAL_PORT 3
+#define FWPS_FIELD_STREAM_V6_IP_REMOTE_PORT 4
+#define FWPS_FIELD_DATAGRAM_DATA_V4_IP_LOCAL_ADDRESS 1
+#define FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_ADDRESS 2
+#define FWPS_FIELD_DATAGRAM_DATA_V4_IP_LOCAL_PORT 4
+#define FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_PORT 5
+#define FWPS_FIELD_DATAGRAM_DATA_V6_IP_LOCAL_ADDRESS 1
+#define FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_ADDRESS 2
+#define FWPS_FIELD_DATAGRAM_DATA_V6_IP_LOCAL_PORT 4
+#define FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_PORT 5
+#define FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V4_IP_LOCAL_ADDRESS 0
+#define FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V4_IP_REMOTE_ADDRESS 4
+#define FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V4_IP_LOCAL_PORT 2
+#define FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V4_IP_REMOTE_PORT 5
+#define FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V6_IP_LOCAL_ADDRESS 0
+#define FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V6_IP_REMOTE_ADDRESS 4
+#define FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V6_IP_LOCAL_PORT 2
+#define FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V6_IP_REMOTE_PORT 5
+
+/* Size of the arrays of incoming values (above the indexes). */
+#define FWPS_MAX_FIELDS 6
+
+typedef struct {
+  UINT8 byteArray16[16];
+} FWP_BYTE_ARRAY16;
+
+typedef struct {
+  union {
+    UINT16 uint16;
+    UINT32 uint32;
+    FWP_BYTE_ARRAY16* byteArray16;
+  };
+} FWP_VALUE;
+
+typedef struct {
+  FWP_VALUE value;
+} FWPS_INCOMING_VALUE;
+
+typedef struct {
+  UINT16 layerId;
+  UINT32 valueCount;
+  FWPS_INCOMING_VALUE* incomingValue;
+} FWPS_INCOMING_VALUES;
+
+#define FWPS_METADATA_FIELD_FLOW_HANDLE 0x00000002
+#define FWPS_METADATA_FIELD_IP_HEADER_SIZE 0x00000004
+#define FWPS_METADATA_FIELD_TRANSPORT_HEADER_SIZE 0x00002000
+
+typedef struct {
+  UINT32 currentMetadataValues;
+  UINT64 flowHandle;
+  UINT32 ipHeaderSize;
+  UINT32 transportHeaderSize;
+} FWPS_INCOMING_METADATA_VALUES;
+
+#define FWPS_IS_METADATA_FIELD_PRESENT(values, field) \
+  (((values)->currentMetadataValues & (field)) == (field))
+
+typedef enum {
+  FWPS_CALLOUT_NOTIFY_ADD_FILTER = 1,
+  FWPS_CALLOUT_NOTIFY_DELETE_FILTER
+} FWPS_CALLOUT_NOTIFY_TYPE;
+
+typedef struct {
+  UINT32 type;
+  UINT32 calloutId;
+} FWPS_ACTION;
+
+typedef struct {
+  UINT64 filterId;
+  FWPS_ACTION action;
+} FWPS_FILTER;
+
+#define FWP_ACTION_CONTINUE 0x00000006
+
+typedef struct {
+  UINT32 actionType;
+  UINT64 outContext;
+  UINT64 filterId;
+  UINT32 rights;
+  UINT32 flags;
+} FWPS_CLASSIFY_OUT;
+
+#define FWPS_STREAM_FLAG_RECEIVE 0x00000001
+#define FWPS_STREAM_FLAG_SEND 0x00010000
+#define FWPS_STREAM_FLAG_RECEIVE_DISCONNECT 0x00000008
+#define FWPS_STREAM_FLAG_SEND_DISCONNECT 0x00080000
+
+typedef struct {
+  UINT32 flags;
+  SIZE_T dataLength;
+  NET_BUFFER_LIST* netBufferListChain;
+} FWPS_STREAM_DATA;
+
+typedef enum {
+  FWPS_STREAM_ACTION_NONE,
+  FWPS_STREAM_ACTION_ALLOW_CONNECTION
+} FWPS_STREAM_ACTION_TYPE;
+
+typedef struct {
+  FWPS_STREAM_DATA* streamData;
+  SIZE_T missedBytes;
+  UINT32 countBytesRequired;
+  SIZE_T countBytesEnforced;
+  FWPS_STREAM_ACTION_TYPE streamAction;
+} FWPS_STREAM_CALLOUT_IO_PACKET0;
+
+static inline NTSTATUS FwpsFlowAssociateContext(UINT64 flowId,
+                                                UINT16 layerId,
+                                                UINT32 calloutId,
+                                                UINT64 flowContext)
+{
+  UNREFERENCED_PARAMETER(flowId);
+  UNREFERENCED_PARAMETER(layerId);
+  UNREFERENCED_PARAMETER(calloutId);
+  UNREFERENCED_PARAMETER(flowContext);
+
+  return STATUS_SUCCESS;
+}
+
+static inline NTSTATUS FwpsFlowRemoveContext(UINT64 flowId,
+                                             UINT16 layerId,
+                                             UINT32 calloutId)
+{
+  UNREFERENCED_PARAMETER(flowId);
+  UNREFERENCED_PARAMETER(layerId);
+  UNREFERENCED_PARAMETER(calloutId);
+
+  return STATUS_SUCCESS;
+}
+
+#endif /* TESTS_NDIS_H */
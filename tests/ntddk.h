@@ -0,0 +1,9 @@
+#ifndef TESTS_NTDDK_H
+#define TESTS_NTDDK_H
+
+#include "fwpsk.h"
+
+/* Implemented by the tests of the modules which print messages. */
+ULONG DbgPrint(const char* format, ...);
+
+#endif /* TESTS_NTDDK_H */
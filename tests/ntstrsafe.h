@@ -0,0 +1,81 @@
+#ifndef TESTS_NTSTRSAFE_H
+#define TESTS_NTSTRSAFE_H
+
+/* Bounded string functions of the configuration (config.c): the result is
+ * always terminated, STATUS_BUFFER_OVERFLOW if it was truncated. The wide
+ * strings are 16 bits (built with -fshort-wchar), the only conversion of
+ * RtlStringCbPrintfW() is %S (a narrow string).
+ */
+
+#include <stdarg.h>
+#include <ntddk.h>
+
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS) 0x80000005)
+
+static inline NTSTATUS RtlStringCbCopyA(char* dest,
+                                        size_t size,
+                                        const char* src)
+{
+  size_t i;
+
+  for (i = 0; (src[i] != 0) && (i + 1 < size); i++) {
+    dest[i] = src[i];
+  }
+
+  dest[i] = 0;
+
+  return (src[i] == 0) ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
+
+static inline NTSTATUS RtlStringCbCopyW(WCHAR* dest,
+                                        size_t size,
+                                        const WCHAR* src)
+{
+  size_t i;
+
+  for (i = 0; (src[i] != 0) && ((i + 1) * sizeof(WCHAR) < size); i++) {
+    dest[i] = src[i];
+  }
+
+  dest[i] = 0;
+
+  return (src[i] == 0) ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
+
+static inline NTSTATUS RtlStringCbPrintfW(WCHAR* dest,
+                                          size_t size,
+                                          const WCHAR* format,
+                                          ...)
+{
+  const char* str;
+  size_t max;
+  size_t n;
+  va_list args;
+
+  max = size / sizeof(WCHAR) - 1;
+  n = 0;
+
+  va_start(args, format);
+
+  for (; (*format != 0) && (n < max); format++) {
+    if (*format != L'%') {
+      dest[n++] = *format;
+    } else if (*++format == L'S') {
+      for (str = va_arg(args, const char*); (*str != 0) && (n < max); str++) {
+        dest[n++] = (UINT8) *str;
+      }
+    } else {
+      va_end(args);
+      dest[0] = 0;
+
+      return STATUS_INVALID_PARAMETER;
+    }
+  }
+
+  va_end(args);
+  dest[n] = 0;
+
+  return (*format == 0) ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
+
+#endif /* TESTS_NTSTRSAFE_H */
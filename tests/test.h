@@ -0,0 +1,26 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+/* Minimal checks: a failed check is reported and the test goes on, main()
+ * returns TEST_RESULT().
+ */
+
+static unsigned test_failures;
+
+#define CHECK(cond)                                                 \
+        do {                                                        \
+          if (!(cond)) {                                            \
+            fprintf(stderr, "%s:%d: check failed: %s\n",            \
+                    __FILE__, __LINE__, #cond);                     \
+            test_failures++;                                        \
+          }                                                         \
+        } while (0)
+
+#define TEST_RESULT()                                               \
+        ((test_failures == 0) ?                                     \
+          (printf("%s: OK\n", __FILE__), 0) :                       \
+          (printf("%s: %u failures\n", __FILE__, test_failures), 1))
+
+#endif /* TEST_H */
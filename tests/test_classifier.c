@@ -0,0 +1,225 @@
+/* Payload classifier (sys/classifier.c): the detectors must accept exactly
+ * what simple reference predicates accept:
+ * - IsHttpRequest(): every method followed by a space, with every byte of
+ *   the method replaced (near misses, lower case, other methods with the
+ *   same first character), truncated at every length, and random data
+ *   starting with the first characters of the methods;
+ * - IsTlsClientHello(): every value of the bytes it looks at;
+ * - IsDnsResponse(), IsDnsQuery() and IsDnsTcpQuery(): every value of the
+ *   flags and of the counts, at every length.
+ * Each buffer has the exact length of the data, so that the sanitizer
+ * catches reads past the end.
+ */
+
+#include <stdio.h>
+#include "../sys/classifier.h"
+#include "test.h"
+#include "test_util.h"
+
+#define NRANDOM 1000000
+#define MAX_DATA 16
+
+static const char* methods[] = {
+  "CONNECT ",
+  "DELETE ",
+  "GET ",
+  "HEAD ",
+  "OPTIONS ",
+  "POST ",
+  "PUT ",
+  "PATCH ",
+  "TRACE "
+};
+
+static BOOL IsRequest(const UINT8* data, SIZE_T len)
+{
+  unsigned i;
+
+  for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+    if ((len >= strlen(methods[i])) &&
+        (memcmp(data, methods[i], strlen(methods[i])) == 0)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static BOOL IsClientHello(const UINT8* data, SIZE_T len)
+{
+  /* Handshake record, SSL 3.0 to TLS 1.3 (and 3.4), ClientHello. */
+  return ((len > 5) &&
+          (data[0] == 22) &&
+          (data[1] == 3) &&
+          (data[2] <= 4) &&
+          (data[5] == 1));
+}
+
+static BOOL IsDnsHeader(const UINT8* data, SIZE_T len, BOOL response)
+{
+  /* QR, opcode 0 (standard query), QDCOUNT 1. */
+  return ((len >= 12) &&
+          (((data[2] >> 7) == 1) == response) &&
+          (((data[2] >> 3) & 0x0f) == 0) &&
+          (data[4] == 0) &&
+          (data[5] == 1));
+}
+
+static BOOL IsTcpQuery(const UINT8* data, SIZE_T len)
+{
+  return ((len >= 2) &&
+          (data[0] * 256 + data[1] >= 12) &&
+          (IsDnsHeader(data + 2, len - 2, FALSE)));
+}
+
+/* Run the detector on a copy of the data of the exact size. */
+static BOOL Detect(BOOL (*detector)(const UINT8*, SIZE_T),
+                   const UINT8* data,
+                   SIZE_T len)
+{
+  UINT8* copy;
+  BOOL detected;
+
+  /* Exact size (copy is not NULL for empty data). */
+  if ((copy = malloc(len + (len == 0))) == NULL) {
+    CHECK(copy != NULL);
+    return FALSE;
+  }
+
+  memcpy(copy, data, len);
+
+  detected = detector(copy, len);
+
+  free(copy);
+
+  return detected;
+}
+
+static void CheckHttp(const UINT8* data, SIZE_T len)
+{
+  SIZE_T n;
+
+  for (n = 0; n <= len; n++) {
+    if (Detect(IsHttpRequest, data, n) != IsRequest(data, n)) {
+      fprintf(stderr, "IsHttpRequest: %.*s\n", (int) n, (const char*) data);
+      CHECK(FALSE);
+    }
+  }
+}
+
+static void CheckDns(const UINT8* data, SIZE_T len)
+{
+  SIZE_T n;
+
+  for (n = 0; n <= len; n++) {
+    CHECK(Detect(IsDnsResponse, data, n) == IsDnsHeader(data, n, TRUE));
+    CHECK(Detect(IsDnsQuery, data, n) == IsDnsHeader(data, n, FALSE));
+    CHECK(Detect(IsDnsTcpQuery, data, n) == IsTcpQuery(data, n));
+  }
+}
+
+int main()
+{
+  UINT8 data[MAX_DATA];
+  SIZE_T len;
+  unsigned seed;
+  unsigned i;
+  unsigned j;
+  unsigned c;
+
+  /* Methods, followed by a path, with every byte replaced. */
+  for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+    len = strlen(methods[i]);
+    memcpy(data, methods[i], len);
+    memcpy(data + len, "/index", 6);
+
+    CHECK(Detect(IsHttpRequest, data, len + 6));
+    CheckHttp(data, len + 6);
+
+    for (j = 0; j < len; j++) {
+      for (c = 0; c < 256; c++) {
+        data[j] = (UINT8) c;
+        CheckHttp(data, len + 1);
+      }
+
+      data[j] = (UINT8) methods[i][j];
+    }
+  }
+
+  CHECK(!Detect(IsHttpRequest, (const UINT8*) "get / HTTP/1.1", 14));
+  CHECK(!Detect(IsHttpRequest, (const UINT8*) "GET/ HTTP/1.1", 13));
+  CHECK(!Detect(IsHttpRequest, (const UINT8*) "POSTS / HTTP/1.1", 16));
+
+  /* Random data starting with the first characters of the methods. */
+  seed = 39;
+
+  for (i = 0; i < NRANDOM; i++) {
+    len = Random(&seed) % (sizeof(data) + 1);
+
+    for (j = 0; j < len; j++) {
+      data[j] = (UINT8) Random(&seed);
+    }
+
+    if (len > 0) {
+      j = Random(&seed) % (sizeof(methods) / sizeof(methods[0]));
+      c = Random(&seed) % (unsigned) strlen(methods[j]);
+      memcpy(data, methods[j], (c < len) ? c : len);
+    }
+
+    if (Detect(IsHttpRequest, data, len) != IsRequest(data, len)) {
+      fprintf(stderr, "IsHttpRequest: %.*s\n", (int) len, (const char*) data);
+      CHECK(FALSE);
+    }
+  }
+
+  /* TLS: every value of the bytes looked at. */
+  memcpy(data, "\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03", 11);
+
+  CHECK(Detect(IsTlsClientHello, data, 11));
+
+  for (i = 0; i < 6; i++) {
+    for (c = 0; c < 256; c++) {
+      data[i] = (UINT8) c;
+
+      for (len = 0; len <= 11; len++) {
+        CHECK(Detect(IsTlsClientHello, data, len) ==
+              IsClientHello(data, len));
+      }
+    }
+
+    data[i] = (UINT8) "\x16\x03\x01\x02\x00\x01"[i];
+  }
+
+  /* DNS: every value of the flags and of the question count. */
+  memset(data, 0, sizeof(data));
+  data[1] = 29;
+  data[3] = 0x12;
+  data[5] = 1;
+
+  for (c = 0; c < 256; c++) {
+    /* Header of a UDP message, or of a TCP one after the length. */
+    data[2] = (UINT8) c;
+    CheckDns(data, 14);
+    data[2] = 0;
+
+    for (i = 3; i <= 7; i++) {
+      data[i] = (UINT8) c;
+      CheckDns(data, 14);
+      data[i] = (UINT8) ((i == 3) ? 0x12 : (i == 5) ? 1 : 0);
+    }
+
+    data[0] = (UINT8) c;
+    CheckDns(data, 14);
+    data[0] = 0;
+
+    data[1] = (UINT8) c;
+    CheckDns(data, 14);
+    data[1] = 29;
+  }
+
+  memcpy(data, "\x12\x34\x81\x80\x00\x01\x00\x02\x00\x00\x00\x00", 12);
+  CHECK(Detect(IsDnsResponse, data, 12));
+  CHECK(!Detect(IsDnsQuery, data, 12));
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,607 @@
+/* Configuration (sys/config.c): without registry values, ReadConfig() must
+ * keep the defaults of GetDefaultConfig() (inspect.h and the default ports
+ * of the dissectors, at most MAX_DISSECTOR_PORTS each). Every numeric value
+ * must land in its field, clamped to its range with a message, and
+ * DnsMaxQueries rounded down to a power of 2 (at least 4, 0 disables). The
+ * string values which are invalid or too long must be ignored with a
+ * message, and the dissectors with the same name must share their ports
+ * value. ParsePorts() is checked on fixed cases and against a reference
+ * parser (which splits the tokens first) on random strings, valid lists of
+ * ports among them.
+ */
+
+#include <stdio.h>
+#include <ndis.h> /* The callouts declared by inspect.h. */
+#include "../sys/config.c"
+#include "test.h"
+#include "test_util.h"
+
+#define NSTRINGS 200000
+#define MAX_STRING 64
+#define MAX_REGISTRY 32
+
+/* A wide character whose low byte is a digit. */
+#define WIDE_DIGIT 0x0131
+
+typedef struct {
+  const WCHAR* name;
+  BOOL string;
+  ULONG value;
+  const WCHAR* str;
+} registry_value_t;
+
+/* Registry key read by ReadConfig(). */
+static registry_value_t registry[MAX_REGISTRY];
+static unsigned nregistry;
+
+/* Messages printed by the module. */
+static unsigned messages;
+
+/* Dissectors (sys/dissector.c): the TLS one has too many ports. */
+static const UINT16 http_ports[] = {80, 8080};
+static const UINT16 tls_ports[] = {443, 8443, 9443, 10443, 11443, 12443,
+                                   13443, 14443, 15443, 16443};
+static const UINT16 dns_ports[] = {53};
+
+static const dissector_t dissectors[PROTOCOL_COUNT] = {
+  [PROTOCOL_UNKNOWN] = {.name = "UNKNOWN"},
+  [PROTOCOL_HTTP] = {.name = "HTTP",
+                     .ports = http_ports,
+                     .nports = ARRAYSIZE(http_ports)},
+  [PROTOCOL_TLS] = {.name = "HTTPS",
+                    .ports = tls_ports,
+                    .nports = ARRAYSIZE(tls_ports)},
+  [PROTOCOL_DNS] = {.name = "DNS",
+                    .ports = dns_ports,
+                    .nports = ARRAYSIZE(dns_ports)},
+  [PROTOCOL_DNS_TCP] = {.name = "DNS",
+                        .ports = dns_ports,
+                        .nports = ARRAYSIZE(dns_ports)}
+};
+
+const dissector_t* GetDissector(protocol_t protocol)
+{
+  return &dissectors[protocol];
+}
+
+ULONG DbgPrint(const char* format, ...)
+{
+  UNREFERENCED_PARAMETER(format);
+
+  messages++;
+
+  return 0;
+}
+
+static SIZE_T WideLength(const WCHAR* str)
+{
+  SIZE_T len;
+
+  len = 0;
+
+  while (str[len] != 0) {
+    len++;
+  }
+
+  return len;
+}
+
+static BOOL SameWide(const WCHAR* a, const WCHAR* b)
+{
+  while ((*a != 0) && (*a == *b)) {
+    a++;
+    b++;
+  }
+
+  return *a == *b;
+}
+
+static const registry_value_t* FindValue(const UNICODE_STRING* name,
+                                         BOOL string)
+{
+  unsigned i;
+
+  for (i = 0; i < nregistry; i++) {
+    if ((registry[i].string == string) &&
+        (WideLength(registry[i].name) * sizeof(WCHAR) == name->Length) &&
+        (memcmp(registry[i].name, name->Buffer, name->Length) == 0)) {
+      return &registry[i];
+    }
+  }
+
+  return NULL;
+}
+
+NTSTATUS WdfRegistryQueryULong(WDFKEY key,
+                               const UNICODE_STRING* name,
+                               ULONG* value)
+{
+  const registry_value_t* entry;
+
+  UNREFERENCED_PARAMETER(key);
+
+  if ((entry = FindValue(name, FALSE)) == NULL) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  *value = entry->value;
+
+  return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfRegistryQueryUnicodeString(WDFKEY key,
+                                       const UNICODE_STRING* name,
+                                       USHORT* len,
+                                       UNICODE_STRING* value)
+{
+  const registry_value_t* entry;
+  SIZE_T size;
+
+  UNREFERENCED_PARAMETER(key);
+
+  if ((entry = FindValue(name, TRUE)) == NULL) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  size = WideLength(entry->str) * sizeof(WCHAR);
+  *len = (USHORT) size;
+
+  if (size > value->MaximumLength) {
+    return STATUS_BUFFER_OVERFLOW;
+  }
+
+  /* Not terminated: the rest of the buffer is garbage. */
+  memset(value->Buffer, 0xa5, value->MaximumLength);
+  memcpy(value->Buffer, entry->str, size);
+  value->Length = (USHORT) size;
+
+  return STATUS_SUCCESS;
+}
+
+static void SetNumber(const WCHAR* name, ULONG value)
+{
+  registry[nregistry].name = name;
+  registry[nregistry].string = FALSE;
+  registry[nregistry].value = value;
+  nregistry++;
+}
+
+static void SetString(const WCHAR* name, const WCHAR* str)
+{
+  registry[nregistry].name = name;
+  registry[nregistry].string = TRUE;
+  registry[nregistry].str = str;
+  nregistry++;
+}
+
+/* Read the configuration from the registry (then emptied), return the
+ * number of messages.
+ */
+static unsigned Read(config_t* config)
+{
+  unsigned before;
+
+  before = messages;
+
+  GetDefaultConfig(config);
+  ReadConfig(NULL, config);
+
+  nregistry = 0;
+
+  return messages - before;
+}
+
+static ULONG* Field(config_t* config, const config_value_t* value)
+{
+  return (ULONG*) ((UINT8*) config + value->offset);
+}
+
+/* Number of slots of the DNS query table. */
+static ULONG QuerySlots(ULONG value)
+{
+  ULONG slots;
+
+  if (value == 0) {
+    return 0;
+  }
+
+  slots = 4;
+
+  while (slots * 2 <= value) {
+    slots *= 2;
+  }
+
+  return slots;
+}
+
+/* Wide copy of 'str' ('#': WIDE_DIGIT). */
+static void Widen(const char* str, WCHAR* wide)
+{
+  do {
+    *wide++ = (*str == '#') ? WIDE_DIGIT : (UINT8) *str;
+  } while (*str++ != 0);
+}
+
+/* Reference: separators, then tokens which must be decimal ports. */
+static BOOL ReferencePorts(const char* str, UINT16* ports, unsigned* count)
+{
+  ULONG port;
+  SIZE_T len;
+  SIZE_T i;
+  unsigned n;
+
+  n = 0;
+
+  for (;;) {
+    str += strspn(str, " ,");
+
+    if (*str == 0) {
+      break;
+    }
+
+    len = strcspn(str, " ,");
+
+    if ((n == MAX_DISSECTOR_PORTS) || (strspn(str, "0123456789") != len)) {
+      return FALSE;
+    }
+
+    port = 0;
+
+    for (i = 0; i < len; i++) {
+      port = min((port * 10) + (str[i] - '0'), 0x10000);
+    }
+
+    if ((port == 0) || (port > 0xffff)) {
+      return FALSE;
+    }
+
+    ports[n++] = (UINT16) port;
+    str += len;
+  }
+
+  *count = n;
+
+  return n > 0;
+}
+
+static BOOL CheckPorts(const char* str)
+{
+  UINT16 expected[MAX_DISSECTOR_PORTS];
+  UINT16 ports[MAX_DISSECTOR_PORTS];
+  WCHAR wide[MAX_STRING + 1];
+  unsigned nexpected;
+  unsigned count;
+  BOOL valid;
+
+  Widen(str, wide);
+
+  count = 0xdead;
+  valid = ReferencePorts(str, expected, &nexpected);
+
+  if (ParsePorts(wide, ports, &count) != valid) {
+    fprintf(stderr, "ParsePorts(\"%s\") != %d\n", str, valid);
+    return FALSE;
+  }
+
+  if (!valid) {
+    /* The count is left as it was. */
+    return count == 0xdead;
+  }
+
+  return (count == nexpected) &&
+         (memcmp(ports, expected, count * sizeof(UINT16)) == 0);
+}
+
+static void CheckParsePorts()
+{
+  static const char* valid[] = {
+    "80",
+    "80, 8080, 8888",
+    "80,8080,8888",
+    "  443  ",
+    ",53,",
+    "1 65535",
+    "0080",
+    "000000000000053",
+    "1,2,3,4,5,6,7,8",
+    "1 2 3 4 5 6 7 8 , ,"
+  };
+
+  static const char* invalid[] = {
+    "",
+    "  ",
+    " , ,",
+    "0",
+    "80,0",
+    "65536",
+    "99999999999",
+    "4294967376",
+    "80a",
+    "a80",
+    "-1",
+    "80;81",
+    "80:81",
+    ":",
+    "/",
+    "80\t81",
+    "8#",
+    "#",
+    "1,2,3,4,5,6,7,8,9",
+    "1 2 3 4 5 6 7 8 x"
+  };
+
+  UINT16 ports[MAX_DISSECTOR_PORTS];
+  char str[MAX_STRING + 1];
+  unsigned seed;
+  unsigned len;
+  unsigned n;
+  unsigned i;
+  unsigned j;
+
+  for (i = 0; i < ARRAYSIZE(valid); i++) {
+    CHECK(ReferencePorts(valid[i], ports, &n));
+    CHECK(CheckPorts(valid[i]));
+  }
+
+  for (i = 0; i < ARRAYSIZE(invalid); i++) {
+    CHECK(!ReferencePorts(invalid[i], ports, &n));
+    CHECK(CheckPorts(invalid[i]));
+  }
+
+  /* Random strings: lists of ports (some of them too long) or characters
+   * drawn mostly from digits and separators.
+   */
+  seed = 49;
+
+  for (i = 0; i < NSTRINGS; i++) {
+    len = 0;
+
+    if (Random(&seed) & 1) {
+      n = Random(&seed) % (MAX_DISSECTOR_PORTS + 2);
+
+      /* Ports up to 98301 (some out of range). */
+      for (j = 0; j < n; j++) {
+        len += (unsigned) sprintf(str + len,
+                                  "%s%u",
+                                  (Random(&seed) & 1) ? ", " : " ",
+                                  (Random(&seed) % 32768) * 3);
+      }
+    } else {
+      n = Random(&seed) % (MAX_STRING + 1);
+
+      for (j = 0; j < n; j++) {
+        str[len++] = "0123456789012345 ,  ,,x:/#"[Random(&seed) % 26];
+      }
+
+      str[len] = 0;
+    }
+
+    if (!CheckPorts(str)) {
+      fprintf(stderr, "Ports mismatch: \"%s\"\n", str);
+      test_failures++;
+      break;
+    }
+  }
+}
+
+static void CheckDefaults()
+{
+  config_t defaults;
+  config_t config;
+  unsigned i;
+
+  GetDefaultConfig(&defaults);
+
+  CHECK(defaults.max_packets == MAX_PACKETS);
+  CHECK(defaults.max_packet_size == MAX_PACKET_SIZE);
+  CHECK(defaults.capture_records == CAPTURE_RECORDS);
+  CHECK(defaults.stats_interval_ms == LOG_STATS_EVERY_MS);
+  CHECK(defaults.flush_interval_ms == FLUSH_LOGS_EVERY_MS);
+  CHECK(defaults.log_buffer_size == LOG_BUFFER_SIZE);
+  CHECK(SameWide(defaults.log_file, LOG_FILE));
+  CHECK(defaults.dns_buckets == DNS_BUCKETS);
+  CHECK(defaults.dns_entries == DNS_ENTRIES);
+  CHECK(defaults.inspect_loopback == INSPECT_LOOPBACK);
+  CHECK(strcmp(defaults.excluded_subnets, EXCLUDED_SUBNETS) == 0);
+  CHECK(defaults.http_max_flows == HTTP_MAX_FLOWS);
+  CHECK(defaults.dns_max_queries == DNS_MAX_QUERIES);
+  CHECK(defaults.dns_drop_unsolicited == DNS_DROP_UNSOLICITED);
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    CHECK(defaults.nports[i] == min(dissectors[i].nports,
+                                    MAX_DISSECTOR_PORTS));
+    CHECK(memcmp(defaults.ports[i],
+                 dissectors[i].ports,
+                 defaults.nports[i] * sizeof(UINT16)) == 0);
+  }
+
+  /* Unrelated values are ignored, the names are case sensitive here. */
+  SetNumber(L"maxpackets", 2 * MAX_PACKETS);
+  SetString(L"MaxPackets", L"2000");
+  SetNumber(L"LogFile", 0);
+  SetString(L"Ports", L"1");
+  CHECK(Read(&config) == 0);
+  CHECK(memcmp(&config, &defaults, sizeof(config_t)) == 0);
+}
+
+static void CheckNumbers()
+{
+  config_t defaults;
+  config_t config;
+  const config_value_t* value;
+  ULONG tries[5];
+  ULONG expected;
+  unsigned i;
+  unsigned j;
+
+  GetDefaultConfig(&defaults);
+
+  for (i = 0; i < ARRAYSIZE(values); i++) {
+    value = &values[i];
+
+    tries[0] = value->minimum;
+    tries[1] = value->maximum;
+    tries[2] = value->minimum + ((value->maximum - value->minimum) / 3);
+    tries[3] = (value->minimum > 0) ? value->minimum - 1 : 0;
+    tries[4] = 0xffffffff;
+
+    for (j = 0; j < ARRAYSIZE(tries); j++) {
+      SetNumber(value->name, tries[j]);
+
+      expected = (tries[j] < value->minimum) ? value->minimum :
+                 min(tries[j], value->maximum);
+
+      CHECK(Read(&config) == ((expected != tries[j]) ? 1 : 0));
+
+      if (value->offset == offsetof(config_t, dns_max_queries)) {
+        expected = QuerySlots(expected);
+      }
+
+      if (*Field(&config, value) != expected) {
+        fprintf(stderr,
+                "Value %u = %u: %u instead of %u\n",
+                i,
+                tries[j],
+                *Field(&config, value),
+                expected);
+        test_failures++;
+      }
+
+      /* The other fields are left as they were. */
+      *Field(&config, value) = *Field(&defaults, value);
+      CHECK(memcmp(&config, &defaults, sizeof(config_t)) == 0);
+    }
+  }
+
+  /* Rounding of the number of DNS queries. */
+  SetNumber(L"DnsMaxQueries", 3);
+  Read(&config);
+  CHECK(config.dns_max_queries == 4);
+
+  SetNumber(L"DnsMaxQueries", 1000);
+  Read(&config);
+  CHECK(config.dns_max_queries == 512);
+
+  SetNumber(L"DnsMaxQueries", 1024);
+  Read(&config);
+  CHECK(config.dns_max_queries == 1024);
+
+  SetNumber(L"DnsMaxQueries", 100000);
+  CHECK(Read(&config) == 1);
+  CHECK(config.dns_max_queries == 64 * 1024);
+
+  SetNumber(L"DnsMaxQueries", 0);
+  Read(&config);
+  CHECK(config.dns_max_queries == 0);
+
+  /* Several values at once. */
+  SetNumber(L"MaxPackets", 4096);
+  SetNumber(L"HttpKeepAlive", 0);
+  SetNumber(L"DnsEntries", 0);
+  CHECK(Read(&config) == 1);
+  CHECK(config.max_packets == 4096);
+  CHECK(!config.http_keep_alive);
+  CHECK(config.dns_entries == 1);
+}
+
+static void CheckStrings()
+{
+  static WCHAR longest[CONFIG_MAX_PATH + 1];
+  static WCHAR subnets[MAX_STRING_VALUE + 1];
+  config_t defaults;
+  config_t config;
+  unsigned i;
+
+  GetDefaultConfig(&defaults);
+
+  /* Log file. */
+  SetString(L"LogFile", L"\\??\\D:\\logs\\inspect.log");
+  CHECK(Read(&config) == 0);
+  CHECK(SameWide(config.log_file, L"\\??\\D:\\logs\\inspect.log"));
+
+  SetString(L"LogFile", L"");
+  CHECK(Read(&config) == 0);
+  CHECK(SameWide(config.log_file, LOG_FILE));
+
+  for (i = 0; i < CONFIG_MAX_PATH - 1; i++) {
+    longest[i] = L'a' + (i % 26);
+  }
+
+  SetString(L"LogFile", longest);
+  CHECK(Read(&config) == 0);
+  CHECK(SameWide(config.log_file, longest));
+
+  /* One character too long: ignored, not truncated. */
+  longest[CONFIG_MAX_PATH - 1] = L'z';
+  SetString(L"LogFile", longest);
+  CHECK(Read(&config) == 1);
+  CHECK(SameWide(config.log_file, LOG_FILE));
+
+  /* Excluded subnets: ASCII only. */
+  SetString(L"ExcludedSubnets", L"10.0.0.0/8, fd00::/8");
+  CHECK(Read(&config) == 0);
+  CHECK(strcmp(config.excluded_subnets, "10.0.0.0/8, fd00::/8") == 0);
+
+  SetString(L"ExcludedSubnets", L"10.0.0.0/8 caf\u00e9::/16");
+  CHECK(Read(&config) == 1);
+  CHECK(strcmp(config.excluded_subnets, EXCLUDED_SUBNETS) == 0);
+
+  SetString(L"ExcludedSubnets", L"");
+  CHECK(Read(&config) == 0);
+  CHECK(config.excluded_subnets[0] == 0);
+
+  /* Over a longer list. */
+  strcpy(config.excluded_subnets, "192.168.0.0/16 10.0.0.0/8");
+  SetString(L"ExcludedSubnets", L"::1/128");
+  ReadConfig(NULL, &config);
+  nregistry = 0;
+  CHECK(strcmp(config.excluded_subnets, "::1/128") == 0);
+
+  for (i = 0; i < MAX_STRING_VALUE - 1; i++) {
+    subnets[i] = (i % 12 == 11) ? L' ' : L"10.0.0.0/24"[i % 12];
+  }
+
+  SetString(L"ExcludedSubnets", subnets);
+  CHECK(Read(&config) == 0);
+  CHECK(strlen(config.excluded_subnets) == MAX_STRING_VALUE - 1);
+
+  subnets[MAX_STRING_VALUE - 1] = L' ';
+  SetString(L"ExcludedSubnets", subnets);
+  CHECK(Read(&config) == 1);
+  CHECK(strcmp(config.excluded_subnets, EXCLUDED_SUBNETS) == 0);
+
+  /* Ports: "DNSPorts" is the value of both DNS dissectors. */
+  SetString(L"HTTPPorts", L"8000, 8001,8002");
+  SetString(L"HTTPSPorts", L"443, 70000");
+  SetString(L"DNSPorts", L"5353");
+  CHECK(Read(&config) == 1);
+
+  CHECK(config.nports[PROTOCOL_HTTP] == 3);
+  CHECK(config.ports[PROTOCOL_HTTP][0] == 8000);
+  CHECK(config.ports[PROTOCOL_HTTP][2] == 8002);
+
+  CHECK(config.nports[PROTOCOL_TLS] == defaults.nports[PROTOCOL_TLS]);
+  CHECK(memcmp(config.ports[PROTOCOL_TLS],
+               defaults.ports[PROTOCOL_TLS],
+               sizeof(config.ports[PROTOCOL_TLS])) == 0);
+
+  CHECK(config.nports[PROTOCOL_DNS] == 1);
+  CHECK(config.ports[PROTOCOL_DNS][0] == 5353);
+  CHECK(config.nports[PROTOCOL_DNS_TCP] == 1);
+  CHECK(config.ports[PROTOCOL_DNS_TCP][0] == 5353);
+
+  SetString(L"HTTPPorts", L"1,2,3,4,5,6,7,8");
+  CHECK(Read(&config) == 0);
+  CHECK(config.nports[PROTOCOL_HTTP] == MAX_DISSECTOR_PORTS);
+  CHECK(config.ports[PROTOCOL_HTTP][MAX_DISSECTOR_PORTS - 1] == 8);
+}
+
+int main()
+{
+  CheckParsePorts();
+  CheckDefaults();
+  CheckNumbers();
+  CheckStrings();
+
+  return TEST_RESULT();
+}
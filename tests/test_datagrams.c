@@ -0,0 +1,844 @@
+/* Datagrams (sys/inspect.c): DatagramClassify() must take every datagram of
+ * a chain of net buffer lists (up to MAX_DATAGRAMS packets, fewer if the
+ * packet pool runs short), in order, whether its data is in one buffer or
+ * split across several (gathered in the packet), truncated to the room of
+ * the packets, and the ignored datagrams must not use up packets. The
+ * packets which are not taken by the worker thread go back to the pool.
+ * The outbound DNS queries of a chain (split anywhere, after the UDP header)
+ * must all be recorded, so that only the responses without query are
+ * flagged (or dropped) as unsolicited. Random chains are checked against a
+ * model which walks the same datagrams from contiguous copies.
+ */
+
+#include <stdio.h>
+#include <ntddk.h>
+
+/* Performance counter of the DNS queries (they never expire here). */
+static LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER* frequency)
+{
+  LARGE_INTEGER counter;
+
+  if (frequency) {
+    frequency->QuadPart = 10000000;
+  }
+
+  counter.QuadPart = 1;
+
+  return counter;
+}
+
+#include "../sys/dns_query.c"
+#include "../sys/inspect.c"
+#include "test.h"
+#include "test_util.h"
+
+#define NROUNDS 3000
+#define MAX_CHAIN 48
+#define MAX_DATAGRAM 2048
+#define MAX_SEGMENTS 4
+#define NPACKETS 64
+
+#define HEADROOM 4
+
+/* Packets given to the worker thread. */
+static packet_t* given[NPACKETS];
+static unsigned ngiven;
+
+/* Number of packets the worker thread takes. */
+static unsigned accepted;
+
+typedef enum {
+  KIND_RESPONSE,
+  KIND_QUERY,
+  KIND_RANDOM,
+  KIND_SHORT,
+  KIND_EMPTY,
+  KIND_COUNT
+} kind_t;
+
+typedef struct {
+  UINT8 data[MAX_DATAGRAM];
+  ULONG len;
+
+  /* End of the question (DNS messages). */
+  ULONG question_end;
+
+  /* Response to a recorded query? */
+  BOOL solicited;
+} datagram_t;
+
+/* Chain of net buffer lists and the buffers of its datagrams. */
+typedef struct {
+  NET_BUFFER_LIST nbls[MAX_CHAIN];
+  NET_BUFFER nbs[MAX_CHAIN];
+  MDL mdls[MAX_CHAIN][MAX_SEGMENTS];
+  unsigned nmdls[MAX_CHAIN];
+} chain_t;
+
+/* Datagrams of the chain. */
+static datagram_t datagrams[MAX_CHAIN];
+
+/* Outbound queries (with the UDP header). */
+static datagram_t queries[MAX_CHAIN];
+
+static chain_t chain;
+
+static FWP_BYTE_ARRAY16 local_ip6 = {
+  {0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1}
+};
+
+static FWP_BYTE_ARRAY16 remote_ip6 = {
+  {0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x53, 0x53}
+};
+
+/* The answers of the DNS records (dns_parser.c) are not added to the cache
+ * and the log formatters (packet_processor.c) are not called.
+ */
+BOOL AddIPv4ToDnsCache(const UINT8* ipv4,
+                       const char* hostname,
+                       UINT16 hostnamelen,
+                       LONGLONG expires)
+{
+  UNREFERENCED_PARAMETER(ipv4);
+  UNREFERENCED_PARAMETER(hostname);
+  UNREFERENCED_PARAMETER(hostnamelen);
+  UNREFERENCED_PARAMETER(expires);
+
+  return TRUE;
+}
+
+BOOL AddIPv6ToDnsCache(const UINT8* ipv6,
+                       const char* hostname,
+                       UINT16 hostnamelen,
+                       LONGLONG expires)
+{
+  return AddIPv4ToDnsCache(ipv6, hostname, hostnamelen, expires);
+}
+
+BOOL Log(LARGE_INTEGER* system_time, const char* format, ...)
+{
+  UNREFERENCED_PARAMETER(system_time);
+  UNREFERENCED_PARAMETER(format);
+
+  return TRUE;
+}
+
+void LogHttp(packet_t* packet,
+             const char* local,
+             const char* remote,
+             const char* str)
+{
+  UNREFERENCED_PARAMETER(packet);
+  UNREFERENCED_PARAMETER(local);
+  UNREFERENCED_PARAMETER(remote);
+  UNREFERENCED_PARAMETER(str);
+}
+
+void LogHttps(packet_t* packet,
+              const char* local,
+              const char* remote,
+              const char* str)
+{
+  LogHttp(packet, local, remote, str);
+}
+
+void LogDns(packet_t* packet,
+            const char* local,
+            const char* remote,
+            const char* str)
+{
+  LogHttp(packet, local, remote, str);
+}
+
+/* Worker thread: takes the first 'accepted' packets. */
+unsigned GivePacketsToWorkerThread(packet_t** packets, unsigned count)
+{
+  if (count > accepted - ngiven) {
+    count = accepted - ngiven;
+  }
+
+  memcpy(given + ngiven, packets, count * sizeof(packet_t*));
+  ngiven += count;
+
+  return count;
+}
+
+BOOL GivePacketToWorkerThread(packet_t* packet)
+{
+  return (GivePacketsToWorkerThread(&packet, 1) == 1);
+}
+
+/* DNS message with a random question (and random answers if it is a
+ * response).
+ */
+static void MakeMessage(datagram_t* datagram,
+                        UINT16 id,
+                        BOOL response,
+                        unsigned* seed)
+{
+  UINT8* msg;
+  ULONG len;
+  unsigned nlabels;
+  unsigned n;
+  unsigned i;
+
+  msg = datagram->data;
+
+  msg[0] = (UINT8) (id >> 8);
+  msg[1] = (UINT8) id;
+  msg[2] = response ? 0x81 : 0x01;
+  msg[3] = (UINT8) (Random(seed) & 0xff);
+  msg[4] = 0;
+  msg[5] = 1;
+  memset(msg + 6, 0, 6);
+
+  /* Without answers, the record is the header and the question (random
+   * answers can't be parsed most of the time).
+   */
+  msg[7] = (UINT8) ((response) ? Random(seed) % 3 : 0);
+
+  len = 12;
+
+  for (nlabels = 1 + (Random(seed) % 4); nlabels > 0; nlabels--) {
+    msg[len++] = (UINT8) (n = 1 + (Random(seed) % 20));
+
+    for (i = 0; i < n; i++) {
+      msg[len++] = (UINT8) ('a' + (Random(seed) % 26));
+    }
+  }
+
+  msg[len++] = 0;
+  msg[len++] = 0;
+  msg[len++] = (Random(seed) % 2 == 0) ? 1 : 28;
+  msg[len++] = 0;
+  msg[len++] = 1;
+
+  datagram->question_end = len;
+
+  /* Answers (or trailing bytes). */
+  if (response) {
+    for (n = Random(seed) % MAX_DATAGRAM;
+         (n > 0) && (len < MAX_DATAGRAM);
+         n--) {
+      msg[len++] = (UINT8) Random(seed);
+    }
+  }
+
+  datagram->len = len;
+  datagram->solicited = FALSE;
+}
+
+static void MakeDatagram(datagram_t* datagram, kind_t kind, unsigned* seed)
+{
+  ULONG i;
+
+  switch (kind) {
+    case KIND_RESPONSE:
+      MakeMessage(datagram, (UINT16) Random(seed), TRUE, seed);
+      break;
+
+    case KIND_QUERY:
+      MakeMessage(datagram, (UINT16) Random(seed), FALSE, seed);
+      break;
+
+    case KIND_RANDOM:
+    case KIND_SHORT:
+      datagram->len = (kind == KIND_SHORT) ?
+                        Random(seed) % 12 :
+                        12 + (Random(seed) % (MAX_DATAGRAM - 12));
+
+      for (i = 0; i < datagram->len; i++) {
+        datagram->data[i] = (UINT8) Random(seed);
+      }
+
+      /* Not a DNS response. */
+      if (datagram->len > 5) {
+        datagram->data[5] = 2;
+      }
+
+      datagram->question_end = 0;
+      datagram->solicited = FALSE;
+      break;
+
+    default:
+      datagram->len = 0;
+      datagram->question_end = 0;
+      datagram->solicited = FALSE;
+  }
+}
+
+/* Split the datagram in 1 to MAX_SEGMENTS buffers (of exact sizes), after
+ * up to HEADROOM bytes and followed by up to 3 bytes which are not part of
+ * the datagram.
+ */
+static BOOL Split(const datagram_t* datagram,
+                  NET_BUFFER* nb,
+                  MDL* mdls,
+                  unsigned* nmdls,
+                  unsigned* seed)
+{
+  ULONG cuts[MAX_SEGMENTS + 1];
+  ULONG headroom;
+  ULONG tail;
+  ULONG size;
+  ULONG tmp;
+  UINT8* buffer;
+  unsigned n;
+  unsigned i;
+  unsigned j;
+
+  headroom = Random(seed) % (HEADROOM + 1);
+  tail = Random(seed) % 4;
+
+  n = 1 + (Random(seed) % MAX_SEGMENTS);
+
+  /* Sorted cuts of the datagram (the buffers might be empty). */
+  cuts[0] = 0;
+  cuts[n] = datagram->len;
+
+  for (i = 1; i < n; i++) {
+    cuts[i] = (datagram->len > 0) ? Random(seed) % (datagram->len + 1) : 0;
+
+    for (j = i; (j > 1) && (cuts[j - 1] > cuts[j]); j--) {
+      tmp = cuts[j];
+      cuts[j] = cuts[j - 1];
+      cuts[j - 1] = tmp;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    size = cuts[i + 1] - cuts[i] + ((i == 0) ? headroom : 0) +
+           ((i == n - 1) ? tail : 0);
+
+    /* Exact size. */
+    if ((buffer = malloc(size + (size == 0))) == NULL) {
+      *nmdls = i;
+      return FALSE;
+    }
+
+    memset(buffer, 0xee, size);
+    memcpy(buffer + ((i == 0) ? headroom : 0),
+           datagram->data + cuts[i],
+           cuts[i + 1] - cuts[i]);
+
+    mdls[i].Next = (i < n - 1) ? &mdls[i + 1] : NULL;
+    mdls[i].base = buffer;
+    mdls[i].length = size;
+    mdls[i].va = buffer;
+    mdls[i].size = size;
+  }
+
+  *nmdls = n;
+
+  nb->Next = NULL;
+  nb->CurrentMdl = &mdls[0];
+  nb->CurrentMdlOffset = headroom;
+  nb->DataLength = datagram->len;
+
+  return TRUE;
+}
+
+static void FreeChain(unsigned count)
+{
+  unsigned i;
+  unsigned j;
+
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < chain.nmdls[i]; j++) {
+      free(chain.mdls[i][j].base);
+    }
+
+    chain.nmdls[i] = 0;
+  }
+}
+
+/* Chain of the datagrams ('head', NULL if there are none), in net buffer
+ * lists of 1 net buffer or more.
+ */
+static BOOL MakeChain(const datagram_t* list,
+                      unsigned count,
+                      NET_BUFFER_LIST** head,
+                      unsigned* seed)
+{
+  NET_BUFFER_LIST* nbl;
+  unsigned nnbls;
+  unsigned i;
+
+  nnbls = 0;
+
+  for (i = 0; i < count; i++) {
+    if (!Split(&list[i], &chain.nbs[i], chain.mdls[i], &chain.nmdls[i], seed)) {
+      FreeChain(i + 1);
+      return FALSE;
+    }
+
+    if ((i == 0) || (Random(seed) % 3 == 0)) {
+      nbl = &chain.nbls[nnbls];
+
+      if (nnbls > 0) {
+        chain.nbls[nnbls - 1].Next = nbl;
+      }
+
+      nbl->Next = NULL;
+      nbl->FirstNetBuffer = &chain.nbs[i];
+
+      nnbls++;
+    } else {
+      chain.nbs[i - 1].Next = &chain.nbs[i];
+    }
+  }
+
+  *head = (count > 0) ? &chain.nbls[0] : NULL;
+
+  return TRUE;
+}
+
+static void MakeValues(FWPS_INCOMING_VALUES* values,
+                       FWPS_INCOMING_VALUE* fields,
+                       UINT8 ip_version)
+{
+  memset(fields, 0, FWPS_MAX_FIELDS * sizeof(FWPS_INCOMING_VALUE));
+
+  if (ip_version == 4) {
+    values->layerId = FWPS_LAYER_DATAGRAM_DATA_V4;
+
+    fields[FWPS_FIELD_DATAGRAM_DATA_V4_IP_LOCAL_ADDRESS].value.uint32 =
+      0x0a000001;
+    fields[FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_ADDRESS].value.uint32 =
+      0x0a000035;
+    fields[FWPS_FIELD_DATAGRAM_DATA_V4_IP_LOCAL_PORT].value.uint16 = 50000;
+    fields[FWPS_FIELD_DATAGRAM_DATA_V4_IP_REMOTE_PORT].value.uint16 = 53;
+  } else {
+    values->layerId = FWPS_LAYER_DATAGRAM_DATA_V6;
+
+    fields[FWPS_FIELD_DATAGRAM_DATA_V6_IP_LOCAL_ADDRESS].value.byteArray16 =
+      &local_ip6;
+    fields[FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_ADDRESS].value.byteArray16 =
+      &remote_ip6;
+    fields[FWPS_FIELD_DATAGRAM_DATA_V6_IP_LOCAL_PORT].value.uint16 = 50001;
+    fields[FWPS_FIELD_DATAGRAM_DATA_V6_IP_REMOTE_PORT].value.uint16 = 53;
+  }
+
+  values->valueCount = FWPS_MAX_FIELDS;
+  values->incomingValue = fields;
+}
+
+/* Packet expected for the datagram (FALSE: ignored). */
+static BOOL Expect(const datagram_t* datagram,
+                   UINT8 ip_version,
+                   unsigned max_payload_size,
+                   BOOL capture_records,
+                   packet_t* packet)
+{
+  const dissector_t* dissector;
+  ULONG len;
+  SIZE_T record_len;
+  UINT16 port;
+
+  memset(packet, 0, offsetof(packet_t, payload));
+
+  packet->ip_version = ip_version;
+
+  if (ip_version == 4) {
+    memcpy(packet->local_ip, "\x0a\x00\x00\x01", 4);
+    memcpy(packet->remote_ip, "\x0a\x00\x00\x35", 4);
+    port = 50000;
+  } else {
+    memcpy(packet->local_ip, local_ip6.byteArray16, 16);
+    memcpy(packet->remote_ip, remote_ip6.byteArray16, 16);
+    port = 50001;
+  }
+
+  packet->local_port = port;
+  packet->remote_port = 53;
+
+  len = min(datagram->len, max_payload_size);
+
+  if ((len == 0) ||
+      ((packet->protocol = (UINT8) DetectProtocol(TRANSPORT_UDP,
+                                                  53,
+                                                  datagram->data,
+                                                  len)) ==
+       PROTOCOL_UNKNOWN)) {
+    return FALSE;
+  }
+
+  dissector = GetDissector((protocol_t) packet->protocol);
+
+  if ((capture_records) &&
+      (dissector->compact) &&
+      ((record_len = dissector->compact(datagram->data,
+                                        len,
+                                        packet->payload,
+                                        max_payload_size)) > 0)) {
+    packet->flags = PACKET_FLAG_RECORD;
+    packet->payloadlen = (UINT16) record_len;
+  } else {
+    packet->payloadlen = (UINT16) min(len, dissector->capture_len);
+    memcpy(packet->payload, datagram->data, packet->payloadlen);
+  }
+
+  /* The question has to be whole to match the query. */
+  if ((packet->protocol == PROTOCOL_DNS) &&
+      (DnsQueriesTracked()) &&
+      ((!datagram->solicited) || (len < datagram->question_end))) {
+    packet->flags |= PACKET_FLAG_UNSOLICITED;
+  }
+
+  return TRUE;
+}
+
+static BOOL SamePacket(const packet_t* packet, const packet_t* expected)
+{
+  SIZE_T iplen;
+
+  iplen = (expected->ip_version == 4) ? 4 : 16;
+
+  return ((packet->ip_version == expected->ip_version) &&
+          (packet->protocol == expected->protocol) &&
+          (packet->flags == expected->flags) &&
+          (memcmp(packet->local_ip, expected->local_ip, iplen) == 0) &&
+          (memcmp(packet->remote_ip, expected->remote_ip, iplen) == 0) &&
+          (packet->local_port == expected->local_port) &&
+          (packet->remote_port == expected->remote_port) &&
+          (packet->payloadlen == expected->payloadlen) &&
+          (memcmp(packet->payload,
+                  expected->payload,
+                  packet->payloadlen) == 0));
+}
+
+/* Every packet back in the pool (once)? */
+static BOOL PoolFull()
+{
+  packet_t* packets[NPACKETS + 1];
+  unsigned count;
+  unsigned i;
+  unsigned j;
+  BOOL ok;
+
+  count = PopPackets(packets, NPACKETS + 1);
+  ok = (count == NPACKETS);
+
+  for (i = 0; i < count; i++) {
+    for (j = i + 1; j < count; j++) {
+      ok &= (packets[i] != packets[j]);
+    }
+  }
+
+  PushPackets(packets, count);
+
+  return ok;
+}
+
+/* Send the queries (outbound chain), then receive the datagrams (inbound
+ * chain) with 'available' packets in the pool and the worker thread taking
+ * 'accepted' of them.
+ */
+static BOOL Round(unsigned ndatagrams,
+                  unsigned nqueries,
+                  UINT8 ip_version,
+                  unsigned max_packet_size,
+                  BOOL capture_records,
+                  BOOL drop_unsolicited,
+                  unsigned available,
+                  unsigned* seed)
+{
+  FWPS_INCOMING_VALUE fields[FWPS_MAX_FIELDS];
+  FWPS_INCOMING_VALUES values;
+  FWPS_INCOMING_METADATA_VALUES meta;
+  FWPS_CLASSIFY_OUT out;
+  FWPS_FILTER filter;
+  dns_query_stats_t stats;
+  NET_BUFFER_LIST* nbl;
+  packet_t* held[NPACKETS];
+  packet_t* packet;
+  UINT8* expected;
+  unsigned max_payload_size;
+  SIZE_T stride;
+  unsigned count;
+  unsigned nexpected;
+  unsigned nheld;
+  unsigned i;
+  BOOL ok;
+
+  max_payload_size = max_packet_size - offsetof(packet_t, payload);
+
+  /* Keep the packets aligned. */
+  stride = ((SIZE_T) max_packet_size + sizeof(LONGLONG) - 1) &
+           ~(sizeof(LONGLONG) - 1);
+
+  if ((expected = malloc(NPACKETS * stride)) == NULL) {
+    return FALSE;
+  }
+
+  InitInspect(max_packet_size, capture_records, drop_unsolicited);
+
+  MakeValues(&values, fields, ip_version);
+
+  memset(&filter, 0, sizeof(filter));
+  ok = TRUE;
+
+  /* Queries of some of the responses (after the UDP header, which is given
+   * by the metadata or not).
+   */
+  for (i = 0; i < nqueries; i++) {
+    datagrams[i].solicited = TRUE;
+
+    memset(queries[i].data, 0, UDP_HEADER_LEN);
+    memcpy(queries[i].data + UDP_HEADER_LEN,
+           datagrams[i].data,
+           datagrams[i].question_end);
+    queries[i].data[UDP_HEADER_LEN + 2] = 0x01;
+    queries[i].len = UDP_HEADER_LEN + datagrams[i].question_end;
+  }
+
+  if (nqueries > 0) {
+    memset(&meta, 0, sizeof(meta));
+
+    if (Random(seed) % 2 == 0) {
+      meta.currentMetadataValues = FWPS_METADATA_FIELD_TRANSPORT_HEADER_SIZE;
+      meta.transportHeaderSize = UDP_HEADER_LEN;
+    }
+
+    if (!MakeChain(queries, nqueries, &nbl, seed)) {
+      free(expected);
+      return FALSE;
+    }
+
+    out.actionType = 0;
+
+    DatagramClassify(&values, &meta, nbl, NULL, &filter, 0, &out);
+
+    ok &= (out.actionType == FWP_ACTION_CONTINUE);
+
+    FreeChain(nqueries);
+
+    GetDnsQueryStats(&stats);
+    ok &= (stats.queries == nqueries);
+  }
+
+  /* Packets expected (for the first datagrams which aren't ignored). */
+  count = min(min(ndatagrams, MAX_DATAGRAMS), available);
+
+  for (i = 0, nexpected = 0; (i < ndatagrams) && (nexpected < count); i++) {
+    packet = (packet_t*) (expected + (nexpected * stride));
+
+    if ((Expect(&datagrams[i],
+                ip_version,
+                max_payload_size,
+                capture_records,
+                packet)) &&
+        ((!drop_unsolicited) ||
+         ((packet->flags & PACKET_FLAG_UNSOLICITED) == 0))) {
+      nexpected++;
+    }
+  }
+
+  /* Packets in use elsewhere. */
+  nheld = PopPackets(held, NPACKETS - available);
+
+  if (!MakeChain(datagrams, ndatagrams, &nbl, seed)) {
+    PushPackets(held, nheld);
+    free(expected);
+    return FALSE;
+  }
+
+  memset(&meta, 0, sizeof(meta));
+  meta.currentMetadataValues = FWPS_METADATA_FIELD_IP_HEADER_SIZE;
+  meta.ipHeaderSize = (ip_version == 4) ? 20 : 40;
+
+  ngiven = 0;
+  out.actionType = 0;
+
+  DatagramClassify(&values, &meta, nbl, NULL, &filter, 0, &out);
+
+  ok &= (out.actionType == FWP_ACTION_CONTINUE);
+
+  FreeChain(ndatagrams);
+
+  /* The first packets, taken by the worker thread. */
+  ok &= (ngiven == min(nexpected, accepted));
+
+  for (i = 0; (i < ngiven) && (ok); i++) {
+    ok &= SamePacket(given[i],
+                     (packet_t*) (expected + (i * stride)));
+  }
+
+  PushPackets(given, ngiven);
+  PushPackets(held, nheld);
+
+  ok &= PoolFull();
+
+  free(expected);
+
+  return ok;
+}
+
+/* A chain of one datagram of each kind, in one buffer and split. */
+static void CheckKinds(unsigned* seed)
+{
+  unsigned kind;
+  unsigned i;
+
+  accepted = NPACKETS;
+
+  for (kind = 0; kind < KIND_COUNT; kind++) {
+    for (i = 0; i < 20; i++) {
+      MakeDatagram(&datagrams[0], (kind_t) kind, seed);
+
+      CHECK(Round(1, 0, 4, MAX_PACKET_SIZE, TRUE, FALSE, NPACKETS, seed));
+      CHECK(Round(1, 0, 6, MAX_PACKET_SIZE, FALSE, FALSE, NPACKETS, seed));
+    }
+  }
+
+  /* A response of MAX_DATAGRAM bytes, truncated and not. */
+  MakeMessage(&datagrams[0], 1, TRUE, seed);
+
+  while (datagrams[0].len < MAX_DATAGRAM) {
+    datagrams[0].data[datagrams[0].len++] = 0;
+  }
+
+  /* No answers: the record is the header and the question. */
+  datagrams[0].data[7] = 0;
+
+  CHECK(Round(1, 0, 4, MAX_PACKET_SIZE, TRUE, FALSE, NPACKETS, seed));
+  CHECK(Round(1,
+              0,
+              4,
+              offsetof(packet_t, payload) + MAX_DATAGRAM,
+              FALSE,
+              FALSE,
+              NPACKETS,
+              seed));
+}
+
+/* More datagrams than MAX_DATAGRAMS, some of them ignored, and more
+ * datagrams than packets.
+ */
+static void CheckLimits(unsigned* seed)
+{
+  unsigned available;
+  unsigned i;
+
+  accepted = NPACKETS;
+
+  for (i = 0; i < MAX_CHAIN; i++) {
+    MakeDatagram(&datagrams[i], (i % 3 == 2) ? KIND_RANDOM : KIND_RESPONSE,
+                 seed);
+  }
+
+  CHECK(Round(MAX_CHAIN, 0, 4, MAX_PACKET_SIZE, TRUE, FALSE, NPACKETS,
+              seed));
+  CHECK(ngiven == MAX_DATAGRAMS);
+
+  for (available = 0; available <= 3; available++) {
+    CHECK(Round(MAX_CHAIN, 0, 6, MAX_PACKET_SIZE, TRUE, FALSE, available,
+                seed));
+    CHECK(ngiven == available);
+  }
+
+  /* The worker thread takes some of them. */
+  for (accepted = 0; accepted < 4; accepted++) {
+    CHECK(Round(MAX_CHAIN, 0, 4, MAX_PACKET_SIZE, FALSE, FALSE, NPACKETS,
+                seed));
+    CHECK(ngiven == accepted);
+  }
+}
+
+/* Random chains, queries of random responses. */
+static void CheckRandom(unsigned* seed)
+{
+  unsigned ndatagrams;
+  unsigned nqueries;
+  unsigned nsolicited;
+  unsigned i;
+  BOOL drop;
+  BOOL ok;
+
+  nsolicited = 0;
+  ok = TRUE;
+
+  for (i = 0; (i < NROUNDS) && (ok); i++) {
+    ndatagrams = Random(seed) % (MAX_CHAIN + 1);
+
+    for (nqueries = 0; nqueries < ndatagrams; nqueries++) {
+      MakeDatagram(&datagrams[nqueries],
+                   (Random(seed) % 2 == 0) ?
+                     KIND_RESPONSE :
+                     (kind_t) (Random(seed) % KIND_COUNT),
+                   seed);
+    }
+
+    /* Queries for the first responses. */
+    for (nqueries = 0;
+         (nqueries < ndatagrams) &&
+         (datagrams[nqueries].data[2] == 0x81) &&
+         (datagrams[nqueries].question_end > 0) &&
+         (Random(seed) % 4 != 0);
+         nqueries++);
+
+    nsolicited += nqueries;
+
+    accepted = (Random(seed) % 4 == 0) ? Random(seed) % 8 : NPACKETS;
+    drop = (Random(seed) % 2 == 0);
+
+    FreeDnsQueries();
+    InitDnsQueries((Random(seed) % 3 == 0) ? 0 : 4096, 5000);
+
+    ok = Round(ndatagrams,
+               DnsQueriesTracked() ? nqueries : 0,
+               (Random(seed) % 2 == 0) ? 4 : 6,
+               offsetof(packet_t, payload) + 32 +
+                 (Random(seed) % (MAX_DATAGRAM - 31)),
+               (Random(seed) % 4 != 0),
+               drop,
+               (Random(seed) % 4 == 0) ? Random(seed) % 40 : NPACKETS,
+               seed);
+
+    if (!ok) {
+      fprintf(stderr,
+              "Round %u (%u datagrams, %u queries) failed.\n",
+              i,
+              ndatagrams,
+              nqueries);
+    }
+
+    /* No responses matched through the untracked queries. */
+    for (nqueries = 0; nqueries < ndatagrams; nqueries++) {
+      datagrams[nqueries].solicited = FALSE;
+    }
+  }
+
+  CHECK(ok);
+  CHECK(nsolicited > 0);
+}
+
+int main()
+{
+  classify_stats_t stats;
+  unsigned seed;
+
+  seed = 46;
+
+  if (!InitPacketPool(NPACKETS, offsetof(packet_t, payload) + MAX_DATAGRAM,
+                      FALSE)) {
+    fprintf(stderr, "InitPacketPool() failed.\n");
+    return 1;
+  }
+
+  InitDissectors();
+  InitDnsQueries(0, 5000);
+
+  CheckKinds(&seed);
+  CheckLimits(&seed);
+  CheckRandom(&seed);
+
+  GetClassifyStats(&stats);
+  CHECK(stats.datagram > NROUNDS);
+  CHECK((stats.stream == 0) && (stats.closure == 0));
+
+  FreeDnsQueries();
+  FreePacketPool();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,288 @@
+/* Dissector registry (sys/dissector.c): the port hash must map every port
+ * (all 65536 of them) to the first dissector which has it, with the default
+ * ports and after SetDissectorPorts() with random sets of ports drawn from
+ * ports which collide in the hash (shared by several dissectors, repeated),
+ * without ever filling more than half of the table. Invalid sets must be
+ * rejected and leave the ports as they were. GetDissectorPorts() must
+ * return the ports of the transport protocols once each, and
+ * DetectProtocol() must find the protocol from the payload whatever the
+ * port.
+ */
+
+#include <stdio.h>
+#include "../sys/dissector.c"
+#include "test.h"
+#include "test_util.h"
+
+#define NCONFIGS 1000
+#define NPOOL 48
+
+/* Log formatters and DNS records (packet_processor.c, dns_parser.c) are not
+ * called by the registry.
+ */
+void LogHttp(packet_t* packet,
+             const char* local,
+             const char* remote,
+             const char* str)
+{
+  UNREFERENCED_PARAMETER(packet);
+  UNREFERENCED_PARAMETER(local);
+  UNREFERENCED_PARAMETER(remote);
+  UNREFERENCED_PARAMETER(str);
+}
+
+void LogHttps(packet_t* packet,
+              const char* local,
+              const char* remote,
+              const char* str)
+{
+  LogHttp(packet, local, remote, str);
+}
+
+void LogDns(packet_t* packet,
+            const char* local,
+            const char* remote,
+            const char* str)
+{
+  LogHttp(packet, local, remote, str);
+}
+
+SIZE_T BuildDnsRecord(const UINT8* data,
+                      SIZE_T len,
+                      UINT8* record,
+                      SIZE_T size)
+{
+  UNREFERENCED_PARAMETER(data);
+  UNREFERENCED_PARAMETER(len);
+  UNREFERENCED_PARAMETER(record);
+  UNREFERENCED_PARAMETER(size);
+
+  return 0;
+}
+
+static UINT16 config_ports[PROTOCOL_COUNT][MAX_DISSECTOR_PORTS];
+static unsigned config_nports[PROTOCOL_COUNT];
+
+/* First dissector which has the port. */
+static protocol_t FindPort(UINT16 port)
+{
+  unsigned i;
+  unsigned j;
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    for (j = 0; j < config_nports[i]; j++) {
+      if (config_ports[i][j] == port) {
+        return (protocol_t) i;
+      }
+    }
+  }
+
+  return PROTOCOL_UNKNOWN;
+}
+
+static BOOL SamePorts(const UINT16* pool, unsigned npool, BOOL all)
+{
+  unsigned port;
+  unsigned used;
+  unsigned i;
+
+  if (all) {
+    for (port = 0; port < 65536; port++) {
+      if (GetProtocolForPort((UINT16) port) != FindPort((UINT16) port)) {
+        fprintf(stderr, "Port %u\n", port);
+        return FALSE;
+      }
+    }
+  } else {
+    for (i = 0; i < npool; i++) {
+      if (GetProtocolForPort(pool[i]) != FindPort(pool[i])) {
+        fprintf(stderr, "Port %u\n", pool[i]);
+        return FALSE;
+      }
+    }
+  }
+
+  /* At most half full (the walks end). */
+  used = 0;
+
+  for (i = 0; i < PORTS_HASH_SIZE; i++) {
+    used += (ports_hash[i].port != 0);
+  }
+
+  return (used <= PORTS_HASH_SIZE / 2);
+}
+
+/* The ports of the dissectors of the transport protocols, once each, in the
+ * order of the dissectors.
+ */
+static BOOL SameDissectorPorts(UINT8 transports, unsigned max)
+{
+  UINT16 ports[PROTOCOL_COUNT * MAX_DISSECTOR_PORTS];
+  UINT16 expected[PROTOCOL_COUNT * MAX_DISSECTOR_PORTS];
+  unsigned nexpected;
+  unsigned count;
+  unsigned i;
+  unsigned j;
+  unsigned k;
+
+  nexpected = 0;
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    if (!(GetDissector((protocol_t) i)->transport & transports)) {
+      continue;
+    }
+
+    for (j = 0; j < config_nports[i]; j++) {
+      for (k = 0; k < nexpected; k++) {
+        if (expected[k] == config_ports[i][j]) {
+          break;
+        }
+      }
+
+      if ((k == nexpected) && (nexpected < max)) {
+        expected[nexpected++] = config_ports[i][j];
+      }
+    }
+  }
+
+  count = GetDissectorPorts(transports, ports, max);
+
+  return ((count == nexpected) &&
+          (memcmp(ports, expected, count * sizeof(UINT16)) == 0));
+}
+
+static void CheckDetection()
+{
+  static const UINT8 request[] = "GET / HTTP/1.1\r\n\r\n";
+  static const UINT8 hello[] = {0x16, 0x03, 0x01, 0x00, 0x2d, 0x01};
+  static const UINT8 response[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00
+  };
+  static const UINT8 tcp_query[] = {
+    0x00, 0x1d, 0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00
+  };
+  static const UINT16 ports[] = {53, 80, 443, 5353, 8080, 12345};
+  unsigned i;
+
+  for (i = 0; i < ARRAYSIZE(ports); i++) {
+    CHECK(DetectProtocol(TRANSPORT_TCP, ports[i], request, 18) ==
+          PROTOCOL_HTTP);
+    CHECK(DetectProtocol(TRANSPORT_TCP, ports[i], hello, 6) == PROTOCOL_TLS);
+    CHECK(DetectProtocol(TRANSPORT_UDP, ports[i], response, 12) ==
+          PROTOCOL_DNS);
+    CHECK(DetectProtocol(TRANSPORT_TCP, ports[i], tcp_query, 14) ==
+          PROTOCOL_DNS_TCP);
+
+    /* Wrong transport protocol, not a response, too short. */
+    CHECK(DetectProtocol(TRANSPORT_UDP, ports[i], request, 18) ==
+          PROTOCOL_UNKNOWN);
+    CHECK(DetectProtocol(TRANSPORT_UDP, ports[i], hello, 6) ==
+          PROTOCOL_UNKNOWN);
+    CHECK(DetectProtocol(TRANSPORT_UDP, ports[i], tcp_query + 2, 12) ==
+          PROTOCOL_UNKNOWN);
+    CHECK(DetectProtocol(TRANSPORT_TCP, ports[i], request, 3) ==
+          PROTOCOL_UNKNOWN);
+  }
+}
+
+int main()
+{
+  UINT16 pool[NPOOL];
+  UINT16 ports[PROTOCOL_COUNT][MAX_DISSECTOR_PORTS];
+  unsigned nports[PROTOCOL_COUNT];
+  unsigned seed;
+  unsigned port;
+  unsigned n;
+  unsigned i;
+  unsigned j;
+
+  /* Default ports. */
+  InitDissectors();
+
+  for (i = PROTOCOL_UNKNOWN + 1; i < PROTOCOL_COUNT; i++) {
+    config_nports[i] = GetDissector((protocol_t) i)->nports;
+    memcpy(config_ports[i],
+           GetDissector((protocol_t) i)->ports,
+           config_nports[i] * sizeof(UINT16));
+  }
+
+  CHECK(SamePorts(NULL, 0, TRUE));
+  CHECK(GetProtocolForPort(53) == PROTOCOL_DNS);
+  CHECK(GetProtocolForPort(8443) == PROTOCOL_TLS);
+  CHECK(SameDissectorPorts(TRANSPORT_TCP, ARRAYSIZE(pool)));
+  CHECK(SameDissectorPorts(TRANSPORT_UDP, ARRAYSIZE(pool)));
+  CHECK(SameDissectorPorts(TRANSPORT_TCP | TRANSPORT_UDP, ARRAYSIZE(pool)));
+  CHECK(SameDissectorPorts(TRANSPORT_TCP, 3));
+
+  CheckDetection();
+
+  /* Ports which collide in the hash (3 slots, 2 of them adjacent). */
+  n = 0;
+
+  for (port = 1; (port < 65536) && (n < NPOOL); port++) {
+    if ((PORT_HASH(port) == 5) || (PORT_HASH(port) == 6) ||
+        (PORT_HASH(port) == PORTS_HASH_SIZE - 1)) {
+      pool[n++] = (UINT16) port;
+    }
+  }
+
+  CHECK(n == NPOOL);
+
+  seed = 40;
+
+  for (i = 0; i < NCONFIGS; i++) {
+    for (j = PROTOCOL_UNKNOWN; j < PROTOCOL_COUNT; j++) {
+      nports[j] = 1 + (Random(&seed) % MAX_DISSECTOR_PORTS);
+
+      for (n = 0; n < nports[j]; n++) {
+        ports[j][n] = ((Random(&seed) % 4) == 0) ?
+                        (UINT16) (1 + (Random(&seed) % 65535)) :
+                        pool[Random(&seed) % NPOOL];
+      }
+    }
+
+    /* Invalid sets. */
+    if ((i % 10) == 0) {
+      j = 1 + (Random(&seed) % (PROTOCOL_COUNT - 1));
+      n = nports[j];
+
+      switch (Random(&seed) % 3) {
+        case 0:
+          nports[j] = 0;
+          break;
+        case 1:
+          nports[j] = MAX_DISSECTOR_PORTS + 1;
+          break;
+        default:
+          ports[j][Random(&seed) % nports[j]] = 0;
+      }
+
+      CHECK(!SetDissectorPorts(ports, nports));
+      CHECK(SamePorts(pool, NPOOL, FALSE));
+
+      nports[j] = n;
+      continue;
+    }
+
+    CHECK(SetDissectorPorts(ports, nports));
+
+    for (j = PROTOCOL_UNKNOWN + 1; j < PROTOCOL_COUNT; j++) {
+      memcpy(config_ports[j], ports[j], nports[j] * sizeof(UINT16));
+      config_nports[j] = nports[j];
+    }
+
+    if (!SamePorts(pool, NPOOL, i < 100)) {
+      fprintf(stderr, "Configuration %u\n", i);
+      CHECK(FALSE);
+    }
+
+    CHECK(SameDissectorPorts(TRANSPORT_TCP, ARRAYSIZE(pool)));
+    CHECK(SameDissectorPorts(TRANSPORT_UDP, ARRAYSIZE(pool)));
+    CHECK(SameDissectorPorts(TRANSPORT_TCP | TRANSPORT_UDP, 5));
+
+    CheckDetection();
+  }
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,659 @@
+/* DNS answers (sys/dns_parser.c): ParseDnsResponse() must add the addresses
+ * of the answers to the DNS cache with the hostname at the beginning of
+ * their CNAME chain, and log the answers, as a reference model of the
+ * aliases (a list searched by name, case-insensitive, the last CNAME record
+ * of an alias wins) does, on responses with many aliases: 20 CNAMEs and 130
+ * A records, 300 A records, 150 CNAMEs (10 interleaved chains) and 10 A
+ * records, 605 small answers (more than MAX_ANSWERS_LEN bytes, the aliases
+ * colliding in the hash table) and random responses. The answers which
+ * start after MAX_ANSWERS_LEN bytes must be ignored, by BuildDnsRecord() as
+ * well, whose record must give the same results. Each response is parsed in
+ * a buffer of the exact size, after the others (the aliases of a response
+ * must not be seen by the next ones).
+ */
+
+#include <stdio.h>
+#include <strings.h>
+#include "../sys/dns_parser.c"
+#include "dns_results.h"
+#include "test_util.h"
+
+#define NRESPONSES 300
+#define MAX_MESSAGE 32768
+#define MAX_ANSWERS 640
+#define MAX_NAMES 1024
+#define MAX_SUFFIXES 4096
+
+#define TYPE_A 1
+#define TYPE_CNAME 5
+#define TYPE_AAAA 28
+
+typedef struct {
+  UINT16 type;
+  UINT16 class;
+
+  /* Name and alias (CNAME) or address. */
+  const char* name;
+  const char* alias;
+  UINT8 address[16];
+
+  UINT32 ttl;
+} answer_t;
+
+typedef struct {
+  /* Question (and other questions). */
+  const char* hostname;
+  const char** questions;
+  unsigned nquestions;
+
+  answer_t answers[MAX_ANSWERS];
+  unsigned nanswers;
+
+  /* Names compressed (pointer to the same name written before). */
+  BOOL compress;
+} response_t;
+
+/* Names of the generated responses. */
+static char names[MAX_NAMES][HOST_NAME_MAX_LEN + 1];
+static unsigned nnames;
+
+/* Names written in the message (to compress the following ones). */
+static const char* suffixes[MAX_SUFFIXES];
+static UINT16 suffix_offsets[MAX_SUFFIXES];
+static unsigned nsuffixes;
+
+/* New name from a format (labels in random case if 'seed'). */
+static const char* Name(unsigned* seed, const char* format, ...)
+{
+  va_list ap;
+  char* name;
+
+  if (nnames == MAX_NAMES) {
+    CHECK(nnames < MAX_NAMES);
+    return "overflow.example";
+  }
+
+  name = names[nnames++];
+
+  va_start(ap, format);
+  vsnprintf(name, HOST_NAME_MAX_LEN + 1, format, ap);
+  va_end(ap);
+
+  for (; (seed) && (*name); name++) {
+    if ((*name >= 'a') && (*name <= 'z') && (Random(seed) % 4 == 0)) {
+      *name = (char) (*name - 'a' + 'A');
+    }
+  }
+
+  return names[nnames - 1];
+}
+
+/* Write the name (a pointer to its longest suffix written before if
+ * compressed).
+ */
+static SIZE_T WriteName(UINT8* buf,
+                        SIZE_T len,
+                        const char* name,
+                        BOOL compress)
+{
+  const char* dot;
+  SIZE_T n;
+  unsigned i;
+
+  while (*name) {
+    if (compress) {
+      for (i = 0; i < nsuffixes; i++) {
+        if (strcmp(suffixes[i], name) == 0) {
+          buf[len++] = (UINT8) (0xc0 | (suffix_offsets[i] >> 8));
+          buf[len++] = (UINT8) suffix_offsets[i];
+          return len;
+        }
+      }
+    }
+
+    if ((nsuffixes < MAX_SUFFIXES) && (len < 0x4000)) {
+      suffixes[nsuffixes] = name;
+      suffix_offsets[nsuffixes++] = (UINT16) len;
+    }
+
+    dot = strchr(name, '.');
+    n = dot ? (SIZE_T) (dot - name) : strlen(name);
+
+    buf[len++] = (UINT8) n;
+    memcpy(buf + len, name, n);
+    len += n;
+
+    name += n + (dot != NULL);
+  }
+
+  buf[len++] = 0;
+
+  return len;
+}
+
+static SIZE_T Write16(UINT8* buf, SIZE_T len, unsigned value)
+{
+  buf[len++] = (UINT8) (value >> 8);
+  buf[len++] = (UINT8) value;
+
+  return len;
+}
+
+/* Write the response, the offset of each answer in 'offsets' and the end of
+ * the last one in offsets[nanswers].
+ */
+static SIZE_T WriteResponse(UINT8* buf,
+                            const response_t* response,
+                            SIZE_T* offsets)
+{
+  const answer_t* answer;
+  SIZE_T len;
+  SIZE_T rdlength;
+  unsigned i;
+
+  nsuffixes = 0;
+
+  /* ID, response (recursion desired and available). */
+  len = Write16(buf, 0, 0x1234);
+  len = Write16(buf, len, 0x8180);
+  len = Write16(buf, len, 1 + response->nquestions);
+  len = Write16(buf, len, response->nanswers);
+  len = Write16(buf, len, 0);
+  len = Write16(buf, len, 0);
+
+  len = WriteName(buf, len, response->hostname, response->compress);
+  len = Write16(buf, len, TYPE_A);
+  len = Write16(buf, len, 1);
+
+  for (i = 0; i < response->nquestions; i++) {
+    len = WriteName(buf, len, response->questions[i], response->compress);
+    len = Write16(buf, len, TYPE_A);
+    len = Write16(buf, len, 1);
+  }
+
+  for (i = 0; i < response->nanswers; i++) {
+    answer = &response->answers[i];
+
+    offsets[i] = len;
+
+    len = WriteName(buf, len, answer->name, response->compress);
+    len = Write16(buf, len, answer->type);
+    len = Write16(buf, len, answer->class);
+    len = Write16(buf, len, answer->ttl >> 16);
+    len = Write16(buf, len, answer->ttl & 0xffff);
+
+    rdlength = len;
+    len += 2;
+
+    switch (answer->type) {
+      case TYPE_CNAME:
+        len = WriteName(buf, len, answer->alias, response->compress);
+        break;
+      case TYPE_AAAA:
+        memcpy(buf + len, answer->address, 16);
+        len += 16;
+        break;
+      default:
+        memcpy(buf + len, answer->address, 4);
+        len += 4;
+    }
+
+    Write16(buf, rdlength, (unsigned) (len - rdlength - 2));
+  }
+
+  offsets[i] = len;
+
+  return len;
+}
+
+/* Hostname at the beginning of the chain of 'name'. */
+static const char* FindChain(const char** aliases,
+                             const char** hostnames,
+                             unsigned naliases,
+                             const char* name)
+{
+  unsigned i;
+
+  for (i = 0; i < naliases; i++) {
+    if (strcasecmp(aliases[i], name) == 0) {
+      return hostnames[i];
+    }
+  }
+
+  return name;
+}
+
+/* Results of the answers which start in the first MAX_ANSWERS_LEN bytes
+ * (their number in 'nparsed', the number of aliases in 'naliases').
+ */
+static void Model(const response_t* response,
+                  const SIZE_T* offsets,
+                  results_t* results,
+                  unsigned* nparsed,
+                  unsigned* naliases)
+{
+  static const char* aliases[MAX_ANSWERS];
+  static const char* hostnames[MAX_ANSWERS];
+  const answer_t* answer;
+  const char* hostname;
+  LONGLONG expires;
+  char ip[128];
+  unsigned i;
+  unsigned j;
+
+  results->ninserts = 0;
+  results->nlines = 0;
+
+  *naliases = 0;
+
+  for (i = 0; i < response->nanswers; i++) {
+    answer = &response->answers[i];
+
+    if (offsets[i] - offsets[0] >= MAX_ANSWERS_LEN) {
+      break;
+    }
+
+    if (answer->class != 1) {
+      continue;
+    }
+
+    expires = SYSTEM_TIME + ((LONGLONG) answer->ttl * 10000000);
+
+    hostname = FindChain(aliases, hostnames, *naliases, answer->name);
+
+    switch (answer->type) {
+      case TYPE_CNAME:
+        for (j = 0; j < *naliases; j++) {
+          if (strcasecmp(aliases[j], answer->alias) == 0) {
+            break;
+          }
+        }
+
+        aliases[j] = answer->alias;
+        hostnames[j] = hostname;
+
+        if (j == *naliases) {
+          (*naliases)++;
+        }
+
+        Expect(results,
+               "Alias: '%s' -> hostname: '%s'.\r\n",
+               answer->alias,
+               answer->name);
+
+        break;
+      case TYPE_AAAA:
+        AddInsert(results, answer->address, TRUE, hostname, expires);
+
+        inet_ntop(AF_INET6, answer->address, ip, sizeof(ip));
+        Expect(results,
+               "Hostname: '%s' -> '%s', address: %s, TTL: %u.\r\n",
+               answer->name,
+               hostname,
+               ip,
+               answer->ttl);
+
+        break;
+      default:
+        AddInsert(results, answer->address, FALSE, hostname, expires);
+
+        Expect(results,
+               "Hostname: '%s' -> '%s', address: %u.%u.%u.%u, TTL: %u.\r\n",
+               answer->name,
+               hostname,
+               answer->address[0],
+               answer->address[1],
+               answer->address[2],
+               answer->address[3],
+               answer->ttl);
+    }
+  }
+
+  *nparsed = i;
+}
+
+static void Parse(const UINT8* data, SIZE_T len, const results_t* expected)
+{
+  LARGE_INTEGER system_time;
+
+  system_time.QuadPart = SYSTEM_TIME;
+
+  parsed.ninserts = 0;
+  parsed.nlines = 0;
+
+  CHECK(ParseDnsResponse(&system_time, data, len));
+  CHECK(SameResults(expected));
+}
+
+static void Check(const response_t* response)
+{
+  static UINT8 message[MAX_MESSAGE];
+  static SIZE_T offsets[MAX_ANSWERS + 1];
+  static results_t expected;
+  UINT8* data;
+  UINT8* record;
+  SIZE_T len;
+  SIZE_T reclen;
+  unsigned nparsed;
+  unsigned naliases;
+
+  len = WriteResponse(message, response, offsets);
+
+  Model(response, offsets, &expected, &nparsed, &naliases);
+
+  /* Exact size. */
+  data = malloc(len);
+  record = malloc(len);
+
+  if ((!data) || (!record)) {
+    CHECK((data != NULL) && (record != NULL));
+    free(data);
+    free(record);
+    return;
+  }
+
+  memcpy(data, message, len);
+
+  Parse(data, len, &expected);
+  CHECK(ncnames == naliases);
+
+  /* Record: the answers parsed, the same results. */
+  reclen = BuildDnsRecord(data, len, record, len);
+
+  CHECK(reclen == offsets[nparsed]);
+  CHECK((record[6] << 8 | record[7]) == nparsed);
+  CHECK(BuildDnsRecord(data, len, record, reclen - 1) == 0);
+
+  if (reclen > 0) {
+    Parse(record, reclen, &expected);
+  }
+
+  /* In place. */
+  CHECK(BuildDnsRecord(data, len, data, len) == reclen);
+  CHECK(memcmp(data, record, reclen) == 0);
+
+  free(data);
+  free(record);
+}
+
+static answer_t* AddAnswer(response_t* response,
+                           UINT16 type,
+                           const char* name,
+                           const char* alias,
+                           unsigned* seed)
+{
+  answer_t* answer;
+  unsigned i;
+
+  answer = &response->answers[response->nanswers++];
+
+  answer->type = type;
+  answer->class = 1;
+  answer->name = name;
+  answer->alias = alias;
+  answer->ttl = Random(seed) % 86400;
+
+  for (i = 0; i < 16; i++) {
+    answer->address[i] = (UINT8) Random(seed);
+  }
+
+  return answer;
+}
+
+/* 20 CNAMEs (a chain) and 130 A records of the names of the chain. */
+static void CheckChain(unsigned* seed)
+{
+  static response_t response;
+  const char* chain[21];
+  unsigned i;
+
+  nnames = 0;
+  response.nanswers = 0;
+  response.nquestions = 0;
+  response.compress = TRUE;
+
+  chain[0] = response.hostname = Name(seed, "www.example.com");
+
+  for (i = 1; i <= 20; i++) {
+    chain[i] = Name(seed, "alias%u.cdn.example.net", i);
+    AddAnswer(&response, TYPE_CNAME, chain[i - 1], chain[i], seed);
+  }
+
+  for (i = 0; i < 130; i++) {
+    /* The last alias (or any name of the chain, in any case). */
+    AddAnswer(&response,
+              TYPE_A,
+              (Random(seed) % 2 == 0) ?
+              chain[20] :
+              Name(seed, "%s", chain[Random(seed) % 21]),
+              NULL,
+              seed);
+  }
+
+  Check(&response);
+}
+
+/* 300 A records (no aliases). */
+static void CheckAddresses(unsigned* seed)
+{
+  static response_t response;
+  unsigned i;
+
+  nnames = 0;
+  response.nanswers = 0;
+  response.nquestions = 0;
+  response.compress = TRUE;
+  response.hostname = Name(seed, "many.example.com");
+
+  for (i = 0; i < 300; i++) {
+    AddAnswer(&response,
+              (i % 10 == 9) ? TYPE_AAAA : TYPE_A,
+              (i % 2 == 0) ?
+              response.hostname :
+              Name(seed, "host%u.example.com", i % 7),
+              NULL,
+              seed);
+  }
+
+  Check(&response);
+}
+
+/* 150 CNAMEs (10 interleaved chains of 15) and 10 A records. */
+static void CheckChains(unsigned* seed)
+{
+  static response_t response;
+  const char* last[10];
+  unsigned i;
+  unsigned c;
+
+  nnames = 0;
+  response.nanswers = 0;
+  response.nquestions = 0;
+  response.compress = TRUE;
+  response.hostname = Name(seed, "chains.example.com");
+
+  for (c = 0; c < 10; c++) {
+    last[c] = Name(seed, "host%u.example.com", c);
+  }
+
+  for (i = 0; i < 150; i++) {
+    c = Random(seed) % 10;
+
+    AddAnswer(&response,
+              TYPE_CNAME,
+              Name(seed, "%s", last[c]),
+              Name(seed, "a%u.chain%u.example.org", i, c),
+              seed);
+
+    last[c] = response.answers[response.nanswers - 1].alias;
+  }
+
+  for (c = 0; c < 10; c++) {
+    AddAnswer(&response, TYPE_A, Name(seed, "%s", last[c]), NULL, seed);
+  }
+
+  Check(&response);
+}
+
+/* Lowercase labels with their lengths. */
+static UINT32 Hash(const char* name)
+{
+  UINT32 hash;
+  const char* dot;
+  SIZE_T n;
+  SIZE_T i;
+
+  hash = FNV1A_OFFSET_BASIS;
+
+  while (*name) {
+    dot = strchr(name, '.');
+    n = dot ? (SIZE_T) (dot - name) : strlen(name);
+
+    hash = (hash ^ (UINT8) n) * FNV1A_PRIME;
+
+    for (i = 0; i < n; i++) {
+      hash = (hash ^ ToLower((UINT8) name[i])) * FNV1A_PRIME;
+    }
+
+    name += n + (dot != NULL);
+  }
+
+  return hash;
+}
+
+/* 605 answers of the smallest size (pointers to the names of the
+ * questions), CNAMEs of aliases which share a slot of the hash table near
+ * its end, and A records if 'addresses': the answers beyond MAX_ANSWERS_LEN
+ * bytes are ignored (MAX_CNAMES CNAMEs without the A records).
+ */
+static void CheckBudget(BOOL addresses, unsigned* seed)
+{
+  static const char* aliases[605];
+  static response_t response;
+  const char* hostname;
+  unsigned n;
+  unsigned i;
+
+  nnames = 0;
+  response.nanswers = 0;
+  response.compress = TRUE;
+  response.hostname = hostname = Name(NULL, "budget.example.com");
+  response.questions = aliases;
+  response.nquestions = 0;
+
+  for (n = 0; response.nquestions < ARRAYSIZE(aliases); n++) {
+    snprintf(names[nnames], sizeof(names[0]), "c%u.a", n);
+
+    if ((Hash(names[nnames]) & (CNAMES_HASH_SIZE - 1)) ==
+        CNAMES_HASH_SIZE - 8) {
+      aliases[response.nquestions++] = names[nnames++];
+    }
+  }
+
+  for (i = 0; i < ARRAYSIZE(aliases); i++) {
+    if ((addresses) && (Random(seed) % 8 == 0)) {
+      AddAnswer(&response, TYPE_A, aliases[Random(seed) % (i + 1)], NULL,
+                seed);
+    } else {
+      AddAnswer(&response, TYPE_CNAME, hostname, aliases[i], seed);
+      hostname = aliases[i];
+    }
+  }
+
+  /* The address of the whole chain (beyond the limit). */
+  AddAnswer(&response, TYPE_A, hostname, NULL, seed);
+
+  if (!addresses) {
+    CHECK(response.answers[MAX_CNAMES].type == TYPE_CNAME);
+  }
+
+  Check(&response);
+
+  CHECK((addresses) || (ncnames == MAX_CNAMES));
+}
+
+/* Random names, aliases repeated (the last record wins), aliases of the
+ * previous responses, other classes.
+ */
+static void CheckRandom(unsigned* seed)
+{
+  static const char* pool[] = {
+    "www.example.com",
+    "example.com",
+    "cdn.example.com",
+    "edge.cdn.example.com",
+    "a.b.c.example.org",
+    "x.example.org"
+  };
+
+  static response_t response;
+  const char* name;
+  answer_t* answer;
+  unsigned n;
+
+  nnames = 0;
+  response.nanswers = 0;
+  response.nquestions = 0;
+  response.compress = (Random(seed) % 4 != 0);
+  response.hostname = Name(seed, "%s", pool[0]);
+
+  for (n = 1 + (Random(seed) % 40); n > 0; n--) {
+    name = Name(seed, "%s", pool[Random(seed) % ARRAYSIZE(pool)]);
+
+    switch (Random(seed) % 3) {
+      case 0:
+        answer = AddAnswer(&response,
+                           TYPE_CNAME,
+                           name,
+                           Name(seed,
+                                "%s",
+                                pool[Random(seed) % ARRAYSIZE(pool)]),
+                           seed);
+        break;
+      case 1:
+        answer = AddAnswer(&response, TYPE_AAAA, name, NULL, seed);
+        break;
+      default:
+        answer = AddAnswer(&response, TYPE_A, name, NULL, seed);
+    }
+
+    if (Random(seed) % 16 == 0) {
+      answer->class = 3;
+    }
+  }
+
+  Check(&response);
+}
+
+int main()
+{
+  unsigned seed;
+  unsigned i;
+
+  seed = 42;
+
+  CheckChain(&seed);
+  CheckAddresses(&seed);
+  CheckChains(&seed);
+  CheckBudget(FALSE, &seed);
+  CheckBudget(TRUE, &seed);
+
+  for (i = 0; i < NRESPONSES; i++) {
+    CheckRandom(&seed);
+
+    /* Between the big responses. */
+    switch (i % 50) {
+      case 0:
+        CheckChain(&seed);
+        break;
+      case 1:
+        CheckChains(&seed);
+        break;
+      case 2:
+        CheckBudget(TRUE, &seed);
+        break;
+    }
+  }
+
+  return TEST_RESULT();
+}
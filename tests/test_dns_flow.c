@@ -0,0 +1,468 @@
+/* Reassembly of DNS messages over TCP (sys/dns_flow.c): streams of
+ * length-prefixed DNS responses are replayed segment by segment (split at
+ * every point, in 1-byte segments and at random points, each segment in a
+ * buffer of its exact size) through the same calls as the stream callout
+ * (FeedDnsFlow() and ContinueDnsFlow() in inspect.c), and closed anywhere
+ * (in a length, in a message). The messages handed to the worker thread
+ * must be the expected bytes whatever the segmentation: empty messages are
+ * skipped, the messages bigger than the packets are truncated (the rest is
+ * skipped), the partial message is handed over when the connection is
+ * closed, and the connection isn't followed anymore when the packets are
+ * exhausted (the worker thread holding them). The flows and packets must
+ * all return to the pool.
+ */
+
+#include <stdio.h>
+#include "../sys/dns_flow.h"
+#include "test.h"
+#include "test_util.h"
+
+#define MAX_FLOWS 4
+#define MAX_MESSAGES 3
+#define MAX_MESSAGE_SIZE 512
+
+#define NSTREAMS 200
+#define MAX_STREAM (8 * (2 + 0xffff))
+#define MAX_PARTS 32
+#define MAX_EMITTED 32
+
+typedef struct {
+  const char* name;
+
+  /* Lengths of the messages (their content is random). */
+  SIZE_T lengths[MAX_PARTS];
+  unsigned nmessages;
+} capture_t;
+
+/* Messages handed to the worker thread (and held by it if 'hold'). */
+static UINT8 emitted[MAX_EMITTED][MAX_MESSAGE_SIZE];
+static SIZE_T emitted_len[MAX_EMITTED];
+static unsigned nemitted;
+
+static packet_t* held[MAX_MESSAGES];
+static unsigned nheld;
+static BOOL hold;
+
+/* Expected messages (offset and length in the stream). */
+static SIZE_T expected_off[MAX_EMITTED];
+static SIZE_T expected_len[MAX_EMITTED];
+static unsigned nexpected;
+
+static UINT8 stream[MAX_STREAM];
+static packet_t tuple;
+
+/* As EndDnsFlow() (the worker thread releases the packet, or holds it). */
+static void EndFlow(dns_flow_t* flow)
+{
+  packet_t* packet;
+
+  packet = TakeDnsFlowPacket(flow);
+
+  CHECK(packet->remote_port == tuple.remote_port);
+  CHECK(packet->payloadlen <= MAX_MESSAGE_SIZE);
+
+  if (nemitted < MAX_EMITTED) {
+    memcpy(emitted[nemitted], packet->payload, packet->payloadlen);
+    emitted_len[nemitted] = packet->payloadlen;
+  }
+
+  nemitted++;
+
+  if ((hold) && (nheld < MAX_MESSAGES)) {
+    held[nheld++] = packet;
+  } else {
+    CHECK(ReleaseDnsFlowPacket(packet));
+  }
+}
+
+/* As FeedDnsFlow(). */
+static BOOL Feed(dns_flow_t* flow, const UINT8* data, SIZE_T len)
+{
+  SIZE_T n;
+  BOOL complete;
+
+  while (len > 0) {
+    if (flow->state == DNS_FLOW_DONE) {
+      return FALSE;
+    }
+
+    if ((flow->state == DNS_FLOW_MESSAGE) && (!flow->packet)) {
+      if (!AttachDnsFlowPacket(flow)) {
+        flow->state = DNS_FLOW_DONE;
+        return FALSE;
+      }
+    }
+
+    n = ConsumeDnsFlowData(flow, data, len, &complete);
+
+    CHECK(n <= len);
+
+    if (complete) {
+      EndFlow(flow);
+    }
+
+    data += n;
+    len -= n;
+  }
+
+  return (flow->state != DNS_FLOW_DONE);
+}
+
+/* Replay the stream in segments ending at the offsets of 'splits' (and at
+ * the end of the stream), each in a buffer of its exact size, then close
+ * the connection.
+ */
+static void Replay(const UINT8* data,
+                   SIZE_T len,
+                   const SIZE_T* splits,
+                   unsigned nsplits)
+{
+  dns_flow_t* flow;
+  UINT8* segment;
+  SIZE_T off;
+  SIZE_T end;
+  unsigned i;
+
+  nemitted = 0;
+
+  if ((flow = NewDnsFlow(&tuple)) == NULL) {
+    CHECK(flow != NULL);
+    return;
+  }
+
+  CHECK(IsDnsFlow(flow));
+
+  off = 0;
+
+  for (i = 0; i <= nsplits; i++) {
+    end = (i < nsplits) ? splits[i] : len;
+
+    /* Exact size (segment is not NULL for empty segments). */
+    if ((segment = malloc(end - off + (end == off))) == NULL) {
+      CHECK(segment != NULL);
+      break;
+    }
+
+    memcpy(segment, data + off, end - off);
+
+    /* ContinueDnsFlow(): stop following the connection. */
+    if (!Feed(flow, segment, end - off)) {
+      free(segment);
+      break;
+    }
+
+    free(segment);
+
+    off = end;
+  }
+
+  /* Closed: the partial message is handed over. */
+  if ((flow->packet) && (flow->packet->payloadlen > 0)) {
+    EndFlow(flow);
+  }
+
+  DeleteDnsFlow(flow);
+
+  /* The worker thread releases the messages it held. */
+  while (nheld > 0) {
+    CHECK(ReleaseDnsFlowPacket(held[--nheld]));
+  }
+}
+
+/* Length-prefixed messages of random bytes. */
+static SIZE_T BuildStream(const capture_t* capture, unsigned* seed)
+{
+  SIZE_T len;
+  SIZE_T i;
+  unsigned m;
+
+  len = 0;
+
+  for (m = 0; m < capture->nmessages; m++) {
+    stream[len++] = (UINT8) (capture->lengths[m] >> 8);
+    stream[len++] = (UINT8) capture->lengths[m];
+
+    for (i = 0; i < capture->lengths[m]; i++) {
+      stream[len++] = (UINT8) Random(seed);
+    }
+  }
+
+  return len;
+}
+
+/* Messages expected when the connection is closed after 'len' bytes of the
+ * stream.
+ */
+static void Expect(const capture_t* capture, SIZE_T len)
+{
+  SIZE_T off;
+  SIZE_T n;
+  unsigned m;
+
+  nexpected = 0;
+  off = 0;
+
+  for (m = 0; m < capture->nmessages; m++) {
+    /* Closed in the length? */
+    if (off + 2 > len) {
+      break;
+    }
+
+    off += 2;
+
+    /* Bytes of the message received (the first MAX_MESSAGE_SIZE ones are
+     * handed over).
+     */
+    n = len - off;
+    if (n > capture->lengths[m]) {
+      n = capture->lengths[m];
+    }
+
+    if (n > 0) {
+      expected_off[nexpected] = off;
+      expected_len[nexpected] = (n < MAX_MESSAGE_SIZE) ? n : MAX_MESSAGE_SIZE;
+      nexpected++;
+    }
+
+    off += n;
+
+    if (n < capture->lengths[m]) {
+      break;
+    }
+  }
+
+  /* Not followed anymore once the packets are exhausted. */
+  if ((hold) && (nexpected > MAX_MESSAGES)) {
+    nexpected = MAX_MESSAGES;
+  }
+}
+
+static BOOL Matches()
+{
+  unsigned i;
+
+  if (nemitted != nexpected) {
+    return FALSE;
+  }
+
+  for (i = 0; i < nemitted; i++) {
+    if ((emitted_len[i] != expected_len[i]) ||
+        (memcmp(emitted[i],
+                stream + expected_off[i],
+                expected_len[i]) != 0)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* The flows and the packets are all back in the pool. */
+static void CheckPool()
+{
+  dns_flow_t* flows[MAX_FLOWS];
+  unsigned i;
+
+  for (i = 0; i < MAX_FLOWS; i++) {
+    CHECK((flows[i] = NewDnsFlow(&tuple)) != NULL);
+  }
+
+  CHECK(NewDnsFlow(&tuple) == NULL);
+
+  /* Only MAX_MESSAGES messages are reassembled at the same time. */
+  for (i = 0; i < MAX_FLOWS; i++) {
+    CHECK(AttachDnsFlowPacket(flows[i]) == (i < MAX_MESSAGES));
+  }
+
+  for (i = 0; i < MAX_FLOWS; i++) {
+    DeleteDnsFlow(flows[i]);
+  }
+}
+
+/* Replay the stream closed after 'len' bytes, in random segments (and in
+ * two at every point and in 1-byte segments if 'all').
+ */
+static void CheckLength(const capture_t* capture,
+                        SIZE_T len,
+                        BOOL all,
+                        unsigned* seed)
+{
+  static SIZE_T splits[MAX_STREAM];
+  SIZE_T s;
+  unsigned nsplits;
+  unsigned failures;
+  unsigned i;
+
+  Expect(capture, len);
+
+  failures = 0;
+
+  Replay(stream, len, NULL, 0);
+  failures += !Matches();
+
+  if (all) {
+    for (s = 1; s < len; s++) {
+      Replay(stream, len, &s, 1);
+      failures += !Matches();
+    }
+
+    for (s = 1; s < len; s++) {
+      splits[s - 1] = s;
+    }
+
+    Replay(stream, len, splits, (len > 0) ? (unsigned) len - 1 : 0);
+    failures += !Matches();
+  }
+
+  for (i = 0; i < 10; i++) {
+    nsplits = 0;
+
+    for (s = 1 + (Random(seed) % 700); s < len; s += 1 + (Random(seed) % 700)) {
+      splits[nsplits++] = s;
+    }
+
+    Replay(stream, len, splits, nsplits);
+    failures += !Matches();
+  }
+
+  if (failures > 0) {
+    fprintf(stderr,
+            "%s (%zu bytes%s): %u segmentations failed\n",
+            capture->name,
+            len,
+            hold ? ", held" : "",
+            failures);
+    CHECK(FALSE);
+  }
+}
+
+/* The whole stream and the stream closed anywhere (every length if it is
+ * short), with the messages released and held by the worker thread.
+ */
+static void Check(const capture_t* capture, unsigned* seed)
+{
+  SIZE_T len;
+  SIZE_T n;
+
+  len = BuildStream(capture, seed);
+
+  for (hold = FALSE; hold <= TRUE; hold++) {
+    CheckLength(capture, len, len <= 4096, seed);
+
+    if (len <= 1024) {
+      for (n = 0; n < len; n++) {
+        CheckLength(capture, n, n % 16 == 0, seed);
+      }
+    } else {
+      for (n = 0; n < 20; n++) {
+        CheckLength(capture, Random(seed) % len, FALSE, seed);
+      }
+    }
+
+    CheckPool();
+  }
+
+  hold = FALSE;
+}
+
+static void AddMessage(capture_t* capture, SIZE_T len)
+{
+  capture->lengths[capture->nmessages++] = len;
+}
+
+int main()
+{
+  capture_t capture;
+  unsigned seed;
+  unsigned i;
+  unsigned n;
+
+  seed = 44;
+
+  memset(&tuple, 0, sizeof(tuple));
+  tuple.remote_port = 53;
+
+  /* Invalid sizes, connections not followed. */
+  CHECK(!InitDnsFlows(MAX_FLOWS, 0, MAX_MESSAGE_SIZE, FALSE));
+  CHECK(!InitDnsFlows(MAX_FLOWS, MAX_MESSAGES, 0, FALSE));
+  CHECK(!InitDnsFlows(MAX_FLOWS, MAX_MESSAGES, 0x10000, FALSE));
+
+  CHECK(InitDnsFlows(0, MAX_MESSAGES, MAX_MESSAGE_SIZE, FALSE));
+  CHECK(NewDnsFlow(&tuple) == NULL);
+  CHECK(!IsDnsFlow(&tuple));
+  FreeDnsFlows();
+
+  if (!InitDnsFlows(MAX_FLOWS, MAX_MESSAGES, MAX_MESSAGE_SIZE, FALSE)) {
+    CHECK(FALSE);
+    return TEST_RESULT();
+  }
+
+  /* Small messages and empty ones. */
+  capture.name = "small";
+  capture.nmessages = 0;
+  AddMessage(&capture, 12);
+  AddMessage(&capture, 0);
+  AddMessage(&capture, 40);
+  AddMessage(&capture, 1);
+  AddMessage(&capture, 0);
+  AddMessage(&capture, 0);
+  AddMessage(&capture, 300);
+  Check(&capture, &seed);
+
+  capture.name = "empty";
+  capture.nmessages = 0;
+  AddMessage(&capture, 0);
+  AddMessage(&capture, 0);
+  AddMessage(&capture, 0);
+  Check(&capture, &seed);
+
+  /* Around the size of the packets. */
+  capture.name = "limits";
+  capture.nmessages = 0;
+  AddMessage(&capture, MAX_MESSAGE_SIZE - 1);
+  AddMessage(&capture, MAX_MESSAGE_SIZE);
+  AddMessage(&capture, MAX_MESSAGE_SIZE + 1);
+  AddMessage(&capture, 0);
+  AddMessage(&capture, 2 * MAX_MESSAGE_SIZE);
+  AddMessage(&capture, 12);
+  Check(&capture, &seed);
+
+  /* The biggest messages (truncated, the rest is skipped). */
+  capture.name = "oversized";
+  capture.nmessages = 0;
+  AddMessage(&capture, 0xffff);
+  AddMessage(&capture, 12);
+  AddMessage(&capture, 0xffff);
+  AddMessage(&capture, 0);
+  AddMessage(&capture, 0xff00);
+  Check(&capture, &seed);
+
+  /* Random streams. */
+  capture.name = "random";
+
+  for (i = 0; i < NSTREAMS; i++) {
+    capture.nmessages = 0;
+
+    for (n = 1 + (Random(&seed) % 8); n > 0; n--) {
+      switch (Random(&seed) % 8) {
+        case 0:
+          AddMessage(&capture, 0);
+          break;
+        case 1:
+          AddMessage(&capture, MAX_MESSAGE_SIZE + (Random(&seed) % 2048));
+          break;
+        case 2:
+          AddMessage(&capture, 1 + (Random(&seed) % 0xffff));
+          break;
+        default:
+          AddMessage(&capture, 12 + (Random(&seed) % 200));
+      }
+    }
+
+    Check(&capture, &seed);
+  }
+
+  FreeDnsFlows();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,579 @@
+/* DNS names (sys/dns_parser.c): CheckDnsName() must accept and skip the
+ * names that a reference decoder, which follows the labels and pointers one
+ * byte at a time, accepts (labels inside the message, at most MAX_POINTERS
+ * pointers, at most 255 characters with the dots, not empty), and find the
+ * same first label. On the names it accepts, DecodeDnsName() and
+ * FirstDnsLabel() must give what the reference decodes, EqualDnsNames()
+ * must compare them as the reference does (case-insensitive) and
+ * HashDnsName() must be the FNV-1a of the lowercase labels. The names are
+ * compressed (pointers to names, into the middle of names and to other
+ * pointers, chains longer than MAX_POINTERS, loops), in mixed case, around
+ * the length limit, written by hand and generated, truncated and corrupted.
+ * Each message has the exact size of the data.
+ */
+
+#include <stdio.h>
+#include "../sys/dns_parser.c"
+#include "test.h"
+#include "test_util.h"
+
+#define NMESSAGES 300
+#define NCORRUPTIONS 20
+#define MAX_MESSAGE 4096
+#define MAX_STARTS 512
+#define MAX_PAIRS 64
+
+typedef struct {
+  /* Offset following the name in the message, offset of its first label. */
+  SIZE_T next;
+  SIZE_T first;
+
+  /* Decompressed name. */
+  char text[2 * HOST_NAME_MAX_LEN];
+  SIZE_T len;
+
+  /* Labels in lowercase, with their lengths. */
+  UINT8 wire[2 * HOST_NAME_MAX_LEN];
+  SIZE_T wirelen;
+} ref_name_t;
+
+static const char* labels[] = {
+  "www",
+  "WWW",
+  "example",
+  "ExAmPlE",
+  "com",
+  "COM",
+  "cdn",
+  "a",
+  "xn--bcher-kva",
+  "edge-1",
+  "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-",
+  "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz-"
+};
+
+/* Answers and log (not reached by the name functions). */
+BOOL AddIPv4ToDnsCache(const UINT8* ipv4,
+                       const char* hostname,
+                       UINT16 hostnamelen,
+                       LONGLONG expires)
+{
+  UNREFERENCED_PARAMETER(ipv4);
+  UNREFERENCED_PARAMETER(hostname);
+  UNREFERENCED_PARAMETER(hostnamelen);
+  UNREFERENCED_PARAMETER(expires);
+
+  return TRUE;
+}
+
+BOOL AddIPv6ToDnsCache(const UINT8* ipv6,
+                       const char* hostname,
+                       UINT16 hostnamelen,
+                       LONGLONG expires)
+{
+  return AddIPv4ToDnsCache(ipv6, hostname, hostnamelen, expires);
+}
+
+BOOL Log(LARGE_INTEGER* system_time, const char* format, ...)
+{
+  UNREFERENCED_PARAMETER(system_time);
+  UNREFERENCED_PARAMETER(format);
+
+  return TRUE;
+}
+
+/* Follow the name at 'off' one byte at a time. */
+static BOOL DecodeName(const UINT8* data,
+                       SIZE_T len,
+                       SIZE_T off,
+                       ref_name_t* ref)
+{
+  unsigned npointers;
+  BOOL jumped;
+  UINT8 l;
+  UINT8 i;
+
+  npointers = 0;
+  jumped = FALSE;
+
+  ref->len = 0;
+  ref->wirelen = 0;
+
+  do {
+    if (off >= len) {
+      return FALSE;
+    }
+
+    l = data[off];
+
+    if (l == 0) {
+      break;
+    }
+
+    if ((l & 0xc0) == 0xc0) {
+      if ((off + 1 >= len) || (++npointers > MAX_POINTERS)) {
+        return FALSE;
+      }
+
+      if (!jumped) {
+        ref->next = off + 2;
+        jumped = TRUE;
+      }
+
+      off = ((l & 0x3f) << 8) | data[off + 1];
+    } else if ((l & 0xc0) == 0) {
+      if (off + l >= len) {
+        return FALSE;
+      }
+
+      if (ref->wirelen == 0) {
+        ref->first = off;
+      } else {
+        ref->text[ref->len++] = '.';
+      }
+
+      if (ref->len + l > HOST_NAME_MAX_LEN) {
+        return FALSE;
+      }
+
+      memcpy(ref->text + ref->len, data + off + 1, l);
+      ref->len += l;
+
+      ref->wire[ref->wirelen++] = l;
+
+      for (i = 1; i <= l; i++) {
+        ref->wire[ref->wirelen++] = ((data[off + i] >= 'A') &&
+                                     (data[off + i] <= 'Z')) ?
+                                    (data[off + i] + 'a' - 'A') :
+                                    data[off + i];
+      }
+
+      off += (1 + l);
+    } else {
+      return FALSE;
+    }
+  } while (TRUE);
+
+  /* The root name is not a hostname. */
+  if (ref->wirelen == 0) {
+    return FALSE;
+  }
+
+  if (!jumped) {
+    ref->next = off + 1;
+  }
+
+  ref->text[ref->len] = 0;
+
+  return TRUE;
+}
+
+static UINT32 Hash(const ref_name_t* ref)
+{
+  UINT32 hash;
+  SIZE_T i;
+
+  hash = 2166136261u;
+
+  for (i = 0; i < ref->wirelen; i++) {
+    hash = (hash ^ ref->wire[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+/* Check the names at 'starts' in the first 'len' bytes of 'message'. */
+static void Check(const UINT8* message,
+                  SIZE_T len,
+                  const SIZE_T* starts,
+                  unsigned nstarts)
+{
+  static ref_name_t refs[MAX_PAIRS];
+  static dns_name_t names[MAX_PAIRS];
+  ref_name_t ref;
+  dns_text_t text;
+  dns_text_t other;
+  const UINT8* ptr;
+  UINT8* data;
+  dns_name_t name;
+  BOOL valid;
+  unsigned nvalid;
+  unsigned i;
+  unsigned j;
+
+  /* Exact size (data is not NULL for empty messages). */
+  if ((data = malloc(len + (len == 0))) == NULL) {
+    CHECK(data != NULL);
+    return;
+  }
+
+  memcpy(data, message, len);
+
+  nvalid = 0;
+
+  for (i = 0; i < nstarts; i++) {
+    if (starts[i] > len) {
+      continue;
+    }
+
+    valid = DecodeName(data, len, starts[i], &ref);
+
+    ptr = data + starts[i];
+    name = 0;
+
+    if (CheckDnsName(data, data + len, &ptr, &name) != valid) {
+      fprintf(stderr, "CheckDnsName(%zu, %zu): %d\n", starts[i], len, valid);
+      CHECK(FALSE);
+      continue;
+    }
+
+    if (!valid) {
+      continue;
+    }
+
+    CHECK(ptr == data + ref.next);
+    CHECK(name == ref.first);
+    CHECK(FirstDnsLabel(data, (dns_name_t) starts[i]) == ref.first);
+
+    text.name = 0;
+    CHECK(strcmp(DecodeDnsName(data, name, &text), ref.text) == 0);
+    CHECK(text.len == ref.len);
+
+    /* Decompressed once. */
+    CHECK(DecodeDnsName(data, name, &text) == text.text);
+    CHECK(strcmp(text.text, ref.text) == 0);
+
+    CHECK(HashDnsName(data, name) == Hash(&ref));
+
+    if (nvalid < MAX_PAIRS) {
+      refs[nvalid] = ref;
+      names[nvalid] = name;
+      nvalid++;
+    }
+  }
+
+  /* Every pair of names (and each name with itself). */
+  for (i = 0; i < nvalid; i++) {
+    for (j = 0; j < nvalid; j++) {
+      valid = ((refs[i].wirelen == refs[j].wirelen) &&
+               (memcmp(refs[i].wire, refs[j].wire, refs[i].wirelen) == 0));
+
+      if (EqualDnsNames(data, names[i], names[j]) != valid) {
+        text.name = 0;
+        other.name = 0;
+        fprintf(stderr,
+                "EqualDnsNames('%s', '%s'): %d\n",
+                DecodeDnsName(data, names[i], &text),
+                DecodeDnsName(data, names[j], &other),
+                valid);
+        CHECK(FALSE);
+      }
+
+      if (valid) {
+        CHECK(HashDnsName(data, names[i]) == HashDnsName(data, names[j]));
+      }
+    }
+  }
+
+  free(data);
+}
+
+static SIZE_T AppendLabel(UINT8* buf, SIZE_T len, const char* label, BOOL up)
+{
+  SIZE_T n;
+  SIZE_T i;
+
+  n = strlen(label);
+
+  buf[len++] = (UINT8) n;
+
+  for (i = 0; i < n; i++) {
+    buf[len++] = ((up) && (label[i] >= 'a') && (label[i] <= 'z')) ?
+                 (UINT8) (label[i] - 'a' + 'A') :
+                 (UINT8) label[i];
+  }
+
+  return len;
+}
+
+static SIZE_T AppendPointer(UINT8* buf, SIZE_T len, SIZE_T off)
+{
+  buf[len++] = (UINT8) (0xc0 | (off >> 8));
+  buf[len++] = (UINT8) off;
+
+  return len;
+}
+
+/* Names (and pointer-only names) with pointers to the previous names, to
+ * their suffixes and to random offsets, then a chain of pointers longer
+ * than MAX_POINTERS. The offsets of all the names are in 'starts'.
+ */
+static SIZE_T MakeMessage(UINT8* buf, SIZE_T* starts, unsigned* nstarts,
+                          unsigned* seed)
+{
+  SIZE_T len;
+  SIZE_T start;
+  unsigned nlabels;
+  unsigned i;
+
+  /* Header (not a name). */
+  memset(buf, 0, DNS_HEADER_LEN);
+  len = DNS_HEADER_LEN;
+
+  *nstarts = 0;
+
+  while ((len + (4 * 64) + 2 < MAX_MESSAGE - 64) &&
+         (*nstarts + 8 < MAX_STARTS - 16)) {
+    start = len;
+
+    if ((*nstarts > 0) && (Random(seed) % 8 == 0)) {
+      /* Pointer to a name (or to a pointer). */
+      len = AppendPointer(buf, len, starts[Random(seed) % *nstarts]);
+    } else {
+      nlabels = Random(seed) % 5;
+
+      for (i = 0; i < nlabels; i++) {
+        /* Each suffix is a name. */
+        starts[(*nstarts)++] = len;
+
+        len = AppendLabel(buf,
+                          len,
+                          labels[Random(seed) % ARRAYSIZE(labels)],
+                          Random(seed) % 4 == 0);
+      }
+
+      if ((*nstarts == 0) || (Random(seed) % 3 == 0)) {
+        buf[len++] = 0;
+      } else if (Random(seed) % 16 == 0) {
+        /* Anywhere (the middle of a label, a pointer, forwards). */
+        len = AppendPointer(buf, len, Random(seed) % (len + 64));
+      } else {
+        len = AppendPointer(buf, len, starts[Random(seed) % *nstarts]);
+      }
+
+      if (nlabels > 0) {
+        continue;
+      }
+    }
+
+    starts[(*nstarts)++] = start;
+  }
+
+  /* Chain of MAX_POINTERS + 2 pointers to a name. */
+  start = len;
+  len = AppendLabel(buf, len, "chain", FALSE);
+  buf[len++] = 0;
+  starts[(*nstarts)++] = start;
+
+  for (i = 0; i < MAX_POINTERS + 2; i++) {
+    len = AppendPointer(buf, len, start);
+    start = len - 2;
+    starts[(*nstarts)++] = start;
+  }
+
+  return len;
+}
+
+static void CheckMessage(const UINT8* message,
+                         SIZE_T len,
+                         const SIZE_T* starts,
+                         unsigned nstarts,
+                         unsigned* seed)
+{
+  UINT8 corrupted[MAX_MESSAGE];
+  SIZE_T off;
+  unsigned n;
+  unsigned i;
+
+  Check(message, len, starts, nstarts);
+
+  /* Truncated. */
+  for (i = 0; i < NCORRUPTIONS; i++) {
+    Check(message, Random(seed) % (len + 1), starts, nstarts);
+  }
+
+  /* Corrupted bytes: lengths, pointers (loops), reserved label types. */
+  for (i = 0; i < NCORRUPTIONS; i++) {
+    memcpy(corrupted, message, len);
+
+    for (n = 1 + (Random(seed) % 4); n > 0; n--) {
+      off = starts[Random(seed) % nstarts] + (Random(seed) % 4);
+
+      if (off >= len) {
+        continue;
+      }
+
+      switch (Random(seed) % 5) {
+        case 0:
+          corrupted[off] = 0;
+          break;
+        case 1:
+          corrupted[off] = (UINT8) (0x40 | (Random(seed) % 64));
+          break;
+        case 2:
+          corrupted[off] = (UINT8) (0x80 | (Random(seed) % 64));
+          break;
+        case 3:
+          corrupted[off] = (UINT8) (0xc0 | ((Random(seed) % len) >> 8));
+          break;
+        default:
+          corrupted[off] = (UINT8) Random(seed);
+      }
+    }
+
+    Check(corrupted, len, starts, nstarts);
+  }
+}
+
+/* Names written by hand: 'n' labels of the given lengths at 'off' (in
+ * uppercase if 'up'), ending with '\0' or with a pointer to 'to'.
+ */
+static SIZE_T Write(UINT8* buf,
+                    SIZE_T off,
+                    const unsigned* lengths,
+                    unsigned n,
+                    BOOL up,
+                    SIZE_T to)
+{
+  unsigned i;
+
+  for (i = 0; i < n; i++) {
+    buf[off++] = (UINT8) lengths[i];
+    memset(buf + off, up ? 'X' : 'x', lengths[i]);
+    off += lengths[i];
+  }
+
+  if (to == 0) {
+    buf[off++] = 0;
+  } else {
+    off = AppendPointer(buf, off, to);
+  }
+
+  return off;
+}
+
+static void CheckLimits()
+{
+  static const unsigned max[] = {63, 63, 63, 61, 1};
+  static const unsigned over[] = {63, 63, 63, 62, 1};
+  static const unsigned half[] = {63, 63};
+  UINT8 buf[MAX_MESSAGE];
+  SIZE_T starts[32];
+  ref_name_t ref;
+  SIZE_T len;
+  unsigned nstarts;
+  unsigned i;
+
+  memset(buf, 0, DNS_HEADER_LEN);
+  len = DNS_HEADER_LEN;
+  nstarts = 0;
+
+  /* 255 characters and 256 characters, uncompressed. */
+  starts[nstarts++] = len;
+  len = Write(buf, len, max, ARRAYSIZE(max), FALSE, 0);
+  starts[nstarts++] = len;
+  len = Write(buf, len, over, ARRAYSIZE(over), TRUE, 0);
+
+  /* The same, compressed (x{63}.x{63} + pointer to the last 3 labels). */
+  starts[nstarts++] = len;
+  len = Write(buf, len, half, ARRAYSIZE(half), TRUE, starts[0] + 128);
+  starts[nstarts++] = len;
+  len = Write(buf, len, half, ARRAYSIZE(half), FALSE, starts[1] + 128);
+
+  /* Pointer to itself, two pointers to each other. */
+  starts[nstarts++] = len;
+  len = AppendPointer(buf, len, len);
+  starts[nstarts++] = len;
+  len = AppendPointer(buf, len, len + 2);
+  starts[nstarts++] = len;
+  len = AppendPointer(buf, len, len - 2);
+
+  /* Label then loop back to the label. */
+  starts[nstarts++] = len;
+  len = AppendLabel(buf, len, "loop", FALSE);
+  len = AppendPointer(buf, len, len - 5);
+
+  /* Reserved label types, root name, pointer beyond the message. */
+  starts[nstarts++] = len;
+  buf[len++] = 0x40;
+  starts[nstarts++] = len;
+  buf[len++] = 0x80;
+  starts[nstarts++] = len;
+  buf[len++] = 0;
+  starts[nstarts++] = len;
+  len = AppendPointer(buf, len, 0x3fff);
+
+  /* Label without its end. */
+  starts[nstarts++] = len;
+  len = AppendLabel(buf, len, "end", FALSE);
+
+  Check(buf, len, starts, nstarts);
+
+  for (i = 0; i < nstarts; i++) {
+    CHECK(DecodeName(buf, len, starts[i], &ref) == ((i == 0) || (i == 2)));
+  }
+
+  CHECK((DecodeName(buf, len, starts[0], &ref)) && (ref.len == 255));
+
+  /* Every truncation. */
+  for (i = 0; i <= len; i++) {
+    Check(buf, i, starts, nstarts);
+  }
+}
+
+static void CheckPointers()
+{
+  UINT8 buf[MAX_MESSAGE];
+  SIZE_T starts[MAX_POINTERS + 3];
+  ref_name_t ref;
+  SIZE_T len;
+  unsigned i;
+
+  memset(buf, 0, DNS_HEADER_LEN);
+  len = DNS_HEADER_LEN;
+
+  /* "Www.Example.COM", then pointers to pointers to it. */
+  starts[0] = len;
+  len = AppendLabel(buf, len, "Www", FALSE);
+  len = AppendLabel(buf, len, "Example", FALSE);
+  len = AppendLabel(buf, len, "COM", FALSE);
+  buf[len++] = 0;
+
+  for (i = 1; i < ARRAYSIZE(starts); i++) {
+    starts[i] = len;
+    len = AppendPointer(buf, len, starts[i - 1]);
+  }
+
+  Check(buf, len, starts, ARRAYSIZE(starts));
+
+  /* Up to MAX_POINTERS pointers. */
+  for (i = 0; i < ARRAYSIZE(starts); i++) {
+    CHECK(DecodeName(buf, len, starts[i], &ref) == (i <= MAX_POINTERS));
+  }
+
+  CHECK((DecodeName(buf, len, starts[MAX_POINTERS], &ref)) &&
+        (strcmp(ref.text, "Www.Example.COM") == 0));
+}
+
+int main()
+{
+  UINT8 message[MAX_MESSAGE];
+  SIZE_T starts[MAX_STARTS];
+  SIZE_T len;
+  unsigned nstarts;
+  unsigned seed;
+  unsigned i;
+
+  CheckLimits();
+  CheckPointers();
+
+  seed = 41;
+
+  for (i = 0; i < NMESSAGES; i++) {
+    len = MakeMessage(message, starts, &nstarts, &seed);
+
+    CheckMessage(message, len, starts, nstarts, &seed);
+  }
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,751 @@
+/* DNS queries (sys/dns_query.c): a response must match the query with the
+ * same transaction ID, local port, resolver and question (the case of the
+ * name doesn't matter), once, until the query expires (timeout included);
+ * retransmissions keep the time of the first query; a full set evicts its
+ * oldest query; the expired queries are counted as unanswered when their
+ * slot is reused; the latencies go to the right bins and the resolvers
+ * beyond DNS_MAX_RESOLVERS share the last slot. Invalid queries are not
+ * recorded and invalid responses are unsolicited. Then random queries and
+ * responses (a small table, few IDs and ports, an advancing clock) are
+ * checked against a reference model: the slots of each set as a list of
+ * queries.
+ */
+
+#include <stdio.h>
+#include <ntddk.h>
+#include "test.h"
+
+/* Performance counter (set by the test), at 10 MHz. */
+#define FREQUENCY 10000000
+
+static LONGLONG ticks;
+
+static LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER* frequency)
+{
+  LARGE_INTEGER counter;
+
+  if (frequency) {
+    frequency->QuadPart = FREQUENCY;
+  }
+
+  counter.QuadPart = ticks;
+
+  return counter;
+}
+
+#include "../sys/dns_query.c"
+#include "test_util.h"
+
+#define TIMEOUT_MS 100
+#define TIMEOUT (FREQUENCY / 1000 * TIMEOUT_MS)
+
+#define MAX_QUERIES 16
+#define NOPERATIONS 200000
+#define MAX_MESSAGE 300
+
+#define MS (FREQUENCY / 1000)
+
+typedef struct {
+  UINT16 id;
+  UINT16 port;
+  UINT8 ip_version;
+  UINT8 ip[16];
+
+  /* Question (lowercase name). */
+  char name[64];
+  UINT16 qtype;
+} question_t;
+
+typedef struct {
+  question_t key;
+  LONGLONG sent;
+} model_query_t;
+
+/* Reference model: the slots of each set (sent 0: free). */
+static model_query_t sets[MAX_QUERIES / QUERY_WAYS][QUERY_WAYS];
+
+static dns_query_stats_t model_stats;
+static dns_resolver_stats_t model_resolvers[DNS_MAX_RESOLVERS + 1];
+static unsigned model_nresolvers;
+
+static const char* names[] = {
+  "www.example.com",
+  "WWW.Example.COM",
+  "example.org",
+  "a.b.c.d.example.net"
+};
+
+/* Message of the question (query, or response with the letters of the name
+ * in random case).
+ */
+static SIZE_T Message(const question_t* key,
+                      BOOL response,
+                      UINT8* msg,
+                      unsigned* seed)
+{
+  const char* label;
+  const char* dot;
+  SIZE_T len;
+  SIZE_T n;
+  SIZE_T i;
+
+  memset(msg, 0, DNS_HEADER_LEN);
+  msg[0] = (UINT8) (key->id >> 8);
+  msg[1] = (UINT8) key->id;
+  msg[2] = response ? 0x81 : 0x01;
+  msg[5] = 1;
+
+  len = DNS_HEADER_LEN;
+
+  for (label = key->name; *label; label += n + (dot != NULL)) {
+    dot = strchr(label, '.');
+    n = dot ? (SIZE_T) (dot - label) : strlen(label);
+
+    msg[len++] = (UINT8) n;
+
+    for (i = 0; i < n; i++) {
+      msg[len++] = ((response) && (Random(seed) % 2 == 0)) ?
+                   (UINT8) (label[i] & ~0x20) :
+                   (UINT8) label[i];
+    }
+  }
+
+  msg[len++] = 0;
+  msg[len++] = (UINT8) (key->qtype >> 8);
+  msg[len++] = (UINT8) key->qtype;
+  msg[len++] = 0;
+  msg[len++] = 1;
+
+  return len;
+}
+
+static void Query(const question_t* key, unsigned* seed)
+{
+  UINT8 msg[MAX_MESSAGE];
+  UINT8* data;
+  SIZE_T len;
+
+  len = Message(key, FALSE, msg, seed);
+
+  /* Exact size. */
+  if ((data = malloc(len)) == NULL) {
+    CHECK(data != NULL);
+    return;
+  }
+
+  memcpy(data, msg, len);
+
+  AddDnsQuery(key->ip_version, key->ip, key->port, data, len);
+
+  free(data);
+}
+
+/* Response packet of 'len' bytes of 'msg'. */
+static BOOL Respond(const question_t* key, const UINT8* msg, SIZE_T len)
+{
+  packet_t* packet;
+  BOOL matched;
+
+  /* Exact size. */
+  if ((packet = malloc(offsetof(packet_t, payload) + len)) == NULL) {
+    CHECK(packet != NULL);
+    return FALSE;
+  }
+
+  memset(packet, 0, offsetof(packet_t, payload));
+  packet->ip_version = key->ip_version;
+  memcpy(packet->remote_ip, key->ip, 16);
+  packet->local_port = key->port;
+  packet->remote_port = 53;
+  packet->payloadlen = (UINT16) len;
+  memcpy(packet->payload, msg, len);
+
+  matched = MatchDnsResponse(packet);
+
+  free(packet);
+
+  return matched;
+}
+
+static BOOL Response(const question_t* key, unsigned* seed)
+{
+  UINT8 msg[MAX_MESSAGE];
+
+  return Respond(key, msg, Message(key, TRUE, msg, seed));
+}
+
+static void MakeKey(question_t* key,
+                    UINT16 id,
+                    UINT16 port,
+                    unsigned resolver,
+                    const char* name,
+                    UINT16 qtype)
+{
+  unsigned i;
+
+  memset(key, 0, sizeof(question_t));
+
+  key->id = id;
+  key->port = port;
+
+  /* Resolvers 0, 2, 4...: IPv4, the others IPv6. */
+  key->ip_version = (resolver % 2 == 0) ? 4 : 6;
+  key->ip[0] = (key->ip_version == 4) ? 10 : 0xfd;
+  key->ip[3] = (UINT8) (resolver + 1);
+  key->ip[15] = (UINT8) resolver;
+
+  for (i = 0; name[i]; i++) {
+    key->name[i] = (char) (((name[i] >= 'A') && (name[i] <= 'Z')) ?
+                           name[i] | 0x20 :
+                           name[i]);
+  }
+
+  key->qtype = qtype;
+}
+
+static BOOL SameKey(const question_t* key1, const question_t* key2)
+{
+  return ((key1->id == key2->id) &&
+          (key1->port == key2->port) &&
+          (key1->ip_version == key2->ip_version) &&
+          (memcmp(key1->ip, key2->ip, 16) == 0) &&
+          (strcmp(key1->name, key2->name) == 0) &&
+          (key1->qtype == key2->qtype));
+}
+
+static BOOL SameStats(const dns_query_stats_t* stats1,
+                      const dns_query_stats_t* stats2)
+{
+  return ((stats1->queries == stats2->queries) &&
+          (stats1->answered == stats2->answered) &&
+          (stats1->unanswered == stats2->unanswered) &&
+          (stats1->evicted == stats2->evicted) &&
+          (stats1->unsolicited == stats2->unsolicited));
+}
+
+/* Set of the key (placement of the table). */
+static unsigned SetOf(const question_t* key, unsigned* seed)
+{
+  UINT8 msg[MAX_MESSAGE];
+  UINT32 hash;
+  SIZE_T len;
+
+  len = Message(key, FALSE, msg, seed);
+
+  CHECK(HashQuestion(msg, len, &hash));
+
+  return (unsigned) ((GetSet(hash, key->id, key->port) - table.queries) /
+                     QUERY_WAYS);
+}
+
+static unsigned ModelResolver(const question_t* key)
+{
+  dns_resolver_stats_t* resolver;
+  unsigned i;
+
+  for (i = 0; i < model_nresolvers; i++) {
+    resolver = &model_resolvers[i];
+
+    if ((resolver->ip_version == key->ip_version) &&
+        (memcmp(resolver->ip,
+                key->ip,
+                (key->ip_version == 4) ? 4 : 16) == 0)) {
+      return i;
+    }
+  }
+
+  if (model_nresolvers == DNS_MAX_RESOLVERS) {
+    return DNS_MAX_RESOLVERS;
+  }
+
+  resolver = &model_resolvers[model_nresolvers];
+  resolver->ip_version = key->ip_version;
+  memcpy(resolver->ip, key->ip, (key->ip_version == 4) ? 4 : 16);
+
+  return model_nresolvers++;
+}
+
+static void ModelQuery(const question_t* key, unsigned* seed)
+{
+  model_query_t* set;
+  model_query_t* slot;
+  model_query_t* oldest;
+  unsigned i;
+
+  set = sets[SetOf(key, seed)];
+
+  /* In the order of the slots: the expired queries are forgotten until a
+   * retransmission is found.
+   */
+  slot = NULL;
+  oldest = NULL;
+
+  for (i = 0; i < QUERY_WAYS; i++) {
+    if (set[i].sent != 0) {
+      if (ticks - set[i].sent > TIMEOUT) {
+        model_stats.unanswered++;
+        model_resolvers[ModelResolver(&set[i].key)].unanswered++;
+
+        set[i].sent = 0;
+      } else if (SameKey(&set[i].key, key)) {
+        return;
+      } else {
+        if ((!oldest) || (set[i].sent < oldest->sent)) {
+          oldest = &set[i];
+        }
+
+        continue;
+      }
+    }
+
+    if (!slot) {
+      slot = &set[i];
+    }
+  }
+
+  if (!slot) {
+    model_stats.evicted++;
+    slot = oldest;
+  }
+
+  slot->key = *key;
+  slot->sent = ticks;
+
+  model_stats.queries++;
+  model_resolvers[ModelResolver(key)].queries++;
+}
+
+static BOOL ModelResponse(const question_t* key, unsigned* seed)
+{
+  dns_resolver_stats_t* resolver;
+  model_query_t* set;
+  ULONGLONG latency;
+  unsigned bin;
+  unsigned i;
+
+  set = sets[SetOf(key, seed)];
+
+  for (i = 0; i < QUERY_WAYS; i++) {
+    if ((set[i].sent != 0) &&
+        (ticks - set[i].sent <= TIMEOUT) &&
+        (SameKey(&set[i].key, key))) {
+      model_stats.answered++;
+
+      resolver = &model_resolvers[ModelResolver(key)];
+
+      latency = (ULONGLONG) (ticks - set[i].sent) * 1000000 / FREQUENCY;
+
+      resolver->answered++;
+      resolver->total_latency += latency;
+
+      if (latency > resolver->max_latency) {
+        resolver->max_latency = latency;
+      }
+
+      /* [2^(bin-1), 2^bin) ms. */
+      for (bin = 0;
+           (bin < DNS_LATENCY_BINS - 1) && (latency >= (1000ull << bin));
+           bin++);
+
+      resolver->latency[bin]++;
+
+      set[i].sent = 0;
+
+      return TRUE;
+    }
+  }
+
+  model_stats.unsolicited++;
+
+  return FALSE;
+}
+
+static BOOL SameResolvers()
+{
+  dns_resolver_stats_t stats;
+  const dns_resolver_stats_t* expected;
+  unsigned n;
+  unsigned i;
+  unsigned b;
+
+  n = model_nresolvers;
+
+  for (i = 0; GetDnsResolverStats(i, &stats); i++) {
+    if (i < model_nresolvers) {
+      expected = &model_resolvers[i];
+    } else if ((i == model_nresolvers) &&
+               (model_resolvers[DNS_MAX_RESOLVERS].queries > 0)) {
+      expected = &model_resolvers[DNS_MAX_RESOLVERS];
+      n++;
+    } else {
+      return FALSE;
+    }
+
+    if ((stats.queries != expected->queries) ||
+        (stats.answered != expected->answered) ||
+        (stats.unanswered != expected->unanswered) ||
+        (stats.total_latency != expected->total_latency) ||
+        (stats.max_latency != expected->max_latency)) {
+      return FALSE;
+    }
+
+    if ((i < model_nresolvers) &&
+        ((stats.ip_version != expected->ip_version) ||
+         (memcmp(stats.ip, expected->ip, 4) != 0))) {
+      return FALSE;
+    }
+
+    for (b = 0; b < DNS_LATENCY_BINS; b++) {
+      if (stats.latency[b] != expected->latency[b]) {
+        return FALSE;
+      }
+    }
+  }
+
+  return (i == n);
+}
+
+static void ResetModel()
+{
+  memset(sets, 0, sizeof(sets));
+  memset(&model_stats, 0, sizeof(model_stats));
+  memset(model_resolvers, 0, sizeof(model_resolvers));
+  model_nresolvers = 0;
+}
+
+static BOOL Init(unsigned timeout_ms)
+{
+  FreeDnsQueries();
+
+  ResetModel();
+
+  ticks = (LONGLONG) 1000 * FREQUENCY;
+
+  return InitDnsQueries(MAX_QUERIES, timeout_ms);
+}
+
+/* Matching fields, case of the name, once only, timeout, retransmission. */
+static void CheckMatching(unsigned* seed)
+{
+  dns_resolver_stats_t resolver;
+  dns_query_stats_t stats;
+  question_t key;
+  question_t other;
+
+  CHECK(Init(TIMEOUT_MS));
+
+  MakeKey(&key, 0x1234, 50000, 0, "www.example.com", 1);
+
+  /* Each field. */
+  Query(&key, seed);
+
+  other = key;
+  other.id ^= 1;
+  CHECK(!Response(&other, seed));
+
+  other = key;
+  other.port ^= 1;
+  CHECK(!Response(&other, seed));
+
+  other = key;
+  other.ip[3] ^= 1;
+  CHECK(!Response(&other, seed));
+
+  other = key;
+  other.ip_version = 6;
+  CHECK(!Response(&other, seed));
+
+  other = key;
+  other.qtype = 28;
+  CHECK(!Response(&other, seed));
+
+  other = key;
+  strcpy(other.name, "www.example.org");
+  CHECK(!Response(&other, seed));
+
+  /* Case changed by the resolver, then once only. */
+  ticks += 3 * MS;
+  CHECK(Response(&key, seed));
+  CHECK(!Response(&key, seed));
+
+  /* Retransmission (the latency from the first query). */
+  Query(&key, seed);
+  ticks += 5 * MS;
+  Query(&key, seed);
+  ticks += 5 * MS;
+  CHECK(Response(&key, seed));
+
+  /* Timeout included (still a retransmission), then expired. */
+  Query(&key, seed);
+  ticks += TIMEOUT;
+  Query(&key, seed);
+  CHECK(Response(&key, seed));
+
+  Query(&key, seed);
+  ticks += TIMEOUT + 1;
+  CHECK(!Response(&key, seed));
+
+  /* Counted as unanswered when the set is used again. */
+  GetDnsQueryStats(&stats);
+  CHECK(stats.unanswered == 0);
+
+  Query(&key, seed);
+
+  GetDnsQueryStats(&stats);
+  CHECK(stats.queries == 5);
+  CHECK(stats.answered == 3);
+  CHECK(stats.unanswered == 1);
+  CHECK(stats.evicted == 0);
+  CHECK(stats.unsolicited == 8);
+
+  CHECK(Response(&key, seed));
+
+  /* 3 ms, 10 ms (retransmission), timeout, 0. */
+  CHECK(GetDnsResolverStats(0, &resolver));
+  CHECK(resolver.total_latency == (3 + 10 + TIMEOUT_MS) * 1000);
+  CHECK(resolver.max_latency == TIMEOUT_MS * 1000);
+  CHECK((resolver.queries == 5) && (resolver.unanswered == 1));
+}
+
+/* Five queries in a set: the oldest one is evicted. */
+static void CheckEviction(unsigned* seed)
+{
+  dns_query_stats_t stats;
+  question_t keys[QUERY_WAYS + 1];
+  unsigned n;
+  unsigned id;
+  unsigned i;
+
+  CHECK(Init(TIMEOUT_MS));
+
+  MakeKey(&keys[0], 0, 40000, 1, "example.org", 1);
+
+  for (n = 1, id = 1; n < QUERY_WAYS + 1; id++) {
+    keys[n] = keys[0];
+    keys[n].id = (UINT16) id;
+
+    if (SetOf(&keys[n], seed) == SetOf(&keys[0], seed)) {
+      n++;
+    }
+  }
+
+  for (i = 0; i < QUERY_WAYS + 1; i++) {
+    Query(&keys[i], seed);
+    ticks += MS;
+  }
+
+  GetDnsQueryStats(&stats);
+  CHECK(stats.queries == QUERY_WAYS + 1);
+  CHECK(stats.evicted == 1);
+
+  CHECK(!Response(&keys[0], seed));
+
+  for (i = 1; i < QUERY_WAYS + 1; i++) {
+    CHECK(Response(&keys[i], seed));
+  }
+
+  /* The expired queries are reused before evicting. */
+  for (i = 0; i < QUERY_WAYS; i++) {
+    Query(&keys[i], seed);
+  }
+
+  ticks += TIMEOUT + 1;
+
+  Query(&keys[QUERY_WAYS], seed);
+
+  GetDnsQueryStats(&stats);
+  CHECK(stats.evicted == 1);
+  CHECK(stats.unanswered == QUERY_WAYS);
+  CHECK(Response(&keys[QUERY_WAYS], seed));
+}
+
+/* Latency bins and resolvers beyond DNS_MAX_RESOLVERS. */
+static void CheckResolvers(unsigned* seed)
+{
+  static const LONGLONG latencies[] = {
+    0,
+    MS - 1,
+    MS,
+    2 * MS - 1,
+    2 * MS,
+    3 * MS,
+    4096 * MS,
+    8192 * MS
+  };
+
+  dns_resolver_stats_t stats;
+  question_t key;
+  unsigned i;
+
+  /* Timeout of 10 s for the long latencies. */
+  CHECK(Init(10 * 1000));
+
+  for (i = 0; i < ARRAYSIZE(latencies); i++) {
+    MakeKey(&key, (UINT16) i, 1024, 0, "example.org", 1);
+
+    Query(&key, seed);
+    ticks += latencies[i];
+    CHECK(Response(&key, seed));
+  }
+
+  CHECK(GetDnsResolverStats(0, &stats));
+  CHECK(stats.answered == ARRAYSIZE(latencies));
+  CHECK(stats.max_latency == 8192 * 1000);
+  CHECK(stats.latency[0] == 2);
+  CHECK(stats.latency[1] == 2);
+  CHECK(stats.latency[2] == 2);
+  CHECK(stats.latency[13] == 2);
+  CHECK(!GetDnsResolverStats(1, &stats));
+
+  /* 12 resolvers: 8 slots, then the others together. */
+  for (i = 0; i < 12; i++) {
+    MakeKey(&key, (UINT16) i, 1024, i, "example.org", 1);
+    Query(&key, seed);
+  }
+
+  for (i = 0; i < DNS_MAX_RESOLVERS; i++) {
+    CHECK(GetDnsResolverStats(i, &stats));
+    CHECK(stats.ip_version == ((i % 2 == 0) ? 4 : 6));
+    CHECK(stats.ip[3] == i + 1);
+  }
+
+  CHECK(GetDnsResolverStats(DNS_MAX_RESOLVERS, &stats));
+  CHECK((stats.ip_version == 0) && (stats.queries == 4));
+  CHECK(!GetDnsResolverStats(DNS_MAX_RESOLVERS + 1, &stats));
+}
+
+/* Invalid queries (not recorded), invalid responses (unsolicited). */
+static void CheckInvalid(unsigned* seed)
+{
+  UINT8 msg[MAX_MESSAGE];
+  dns_query_stats_t stats;
+  question_t key;
+  SIZE_T len;
+  SIZE_T n;
+
+  CHECK(Init(TIMEOUT_MS));
+
+  MakeKey(&key, 7, 53000, 0, "a.b.c.d.example.net", 1);
+  len = Message(&key, FALSE, msg, seed);
+
+  /* Truncated anywhere. */
+  for (n = 0; n < len; n++) {
+    AddDnsQuery(key.ip_version, key.ip, key.port, msg, n);
+    CHECK(!Respond(&key, msg, n));
+  }
+
+  /* Compressed name (pointer). */
+  msg[DNS_HEADER_LEN] = 0xc0;
+  AddDnsQuery(key.ip_version, key.ip, key.port, msg, len);
+  CHECK(!Respond(&key, msg, len));
+
+  /* Label of 64 bytes, then 63. */
+  memset(msg + DNS_HEADER_LEN, 'a', 65);
+  msg[DNS_HEADER_LEN] = 64;
+  memset(msg + DNS_HEADER_LEN + 65, 0, 5);
+
+  AddDnsQuery(key.ip_version, key.ip, key.port, msg, DNS_HEADER_LEN + 70);
+  CHECK(!Respond(&key, msg, DNS_HEADER_LEN + 70));
+
+  msg[DNS_HEADER_LEN] = 63;
+  msg[DNS_HEADER_LEN + 64] = 0;
+
+  AddDnsQuery(key.ip_version, key.ip, key.port, msg, DNS_HEADER_LEN + 69);
+  CHECK(Respond(&key, msg, DNS_HEADER_LEN + 69));
+
+  /* Name of 256 bytes (with the lengths), then 255. */
+  memset(msg + DNS_HEADER_LEN, 'a', 256);
+  msg[DNS_HEADER_LEN] = 63;
+  msg[DNS_HEADER_LEN + 64] = 63;
+  msg[DNS_HEADER_LEN + 128] = 63;
+  msg[DNS_HEADER_LEN + 192] = 62;
+  msg[DNS_HEADER_LEN + 255] = 0;
+  memset(msg + DNS_HEADER_LEN + 256, 0, 4);
+
+  AddDnsQuery(key.ip_version, key.ip, key.port, msg, DNS_HEADER_LEN + 260);
+
+  msg[DNS_HEADER_LEN + 192] = 61;
+  msg[DNS_HEADER_LEN + 254] = 0;
+
+  AddDnsQuery(key.ip_version, key.ip, key.port, msg, DNS_HEADER_LEN + 259);
+
+  GetDnsQueryStats(&stats);
+  CHECK(stats.queries == 2);
+  CHECK(stats.unsolicited == len + 2);
+
+  CHECK(Respond(&key, msg, DNS_HEADER_LEN + 259));
+}
+
+static void CheckRandom(unsigned* seed)
+{
+  dns_query_stats_t stats;
+  question_t key;
+  unsigned failures;
+  unsigned i;
+
+  CHECK(Init(TIMEOUT_MS));
+
+  failures = 0;
+
+  for (i = 0; i < NOPERATIONS; i++) {
+    /* Strictly increasing (no two queries sent at the same time). */
+    ticks += 1 + (Random(seed) % (TIMEOUT / 8));
+
+    MakeKey(&key,
+            (UINT16) (Random(seed) % 16),
+            (UINT16) (5000 + (Random(seed) % 2)),
+            Random(seed) % 10,
+            names[Random(seed) % ARRAYSIZE(names)],
+            (Random(seed) % 4 == 0) ? 28 : 1);
+
+    if (Random(seed) % 2 == 0) {
+      Query(&key, seed);
+      ModelQuery(&key, seed);
+    } else {
+      failures += (Response(&key, seed) != ModelResponse(&key, seed));
+    }
+
+    GetDnsQueryStats(&stats);
+    failures += !SameStats(&stats, &model_stats);
+  }
+
+  CHECK(failures == 0);
+  CHECK(SameResolvers());
+
+  /* Everything happened. */
+  CHECK((model_stats.answered > 0) &&
+        (model_stats.unanswered > 0) &&
+        (model_stats.evicted > 0) &&
+        (model_stats.unsolicited > 0) &&
+        (model_resolvers[DNS_MAX_RESOLVERS].queries > 0));
+}
+
+int main()
+{
+  question_t key;
+  unsigned seed;
+
+  seed = 45;
+
+  /* Invalid sizes, queries not tracked. */
+  CHECK(!InitDnsQueries(2, TIMEOUT_MS));
+  CHECK(!InitDnsQueries(24, TIMEOUT_MS));
+  CHECK(!InitDnsQueries(MAX_QUERIES, 0));
+
+  CHECK(InitDnsQueries(0, TIMEOUT_MS));
+  CHECK(!DnsQueriesTracked());
+
+  MakeKey(&key, 1, 1, 0, "example.org", 1);
+  Query(&key, &seed);
+  CHECK(Response(&key, &seed));
+
+  CheckMatching(&seed);
+  CheckEviction(&seed);
+  CheckResolvers(&seed);
+  CheckInvalid(&seed);
+  CheckRandom(&seed);
+
+  FreeDnsQueries();
+
+  return TEST_RESULT();
+}
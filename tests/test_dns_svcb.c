@@ -0,0 +1,605 @@
+/* SVCB and HTTPS records (sys/dns_parser.c): FormatAlpnList() (shared with
+ * the TLS ClientHellos) must format the ALPN parameter as a reference
+ * formatter does (the protocols separated by commas, nothing if an
+ * identifier is empty, runs past the end, has a space, a control or an
+ * 8-bit character or if the buffer is too small), and ParseSvcbRecord()
+ * must accept the records that a reference parser accepts (target name,
+ * parameters inside the RDATA, hints of whole addresses, alias mode) and
+ * add and log the same address hints, on generated records (known and
+ * unknown parameters, repeated parameters, bad lengths) truncated at every
+ * length and corrupted, with buffers of the exact size. A response with
+ * HTTPS and SVCB records after a CNAME is parsed by ParseDnsResponse().
+ */
+
+#include <stdio.h>
+#include <arpa/inet.h>
+#include "../sys/dns_parser.c"
+#include "dns_results.h"
+#include "test_util.h"
+
+#define NRECORDS 2000
+#define NCORRUPTIONS 10
+#define MAX_RDATA 1024
+#define MAX_ALPN 256
+
+#define NAME "_443._https.example.com"
+#define HOSTNAME "www.example.com"
+#define TTL 300
+
+static const char* protocols[] = {
+  "h2",
+  "http/1.1",
+  "h3",
+  "h3-29",
+  "x",
+  "",
+  "a-protocol-identifier-which-is-rather-long",
+  "with space",
+  "with,comma"
+};
+
+/* Expected output of FormatAlpnList(). */
+static void FormatAlpn(const UINT8* alpn,
+                       SIZE_T alpnlen,
+                       SIZE_T size,
+                       char* out)
+{
+  SIZE_T pos;
+  SIZE_T n;
+  SIZE_T i;
+
+  *out = 0;
+
+  /* Nothing (not even "[ALPN: ]") for an empty list. */
+  if ((!alpn) || (alpnlen == 0)) {
+    return;
+  }
+
+  strcpy(out, " [ALPN: ");
+  n = strlen(out);
+
+  for (pos = 0; pos < alpnlen; pos += 1 + alpn[pos]) {
+    if ((alpn[pos] == 0) || (pos + 1 + alpn[pos] > alpnlen)) {
+      *out = 0;
+      return;
+    }
+
+    if (n > 8) {
+      out[n++] = ',';
+    }
+
+    for (i = pos + 1; i <= pos + alpn[pos]; i++) {
+      if ((alpn[i] <= ' ') || (alpn[i] > '~')) {
+        *out = 0;
+        return;
+      }
+
+      out[n++] = (char) alpn[i];
+    }
+  }
+
+  out[n++] = ']';
+  out[n] = 0;
+
+  /* The buffer must hold the longest output for this length. */
+  if (alpnlen + 9 > size) {
+    *out = 0;
+  }
+}
+
+static void CheckAlpn(const UINT8* alpn, SIZE_T alpnlen, SIZE_T size)
+{
+  char expected[MAX_ALPN + 16];
+  UINT8* data;
+  char* buf;
+
+  FormatAlpn(alpn, alpnlen, size, expected);
+
+  /* Exact sizes (data is not NULL for empty lists). */
+  data = malloc(alpnlen + (alpnlen == 0));
+  buf = malloc(size);
+
+  if ((!data) || (!buf)) {
+    CHECK((data != NULL) && (buf != NULL));
+    free(data);
+    free(buf);
+    return;
+  }
+
+  if (alpn) {
+    memcpy(data, alpn, alpnlen);
+  }
+
+  memset(buf, 'x', size);
+
+  FormatAlpnList(alpn ? data : NULL, alpnlen, buf, size);
+
+  if (strcmp(buf, expected) != 0) {
+    fprintf(stderr,
+            "FormatAlpnList(%zu, %zu): '%s' (expected: '%s')\n",
+            alpnlen,
+            size,
+            buf,
+            expected);
+    CHECK(FALSE);
+  }
+
+  free(data);
+  free(buf);
+}
+
+/* alpn-ids of random protocols (and a bad character sometimes). */
+static SIZE_T MakeAlpn(UINT8* alpn, SIZE_T max, unsigned* seed)
+{
+  const char* protocol;
+  SIZE_T len;
+  SIZE_T n;
+  unsigned count;
+
+  len = 0;
+
+  for (count = Random(seed) % 6; count > 0; count--) {
+    protocol = protocols[Random(seed) % ARRAYSIZE(protocols)];
+    n = strlen(protocol);
+
+    if (len + 1 + n > max) {
+      break;
+    }
+
+    alpn[len++] = (UINT8) n;
+    memcpy(alpn + len, protocol, n);
+    len += n;
+
+    if ((n > 0) && (Random(seed) % 32 == 0)) {
+      alpn[len - 1] = (UINT8) ((Random(seed) % 2 == 0) ? 0x1f : 0x7f +
+                               (Random(seed) % 0x81));
+    }
+  }
+
+  return len;
+}
+
+static void CheckAlpns(unsigned* seed)
+{
+  static const SIZE_T sizes[] = {1, 8, 9, 10, 16, LOG_ALPN_SIZE};
+  UINT8 alpn[MAX_ALPN];
+  SIZE_T len;
+  SIZE_T n;
+  unsigned i;
+  unsigned s;
+
+  CheckAlpn(NULL, 0, LOG_ALPN_SIZE);
+  CheckAlpn(NULL, 0, 1);
+
+  for (i = 0; i < NRECORDS; i++) {
+    len = MakeAlpn(alpn, (i % 10 == 0) ? MAX_ALPN : 64, seed);
+
+    /* Every truncation (identifiers running past the end). */
+    for (n = 0; n <= len; n++) {
+      for (s = 0; s < ARRAYSIZE(sizes); s++) {
+        CheckAlpn(alpn, n, sizes[s]);
+      }
+
+      /* Just enough, one byte short. */
+      CheckAlpn(alpn, n, n + 9);
+      CheckAlpn(alpn, n, n + 8 + (n == 0));
+    }
+  }
+}
+
+static SIZE_T Write16(UINT8* buf, SIZE_T len, unsigned value)
+{
+  buf[len++] = (UINT8) (value >> 8);
+  buf[len++] = (UINT8) value;
+
+  return len;
+}
+
+/* SvcPriority, TargetName and SvcParams (known and unknown keys, repeated,
+ * with bad lengths sometimes).
+ */
+static SIZE_T MakeRdata(UINT8* rdata, unsigned* seed)
+{
+  static const UINT16 keys[] = {
+    0, /* mandatory */
+    SVC_PARAM_ALPN,
+    2, /* no-default-alpn */
+    3, /* port */
+    SVC_PARAM_IPV4HINT,
+    5, /* ech */
+    SVC_PARAM_IPV6HINT,
+    0xfffe
+  };
+
+  SIZE_T len;
+  SIZE_T value;
+  SIZE_T n;
+  UINT16 key;
+  unsigned count;
+
+  len = Write16(rdata, 0, (Random(seed) % 8 == 0) ? 0 : Random(seed) % 4);
+
+  switch (Random(seed) % 4) {
+    case 0:
+      /* Root (the owner name). */
+      rdata[len++] = 0;
+      break;
+    case 1:
+      /* Pointer (not expected in a TargetName, but skipped). */
+      len = Write16(rdata, len, 0xc00c);
+      break;
+    default:
+      memcpy(rdata + len, "\3svc\7example\3net", 17);
+      len += 17;
+  }
+
+  for (count = Random(seed) % 6; count > 0; count--) {
+    key = keys[Random(seed) % ARRAYSIZE(keys)];
+
+    len = Write16(rdata, len, key);
+
+    value = len + 2;
+
+    switch (key) {
+      case SVC_PARAM_ALPN:
+        n = MakeAlpn(rdata + value, 128, seed);
+        break;
+      case SVC_PARAM_IPV4HINT:
+        n = 4 * (Random(seed) % 5);
+        break;
+      case SVC_PARAM_IPV6HINT:
+        n = 16 * (Random(seed) % 4);
+        break;
+      default:
+        n = Random(seed) % 8;
+    }
+
+    /* Not a whole number of addresses. */
+    if (Random(seed) % 16 == 0) {
+      n += 1 + (Random(seed) % ((key == SVC_PARAM_IPV6HINT) ? 15 : 3));
+    }
+
+    if (key != SVC_PARAM_ALPN) {
+      for (len = value; len < value + n; len++) {
+        rdata[len] = (UINT8) Random(seed);
+      }
+    }
+
+    Write16(rdata, value - 2, (unsigned) n);
+    len = value + n;
+  }
+
+  return len;
+}
+
+/* Expected results of ParseSvcbRecord(). */
+static BOOL ParseRdata(const char* type,
+                       const UINT8* rdata,
+                       SIZE_T rdlength,
+                       results_t* results)
+{
+  char protocols[LOG_ALPN_SIZE];
+  char ip[128];
+  const UINT8* alpn;
+  SIZE_T alpnlen;
+  SIZE_T ipv4;
+  SIZE_T ipv4len;
+  SIZE_T ipv6;
+  SIZE_T ipv6len;
+  SIZE_T pos;
+  SIZE_T len;
+  UINT16 priority;
+  UINT16 key;
+  UINT8 l;
+
+  results->ninserts = 0;
+  results->nlines = 0;
+
+  if (rdlength < 3) {
+    return FALSE;
+  }
+
+  priority = (rdata[0] << 8) | rdata[1];
+
+  /* TargetName (ending with '\0' or a pointer). */
+  for (pos = 2; ; pos += 1 + l) {
+    if (pos >= rdlength) {
+      return FALSE;
+    }
+
+    if ((l = rdata[pos]) == 0) {
+      pos++;
+      break;
+    }
+
+    if ((l & 0xc0) == 0xc0) {
+      if (pos + 2 > rdlength) {
+        return FALSE;
+      }
+
+      pos += 2;
+      break;
+    }
+
+    if ((l & 0xc0) != 0) {
+      return FALSE;
+    }
+  }
+
+  if (priority == 0) {
+    return TRUE;
+  }
+
+  alpn = NULL;
+  alpnlen = 0;
+  ipv4 = 0;
+  ipv4len = 0;
+  ipv6 = 0;
+  ipv6len = 0;
+
+  for (; pos < rdlength; pos += 4 + len) {
+    if (pos + 4 > rdlength) {
+      return FALSE;
+    }
+
+    key = (rdata[pos] << 8) | rdata[pos + 1];
+    len = (rdata[pos + 2] << 8) | rdata[pos + 3];
+
+    if (pos + 4 + len > rdlength) {
+      return FALSE;
+    }
+
+    /* The last parameter of each key wins. */
+    if (key == SVC_PARAM_ALPN) {
+      alpn = rdata + pos + 4;
+      alpnlen = len;
+    } else if (key == SVC_PARAM_IPV4HINT) {
+      if (len % 4 != 0) {
+        return FALSE;
+      }
+
+      ipv4 = pos + 4;
+      ipv4len = len;
+    } else if (key == SVC_PARAM_IPV6HINT) {
+      if (len % 16 != 0) {
+        return FALSE;
+      }
+
+      ipv6 = pos + 4;
+      ipv6len = len;
+    }
+  }
+
+  FormatAlpn(alpn, alpnlen, sizeof(protocols), protocols);
+
+  Expect(results,
+         "%s record: '%s' -> '%s', priority: %u%s, TTL: %u.\r\n",
+         type,
+         NAME,
+         HOSTNAME,
+         priority,
+         protocols,
+         TTL);
+
+  for (; ipv4len > 0; ipv4 += 4, ipv4len -= 4) {
+    AddInsert(results, rdata + ipv4, FALSE, HOSTNAME, SYSTEM_TIME);
+    Expect(results,
+           "Hostname: '%s' -> '%s', address: %u.%u.%u.%u (%s hint), "
+           "TTL: %u.\r\n",
+           NAME,
+           HOSTNAME,
+           rdata[ipv4],
+           rdata[ipv4 + 1],
+           rdata[ipv4 + 2],
+           rdata[ipv4 + 3],
+           type,
+           TTL);
+  }
+
+  for (; ipv6len > 0; ipv6 += 16, ipv6len -= 16) {
+    AddInsert(results, rdata + ipv6, TRUE, HOSTNAME, SYSTEM_TIME);
+    inet_ntop(AF_INET6, rdata + ipv6, ip, sizeof(ip));
+    Expect(results,
+           "Hostname: '%s' -> '%s', address: %s (%s hint), TTL: %u.\r\n",
+           NAME,
+           HOSTNAME,
+           ip,
+           type,
+           TTL);
+  }
+
+  return TRUE;
+}
+
+static void CheckRdata(const UINT8* rdata, SIZE_T rdlength, const char* type)
+{
+  static results_t expected;
+  LARGE_INTEGER system_time;
+  dns_text_t hostname;
+  UINT8* data;
+  BOOL valid;
+
+  valid = ParseRdata(type, rdata, rdlength, &expected);
+
+  /* Exact size (data is not NULL for empty records). */
+  if ((data = malloc(rdlength + (rdlength == 0))) == NULL) {
+    CHECK(data != NULL);
+    return;
+  }
+
+  memcpy(data, rdata, rdlength);
+
+  system_time.QuadPart = SYSTEM_TIME;
+
+  hostname.name = 12;
+  strcpy(hostname.text, HOSTNAME);
+  hostname.len = (UINT16) strlen(HOSTNAME);
+
+  parsed.ninserts = 0;
+  parsed.nlines = 0;
+
+  if (ParseSvcbRecord(&system_time,
+                      type,
+                      data,
+                      (UINT16) rdlength,
+                      NAME,
+                      &hostname,
+                      SYSTEM_TIME,
+                      TTL) != valid) {
+    fprintf(stderr, "ParseSvcbRecord(%zu): %d\n", rdlength, valid);
+    CHECK(FALSE);
+  }
+
+  CHECK(SameResults(&expected));
+
+  free(data);
+}
+
+static void CheckRecords(unsigned* seed)
+{
+  UINT8 rdata[MAX_RDATA];
+  const char* type;
+  SIZE_T len;
+  SIZE_T n;
+  unsigned i;
+  unsigned j;
+
+  for (i = 0; i < NRECORDS; i++) {
+    len = MakeRdata(rdata, seed);
+    type = (i % 2 == 0) ? "HTTPS" : "SVCB";
+
+    CheckRdata(rdata, len, type);
+
+    /* Every truncation of the first records. */
+    if (i < 200) {
+      for (n = 0; n < len; n++) {
+        CheckRdata(rdata, n, type);
+      }
+    }
+
+    /* Corrupted bytes (lengths, keys, labels). */
+    for (j = 0; (j < NCORRUPTIONS) && (len > 0); j++) {
+      n = Random(seed) % len;
+      rdata[n] = (UINT8) Random(seed);
+
+      CheckRdata(rdata, len, type);
+    }
+  }
+}
+
+/* Response to "www.example.com" (type HTTPS): CNAME to svc.example.net,
+ * then HTTPS and SVCB records of the alias (with hints), an HTTPS record of
+ * another class (ignored) and one with a hint of 3 bytes (not logged).
+ */
+static void CheckResponse()
+{
+  static const UINT8 response[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00,
+
+    /* Question (12). */
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm',
+    0, 0x00, 0x41, 0x00, 0x01,
+
+    /* CNAME: svc.example.net (45). */
+    0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x11,
+    3, 's', 'v', 'c', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'n', 'e', 't',
+    0,
+
+    /* HTTPS: priority 1, ".", alpn h2,h3, ipv4hint x 2, ipv6hint. */
+    0xc0, 0x2d, 0x00, 0x41, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x2d,
+    0x00, 0x01, 0x00,
+    0x00, 0x01, 0x00, 0x06, 2, 'h', '2', 2, 'h', '3',
+    0x00, 0x04, 0x00, 0x08, 192, 0, 2, 1, 192, 0, 2, 2,
+    0x00, 0x06, 0x00, 0x10, 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 1,
+
+    /* SVCB: priority 2, "svc.example.net" (uncompressed), port. */
+    0xc0, 0x2d, 0x00, 0x40, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x19,
+    0x00, 0x02,
+    3, 's', 'v', 'c', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'n', 'e', 't',
+    0,
+    0x00, 0x03, 0x00, 0x02, 0x01, 0xbb,
+
+    /* HTTPS, class CHAOS. */
+    0xc0, 0x2d, 0x00, 0x41, 0x00, 0x03, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x0b,
+    0x00, 0x01, 0x00,
+    0x00, 0x04, 0x00, 0x04, 10, 0, 0, 1,
+
+    /* HTTPS, ipv4hint of 3 bytes. */
+    0xc0, 0x2d, 0x00, 0x41, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x0a,
+    0x00, 0x01, 0x00,
+    0x00, 0x04, 0x00, 0x03, 10, 0, 0
+  };
+
+  static const char* lines[] = {
+    "Alias: 'svc.example.net' -> hostname: 'www.example.com'.\r\n",
+    "HTTPS record: 'svc.example.net' -> 'www.example.com', priority: 1 "
+    "[ALPN: h2,h3], TTL: 60.\r\n",
+    "Hostname: 'svc.example.net' -> 'www.example.com', address: 192.0.2.1 "
+    "(HTTPS hint), TTL: 60.\r\n",
+    "Hostname: 'svc.example.net' -> 'www.example.com', address: 192.0.2.2 "
+    "(HTTPS hint), TTL: 60.\r\n",
+    "Hostname: 'svc.example.net' -> 'www.example.com', address: 2001:db8::1 "
+    "(HTTPS hint), TTL: 60.\r\n",
+    "SVCB record: 'svc.example.net' -> 'www.example.com', priority: 2, "
+    "TTL: 60.\r\n"
+  };
+
+  static results_t expected;
+  LARGE_INTEGER system_time;
+  UINT8* data;
+  unsigned i;
+
+  if ((data = malloc(sizeof(response))) == NULL) {
+    CHECK(data != NULL);
+    return;
+  }
+
+  memcpy(data, response, sizeof(response));
+
+  expected.ninserts = 0;
+  expected.nlines = 0;
+
+  for (i = 0; i < ARRAYSIZE(lines); i++) {
+    Expect(&expected, "%s", lines[i]);
+  }
+
+  AddInsert(&expected,
+            response + 91,
+            FALSE,
+            "www.example.com",
+            SYSTEM_TIME + (60 * 10000000ll));
+  AddInsert(&expected,
+            response + 95,
+            FALSE,
+            "www.example.com",
+            SYSTEM_TIME + (60 * 10000000ll));
+  AddInsert(&expected,
+            response + 103,
+            TRUE,
+            "www.example.com",
+            SYSTEM_TIME + (60 * 10000000ll));
+
+  system_time.QuadPart = SYSTEM_TIME;
+
+  parsed.ninserts = 0;
+  parsed.nlines = 0;
+
+  CHECK(ParseDnsResponse(&system_time, data, sizeof(response)));
+  CHECK(SameResults(&expected));
+
+  free(data);
+}
+
+int main()
+{
+  unsigned seed;
+
+  seed = 43;
+
+  CheckResponse();
+  CheckAlpns(&seed);
+  CheckRecords(&seed);
+
+  return TEST_RESULT();
+}
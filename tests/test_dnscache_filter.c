@@ -0,0 +1,147 @@
+/* Negative lookup filter of the DNS cache (sys/dnscache.c, included to
+ * reach the static functions): the counts of used and saturated counters
+ * and the weight of the blocks (for the false-positive rate), which are
+ * kept up to date by the writer, must match a scan of the filter after
+ * inserts, overwrites and evictions, and after saturating counters.
+ */
+
+#include <stdio.h>
+#include "../sys/dnscache.c"
+#include "test.h"
+#include "test_util.h"
+
+#define MAX_ENTRIES 512
+#define NADDRESSES 2048
+#define NWRITES 50000
+
+static unsigned used;
+static unsigned saturated;
+static UINT64 weight;
+
+static void Scan(const filter_t* filter)
+{
+  SIZE_T nblocks;
+  SIZE_T b;
+  UINT64 n;
+  unsigned i;
+
+  nblocks = (SIZE_T) filter->mask + 1;
+
+  used = 0;
+  saturated = 0;
+  weight = 0;
+
+  for (b = 0; b < nblocks; b++) {
+    n = 0;
+
+    for (i = 0; i < FILTER_BLOCK_SIZE; i++) {
+      if (filter->blocks[(b * FILTER_BLOCK_SIZE) + i] != 0) {
+        n++;
+
+        if (filter->blocks[(b * FILTER_BLOCK_SIZE) + i] == FILTER_MAX_COUNT) {
+          saturated++;
+        }
+      }
+    }
+
+    used += (unsigned) n;
+    weight += n * n * n * n;
+  }
+}
+
+static BOOL Matches(const filter_t* filter)
+{
+  Scan(filter);
+
+  return ((filter->used == used) &&
+          (filter->saturated == saturated) &&
+          (filter->weight == weight));
+}
+
+int main()
+{
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  filter_t filter;
+  char hostname[64];
+  UINT8 ip[4];
+  unsigned seed;
+  unsigned len;
+  unsigned i;
+
+  CHECK(InitDnsCache(127, MAX_ENTRIES, FALSE));
+
+  /* Inserts, overwrites and evictions. */
+  seed = 1;
+
+  for (i = 0; i < NWRITES; i++) {
+    seed = (seed * 1103515245) + 12345;
+
+    MakeAddress((seed >> 8) % NADDRESSES, ip);
+    len = (unsigned) sprintf(hostname, "host%u.example", i % 1000);
+
+    AddIPv4ToDnsCache(ip, hostname, (UINT16) len, 0x7fffffffffffffffLL);
+
+    if ((i % 1000) == 0) {
+      CHECK(Matches(&ipv4_cache.table->filter));
+    }
+  }
+
+  CHECK(Matches(&ipv4_cache.table->filter));
+  CHECK(used > 0);
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+
+  CHECK(ipv4_stats.entries == MAX_ENTRIES);
+  CHECK(ipv4_stats.false_positive_rate > 0);
+  CHECK(ipv6_stats.false_positive_rate == 0);
+
+  /* The filters of both tables count their counters while the entries
+   * are moved.
+   */
+  CHECK(ResizeDnsCache(61, MAX_ENTRIES / 2, FALSE));
+
+  while (MoveDnsCacheEntries(16, 0)) {
+    CHECK(Matches(&ipv4_cache.table->filter));
+
+    if (ipv4_cache.old) {
+      CHECK(Matches(&ipv4_cache.old->filter));
+    }
+  }
+
+  CHECK(Matches(&ipv4_cache.table->filter));
+
+  FreeDnsCache();
+
+  /* Saturated counters. */
+  CHECK(InitFilter(&filter, 64));
+
+  MakeAddress(1, ip);
+
+  for (i = 0; i < FILTER_MAX_COUNT + 10; i++) {
+    AddToFilter(&filter, ip, 4);
+  }
+
+  MakeAddress(2, ip);
+  AddToFilter(&filter, ip, 4);
+
+  CHECK(Matches(&filter));
+  CHECK(saturated > 0);
+
+  /* Saturated counters stay saturated (and used). */
+  MakeAddress(1, ip);
+
+  for (i = 0; i < FILTER_MAX_COUNT + 10; i++) {
+    RemoveFromFilter(&filter, ip, 4);
+  }
+
+  MakeAddress(2, ip);
+  RemoveFromFilter(&filter, ip, 4);
+
+  CHECK(Matches(&filter));
+  CHECK(used == saturated);
+
+  FreeFilter(&filter);
+
+  return TEST_RESULT();
+}
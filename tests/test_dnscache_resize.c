@@ -0,0 +1,388 @@
+/* Resizing the DNS cache (sys/dnscache.c): the entries which haven't
+ * expired must be moved with their hostnames, expiry times and time order
+ * (a snapshot saved after the resize has the same bytes as before), the
+ * counters must be kept, and a cache which is too small must keep the
+ * newest entries. The entries looked up before the resize keep their second
+ * chance (the ones which don't fit are dropped all the same), and a failed
+ * resize leaves the caches as they were. While the entries are moved a few
+ * buckets at a time, every entry must be found, the insertions and
+ * overwrites must not duplicate the entries of the previous tables, and
+ * another resize must be refused.
+ */
+
+#include <stdio.h>
+#include "../sys/dnscache.h"
+#include "test.h"
+#include "test_util.h"
+
+#define NIPV4 1000
+#define NIPV6 300
+
+#define NOW 1000000LL
+
+/* Every 7th entry expires at NOW - 1, when the caches are resized. */
+#define EXPIRED(n) (((n) % 7) == 3)
+
+/* Entries of each family in the shrunk cache. */
+#define SHRUNK 100
+
+/* Buckets moved per step of the incremental resize. */
+#define STEP 4
+
+static UINT8 before[1 << 20];
+static UINT8 after[1 << 20];
+
+static void Fill()
+{
+  char hostname[256];
+  UINT8 ip[16];
+  LONGLONG expires;
+  unsigned len;
+  unsigned n;
+
+  for (n = 0; n < NIPV4; n++) {
+    MakeAddress(n, ip);
+    len = MakeHostname(n, hostname);
+    expires = EXPIRED(n) ? NOW - 1 : NOW + 1000;
+
+    CHECK(AddIPv4ToDnsCache(ip, hostname, (UINT16) len, expires));
+  }
+
+  for (n = 0; n < NIPV6; n++) {
+    MakeIPv6Address(n, ip);
+    len = MakeHostname(n, hostname);
+    expires = EXPIRED(n) ? NOW - 1 : NOW + 1000;
+
+    CHECK(AddIPv6ToDnsCache(ip, hostname, (UINT16) len, expires));
+  }
+}
+
+static SIZE_T Save(UINT8* buf)
+{
+  dns_cache_snapshot_t s;
+  SIZE_T total;
+  SIZE_T size;
+
+  BeginDnsCacheSnapshot(&s, NOW);
+
+  total = 0;
+
+  while ((size = SaveDnsCache(&s, buf + total, 4096)) > 0) {
+    total += size;
+  }
+
+  GetDnsCacheSnapshotHeader(&s, buf);
+
+  return total;
+}
+
+/* Entries from 'first' to 'count' - 1 which haven't expired. */
+static unsigned Unexpired(unsigned first, unsigned count)
+{
+  unsigned n;
+  unsigned unexpired;
+
+  unexpired = 0;
+
+  for (n = first; n < count; n++) {
+    if (!EXPIRED(n)) {
+      unexpired++;
+    }
+  }
+
+  return unexpired;
+}
+
+static void Finish()
+{
+  while (MoveDnsCacheEntries(STEP, NOW - 1)) {
+  }
+}
+
+static BOOL SameCounters(const dns_cache_stats_t* a,
+                         const dns_cache_stats_t* b)
+{
+  return (a->inserts == b->inserts) &&
+         (a->overwrites == b->overwrites) &&
+         (a->refreshes == b->refreshes) &&
+         (a->hits == b->hits) &&
+         (a->misses == b->misses) &&
+         (a->evictions == b->evictions);
+}
+
+static void CheckGrow()
+{
+  dns_cache_stats_t ipv4_before;
+  dns_cache_stats_t ipv6_before;
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  char hostname[256];
+  char found[256];
+  UINT8 ip[16];
+  SIZE_T size;
+  unsigned n;
+
+  CHECK(InitDnsCache(127, 2048, FALSE));
+
+  Fill();
+
+  /* Some hits and misses for the counters. */
+  for (n = 0; n < NIPV4 + 50; n += 10) {
+    MakeAddress(n, ip);
+    GetIPv4FromDnsCache(ip, found);
+  }
+
+  GetDnsCacheStats(&ipv4_before, &ipv6_before);
+
+  size = Save(before);
+
+  CHECK(ResizeDnsCache(509, 4096, FALSE));
+  Finish();
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+
+  CHECK(SameCounters(&ipv4_stats, &ipv4_before));
+  CHECK(SameCounters(&ipv6_stats, &ipv6_before));
+  CHECK(ipv4_stats.entries == Unexpired(0, NIPV4));
+  CHECK(ipv6_stats.entries == Unexpired(0, NIPV6));
+  CHECK((ipv4_stats.nbuckets == 509) && (ipv4_stats.max_entries == 4096));
+  CHECK((ipv6_stats.nbuckets == 509) && (ipv6_stats.max_entries == 4096));
+
+  /* Same entries, in the same order. */
+  CHECK(Save(after) == size);
+  CHECK(memcmp(before, after, size) == 0);
+
+  for (n = 0; n < NIPV4; n++) {
+    MakeAddress(n, ip);
+    MakeHostname(n, hostname);
+
+    if (EXPIRED(n)) {
+      CHECK(GetIPv4FromDnsCache(ip, found) == NULL);
+    } else {
+      CHECK((GetIPv4FromDnsCache(ip, found) != NULL) &&
+            (strcmp(found, hostname) == 0));
+    }
+  }
+
+  for (n = 0; n < NIPV6; n++) {
+    MakeIPv6Address(n, ip);
+    MakeHostname(n, hostname);
+
+    if (EXPIRED(n)) {
+      CHECK(GetIPv6FromDnsCache(ip, found) == NULL);
+    } else {
+      CHECK((GetIPv6FromDnsCache(ip, found) != NULL) &&
+            (strcmp(found, hostname) == 0));
+    }
+  }
+
+  /* A failed resize doesn't modify the caches. */
+  size = Save(before);
+
+  CHECK(!ResizeDnsCache(61, 0, FALSE));
+  CHECK(!MoveDnsCacheEntries(STEP, NOW - 1));
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+  CHECK((ipv4_stats.nbuckets == 509) && (ipv4_stats.max_entries == 4096));
+
+  CHECK(Save(after) == size);
+  CHECK(memcmp(before, after, size) == 0);
+
+  FreeDnsCache();
+}
+
+static void CheckShrink()
+{
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  char hostname[256];
+  char found[256];
+  UINT8 ip[16];
+  unsigned oldest;
+  unsigned kept;
+  unsigned nfound;
+  unsigned len;
+  unsigned n;
+
+  SetDnsCachePolicy(DNS_CACHE_POLICY_CLOCK);
+
+  CHECK(InitDnsCache(127, 2048, FALSE));
+
+  Fill();
+
+  /* The SHRUNK newest entries are kept (but not the expired ones). The
+   * oldest of them gets a second chance, an older one which doesn't fit is
+   * dropped all the same.
+   */
+  oldest = NIPV4 - SHRUNK;
+  kept = Unexpired(oldest, NIPV4);
+
+  MakeAddress(oldest, ip);
+  CHECK((!EXPIRED(oldest)) && (GetIPv4FromDnsCache(ip, found) != NULL));
+
+  MakeAddress(oldest - 2, ip);
+  CHECK(GetIPv4FromDnsCache(ip, found) != NULL);
+
+  CHECK(ResizeDnsCache(61, SHRUNK, FALSE));
+  Finish();
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+  CHECK(ipv4_stats.entries == kept);
+  CHECK(ipv6_stats.entries == Unexpired(NIPV6 - SHRUNK, NIPV6));
+
+  CHECK(GetIPv4FromDnsCache(ip, found) == NULL);
+
+  /* New entries take the free entries of the expired ones... */
+  for (n = NIPV4; n < NIPV4 + SHRUNK - kept; n++) {
+    MakeAddress(n, ip);
+    len = MakeHostname(n, hostname);
+    CHECK(AddIPv4ToDnsCache(ip, hostname, (UINT16) len, NOW + 1000));
+  }
+
+  /* ... and then a new entry evicts the second oldest entry... */
+  MakeAddress(n, ip);
+  len = MakeHostname(n, hostname);
+  CHECK(AddIPv4ToDnsCache(ip, hostname, (UINT16) len, NOW + 1000));
+
+  MakeAddress(oldest + 1, ip);
+  CHECK(GetIPv4FromDnsCache(ip, found) == NULL);
+
+  /* ... and the next one the third oldest one (without second chance). */
+  SetDnsCachePolicy(DNS_CACHE_POLICY_FIFO);
+
+  MakeAddress(n + 1, ip);
+  len = MakeHostname(n + 1, hostname);
+  CHECK(AddIPv4ToDnsCache(ip, hostname, (UINT16) len, NOW + 1000));
+
+  MakeAddress(oldest + 2, ip);
+  CHECK(GetIPv4FromDnsCache(ip, found) == NULL);
+
+  MakeAddress(oldest, ip);
+  CHECK(GetIPv4FromDnsCache(ip, found) != NULL);
+
+  /* The other entries are the newest ones. */
+  nfound = 0;
+
+  for (n = 0; n < NIPV4; n++) {
+    MakeAddress(n, ip);
+    MakeHostname(n, hostname);
+
+    if (GetIPv4FromDnsCache(ip, found) != NULL) {
+      CHECK((n >= oldest) && !EXPIRED(n) && (strcmp(found, hostname) == 0));
+      nfound++;
+    }
+  }
+
+  CHECK(nfound == kept - 2);
+
+  nfound = 0;
+
+  for (n = 0; n < NIPV6; n++) {
+    MakeIPv6Address(n, ip);
+    MakeHostname(n, hostname);
+
+    if (GetIPv6FromDnsCache(ip, found) != NULL) {
+      CHECK((n >= NIPV6 - SHRUNK) &&
+            !EXPIRED(n) &&
+            (strcmp(found, hostname) == 0));
+
+      nfound++;
+    }
+  }
+
+  CHECK(nfound == Unexpired(NIPV6 - SHRUNK, NIPV6));
+
+  FreeDnsCache();
+}
+
+/* Every IPv4 entry which hasn't expired is found: the first 'overwritten'
+ * ones with the hostname of their overwrite, and as many new ones.
+ */
+static unsigned CheckFound(unsigned overwritten)
+{
+  char hostname[256];
+  char found[256];
+  UINT8 ip[16];
+  unsigned missing;
+  unsigned n;
+
+  missing = 0;
+
+  for (n = 0; n < NIPV4 + overwritten; n++) {
+    if ((n >= overwritten) && (n < NIPV4) && (EXPIRED(n))) {
+      continue;
+    }
+
+    MakeAddress(n, ip);
+    MakeHostname((n < overwritten) ? NIPV4 + n : n, hostname);
+
+    if ((GetIPv4FromDnsCache(ip, found) == NULL) ||
+        (strcmp(found, hostname) != 0)) {
+      missing++;
+    }
+  }
+
+  return missing;
+}
+
+static void CheckIncremental()
+{
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  char hostname[256];
+  UINT8 ip[16];
+  unsigned steps;
+  unsigned len;
+
+  CHECK(InitDnsCache(61, 2048, FALSE));
+
+  Fill();
+
+  CHECK(ResizeDnsCache(127, 2048, FALSE));
+
+  /* Refused until the entries have been moved. */
+  CHECK(!ResizeDnsCache(509, 4096, FALSE));
+
+  steps = 0;
+
+  while (MoveDnsCacheEntries(STEP, NOW - 1)) {
+    /* Overwrite an entry (which might not have been moved yet) and insert
+     * a new one.
+     */
+    MakeAddress(steps, ip);
+    len = MakeHostname(NIPV4 + steps, hostname);
+    CHECK(AddIPv4ToDnsCache(ip, hostname, (UINT16) len, NOW + 1000));
+
+    MakeAddress(NIPV4 + steps, ip);
+    CHECK(AddIPv4ToDnsCache(ip, hostname, (UINT16) len, NOW + 1000));
+
+    steps++;
+
+    CHECK(CheckFound(steps) == 0);
+
+    GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+    CHECK((ipv4_stats.nbuckets == 127) && (ipv6_stats.nbuckets == 127));
+  }
+
+  CHECK(steps > 1);
+  CHECK(CheckFound(steps) == 0);
+
+  /* No duplicates. */
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+  CHECK(ipv4_stats.entries == Unexpired(steps, NIPV4) + (2 * steps));
+  CHECK(ipv6_stats.entries == Unexpired(0, NIPV6));
+
+  CHECK(ResizeDnsCache(509, 4096, FALSE));
+  Finish();
+
+  FreeDnsCache();
+}
+
+int main()
+{
+  CheckGrow();
+  CheckShrink();
+  CheckIncremental();
+
+  return TEST_RESULT();
+}
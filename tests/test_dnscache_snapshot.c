@@ -0,0 +1,199 @@
+/* Snapshots of the DNS cache (sys/dnscache.c): the snapshot is saved in
+ * pieces into a small buffer and must not depend on the size of the
+ * buffer. Loading it restores the entries which haven't expired, keeps the
+ * newest ones if the cache is smaller and rejects truncated snapshots.
+ */
+
+#include <stdio.h>
+#include "../sys/dnscache.h"
+#include "test.h"
+#include "test_util.h"
+
+#define NBUCKETS 127
+#define NIPV4 1000
+#define NIPV6 300
+
+#define NOW 1000000LL
+
+/* Every 7th entry has expired when the snapshot is saved. */
+#define EXPIRED(n) (((n) % 7) == 3)
+
+static UINT8 snapshot[1 << 20];
+static UINT8 copy[1 << 20];
+
+static void Fill()
+{
+  char hostname[256];
+  UINT8 ip[16];
+  LONGLONG expires;
+  unsigned len;
+  unsigned n;
+
+  for (n = 0; n < NIPV4; n++) {
+    MakeAddress(n, ip);
+    len = MakeHostname(n, hostname);
+    expires = EXPIRED(n) ? NOW - 1 : NOW + 1000;
+
+    CHECK(AddIPv4ToDnsCache(ip, hostname, (UINT16) len, expires));
+  }
+
+  for (n = 0; n < NIPV6; n++) {
+    MakeIPv6Address(n, ip);
+    len = MakeHostname(n, hostname);
+    expires = EXPIRED(n) ? NOW - 1 : NOW + 1000;
+
+    CHECK(AddIPv6ToDnsCache(ip, hostname, (UINT16) len, expires));
+  }
+}
+
+/* Save the snapshot in pieces of at most 'piece' bytes. */
+static SIZE_T Save(UINT8* buf, SIZE_T piece)
+{
+  dns_cache_snapshot_t s;
+  SIZE_T total;
+  SIZE_T size;
+
+  BeginDnsCacheSnapshot(&s, NOW);
+
+  total = 0;
+
+  while ((size = SaveDnsCache(&s, buf + total, piece)) > 0) {
+    CHECK(size <= piece);
+    total += size;
+  }
+
+  GetDnsCacheSnapshotHeader(&s, buf);
+
+  CHECK(s.size == total);
+  CHECK(total <= GetDnsCacheSnapshotSize());
+
+  return total;
+}
+
+static unsigned Unexpired(unsigned count)
+{
+  unsigned n;
+  unsigned unexpired;
+
+  unexpired = 0;
+
+  for (n = 0; n < count; n++) {
+    if (!EXPIRED(n)) {
+      unexpired++;
+    }
+  }
+
+  return unexpired;
+}
+
+int main()
+{
+  dns_cache_snapshot_t s;
+  char hostname[256];
+  char found[256];
+  UINT8 buf[DNS_CACHE_SNAPSHOT_MIN_BUFFER];
+  UINT8 ip[16];
+  SIZE_T size;
+  SIZE_T size2;
+  unsigned loaded;
+  unsigned expired;
+  unsigned nfound;
+  unsigned n;
+
+  CHECK(InitDnsCache(NBUCKETS, 2048, FALSE));
+
+  Fill();
+
+  /* A buffer smaller than the minimum is refused. */
+  BeginDnsCacheSnapshot(&s, NOW);
+  CHECK(SaveDnsCache(&s, buf, sizeof(buf) - 1) == 0);
+
+  /* The smallest buffer and a buffer for the whole snapshot give the same
+   * bytes.
+   */
+  size = Save(snapshot, DNS_CACHE_SNAPSHOT_MIN_BUFFER);
+  size2 = Save(copy, sizeof(copy));
+
+  CHECK(size == size2);
+  CHECK(memcmp(snapshot, copy, size) == 0);
+
+  /* Odd piece sizes too. */
+  size2 = Save(copy, DNS_CACHE_SNAPSHOT_MIN_BUFFER + 333);
+
+  CHECK(size == size2);
+  CHECK(memcmp(snapshot, copy, size) == 0);
+
+  FreeDnsCache();
+
+  /* Load into an empty cache. */
+  CHECK(InitDnsCache(NBUCKETS, 2048, FALSE));
+
+  CHECK(LoadDnsCache(snapshot, size, NOW, &loaded, &expired));
+  CHECK(loaded == Unexpired(NIPV4) + Unexpired(NIPV6));
+
+  for (n = 0; n < NIPV4; n++) {
+    MakeAddress(n, ip);
+    MakeHostname(n, hostname);
+
+    if (EXPIRED(n)) {
+      CHECK(GetIPv4FromDnsCache(ip, found) == NULL);
+    } else {
+      CHECK((GetIPv4FromDnsCache(ip, found) != NULL) &&
+            (strcmp(found, hostname) == 0));
+    }
+  }
+
+  for (n = 0; n < NIPV6; n++) {
+    MakeIPv6Address(n, ip);
+    MakeHostname(n, hostname);
+
+    if (EXPIRED(n)) {
+      CHECK(GetIPv6FromDnsCache(ip, found) == NULL);
+    } else {
+      CHECK((GetIPv6FromDnsCache(ip, found) != NULL) &&
+            (strcmp(found, hostname) == 0));
+    }
+  }
+
+  /* Saving the restored cache gives the same snapshot. */
+  size2 = Save(copy, DNS_CACHE_SNAPSHOT_MIN_BUFFER);
+
+  CHECK(size == size2);
+  CHECK(memcmp(snapshot, copy, size) == 0);
+
+  FreeDnsCache();
+
+  /* Load into a smaller cache: the newest entries are kept. */
+  CHECK(InitDnsCache(NBUCKETS, 100, FALSE));
+
+  CHECK(LoadDnsCache(snapshot, size, NOW, &loaded, &expired));
+
+  nfound = 0;
+
+  for (n = 0; n < NIPV4; n++) {
+    MakeAddress(n, ip);
+
+    if (GetIPv4FromDnsCache(ip, found) != NULL) {
+      CHECK(n >= NIPV4 - 130);
+      nfound++;
+    }
+  }
+
+  CHECK(nfound == 100);
+
+  FreeDnsCache();
+
+  /* Truncated snapshots are rejected. */
+  CHECK(InitDnsCache(NBUCKETS, 2048, FALSE));
+
+  CHECK(!LoadDnsCache(snapshot, size - 1, NOW, &loaded, &expired));
+  CHECK(!LoadDnsCache(snapshot, 16, NOW, &loaded, &expired));
+
+  /* A snapshot whose header was not written (the save failed). */
+  memset(copy, 0, DNS_CACHE_SNAPSHOT_HEADER_SIZE);
+  CHECK(!LoadDnsCache(copy, size, NOW, &loaded, &expired));
+
+  FreeDnsCache();
+
+  return TEST_RESULT();
+}
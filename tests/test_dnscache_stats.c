@@ -0,0 +1,234 @@
+/* Statistics of the DNS cache (sys/dnscache.c, included to reach the
+ * caches): the occupancy, chain lengths and bin counts, which are kept up
+ * to date by the writer, must match a walk of the chains and of the free
+ * lists after inserts, overwrites (moving hostnames between bins),
+ * evictions, a snapshot load and during and after a resize (which counts
+ * the entries of both tables, but only the chains of the new ones).
+ */
+
+#include <stdio.h>
+#include "../sys/dnscache.c"
+#include "test.h"
+#include "test_util.h"
+
+#define NADDRESSES 4096
+#define NWRITES 100000
+
+static UINT8 snapshot[1 << 20];
+
+static void WalkTable(const cache_table_t* table, dns_cache_stats_t* stats)
+{
+  const cache_header_t* header;
+  const cache_entry_t* entry;
+  unsigned len;
+  unsigned i;
+
+  for (i = 0; i < table->nbuckets; i++) {
+    header = &table->buckets[i];
+
+    len = 0;
+
+    entry = (const cache_entry_t*) header->next;
+    while (entry != (const cache_entry_t*) header) {
+      len++;
+      entry = entry->next;
+    }
+
+    if (len > 0) {
+      stats->entries += len;
+      stats->used_buckets++;
+
+      if (len > stats->max_chain) {
+        stats->max_chain = len;
+      }
+    }
+  }
+
+  if (stats->max_chain > DNS_CACHE_MAX_CHAIN) {
+    stats->max_chain = DNS_CACHE_MAX_CHAIN;
+  }
+}
+
+/* The statistics as they were computed before the counters. */
+static void WalkCache(const dns_cache_t* ip_cache, dns_cache_stats_t* stats)
+{
+  dns_cache_stats_t old;
+  const page_t* page;
+  unsigned i;
+  int off;
+
+  memset(stats, 0, sizeof(dns_cache_stats_t));
+
+  WalkTable(ip_cache->table, stats);
+
+  if (ip_cache->old) {
+    memset(&old, 0, sizeof(dns_cache_stats_t));
+    WalkTable(ip_cache->old, &old);
+
+    stats->entries += old.entries;
+  }
+
+  for (i = 0; i < MAX_BINS; i++) {
+    for (page = ip_cache->bins[i]; page; page = page->next) {
+      stats->bin_pages[i]++;
+
+      off = page->free;
+
+      while (off != -1) {
+        stats->bin_free_slots[i]++;
+        off = *((const int*) (page->data + off));
+      }
+    }
+  }
+}
+
+static BOOL Matches(dns_cache_t* ip_cache)
+{
+  dns_cache_stats_t stats;
+  dns_cache_stats_t walked;
+  unsigned i;
+
+  GetCacheStats(ip_cache, &stats);
+  WalkCache(ip_cache, &walked);
+
+  if ((stats.entries != walked.entries) ||
+      (stats.used_buckets != walked.used_buckets) ||
+      (stats.max_chain != walked.max_chain)) {
+    fprintf(stderr,
+            "entries %u/%u, used buckets %u/%u, max chain %u/%u\n",
+            stats.entries,
+            walked.entries,
+            stats.used_buckets,
+            walked.used_buckets,
+            stats.max_chain,
+            walked.max_chain);
+
+    return FALSE;
+  }
+
+  for (i = 0; i < MAX_BINS; i++) {
+    if ((stats.bin_pages[i] != walked.bin_pages[i]) ||
+        (stats.bin_free_slots[i] != walked.bin_free_slots[i])) {
+      fprintf(stderr,
+              "bin %u: pages %u/%u, free slots %u/%u\n",
+              i,
+              stats.bin_pages[i],
+              walked.bin_pages[i],
+              stats.bin_free_slots[i],
+              walked.bin_free_slots[i]);
+
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Hostnames of 8 to 255 characters, so they go to all the bins. */
+static void Write(unsigned nwrites, unsigned* seed)
+{
+  char hostname[256];
+  UINT8 ip[16];
+  unsigned n;
+  unsigned len;
+  unsigned i;
+
+  for (i = 0; i < nwrites; i++) {
+    n = Random(seed) % NADDRESSES;
+    len = 8 + (Random(seed) % 248);
+
+    memset(hostname, 'a' + (i % 26), len);
+
+    MakeAddress(n, ip);
+
+    AddIPv4ToDnsCache(ip, hostname, (UINT16) len, 0x7fffffffffffffffLL);
+
+    MakeIPv6Address(n, ip);
+
+    AddIPv6ToDnsCache(ip, hostname, (UINT16) len, 0x7fffffffffffffffLL);
+
+    if ((i % 5000) == 0) {
+      CHECK(Matches(&ipv4_cache));
+      CHECK(Matches(&ipv6_cache));
+    }
+  }
+}
+
+int main()
+{
+  dns_cache_snapshot_t s;
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  SIZE_T size;
+  SIZE_T n;
+  unsigned loaded;
+  unsigned expired;
+  unsigned seed;
+
+  seed = 7;
+
+  /* Short chains. */
+  CHECK(InitDnsCache(509, 1024, FALSE));
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+  CHECK((ipv4_stats.entries == 0) && (ipv4_stats.used_buckets == 0));
+
+  Write(NWRITES, &seed);
+
+  CHECK(Matches(&ipv4_cache));
+  CHECK(Matches(&ipv6_cache));
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+  CHECK(ipv4_stats.entries == 1024);
+  CHECK(ipv4_stats.max_chain < DNS_CACHE_MAX_CHAIN);
+
+  /* Long chains (the maximum is capped), with writes while the oldest
+   * entries are dropped and the others moved.
+   */
+  CHECK(ResizeDnsCache(7, 512, FALSE));
+
+  do {
+    Write(100, &seed);
+
+    CHECK(Matches(&ipv4_cache));
+    CHECK(Matches(&ipv6_cache));
+  } while (MoveDnsCacheEntries(64, 0));
+
+  CHECK(Matches(&ipv4_cache));
+  CHECK(Matches(&ipv6_cache));
+
+  Write(NWRITES / 10, &seed);
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+  CHECK(ipv4_stats.entries == 512);
+  CHECK(ipv4_stats.max_chain == DNS_CACHE_MAX_CHAIN);
+
+  /* Snapshot load. */
+  BeginDnsCacheSnapshot(&s, 0);
+
+  size = 0;
+
+  while ((n = SaveDnsCache(&s, snapshot + size, 4096)) > 0) {
+    size += n;
+  }
+
+  GetDnsCacheSnapshotHeader(&s, snapshot);
+
+  FreeDnsCache();
+
+  CHECK(InitDnsCache(127, 2048, FALSE));
+
+  CHECK(LoadDnsCache(snapshot, size, 0, &loaded, &expired));
+  CHECK(loaded == 1024);
+
+  CHECK(Matches(&ipv4_cache));
+  CHECK(Matches(&ipv6_cache));
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+  CHECK(ipv4_stats.entries == 512);
+  CHECK(ipv6_stats.entries == 512);
+
+  FreeDnsCache();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,232 @@
+/* Lock-free lookups of the DNS cache (sys/dnscache.c): reader threads look
+ * up addresses while a writer inserts, overwrites (with hostnames of other
+ * lengths, so they move between bins) and evicts entries of a small cache.
+ * A reader must never see a torn hostname or the hostname of another
+ * address. The writer also resizes the cache from time to time, and moves
+ * the entries between its writes while the readers look up both tables.
+ *
+ * Each hostname encodes its address, its length and a fill character which
+ * changes with each write: "h<address>-<length>-<fill...>.example".
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include "../sys/dnscache.h"
+#include "test.h"
+#include "test_util.h"
+
+#define NBUCKETS 61
+#define MAX_ENTRIES 256
+#define NADDRESSES 1024
+#define NREADERS 3
+#define NWRITES 400000
+#define RESIZE_INTERVAL 50000
+
+#define MIN_LEN 20
+#define MAX_LEN 96
+
+typedef struct {
+  unsigned seed;
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned long errors;
+} reader_t;
+
+static volatile int done;
+
+/* Last hostname written for each address. */
+static char last[NADDRESSES][MAX_LEN + 1];
+
+static unsigned TaggedHostname(unsigned n, unsigned len, char fill, char* s)
+{
+  unsigned off;
+
+  off = (unsigned) sprintf(s, "h%04x-%03u-", n, len);
+
+  while (off < len - 8) {
+    s[off++] = fill;
+  }
+
+  memcpy(s + off, ".example", 9);
+
+  return len;
+}
+
+static BOOL CheckHostname(unsigned n, const char* s)
+{
+  char expected[MAX_LEN + 1];
+  unsigned len;
+
+  if (sscanf(s, "h%*4x-%03u-", &len) != 1) {
+    return FALSE;
+  }
+
+  if ((len < MIN_LEN) || (len > MAX_LEN) || (strlen(s) != len)) {
+    return FALSE;
+  }
+
+  TaggedHostname(n, len, s[10], expected);
+
+  return (strcmp(s, expected) == 0);
+}
+
+static double Now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void* Reader(void* arg)
+{
+  reader_t* reader = (reader_t*) arg;
+  char hostname[DNS_CACHE_BATCH_SIZE][256];
+  char* hostnames[DNS_CACHE_BATCH_SIZE];
+  UINT8 ips[DNS_CACHE_BATCH_SIZE][4];
+  const UINT8* ptrs[DNS_CACHE_BATCH_SIZE];
+  unsigned n[DNS_CACHE_BATCH_SIZE];
+  unsigned i;
+
+  for (i = 0; i < DNS_CACHE_BATCH_SIZE; i++) {
+    hostnames[i] = hostname[i];
+    ptrs[i] = ips[i];
+  }
+
+  while (!done) {
+    /* Single lookup. */
+    n[0] = Random(&reader->seed) % NADDRESSES;
+    MakeAddress(n[0], ips[0]);
+
+    reader->lookups++;
+
+    if (GetIPv4FromDnsCache(ips[0], hostname[0])) {
+      reader->hits++;
+
+      if (!CheckHostname(n[0], hostname[0])) {
+        fprintf(stderr, "Bad hostname for %u: '%s'.\n", n[0], hostname[0]);
+        reader->errors++;
+      }
+    }
+
+    /* Batch lookup. */
+    for (i = 0; i < DNS_CACHE_BATCH_SIZE; i++) {
+      n[i] = Random(&reader->seed) % NADDRESSES;
+      MakeAddress(n[i], ips[i]);
+    }
+
+    reader->lookups += DNS_CACHE_BATCH_SIZE;
+    reader->hits += GetIPv4BatchFromDnsCache(ptrs,
+                                             DNS_CACHE_BATCH_SIZE,
+                                             hostnames);
+
+    for (i = 0; i < DNS_CACHE_BATCH_SIZE; i++) {
+      if ((hostname[i][0] != 0) && (!CheckHostname(n[i], hostname[i]))) {
+        fprintf(stderr, "Bad hostname for %u: '%s'.\n", n[i], hostname[i]);
+        reader->errors++;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+int main()
+{
+  pthread_t threads[NREADERS];
+  reader_t readers[NREADERS];
+  dns_cache_stats_t ipv4_stats;
+  dns_cache_stats_t ipv6_stats;
+  char hostname[MAX_LEN + 1];
+  char found[256];
+  UINT8 ip[4];
+  double start;
+  double elapsed;
+  unsigned seed;
+  unsigned n;
+  unsigned len;
+  unsigned i;
+
+  CHECK(InitDnsCache(NBUCKETS, MAX_ENTRIES, FALSE));
+
+  for (i = 0; i < NREADERS; i++) {
+    memset(&readers[i], 0, sizeof(reader_t));
+    readers[i].seed = i + 1;
+
+    CHECK(pthread_create(&threads[i], NULL, Reader, &readers[i]) == 0);
+  }
+
+  /* Writer. */
+  seed = 12345;
+  start = Now();
+
+  for (i = 0; i < NWRITES; i++) {
+    n = Random(&seed) % NADDRESSES;
+    len = MIN_LEN + (Random(&seed) % (MAX_LEN - MIN_LEN + 1));
+
+    MakeAddress(n, ip);
+    TaggedHostname(n, len, (char) ('a' + (i % 26)), hostname);
+
+    if (AddIPv4ToDnsCache(ip, hostname, (UINT16) len, 0x7fffffffffffffffLL)) {
+      strcpy(last[n], hostname);
+    }
+
+    /* Grow and shrink back the cache (the last resize shrinks it). */
+    if ((i % RESIZE_INTERVAL) == (RESIZE_INTERVAL / 2)) {
+      if (((i / RESIZE_INTERVAL) % 2) == 0) {
+        CHECK(ResizeDnsCache((2 * NBUCKETS) + 1, 2 * MAX_ENTRIES, FALSE));
+      } else {
+        CHECK(ResizeDnsCache(NBUCKETS, MAX_ENTRIES, FALSE));
+      }
+    }
+
+    MoveDnsCacheEntries(1, 0);
+  }
+
+  /* Finish the last resize while the readers still run: the previous
+   * tables are only freed once no lookup uses them.
+   */
+  while (MoveDnsCacheEntries(1, 0)) {
+    YieldProcessor();
+  }
+
+  done = 1;
+  elapsed = Now() - start;
+
+  printf("Writer: %u inserts, %.2f M/s.\n", NWRITES, NWRITES / elapsed / 1e6);
+
+  for (i = 0; i < NREADERS; i++) {
+    pthread_join(threads[i], NULL);
+
+    printf("Reader %u: %lu lookups (%lu hits), %.2f M/s.\n",
+           i,
+           readers[i].lookups,
+           readers[i].hits,
+           readers[i].lookups / elapsed / 1e6);
+
+    CHECK(readers[i].errors == 0);
+  }
+
+  /* Without the writer, the cache holds the last hostname of each
+   * address (or nothing if it was evicted).
+   */
+  for (n = 0; n < NADDRESSES; n++) {
+    MakeAddress(n, ip);
+
+    if (GetIPv4FromDnsCache(ip, found)) {
+      CHECK(strcmp(found, last[n]) == 0);
+    }
+  }
+
+  GetDnsCacheStats(&ipv4_stats, &ipv6_stats);
+
+  CHECK(ipv4_stats.entries == MAX_ENTRIES);
+  CHECK(ipv4_stats.evictions > 0);
+  CHECK(ipv4_stats.overwrites > 0);
+
+  FreeDnsCache();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,500 @@
+/* Reassembly of HTTP request headers (sys/http_flow.c): captured client
+ * streams are replayed segment by segment (split at every point, in 1-byte
+ * segments and at random points) through the same calls as the stream
+ * callout (StartHttpFlow(), ContinueHttpFlow() and FeedHttpFlow() in
+ * inspect.c), with and without keep-alive. The request headers handed to
+ * the worker thread must be the expected bytes (up to the end of the header
+ * or the size cap), whatever the segmentation, the bodies (Content-Length,
+ * chunked) must be skipped, and the flows must stay within their memory
+ * budget.
+ */
+
+#include <stdio.h>
+#include "../sys/http_flow.h"
+#include "../sys/http_scanner.h"
+#include "test.h"
+#include "test_util.h"
+
+#define MAX_FLOWS 4
+#define MAX_HEADERS 2
+#define MAX_HEADER_SIZE 1024
+
+#define MAX_PARTS 16
+#define MAX_STREAM (16 * 1024)
+#define MAX_EMITTED 16
+
+typedef struct {
+  const UINT8* data;
+  SIZE_T len;
+
+  /* Request header (expected to be handed to the worker thread). */
+  BOOL header;
+} part_t;
+
+typedef struct {
+  const char* name;
+  part_t parts[MAX_PARTS];
+  unsigned nparts;
+} capture_t;
+
+/* Request headers handed to the worker thread. */
+static UINT8 emitted[MAX_EMITTED][MAX_HEADER_SIZE];
+static SIZE_T emitted_len[MAX_EMITTED];
+static unsigned nemitted;
+
+static UINT8 stream[MAX_STREAM];
+
+static void AddPart(capture_t* capture,
+                    const void* data,
+                    SIZE_T len,
+                    BOOL header)
+{
+  capture->parts[capture->nparts].data = (const UINT8*) data;
+  capture->parts[capture->nparts].len = len;
+  capture->parts[capture->nparts].header = header;
+  capture->nparts++;
+}
+
+static void AddText(capture_t* capture, const char* text, BOOL header)
+{
+  AddPart(capture, text, strlen(text), header);
+}
+
+/* As EndHttpFlow() (the worker thread releases the packet). */
+static void EndFlow(http_flow_t* flow)
+{
+  packet_t* packet;
+
+  packet = TakeHttpFlowPacket(flow);
+
+  if (nemitted < MAX_EMITTED) {
+    memcpy(emitted[nemitted], packet->payload, packet->payloadlen);
+    emitted_len[nemitted] = packet->payloadlen;
+  }
+
+  nemitted++;
+
+  CHECK(ReleaseHttpFlowPacket(packet));
+}
+
+/* As FeedHttpFlow(). */
+static BOOL Feed(http_flow_t* flow, const UINT8* data, SIZE_T len)
+{
+  SIZE_T n;
+  BOOL complete;
+
+  while (len > 0) {
+    if (flow->state == HTTP_FLOW_DONE) {
+      return FALSE;
+    }
+
+    if ((flow->state == HTTP_FLOW_HEADER) && (!flow->packet)) {
+      if (!AttachHttpFlowPacket(flow)) {
+        flow->state = HTTP_FLOW_DONE;
+        return FALSE;
+      }
+    }
+
+    n = ConsumeHttpFlowData(flow, data, len, &complete);
+
+    if (complete) {
+      EndFlow(flow);
+    }
+
+    data += n;
+    len -= n;
+  }
+
+  return (flow->state != HTTP_FLOW_DONE);
+}
+
+/* Replay the stream in segments ending at the offsets of 'splits' (and at
+ * the end of the stream), then close the connection. Return FALSE if the
+ * flow could not be started.
+ */
+static BOOL Replay(const UINT8* data,
+                   SIZE_T len,
+                   const SIZE_T* splits,
+                   unsigned nsplits)
+{
+  http_flow_t* flow;
+  packet_t tuple;
+  SIZE_T off;
+  SIZE_T end;
+  unsigned i;
+
+  memset(&tuple, 0, sizeof(tuple));
+
+  nemitted = 0;
+
+  if ((flow = NewHttpFlow(&tuple)) == NULL) {
+    return FALSE;
+  }
+
+  off = 0;
+
+  for (i = 0; i <= nsplits; i++) {
+    end = (i < nsplits) ? splits[i] : len;
+
+    /* StartHttpFlow() and ContinueHttpFlow(): stop following the
+     * connection.
+     */
+    if (!Feed(flow, data + off, end - off)) {
+      break;
+    }
+
+    off = end;
+  }
+
+  /* Closed: the partial request header is logged. */
+  if ((flow->packet) && (flow->packet->payloadlen > 0)) {
+    EndFlow(flow);
+  }
+
+  DeleteHttpFlow(flow);
+
+  return TRUE;
+}
+
+static SIZE_T BuildStream(const capture_t* capture)
+{
+  SIZE_T len;
+  unsigned i;
+
+  len = 0;
+
+  for (i = 0; i < capture->nparts; i++) {
+    memcpy(stream + len, capture->parts[i].data, capture->parts[i].len);
+    len += capture->parts[i].len;
+  }
+
+  return len;
+}
+
+/* The request headers (the first ones up to the first header which doesn't
+ * fit, which is truncated) must have been emitted in order.
+ */
+static BOOL Matches(const capture_t* capture)
+{
+  const part_t* part;
+  unsigned n;
+  unsigned i;
+  SIZE_T len;
+
+  n = 0;
+
+  for (i = 0; i < capture->nparts; i++) {
+    part = &capture->parts[i];
+
+    if (!part->header) {
+      continue;
+    }
+
+    len = (part->len < MAX_HEADER_SIZE) ? part->len : MAX_HEADER_SIZE;
+
+    if ((n >= nemitted) ||
+        (emitted_len[n] != len) ||
+        (memcmp(emitted[n], part->data, len) != 0)) {
+      return FALSE;
+    }
+
+    n++;
+
+    /* The connection is not followed after a truncated header. */
+    if (len < part->len) {
+      break;
+    }
+  }
+
+  return (n == nemitted);
+}
+
+static void Check(const capture_t* capture, unsigned* seed)
+{
+  SIZE_T splits[MAX_STREAM];
+  SIZE_T len;
+  SIZE_T s;
+  unsigned nsplits;
+  unsigned failures;
+  unsigned i;
+
+  len = BuildStream(capture);
+
+  failures = 0;
+
+  /* In one segment and in two at every point. */
+  CHECK(Replay(stream, len, NULL, 0));
+  failures += !Matches(capture);
+
+  for (s = 1; s < len; s++) {
+    CHECK(Replay(stream, len, &s, 1));
+    failures += !Matches(capture);
+  }
+
+  /* In 1-byte segments. */
+  for (s = 1; s < len; s++) {
+    splits[s - 1] = s;
+  }
+
+  CHECK(Replay(stream, len, splits, (len > 0) ? (unsigned) len - 1 : 0));
+  failures += !Matches(capture);
+
+  /* In random segments. */
+  for (i = 0; i < 100; i++) {
+    nsplits = 0;
+
+    for (s = 1 + (Random(seed) % 64); s < len; s += 1 + (Random(seed) % 64)) {
+      splits[nsplits++] = s;
+    }
+
+    CHECK(Replay(stream, len, splits, nsplits));
+    failures += !Matches(capture);
+  }
+
+  if (failures > 0) {
+    fprintf(stderr, "%s: %u segmentations failed\n", capture->name, failures);
+    CHECK(FALSE);
+  }
+}
+
+static void CheckBudget()
+{
+  http_flow_t* flows[MAX_FLOWS];
+  packet_t tuple;
+  unsigned round;
+  unsigned i;
+
+  memset(&tuple, 0, sizeof(tuple));
+
+  for (round = 0; round < 2; round++) {
+    for (i = 0; i < MAX_FLOWS; i++) {
+      CHECK((flows[i] = NewHttpFlow(&tuple)) != NULL);
+    }
+
+    CHECK(NewHttpFlow(&tuple) == NULL);
+
+    /* Only MAX_HEADERS headers are reassembled at the same time. */
+    for (i = 0; i < MAX_FLOWS; i++) {
+      CHECK(AttachHttpFlowPacket(flows[i]) == (i < MAX_HEADERS));
+    }
+
+    /* Everything goes back to the pool. */
+    for (i = 0; i < MAX_FLOWS; i++) {
+      DeleteHttpFlow(flows[i]);
+    }
+  }
+}
+
+/* Connections followed until they are closed: every request header is
+ * logged, the bodies (Content-Length and chunked, which contain text which
+ * looks like requests) are skipped.
+ */
+static void CheckKeepAlive(unsigned* seed)
+{
+  capture_t capture;
+
+  /* Requests without body, one after the other. */
+  capture.name = "pipelined";
+  capture.nparts = 0;
+  AddText(&capture, "GET /1 HTTP/1.1\r\nHost: a.example\r\n\r\n", TRUE);
+  AddText(&capture, "GET /2 HTTP/1.1\r\nHost: a.example\r\n\r\n", TRUE);
+  AddText(&capture, "\r\n", FALSE);
+  AddText(&capture, "HEAD /3 HTTP/1.1\nHost: a.example\n\n", TRUE);
+  Check(&capture, seed);
+
+  /* Content-Length. */
+  capture.name = "content-length";
+  capture.nparts = 0;
+  AddText(&capture,
+          "POST /form HTTP/1.1\r\nHost: b.example\r\n"
+          "Content-Length: 35\r\n\r\n",
+          TRUE);
+  AddText(&capture, "GET /not/a/request HTTP/1.1\r\n\r\n\r\n\r\n", FALSE);
+  AddText(&capture,
+          "POST /empty HTTP/1.1\r\nContent-Length: 0\r\n\r\n",
+          TRUE);
+  AddText(&capture, "GET /after HTTP/1.1\r\nHost: b.example\r\n\r\n", TRUE);
+  AddText(&capture,
+          "PUT /last HTTP/1.1\r\ncontent-length: 9\r\n\r\n",
+          TRUE);
+  /* Closed in the middle of the body. */
+  AddText(&capture, "\r\n\r\n\r", FALSE);
+  Check(&capture, seed);
+
+  /* Chunked body: extensions, upper case digits, LF line ends, trailer. */
+  capture.name = "chunked";
+  capture.nparts = 0;
+  AddText(&capture,
+          "POST /upload HTTP/1.1\r\nHost: c.example\r\n"
+          "Transfer-Encoding: gzip, Chunked\r\n\r\n",
+          TRUE);
+  AddText(&capture,
+          "17;name=value\r\nGET /x HTTP/1.1\r\n\r\n\r\n:)\r\n"
+          "A\nGET / \r\n\r\n\n"
+          "00\r\n"
+          "X-Trailer: GET / HTTP/1.1\r\n\r\n",
+          FALSE);
+  AddText(&capture,
+          "POST /next HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+          TRUE);
+  AddText(&capture, "3\r\nabc\r\n0\r\n\r\n", FALSE);
+  AddText(&capture, "GET /done HTTP/1.1\r\nHost: c.example\r\n\r\n", TRUE);
+  Check(&capture, seed);
+
+  /* Not HTTP anymore after an upgrade or a CONNECT. */
+  capture.name = "upgrade";
+  capture.nparts = 0;
+  AddText(&capture,
+          "GET /chat HTTP/1.1\r\nHost: d.example\r\nUpgrade: websocket\r\n"
+          "Connection: Upgrade\r\n\r\n",
+          TRUE);
+  AddText(&capture, "GET /frame HTTP/1.1\r\n\r\n", FALSE);
+  Check(&capture, seed);
+
+  capture.name = "connect";
+  capture.nparts = 0;
+  AddText(&capture,
+          "CONNECT d.example:443 HTTP/1.1\r\nHost: d.example:443\r\n\r\n",
+          TRUE);
+  AddText(&capture, "GET /tunnel HTTP/1.1\r\n\r\n", FALSE);
+  Check(&capture, seed);
+
+  /* Body whose end can't be found: not followed anymore. */
+  capture.name = "bad length";
+  capture.nparts = 0;
+  AddText(&capture,
+          "POST / HTTP/1.1\r\nContent-Length: 12a\r\n\r\n",
+          TRUE);
+  AddText(&capture, "GET / HTTP/1.1\r\n\r\n", FALSE);
+  Check(&capture, seed);
+
+  capture.name = "gzip";
+  capture.nparts = 0;
+  AddText(&capture,
+          "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n"
+          "Content-Length: 2\r\n\r\n",
+          TRUE);
+  AddText(&capture, "..GET / HTTP/1.1\r\n\r\n", FALSE);
+  Check(&capture, seed);
+
+  capture.name = "bad chunk";
+  capture.nparts = 0;
+  AddText(&capture,
+          "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+          TRUE);
+  AddText(&capture, "x\r\nGET / HTTP/1.1\r\n\r\n", FALSE);
+  Check(&capture, seed);
+
+  capture.name = "long chunk size";
+  capture.nparts = 0;
+  AddText(&capture,
+          "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+          TRUE);
+  AddText(&capture, "00000000000000001\r\nGET / HTTP/1.1\r\n\r\n", FALSE);
+  Check(&capture, seed);
+
+  /* Closed in the middle of the second request header. */
+  capture.name = "keep-alive partial";
+  capture.nparts = 0;
+  AddText(&capture,
+          "POST /a HTTP/1.1\r\nContent-Length: 3\r\n\r\n",
+          TRUE);
+  AddText(&capture, "abc", FALSE);
+  AddText(&capture, "GET /b HTTP/1.1\r\nHost: e.exa", TRUE);
+  Check(&capture, seed);
+}
+
+int main()
+{
+  static UINT8 cookie[3000];
+  static UINT8 big[MAX_HEADER_SIZE + 500];
+  capture_t capture;
+  SIZE_T len;
+  unsigned seed;
+
+  seed = 35;
+
+  CHECK(InitHttpFlows(MAX_FLOWS,
+                      MAX_HEADERS,
+                      MAX_HEADER_SIZE,
+                      FALSE,
+                      FALSE));
+
+  CHECK(!HttpFlowsKeepAlive());
+
+  /* Small request (only the header is kept). */
+  capture.name = "small";
+  capture.nparts = 0;
+  AddText(&capture,
+          "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n\r\n",
+          TRUE);
+  AddText(&capture, "GET /second HTTP/1.1\r\nHost: a\r\n\r\n", FALSE);
+  Check(&capture, &seed);
+
+  /* Empty lines before the request line, LF line ends. */
+  capture.name = "empty lines";
+  capture.nparts = 0;
+  AddText(&capture, "\r\n\n\r\n", FALSE);
+  AddText(&capture, "GET / HTTP/1.0\nHost: lf.example\n\n", TRUE);
+  AddText(&capture, "trailing data", FALSE);
+  Check(&capture, &seed);
+
+  /* Big cookie: the header spans several segments (but fits). */
+  memset(cookie, 'c', sizeof(cookie));
+  memcpy(cookie, "Cookie: ", 8);
+  memcpy(cookie + sizeof(cookie) - 2, "\r\n", 2);
+
+  capture.name = "cookie";
+  capture.nparts = 0;
+  len = (SIZE_T) sprintf((char*) big,
+                         "GET /account HTTP/1.1\r\nHost: shop.example\r\n%.*s"
+                         "\r\n\r\n",
+                         (int) (MAX_HEADER_SIZE - 100),
+                         (const char*) cookie);
+  AddPart(&capture, big, len, TRUE);
+  AddText(&capture, "{\"body\": 1}", FALSE);
+  Check(&capture, &seed);
+
+  /* Header bigger than the cap: truncated. */
+  capture.name = "too big";
+  capture.nparts = 0;
+  AddText(&capture, "GET /big HTTP/1.1\r\n", FALSE);
+  AddPart(&capture, cookie, sizeof(cookie), FALSE);
+  AddText(&capture, "\r\n", FALSE);
+  len = BuildStream(&capture);
+  memcpy(big, stream, MAX_HEADER_SIZE + 1);
+  capture.nparts = 0;
+  AddPart(&capture, big, MAX_HEADER_SIZE + 1, TRUE);
+  AddPart(&capture, cookie, len - MAX_HEADER_SIZE - 1, FALSE);
+  Check(&capture, &seed);
+
+  /* Closed before the end of the header: the partial header is logged. */
+  capture.name = "partial";
+  capture.nparts = 0;
+  AddText(&capture, "POST /upload HTTP/1.1\r\nHost: up.example\r\nCont", TRUE);
+  Check(&capture, &seed);
+
+  CheckBudget();
+
+  FreeHttpFlows();
+
+  CHECK(InitHttpFlows(MAX_FLOWS,
+                      MAX_HEADERS,
+                      MAX_HEADER_SIZE,
+                      TRUE,
+                      FALSE));
+
+  CHECK(HttpFlowsKeepAlive());
+
+  CheckKeepAlive(&seed);
+
+  FreeHttpFlows();
+
+  /* Connections not followed. */
+  CHECK(InitHttpFlows(0, MAX_HEADERS, MAX_HEADER_SIZE, TRUE, FALSE));
+  CHECK(!HttpFlowsKeepAlive());
+  CHECK(NewHttpFlow((const packet_t*) stream) == NULL);
+  FreeHttpFlows();
+
+  return TEST_RESULT();
+}
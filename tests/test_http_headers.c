@@ -0,0 +1,639 @@
+/* HTTP request parser (sys/http_scanner.c): ParseHttpRequest() must return
+ * the same method, path and header fields (same pointers and lengths) as a
+ * reference parser which walks the request byte by byte, on a few requests
+ * written by hand and on a corpus of generated ones (names in any case,
+ * repeated headers, spaces around the values, LF and CRLF line ends,
+ * headers after the end of the header, more than 32 lines) truncated at
+ * every length. The records built by BuildHttpRecord() (out of place and
+ * over the request, as the classify callouts do) must give the same fields
+ * through ParseHttpRecord(), exactly when the request line can be parsed and
+ * the end of the header is there, and must only be built if they fit (the
+ * request is left as is otherwise).
+ */
+
+#include <stdio.h>
+#include <strings.h>
+#include "../sys/http_scanner.h"
+#include "test.h"
+#include "test_util.h"
+
+#define NREQUESTS 3000
+#define MAX_REQUEST 4096
+#define MAX_HEADERS 48
+
+/* Table of the record: offset and length (16 bits each) of the method, the
+ * path and the known headers (offset 0xffff: not present).
+ */
+#define RECORD_FIELDS (2 + HTTP_NUMBER_HEADERS)
+#define RECORD_TABLE_LEN (RECORD_FIELDS * 2 * sizeof(UINT16))
+#define NO_FIELD 0xffff
+
+static const char* requests[] = {
+  "GET / HTTP/1.1\r\nhost: lower.example\r\n\r\n",
+  "GET / HTTP/1.1\r\nHOST:upper.example\r\nHost: second.example\r\n\r\n",
+  "GET / HTTP/1.1\r\nHost : space.example\r\nHost:\t tab.example \r\n\r\n",
+  "GET / HTTP/1.1\r\nUser-Agent:   agent  \t\r\nReferer:\r\n\r\n"
+  "Content-Type: after/the-end\r\n",
+  "POST /a HTTP/1.1\nContent-Length: 12\nTransfer-Encoding: chunked\n\n",
+  "GET /\nHost: no-version.example\n\n",
+  "GET / HTTP/1.1\r\nHost: unterminated.example",
+  "GET / HTTP/1.1\r\n: no name\r\nUpgrade: websocket\r\n\r\n"
+};
+
+static const char* names[] = {
+  "Host",
+  "host",
+  "HoSt",
+  "Host ",
+  "User-Agent",
+  "user-agent",
+  "Referer",
+  "Content-Type",
+  "CONTENT-LENGTH",
+  "Upgrade",
+  "Transfer-Encoding",
+  "Accept",
+  "Hosts",
+  "X-Forwarded-For",
+  ""
+};
+
+static const char* values[] = {
+  "www.example.com",
+  "www.example.com:8080 trailing",
+  "  spaces before and after  ",
+  "",
+  " ",
+  "a:b:c",
+  "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0",
+  "12345"
+};
+
+static SIZE_T MakeRequest(UINT8* buf, unsigned* seed)
+{
+  const char* eol;
+  SIZE_T len;
+  unsigned nheaders;
+  unsigned i;
+
+  eol = ((Random(seed) % 4) == 0) ? "\n" : "\r\n";
+
+  len = Append(buf, 0, MAX_REQUEST, ((Random(seed) % 8) == 0) ? "\r\n" : "");
+  len = Append(buf,
+               len,
+               MAX_REQUEST,
+               ((Random(seed) % 2) == 0) ? "GET" : "POST");
+  len = Append(buf, len, MAX_REQUEST, ((Random(seed) % 8) == 0) ? " \t" : " ");
+  len = Append(buf, len, MAX_REQUEST, "/path/of/the/resource?query=a:b");
+  len = Append(buf, len, MAX_REQUEST, " HTTP/1.1");
+  len = Append(buf, len, MAX_REQUEST, eol);
+
+  nheaders = Random(seed) % MAX_HEADERS;
+
+  for (i = 0; i < nheaders; i++) {
+    len = Append(buf,
+                 len,
+                 MAX_REQUEST,
+                 names[Random(seed) % (sizeof(names) / sizeof(names[0]))]);
+
+    if ((Random(seed) % 16) != 0) {
+      len = Append(buf, len, MAX_REQUEST, ":");
+    }
+
+    len = Append(buf,
+                 len,
+                 MAX_REQUEST,
+                 values[Random(seed) % (sizeof(values) / sizeof(values[0]))]);
+
+    len = Append(buf, len, MAX_REQUEST, eol);
+
+    /* End of the header, followed by more lines. */
+    if ((Random(seed) % 64) == 0) {
+      len = Append(buf, len, MAX_REQUEST, eol);
+    }
+  }
+
+  len = Append(buf, len, MAX_REQUEST, eol);
+
+  return len;
+}
+
+static http_header_t FindHeader(const UINT8* name, SIZE_T len)
+{
+  unsigned i;
+
+  for (i = 0; i < HTTP_NUMBER_HEADERS; i++) {
+    if ((strlen(GetHttpHeaderName((http_header_t) i)) == len) &&
+        (strncasecmp((const char*) name,
+                     GetHttpHeaderName((http_header_t) i),
+                     len) == 0)) {
+      return (http_header_t) i;
+    }
+  }
+
+  return HTTP_NUMBER_HEADERS;
+}
+
+/* The request line ends at the first line feed after the byte which follows
+ * the path. The header lines end with a line feed (an unterminated last
+ * line is ignored) and the header ends with an empty line. The name is
+ * before the first colon, the value is trimmed (the Host ends at the first
+ * space or control character).
+ */
+static BOOL ParseRequest(const UINT8* data,
+                         SIZE_T len,
+                         const UINT8** method,
+                         SIZE_T* methodlen,
+                         const UINT8** path,
+                         SIZE_T* pathlen,
+                         http_field_t* fields)
+{
+  http_header_t header;
+  SIZE_T pos;
+  SIZE_T line;
+  SIZE_T eol;
+  SIZE_T colon;
+  SIZE_T start;
+  SIZE_T end;
+  unsigned i;
+
+  for (i = 0; i < HTTP_NUMBER_HEADERS; i++) {
+    fields[i].value = NULL;
+    fields[i].len = 0;
+  }
+
+  for (pos = 0; (pos < len) && (data[pos] <= ' '); pos++) {
+    if ((data[pos] != '\r') && (data[pos] != '\n')) {
+      return FALSE;
+    }
+  }
+
+  *method = data + pos;
+
+  while ((pos < len) && (data[pos] > ' ')) {
+    pos++;
+  }
+
+  if (pos == len) {
+    return FALSE;
+  }
+
+  *methodlen = data + pos - *method;
+
+  pos++;
+
+  while ((pos < len) && ((data[pos] == ' ') || (data[pos] == '\t'))) {
+    pos++;
+  }
+
+  if (pos == len) {
+    return FALSE;
+  }
+
+  *path = data + pos;
+
+  pos++;
+
+  while ((pos < len) && (data[pos] > ' ')) {
+    pos++;
+  }
+
+  if (pos == len) {
+    return FALSE;
+  }
+
+  *pathlen = data + pos - *path;
+
+  if (++pos == len) {
+    return FALSE;
+  }
+
+  while ((pos < len) && (data[pos] != '\n')) {
+    pos++;
+  }
+
+  while (pos < len) {
+    line = pos + 1;
+
+    if ((line == len) || (data[line] == '\r') || (data[line] == '\n')) {
+      break;
+    }
+
+    eol = line;
+
+    while ((eol < len) && (data[eol] != '\n')) {
+      eol++;
+    }
+
+    if (eol == len) {
+      break;
+    }
+
+    colon = line;
+
+    while ((colon < eol) && (data[colon] != ':')) {
+      colon++;
+    }
+
+    if ((colon < eol) &&
+        (colon > line) &&
+        ((header = FindHeader(data + line, colon - line)) !=
+         HTTP_NUMBER_HEADERS) &&
+        (!fields[header].value)) {
+      start = colon + 1;
+
+      while ((start < eol) &&
+             ((data[start] == ' ') || (data[start] == '\t'))) {
+        start++;
+      }
+
+      if (header == HTTP_HEADER_HOST) {
+        end = start;
+
+        while ((end < eol) && (data[end] > ' ')) {
+          end++;
+        }
+      } else {
+        end = eol;
+
+        while ((end > start) && (data[end - 1] <= ' ')) {
+          end--;
+        }
+      }
+
+      if (end > start) {
+        fields[header].value = data + start;
+        fields[header].len = end - start;
+      }
+    }
+
+    pos = eol;
+  }
+
+  return TRUE;
+}
+
+static BOOL Same(const UINT8* data, SIZE_T len)
+{
+  http_field_t expected[HTTP_NUMBER_HEADERS];
+  http_field_t fields[HTTP_NUMBER_HEADERS];
+  const UINT8* method[2];
+  const UINT8* path[2];
+  SIZE_T methodlen[2];
+  SIZE_T pathlen[2];
+  BOOL parsed;
+  unsigned i;
+
+  parsed = ParseRequest(data,
+                        len,
+                        &method[0],
+                        &methodlen[0],
+                        &path[0],
+                        &pathlen[0],
+                        expected);
+
+  if (parsed != ParseHttpRequest(data,
+                                 len,
+                                 &method[1],
+                                 &methodlen[1],
+                                 &path[1],
+                                 &pathlen[1],
+                                 fields)) {
+    return FALSE;
+  }
+
+  if (!parsed) {
+    return TRUE;
+  }
+
+  if ((method[0] != method[1]) ||
+      (methodlen[0] != methodlen[1]) ||
+      (path[0] != path[1]) ||
+      (pathlen[0] != pathlen[1])) {
+    return FALSE;
+  }
+
+  for (i = 0; i < HTTP_NUMBER_HEADERS; i++) {
+    if ((fields[i].value != expected[i].value) ||
+        (fields[i].len != expected[i].len)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static BOOL SameField(const UINT8* value1,
+                      SIZE_T len1,
+                      const UINT8* value2,
+                      SIZE_T len2)
+{
+  if ((!value1) || (!value2)) {
+    return ((!value1) && (!value2));
+  }
+
+  return ((len1 == len2) && (memcmp(value1, value2, len1) == 0));
+}
+
+/* Fields of the record against the fields of the request. */
+static BOOL SameRecord(const UINT8* record,
+                       SIZE_T recordlen,
+                       const UINT8* method,
+                       SIZE_T methodlen,
+                       const UINT8* path,
+                       SIZE_T pathlen,
+                       const http_field_t* fields)
+{
+  http_field_t record_fields[HTTP_NUMBER_HEADERS];
+  const UINT8* record_method;
+  const UINT8* record_path;
+  SIZE_T record_methodlen;
+  SIZE_T record_pathlen;
+  unsigned i;
+
+  /* The absent fields must be set too. */
+  memset(record_fields, 0xa5, sizeof(record_fields));
+
+  if ((!ParseHttpRecord(record,
+                        recordlen,
+                        &record_method,
+                        &record_methodlen,
+                        &record_path,
+                        &record_pathlen,
+                        record_fields)) ||
+      (!SameField(record_method, record_methodlen, method, methodlen)) ||
+      (!SameField(record_path, record_pathlen, path, pathlen))) {
+    return FALSE;
+  }
+
+  for (i = 0; i < HTTP_NUMBER_HEADERS; i++) {
+    if (!SameField(record_fields[i].value,
+                   record_fields[i].len,
+                   fields[i].value,
+                   fields[i].len)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Record of the request, built out of place and over the request. */
+static BOOL CheckRecord(const UINT8* data, SIZE_T len)
+{
+  http_field_t fields[HTTP_NUMBER_HEADERS];
+  const UINT8* method;
+  const UINT8* path;
+  SIZE_T methodlen;
+  SIZE_T pathlen;
+  SIZE_T expected;
+  SIZE_T size;
+  UINT8* record;
+  UINT8* copy;
+  unsigned i;
+  BOOL ok;
+
+  /* Only whole request headers. */
+  expected = 0;
+
+  if ((FindEndOfHttpHeader(data, len, 0) > 0) &&
+      (ParseHttpRequest(data,
+                        len,
+                        &method,
+                        &methodlen,
+                        &path,
+                        &pathlen,
+                        fields))) {
+    expected = methodlen + pathlen + RECORD_TABLE_LEN;
+
+    for (i = 0; i < HTTP_NUMBER_HEADERS; i++) {
+      expected += fields[i].len;
+    }
+  }
+
+  /* Exact sizes. */
+  size = (expected > len) ? expected : len;
+
+  record = malloc(size + (size == 0));
+  copy = malloc(size + (size == 0));
+
+  if ((!record) || (!copy)) {
+    free(record);
+    free(copy);
+    return FALSE;
+  }
+
+  /* Out of place, with room to spare. */
+  ok = (BuildHttpRecord(data, len, record, size) == expected);
+
+  if ((expected > 0) && (ok)) {
+    ok = (SameRecord(record,
+                     expected,
+                     method,
+                     methodlen,
+                     path,
+                     pathlen,
+                     fields)) &&
+         (BuildHttpRecord(data, len, record, expected - 1) == 0);
+
+    /* Over the request, without room for the record, then with room
+     * (the same bytes as out of place).
+     */
+    memcpy(copy, data, len);
+
+    ok &= ((BuildHttpRecord(copy, len, copy, expected - 1) == 0) &&
+           (memcmp(copy, data, len) == 0) &&
+           (BuildHttpRecord(copy, len, copy, size) == expected) &&
+           (memcmp(copy, record, expected) == 0));
+  }
+
+  free(record);
+  free(copy);
+
+  return ok;
+}
+
+static void Check(const UINT8* request, SIZE_T len)
+{
+  UINT8* data;
+
+  /* Exact size (data is not NULL for empty requests). */
+  if ((data = malloc(len + (len == 0))) == NULL) {
+    CHECK(data != NULL);
+    return;
+  }
+
+  memcpy(data, request, len);
+
+  if (!Same(data, len)) {
+    fprintf(stderr, "Mismatch: %.*s\n", (int) len, (const char*) data);
+    CHECK(FALSE);
+  }
+
+  if (!CheckRecord(data, len)) {
+    fprintf(stderr, "Record mismatch: %.*s\n", (int) len, (const char*) data);
+    CHECK(FALSE);
+  }
+
+  free(data);
+}
+
+/* Records whose fields are not in the record (or without method or path)
+ * must be rejected.
+ */
+static void CheckBadRecords()
+{
+  http_field_t fields[HTTP_NUMBER_HEADERS];
+  UINT8 record[MAX_REQUEST];
+  const UINT8* method;
+  const UINT8* path;
+  SIZE_T methodlen;
+  SIZE_T pathlen;
+  SIZE_T recordlen;
+  SIZE_T datalen;
+  UINT16 entry[2];
+  UINT16 len;
+  UINT8* table;
+  unsigned i;
+
+  recordlen = BuildHttpRecord((const UINT8*) requests[3],
+                              strlen(requests[3]),
+                              record,
+                              sizeof(record));
+
+  CHECK(recordlen > RECORD_TABLE_LEN);
+
+  datalen = recordlen - RECORD_TABLE_LEN;
+  table = record + datalen;
+
+  for (i = 0; i < RECORD_FIELDS; i++) {
+    memcpy(entry, table + (i * sizeof(entry)), sizeof(entry));
+
+    if (entry[0] == NO_FIELD) {
+      continue;
+    }
+
+    /* Up to the end of the bytes, then one more. */
+    len = (UINT16) (datalen - entry[0]);
+    memcpy(table + (i * sizeof(entry)) + sizeof(UINT16), &len, sizeof(len));
+
+    CHECK(ParseHttpRecord(record,
+                          recordlen,
+                          &method,
+                          &methodlen,
+                          &path,
+                          &pathlen,
+                          fields));
+
+    len++;
+    memcpy(table + (i * sizeof(entry)) + sizeof(UINT16), &len, sizeof(len));
+
+    CHECK(!ParseHttpRecord(record,
+                           recordlen,
+                           &method,
+                           &methodlen,
+                           &path,
+                           &pathlen,
+                           fields));
+
+    /* Method and path. */
+    if (i < 2) {
+      len = NO_FIELD;
+      memcpy(table + (i * sizeof(entry)), &len, sizeof(len));
+
+      CHECK(!ParseHttpRecord(record,
+                             recordlen,
+                             &method,
+                             &methodlen,
+                             &path,
+                             &pathlen,
+                             fields));
+    }
+
+    memcpy(table + (i * sizeof(entry)), entry, sizeof(entry));
+  }
+
+  CHECK(!ParseHttpRecord(record,
+                         RECORD_TABLE_LEN - 1,
+                         &method,
+                         &methodlen,
+                         &path,
+                         &pathlen,
+                         fields));
+}
+
+static BOOL HasField(const char* request,
+                     http_header_t header,
+                     const char* value)
+{
+  http_field_t fields[HTTP_NUMBER_HEADERS];
+  const UINT8* method;
+  const UINT8* path;
+  SIZE_T methodlen;
+  SIZE_T pathlen;
+
+  if (!ParseHttpRequest((const UINT8*) request,
+                        strlen(request),
+                        &method,
+                        &methodlen,
+                        &path,
+                        &pathlen,
+                        fields)) {
+    return FALSE;
+  }
+
+  if (!value) {
+    return (fields[header].value == NULL);
+  }
+
+  return ((fields[header].len == strlen(value)) &&
+          (memcmp(fields[header].value, value, fields[header].len) == 0));
+}
+
+int main()
+{
+  UINT8 request[MAX_REQUEST];
+  SIZE_T len;
+  SIZE_T n;
+  unsigned seed;
+  unsigned i;
+
+  /* Hand-written requests (and what the parser must find). */
+  for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+    len = strlen(requests[i]);
+
+    for (n = 0; n <= len; n++) {
+      Check((const UINT8*) requests[i], n);
+    }
+  }
+
+  CHECK(HasField(requests[0], HTTP_HEADER_HOST, "lower.example"));
+  CHECK(HasField(requests[1], HTTP_HEADER_HOST, "upper.example"));
+  CHECK(HasField(requests[2], HTTP_HEADER_HOST, "tab.example"));
+  CHECK(HasField(requests[3], HTTP_HEADER_USER_AGENT, "agent"));
+  CHECK(HasField(requests[3], HTTP_HEADER_REFERER, NULL));
+  CHECK(HasField(requests[3], HTTP_HEADER_CONTENT_TYPE, NULL));
+  CHECK(HasField(requests[4], HTTP_HEADER_TRANSFER_ENCODING, "chunked"));
+  CHECK(HasField(requests[7], HTTP_HEADER_UPGRADE, "websocket"));
+
+  CheckBadRecords();
+
+  /* Generated requests. */
+  seed = 34;
+
+  for (i = 0; i < NREQUESTS; i++) {
+    len = MakeRequest(request, &seed);
+
+    /* Every truncation of the first requests, a few of the others. */
+    if (i < 100) {
+      for (n = 0; n <= len; n++) {
+        Check(request, n);
+      }
+    } else {
+      Check(request, len);
+      Check(request, Random(&seed) % (len + 1));
+    }
+  }
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,257 @@
+/* HTTP scanner (sys/http_scanner.c): FindHttpDelimiter() and
+ * IndexHttpLines(), with their SSE2 paths on x64, must return exactly what
+ * byte loops return, on a corpus of generated requests (upper and lower
+ * case names, colons in the values, LF and CRLF line ends, control and
+ * 8-bit bytes, more than 32 lines) truncated at every length, from every
+ * offset (FindHttpDelimiter) or from a few (IndexHttpLines). Each buffer has
+ * the exact length of the data, so that the sanitizer catches reads past
+ * the end.
+ */
+
+#include <stdio.h>
+#include "../sys/http_scanner.h"
+#include "test.h"
+#include "test_util.h"
+
+#define NREQUESTS 3000
+#define MAX_REQUEST 4096
+#define MAX_LINES 40
+
+static const char* request_lines[] = {
+  "GET / HTTP/1.1",
+  "POST /submit?a=b:c HTTP/1.0",
+  "HEAD\t/index.html HTTP/1.1",
+  "\r\nGET /after/empty/lines HTTP/1.1",
+  "OPTIONS * HTTP/1.1",
+  "GET /a/rather/long/path/which/spans/several/sse2/blocks/of/the/request"
+  "?with=a&query=string HTTP/1.1"
+};
+
+static const char* names[] = {
+  "Host",
+  "host",
+  "HOST",
+  "User-Agent",
+  "Referer",
+  "Content-Type",
+  "Content-Length",
+  "Upgrade",
+  "Transfer-Encoding",
+  "Accept",
+  "X-A-Header-Name-Which-Is-Longer-Than-Sixteen-Bytes",
+  ""
+};
+
+static const char* values[] = {
+  "www.example.com",
+  "www.example.com:8080",
+  "  spaces before and after  ",
+  "",
+  "a:b:c",
+  "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0",
+  "text/html; charset=utf-8",
+  "12345"
+};
+
+static SIZE_T MakeRequest(UINT8* buf, unsigned* seed)
+{
+  const char* eol;
+  SIZE_T len;
+  unsigned nheaders;
+  unsigned i;
+  unsigned j;
+
+  eol = ((Random(seed) % 4) == 0) ? "\n" : "\r\n";
+
+  len = Append(buf,
+               0,
+               MAX_REQUEST,
+               request_lines[Random(seed) %
+                             (sizeof(request_lines) /
+                              sizeof(request_lines[0]))]);
+
+  len = Append(buf, len, MAX_REQUEST, eol);
+
+  nheaders = Random(seed) % (MAX_LINES + 10);
+
+  for (i = 0; i < nheaders; i++) {
+    switch (Random(seed) % 16) {
+      case 0:
+        /* No colon. */
+        len = Append(buf, len, MAX_REQUEST, "no colon on this line");
+        break;
+      case 1:
+        /* Random bytes (control characters, 8-bit). */
+        for (j = Random(seed) % 40; (j > 0) && (len < MAX_REQUEST); j--) {
+          buf[len++] = (UINT8) Random(seed);
+        }
+
+        break;
+      default:
+        len = Append(buf,
+                     len,
+                     MAX_REQUEST,
+                     names[Random(seed) % (sizeof(names) / sizeof(names[0]))]);
+
+        len = Append(buf,
+                     len,
+                     MAX_REQUEST,
+                     ((Random(seed) % 4) == 0) ? " : " : ": ");
+
+        len = Append(buf,
+                     len,
+                     MAX_REQUEST,
+                     values[Random(seed) %
+                            (sizeof(values) / sizeof(values[0]))]);
+    }
+
+    len = Append(buf, len, MAX_REQUEST, ((Random(seed) % 8) == 0) ? "\n" : eol);
+  }
+
+  /* Mostly complete headers, sometimes followed by a body. */
+  if ((Random(seed) % 8) != 0) {
+    len = Append(buf, len, MAX_REQUEST, eol);
+
+    if ((Random(seed) % 4) == 0) {
+      len = Append(buf,
+                   len,
+                   MAX_REQUEST,
+                   "body: with a colon\r\nand\nline feeds\r\n\r\n");
+    }
+  }
+
+  return len;
+}
+
+static const UINT8* FindDelimiter(const UINT8* ptr, const UINT8* end)
+{
+  while ((ptr < end) && (*ptr > ' ')) {
+    ptr++;
+  }
+
+  return ptr;
+}
+
+static unsigned IndexLines(const UINT8* data,
+                           SIZE_T len,
+                           SIZE_T off,
+                           http_line_t* lines,
+                           unsigned max)
+{
+  unsigned nlines;
+  SIZE_T pos;
+
+  nlines = 0;
+
+  for (pos = off; pos < len; pos++) {
+    if (data[pos] == '\n') {
+      if (nlines == max) {
+        break;
+      }
+
+      lines[nlines].off = (UINT32) (pos + 1);
+      lines[nlines].colon = HTTP_NO_COLON;
+      nlines++;
+
+      if ((pos + 1 < len) &&
+          ((data[pos + 1] == '\r') || (data[pos + 1] == '\n'))) {
+        break;
+      }
+    } else if ((data[pos] == ':') &&
+               (nlines > 0) &&
+               (lines[nlines - 1].colon == HTTP_NO_COLON)) {
+      lines[nlines - 1].colon = (UINT32) pos;
+    }
+  }
+
+  return nlines;
+}
+
+static BOOL SameLines(const UINT8* data, SIZE_T len, SIZE_T off, unsigned max)
+{
+  http_line_t expected[MAX_LINES + 1];
+  http_line_t lines[MAX_LINES + 1];
+  unsigned nexpected;
+  unsigned nlines;
+  unsigned i;
+
+  nexpected = IndexLines(data, len, off, expected, max);
+  nlines = IndexHttpLines(data, len, off, lines, max);
+
+  if (nlines != nexpected) {
+    return FALSE;
+  }
+
+  for (i = 0; i < nlines; i++) {
+    if ((lines[i].off != expected[i].off) ||
+        (lines[i].colon != expected[i].colon)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static void Check(const UINT8* request, SIZE_T len, unsigned* seed)
+{
+  static const unsigned maxs[] = {1, 2, 3, 8, 32, MAX_LINES + 1};
+  UINT8* data;
+  SIZE_T off;
+  unsigned m;
+
+  /* Exact size (data is not NULL for empty requests). */
+  if ((data = malloc(len + (len == 0))) == NULL) {
+    CHECK(data != NULL);
+    return;
+  }
+
+  memcpy(data, request, len);
+
+  for (off = 0; off <= len; off++) {
+    if (FindHttpDelimiter(data + off, data + len) !=
+        FindDelimiter(data + off, data + len)) {
+      fprintf(stderr, "FindHttpDelimiter(%zu, %zu)\n", off, len);
+      CHECK(FALSE);
+    }
+  }
+
+  for (m = 0; m < sizeof(maxs) / sizeof(maxs[0]); m++) {
+    /* From the beginning, the request line and a random offset. */
+    CHECK(SameLines(data, len, 0, maxs[m]));
+    CHECK(SameLines(data,
+                    len,
+                    FindDelimiter(data, data + len) - data,
+                    maxs[m]));
+    CHECK(SameLines(data, len, Random(seed) % (len + 1), maxs[m]));
+  }
+
+  free(data);
+}
+
+int main()
+{
+  UINT8 request[MAX_REQUEST];
+  SIZE_T len;
+  SIZE_T n;
+  unsigned seed;
+  unsigned i;
+
+  seed = 33;
+
+  for (i = 0; i < NREQUESTS; i++) {
+    len = MakeRequest(request, &seed);
+
+    /* Every truncation of the first requests, a few of the others. */
+    if (i < 50) {
+      for (n = 0; n <= len; n++) {
+        Check(request, n, &seed);
+      }
+    } else {
+      Check(request, len, &seed);
+      Check(request, Random(&seed) % (len + 1), &seed);
+      Check(request, Random(&seed) % (len + 1), &seed);
+    }
+  }
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,205 @@
+/* MD5 (sys/md5.c) and JA3 fingerprints (GetTlsFingerprint() in
+ * sys/tls_parser.c):
+ * - the test suite of RFC 1321 (appendix A.5) and a million 'a', hashed in
+ *   one piece, split at every point and in random pieces, and every length
+ *   from 0 to 200 bytes;
+ * - the fingerprints of a ClientHello of OpenSSL and of one with GREASE
+ *   values must be the hashes computed by an independent JA3
+ *   implementation in Python (which walks the ClientHello with slices and
+ *   hashes the string with hashlib), and the MD5 of the JA3 strings;
+ * - truncated ClientHellos have no fingerprint.
+ */
+
+#include <stdio.h>
+#include "../sys/tls_parser.h"
+#include "test.h"
+#include "tls_hello.h"
+#include "test_util.h"
+
+typedef struct {
+  const char* data;
+  const char* digest;
+} md5_vector_t;
+
+typedef struct {
+  const UINT8* hello;
+  SIZE_T len;
+  const char* ja3;
+  const char* digest;
+} ja3_vector_t;
+
+static const md5_vector_t md5_vectors[] = {
+  {"", "d41d8cd98f00b204e9800998ecf8427e"},
+  {"a", "0cc175b9c0f1b6a831c399e269772661"},
+  {"abc", "900150983cd24fb0d6963f7d28e17f72"},
+  {"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+  {"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+  {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+   "d174ab98d277d9f5a5611c2c9f419d9f"},
+  {"1234567890123456789012345678901234567890"
+   "1234567890123456789012345678901234567890",
+   "57edf4a22be3c955ac49da2e2107b67a"}
+};
+
+/* Computed with Python 3 (hashlib) from the bytes of tls_hello.h. */
+static const ja3_vector_t ja3_vectors[] = {
+  {openssl_hello,
+   sizeof(openssl_hello),
+   "771,4866-4867-4865-49196-49200-49195-49199-52393-52392-49188-49192-"
+   "49187-49191-159-158-107-103-255,0-11-10-35-16-22-23-13-43-45-51-21,"
+   "29-23-30-25-24-256-257-258-259-260,0-1-2",
+   "304734bb1c086c3453b387400cf83f11"},
+  {grease_hello,
+   sizeof(grease_hello),
+   "771,4865-4866-4867-49195-49199-49196-49200-52393-52392-49171-49172-"
+   "156-157-47-53,0-23-65281-10-11-35-16-5-13-18-51-45-43-27-21,29-23-24,0",
+   "b32309a26951912be7dba376398abc3b"}
+};
+
+static BOOL SameDigest(const UINT8* digest, const char* hex)
+{
+  char s[(MD5_DIGEST_LEN * 2) + 1];
+  unsigned i;
+
+  for (i = 0; i < MD5_DIGEST_LEN; i++) {
+    sprintf(s + (i * 2), "%02x", digest[i]);
+  }
+
+  return (strcmp(s, hex) == 0);
+}
+
+/* Hash 'data' in pieces ending at the offsets of 'splits'. */
+static void Hash(const UINT8* data,
+                 SIZE_T len,
+                 const SIZE_T* splits,
+                 unsigned nsplits,
+                 UINT8* digest)
+{
+  md5_t ctx;
+  SIZE_T off;
+  unsigned i;
+
+  Md5Init(&ctx);
+
+  off = 0;
+
+  for (i = 0; i < nsplits; i++) {
+    Md5Update(&ctx, data + off, splits[i] - off);
+    off = splits[i];
+  }
+
+  Md5Update(&ctx, data + off, len - off);
+
+  Md5Final(&ctx, digest);
+}
+
+static void CheckMd5(const UINT8* data,
+                     SIZE_T len,
+                     const char* hex,
+                     unsigned* seed)
+{
+  UINT8 digest[MD5_DIGEST_LEN];
+  SIZE_T splits[64];
+  SIZE_T s;
+  unsigned nsplits;
+  unsigned i;
+
+  Hash(data, len, NULL, 0, digest);
+  CHECK(SameDigest(digest, hex));
+
+  /* Every split point of the short data. */
+  if (len <= 4096) {
+    for (s = 0; s <= len; s++) {
+      Hash(data, len, &s, 1, digest);
+      CHECK(SameDigest(digest, hex));
+    }
+  }
+
+  /* Random pieces (around the block size). */
+  for (i = 0; i < 100; i++) {
+    nsplits = 0;
+
+    for (s = Random(seed) % 130;
+         (s <= len) && (nsplits < sizeof(splits) / sizeof(splits[0]));
+         s += Random(seed) % ((len / 32) + 130)) {
+      splits[nsplits++] = s;
+    }
+
+    Hash(data, len, splits, nsplits, digest);
+    CHECK(SameDigest(digest, hex));
+  }
+}
+
+int main()
+{
+  UINT8 digest[MD5_DIGEST_LEN];
+  UINT8 prefixes[200];
+  tls_client_hello_t hello;
+  const ja3_vector_t* vector;
+  md5_t ctx;
+  UINT8* data;
+  SIZE_T len;
+  unsigned seed;
+  unsigned i;
+
+  seed = 38;
+
+  for (i = 0; i < sizeof(md5_vectors) / sizeof(md5_vectors[0]); i++) {
+    CheckMd5((const UINT8*) md5_vectors[i].data,
+             strlen(md5_vectors[i].data),
+             md5_vectors[i].digest,
+             &seed);
+  }
+
+  /* A million 'a' (several blocks in each piece). */
+  len = 1000000;
+
+  if ((data = malloc(len)) != NULL) {
+    memset(data, 'a', len);
+    CheckMd5(data, len, "7707d6ae4e027c70eea2a935c2296f21", &seed);
+    free(data);
+  } else {
+    CHECK(data != NULL);
+  }
+
+  /* Every length around the padding boundaries (0 to 200 bytes): MD5 of
+   * the digests of the prefixes, computed with Python.
+   */
+  for (i = 0; i < sizeof(prefixes); i++) {
+    prefixes[i] = (UINT8) (i * 7);
+  }
+
+  Md5Init(&ctx);
+
+  for (len = 0; len <= sizeof(prefixes); len++) {
+    Hash(prefixes, len, NULL, 0, digest);
+    Md5Update(&ctx, digest, MD5_DIGEST_LEN);
+  }
+
+  Md5Final(&ctx, digest);
+  CHECK(SameDigest(digest, "eb350bfbf075326c945ddb60048458ac"));
+
+  for (i = 0; i < sizeof(ja3_vectors) / sizeof(ja3_vectors[0]); i++) {
+    vector = &ja3_vectors[i];
+
+    /* The hash of the string... */
+    CheckMd5((const UINT8*) vector->ja3,
+             strlen(vector->ja3),
+             vector->digest,
+             &seed);
+
+    /* ...is the fingerprint. */
+    CHECK(ParseTlsClientHello(vector->hello, vector->len, &hello));
+    CHECK(GetTlsFingerprint(&hello, digest));
+    CHECK(SameDigest(digest, vector->digest));
+
+    /* No fingerprint before the end of the ClientHello. */
+    for (len = 0; len < vector->len; len++) {
+      if (ParseTlsClientHello(vector->hello, len, &hello)) {
+        CHECK(!GetTlsFingerprint(&hello, digest));
+      }
+    }
+  }
+
+  return TEST_RESULT();
+}
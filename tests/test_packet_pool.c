@@ -0,0 +1,119 @@
+/* Growing the packet pool (sys/packet_pool.c): the packets added by each
+ * growth must be new (not overlapping each other or the packets in use),
+ * the free packets must be kept and the packets in use when the pool grows
+ * must fit when they are pushed back. The pool must refuse to grow more
+ * than PACKET_POOL_MAX_GROWTHS times with STATUS_QUOTA_EXCEEDED, without
+ * being modified.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../sys/packet_pool.h"
+#include "test.h"
+
+#define PACKET_SIZE 100
+
+/* Rounded up to keep the packets aligned. */
+#define ALIGNED_SIZE 104
+
+#define MAX_PACKETS (MIN_PACKETS * (PACKET_POOL_MAX_GROWTHS + 2))
+
+static packet_t* packets[MAX_PACKETS + 1];
+
+static int Compare(const void* a, const void* b)
+{
+  const UINT8* p = *((const UINT8* const*) a);
+  const UINT8* q = *((const UINT8* const*) b);
+
+  return (p < q) ? -1 : (p > q);
+}
+
+/* The packets are aligned and don't overlap (each one is filled). */
+static BOOL Distinct(packet_t** p, unsigned count)
+{
+  packet_t* sorted[MAX_PACKETS + 1];
+  unsigned i;
+
+  memcpy(sorted, p, count * sizeof(packet_t*));
+  qsort(sorted, count, sizeof(packet_t*), Compare);
+
+  for (i = 0; i < count; i++) {
+    if (((ULONG_PTR) sorted[i] % sizeof(LONGLONG)) != 0) {
+      return FALSE;
+    }
+
+    if ((i > 0) &&
+        ((UINT8*) sorted[i] - (UINT8*) sorted[i - 1] < ALIGNED_SIZE)) {
+      return FALSE;
+    }
+
+    memset(sorted[i], (int) i, PACKET_SIZE);
+  }
+
+  return TRUE;
+}
+
+int main()
+{
+  unsigned npackets;
+  unsigned max_packets;
+  unsigned growths;
+
+  CHECK(InitPacketPool(MIN_PACKETS, PACKET_SIZE, FALSE));
+
+  CHECK(PopPackets(packets, MAX_PACKETS) == MIN_PACKETS);
+  CHECK(Distinct(packets, MIN_PACKETS));
+
+  /* The pool doesn't shrink. */
+  CHECK(GrowPacketPool(MIN_PACKETS - 1, FALSE) == STATUS_SUCCESS);
+  CHECK(GrowPacketPool(MIN_PACKETS, FALSE) == STATUS_SUCCESS);
+  CHECK(PopPacket() == NULL);
+
+  npackets = MIN_PACKETS;
+  max_packets = MIN_PACKETS;
+
+  /* Grow while most of the packets are in use (the free ones are kept):
+   * all the packets fit when they are pushed back.
+   */
+  for (growths = 0; growths < PACKET_POOL_MAX_GROWTHS; growths++) {
+    npackets -= growths;
+    PushPackets(packets + npackets, growths);
+
+    max_packets += MIN_PACKETS + growths;
+
+    CHECK(GrowPacketPool(max_packets, FALSE) == STATUS_SUCCESS);
+
+    npackets += PopPackets(packets + npackets, MAX_PACKETS);
+
+    CHECK(npackets == max_packets);
+    CHECK(Distinct(packets, npackets));
+  }
+
+  /* The packets pushed into a full pool are dropped. */
+  packets[npackets] = (packet_t*) malloc(ALIGNED_SIZE);
+
+  PushPackets(packets, npackets / 2);
+  PushPackets(packets + (npackets / 2), npackets - (npackets / 2) + 1);
+  PushPacket(packets[npackets]);
+
+  free(packets[npackets]);
+
+  CHECK(PopPackets(packets, MAX_PACKETS) == max_packets);
+  CHECK(Distinct(packets, max_packets));
+
+  PushPackets(packets, max_packets);
+
+  /* No more growths. */
+  CHECK(GrowPacketPool(max_packets + 1, FALSE) == STATUS_QUOTA_EXCEEDED);
+
+  CHECK(PopPackets(packets, MAX_PACKETS) == max_packets);
+  CHECK(PopPacket() == NULL);
+
+  PushPackets(packets, max_packets);
+
+  CHECK(GrowPacketPool(max_packets, FALSE) == STATUS_SUCCESS);
+
+  FreePacketPool();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,284 @@
+/* Subnets of the exclusion filters (sys/subnets.c): IPv4 and IPv6 subnets in
+ * CIDR notation, or single addresses, separated by spaces or commas, must
+ * give the address (host bits cleared, IPv4 in host byte order) and the mask
+ * or prefix length of the filter conditions. Out of range or malformed
+ * prefixes, garbage after an address and more than MAX_SUBNETS subnets of a
+ * family must be rejected. Then random lists (addresses, prefixes and
+ * separators) are checked against the subnets they were made of.
+ */
+
+#include <stdio.h>
+#include "../sys/subnets.h"
+#include <ip2string.h>
+#include "test.h"
+#include "test_util.h"
+
+#define NLISTS 20000
+#define MAX_LIST (2 * MAX_SUBNETS * (INET6_ADDRSTRLEN + 6))
+
+static BOOL Parse(const char* str, subnets_t* subnets)
+{
+  subnets->nipv4 = 0;
+  subnets->nipv6 = 0;
+
+  return AddSubnets(subnets, str);
+}
+
+static BOOL SameIPv4(const FWP_V4_ADDR_AND_MASK* subnet,
+                     UINT32 addr,
+                     UINT32 mask)
+{
+  return (subnet->addr == addr) && (subnet->mask == mask);
+}
+
+static BOOL SameIPv6(const FWP_V6_ADDR_AND_MASK* subnet,
+                     const char* addr,
+                     UINT8 prefix)
+{
+  UINT8 bytes[16];
+
+  inet_pton(AF_INET6, addr, bytes);
+
+  return (memcmp(subnet->addr, bytes, 16) == 0) &&
+         (subnet->prefixLength == prefix);
+}
+
+static void CheckFixed()
+{
+  static const char* invalid[] = {
+    "10.0.0.0/33",
+    "::/129",
+    "10.0.0.0/",
+    "10.0.0.0/8x",
+    "10.0.0.0/-8",
+    "10.0.0.0/0008",
+    "10.0.0/8",
+    "10.0.0.256",
+    "1.2.3.4.5",
+    "10.0.0.0;8",
+    "10.0.0.0/8;",
+    "10.0.0.0 /8",
+    "localhost",
+    "fd00::/8/8",
+    "fd00:::1",
+    "fe80::1%1"
+  };
+
+  subnets_t subnets;
+  unsigned i;
+
+  CHECK(Parse("10.0.0.0/8", &subnets));
+  CHECK((subnets.nipv4 == 1) && (subnets.nipv6 == 0));
+  CHECK(SameIPv4(&subnets.ipv4[0], 0x0a000000, 0xff000000));
+
+  /* The host bits are cleared. */
+  CHECK(Parse("192.168.1.77/24", &subnets));
+  CHECK(SameIPv4(&subnets.ipv4[0], 0xc0a80100, 0xffffff00));
+
+  CHECK(Parse("172.16.255.255/12", &subnets));
+  CHECK(SameIPv4(&subnets.ipv4[0], 0xac100000, 0xfff00000));
+
+  CHECK(Parse("1.2.3.4", &subnets));
+  CHECK(SameIPv4(&subnets.ipv4[0], 0x01020304, 0xffffffff));
+
+  CHECK(Parse("1.2.3.4/32", &subnets));
+  CHECK(SameIPv4(&subnets.ipv4[0], 0x01020304, 0xffffffff));
+
+  CHECK(Parse("1.2.3.4/0", &subnets));
+  CHECK(SameIPv4(&subnets.ipv4[0], 0, 0));
+
+  CHECK(Parse("fd12:3456::1/8", &subnets));
+  CHECK((subnets.nipv4 == 0) && (subnets.nipv6 == 1));
+  CHECK(SameIPv6(&subnets.ipv6[0], "fd00::", 8));
+
+  CHECK(Parse("2001:db8::ffff/127", &subnets));
+  CHECK(SameIPv6(&subnets.ipv6[0], "2001:db8::fffe", 127));
+
+  CHECK(Parse("::1", &subnets));
+  CHECK(SameIPv6(&subnets.ipv6[0], "::1", 128));
+
+  CHECK(Parse("::ffff:10.1.2.3/120", &subnets));
+  CHECK(SameIPv6(&subnets.ipv6[0], "::ffff:10.1.2.0", 120));
+
+  CHECK(Parse("2001:db8::1/0", &subnets));
+  CHECK(SameIPv6(&subnets.ipv6[0], "::", 0));
+
+  /* Lists. */
+  CHECK(Parse("", &subnets));
+  CHECK((subnets.nipv4 == 0) && (subnets.nipv6 == 0));
+
+  CHECK(Parse(" , ,", &subnets));
+  CHECK((subnets.nipv4 == 0) && (subnets.nipv6 == 0));
+
+  CHECK(Parse(",10.0.0.0/8, fd00::/8,,  127.0.0.1 ", &subnets));
+  CHECK((subnets.nipv4 == 2) && (subnets.nipv6 == 1));
+  CHECK(SameIPv4(&subnets.ipv4[0], 0x0a000000, 0xff000000));
+  CHECK(SameIPv4(&subnets.ipv4[1], 0x7f000001, 0xffffffff));
+  CHECK(SameIPv6(&subnets.ipv6[0], "fd00::", 8));
+
+  /* Added after the subnets already there (the loopback subnets). */
+  CHECK(Parse("127.0.0.0/8 ::1/128", &subnets));
+  CHECK(AddSubnets(&subnets, "10.0.0.0/8"));
+  CHECK((subnets.nipv4 == 2) && (subnets.nipv6 == 1));
+  CHECK(SameIPv4(&subnets.ipv4[0], 0x7f000000, 0xff000000));
+  CHECK(SameIPv4(&subnets.ipv4[1], 0x0a000000, 0xff000000));
+
+  for (i = 0; i < ARRAYSIZE(invalid); i++) {
+    if (Parse(invalid[i], &subnets)) {
+      fprintf(stderr, "\"%s\" accepted\n", invalid[i]);
+      test_failures++;
+    }
+  }
+}
+
+static void CheckLimits()
+{
+  char str[MAX_LIST];
+  subnets_t subnets;
+  unsigned len;
+  unsigned i;
+
+  len = 0;
+
+  for (i = 0; i < MAX_SUBNETS; i++) {
+    len += (unsigned) sprintf(str + len, "10.%u.0.0/16 fd%02x::/16 ", i, i);
+  }
+
+  CHECK(Parse(str, &subnets));
+  CHECK((subnets.nipv4 == MAX_SUBNETS) && (subnets.nipv6 == MAX_SUBNETS));
+  CHECK(SameIPv4(&subnets.ipv4[MAX_SUBNETS - 1],
+                 0x0a000000 | ((MAX_SUBNETS - 1) << 16),
+                 0xffff0000));
+
+  /* One more of either family. */
+  strcpy(str + len, "11.0.0.0/8");
+  CHECK(!Parse(str, &subnets));
+
+  strcpy(str + len, "fe00::/8");
+  CHECK(!Parse(str, &subnets));
+}
+
+/* Append a random subnet of the family to 'str' and to 'expected'. */
+static unsigned AddRandomIPv4(char* str,
+                              FWP_V4_ADDR_AND_MASK* expected,
+                              unsigned* seed)
+{
+  UINT32 addr;
+  unsigned prefix;
+  unsigned len;
+
+  addr = ((UINT32) Random(seed) << 17) ^ Random(seed);
+
+  len = (unsigned) sprintf(str,
+                           "%u.%u.%u.%u",
+                           addr >> 24,
+                           (addr >> 16) & 0xff,
+                           (addr >> 8) & 0xff,
+                           addr & 0xff);
+
+  /* A single address once in three. */
+  if (Random(seed) % 3 == 0) {
+    prefix = 32;
+  } else {
+    prefix = Random(seed) % 33;
+    len += (unsigned) sprintf(str + len, "/%u", prefix);
+  }
+
+  expected->mask = (prefix > 0) ? 0xffffffffu << (32 - prefix) : 0;
+  expected->addr = addr & expected->mask;
+
+  return len;
+}
+
+static unsigned AddRandomIPv6(char* str,
+                              FWP_V6_ADDR_AND_MASK* expected,
+                              unsigned* seed)
+{
+  char text[INET6_ADDRSTRLEN];
+  UINT8 bytes[16];
+  unsigned prefix;
+  unsigned len;
+  unsigned i;
+
+  /* Runs of zeros, to get compressed addresses. */
+  for (i = 0; i < 16; i++) {
+    bytes[i] = (Random(seed) & 3) ? 0 : (UINT8) Random(seed);
+  }
+
+  inet_ntop(AF_INET6, bytes, text, sizeof(text));
+  len = (unsigned) sprintf(str, "%s", text);
+
+  if (Random(seed) % 3 == 0) {
+    prefix = 128;
+  } else {
+    prefix = Random(seed) % 129;
+    len += (unsigned) sprintf(str + len, "/%u", prefix);
+  }
+
+  for (i = prefix; i < 128; i++) {
+    bytes[i / 8] &= (UINT8) ~(0x80 >> (i % 8));
+  }
+
+  memcpy(expected->addr, bytes, 16);
+  expected->prefixLength = (UINT8) prefix;
+
+  return len;
+}
+
+static void CheckRandom()
+{
+  FWP_V4_ADDR_AND_MASK ipv4[MAX_SUBNETS];
+  FWP_V6_ADDR_AND_MASK ipv6[MAX_SUBNETS];
+  char str[MAX_LIST];
+  subnets_t subnets;
+  unsigned nipv4;
+  unsigned nipv6;
+  unsigned len;
+  unsigned seed;
+  unsigned n;
+  unsigned i;
+  unsigned j;
+
+  seed = 50;
+
+  for (i = 0; i < NLISTS; i++) {
+    n = Random(&seed) % (2 * MAX_SUBNETS + 1);
+    nipv4 = 0;
+    nipv6 = 0;
+    len = 0;
+    str[0] = '\0';
+
+    for (j = 0; j < n; j++) {
+      len += (unsigned) sprintf(str + len,
+                                "%s",
+                                (j == 0) ? "" :
+                                (Random(&seed) & 1) ? ", " : " ");
+
+      if (((Random(&seed) & 1) && (nipv4 < MAX_SUBNETS)) ||
+          (nipv6 == MAX_SUBNETS)) {
+        len += AddRandomIPv4(str + len, &ipv4[nipv4++], &seed);
+      } else {
+        len += AddRandomIPv6(str + len, &ipv6[nipv6++], &seed);
+      }
+    }
+
+    if (!Parse(str, &subnets) ||
+        (subnets.nipv4 != nipv4) ||
+        (subnets.nipv6 != nipv6) ||
+        (memcmp(subnets.ipv4, ipv4, nipv4 * sizeof(ipv4[0])) != 0) ||
+        (memcmp(subnets.ipv6, ipv6, nipv6 * sizeof(ipv6[0])) != 0)) {
+      fprintf(stderr, "Subnets mismatch: \"%s\"\n", str);
+      test_failures++;
+      break;
+    }
+  }
+}
+
+int main()
+{
+  CheckFixed();
+  CheckLimits();
+  CheckRandom();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,452 @@
+/* Reassembly of TLS ClientHellos (sys/tls_flow.c): client streams starting
+ * with a ClientHello record are replayed segment by segment (split at every
+ * point, in 1-byte segments and at random points, each segment in a buffer
+ * of its exact size) through the same calls as the stream callout
+ * (FeedTlsFlow() and ContinueTlsFlow() in inspect.c), and closed anywhere.
+ * Only the first record must be handed to the worker thread, whatever the
+ * segmentation: whole (with the server name and the JA3 fingerprint of the
+ * ClientHello), truncated to the size of the packets (without fingerprint),
+ * or partial when the connection is closed.
+ * The connection isn't followed when the packets are exhausted, and the
+ * flows and packets must all return to the pool.
+ */
+
+#include <stdio.h>
+#include "../sys/md5.h"
+#include "../sys/tls_flow.h"
+#include "../sys/tls_parser.h"
+#include "test.h"
+#include "test_util.h"
+#include "tls_hello.h"
+
+#define MAX_FLOWS 4
+#define MAX_RECORDS 3
+#define MAX_RECORD_SIZE 512
+
+#define MAX_STREAM (2 * (TLS_RECORD_HEADER_LEN + 0xffff))
+#define MAX_EMITTED 4
+
+/* Records handed to the worker thread. */
+static UINT8 emitted[MAX_EMITTED][MAX_RECORD_SIZE];
+static SIZE_T emitted_len[MAX_EMITTED];
+static unsigned nemitted;
+
+static UINT8 stream[MAX_STREAM];
+static packet_t tuple;
+
+/* As EndTlsFlow() (the worker thread releases the packet). */
+static void EndFlow(tls_flow_t* flow)
+{
+  packet_t* packet;
+
+  packet = TakeTlsFlowPacket(flow);
+
+  CHECK(packet->remote_port == tuple.remote_port);
+  CHECK(packet->payloadlen <= MAX_RECORD_SIZE);
+
+  if (nemitted < MAX_EMITTED) {
+    memcpy(emitted[nemitted], packet->payload, packet->payloadlen);
+    emitted_len[nemitted] = packet->payloadlen;
+  }
+
+  nemitted++;
+
+  CHECK(ReleaseTlsFlowPacket(packet));
+}
+
+/* As FeedTlsFlow(). */
+static BOOL Feed(tls_flow_t* flow, const UINT8* data, SIZE_T len)
+{
+  SIZE_T n;
+  BOOL complete;
+
+  while (len > 0) {
+    if (flow->state == TLS_FLOW_DONE) {
+      return FALSE;
+    }
+
+    if (!flow->packet) {
+      if (!AttachTlsFlowPacket(flow)) {
+        flow->state = TLS_FLOW_DONE;
+        return FALSE;
+      }
+    }
+
+    n = ConsumeTlsFlowData(flow, data, len, &complete);
+
+    CHECK(n <= len);
+
+    if (complete) {
+      EndFlow(flow);
+    }
+
+    data += n;
+    len -= n;
+  }
+
+  return (flow->state != TLS_FLOW_DONE);
+}
+
+/* Replay the stream in segments ending at the offsets of 'splits' (and at
+ * the end of the stream), each in a buffer of its exact size, then close
+ * the connection.
+ */
+static void Replay(const UINT8* data,
+                   SIZE_T len,
+                   const SIZE_T* splits,
+                   unsigned nsplits)
+{
+  tls_flow_t* flow;
+  UINT8* segment;
+  SIZE_T off;
+  SIZE_T end;
+  unsigned i;
+
+  nemitted = 0;
+
+  if ((flow = NewTlsFlow(&tuple)) == NULL) {
+    CHECK(flow != NULL);
+    return;
+  }
+
+  CHECK(IsTlsFlow(flow));
+
+  off = 0;
+
+  for (i = 0; i <= nsplits; i++) {
+    end = (i < nsplits) ? splits[i] : len;
+
+    /* Exact size (segment is not NULL for empty segments). */
+    if ((segment = malloc(end - off + (end == off))) == NULL) {
+      CHECK(segment != NULL);
+      break;
+    }
+
+    memcpy(segment, data + off, end - off);
+
+    /* ContinueTlsFlow(): stop following the connection. */
+    if (!Feed(flow, segment, end - off)) {
+      free(segment);
+      break;
+    }
+
+    free(segment);
+
+    off = end;
+  }
+
+  /* Closed: the partial record is handed over. */
+  if ((flow->packet) && (flow->packet->payloadlen > 0)) {
+    EndFlow(flow);
+  }
+
+  DeleteTlsFlow(flow);
+}
+
+/* The first record (its first MAX_RECORD_SIZE bytes) of the stream closed
+ * after 'len' bytes.
+ */
+static BOOL Matches(SIZE_T record, SIZE_T len)
+{
+  SIZE_T expected;
+
+  expected = (len < record) ? len : record;
+  if (expected > MAX_RECORD_SIZE) {
+    expected = MAX_RECORD_SIZE;
+  }
+
+  if (expected == 0) {
+    return (nemitted == 0);
+  }
+
+  return ((nemitted == 1) &&
+          (emitted_len[0] == expected) &&
+          (memcmp(emitted[0], stream, expected) == 0));
+}
+
+/* The flows and the packets are all back in the pool. */
+static void CheckPool()
+{
+  tls_flow_t* flows[MAX_FLOWS];
+  unsigned i;
+
+  for (i = 0; i < MAX_FLOWS; i++) {
+    CHECK((flows[i] = NewTlsFlow(&tuple)) != NULL);
+  }
+
+  CHECK(NewTlsFlow(&tuple) == NULL);
+
+  /* Only MAX_RECORDS records are reassembled at the same time: the other
+   * connections are not followed.
+   */
+  for (i = 0; i < MAX_FLOWS; i++) {
+    CHECK(Feed(flows[i], stream, 1) == (i < MAX_RECORDS));
+  }
+
+  for (i = 0; i < MAX_FLOWS; i++) {
+    DeleteTlsFlow(flows[i]);
+  }
+}
+
+/* Replay the stream closed after 'len' bytes, in random segments (and in
+ * two at every point and in 1-byte segments if 'all').
+ */
+static void CheckLength(const char* name,
+                        SIZE_T record,
+                        SIZE_T len,
+                        BOOL all,
+                        unsigned* seed)
+{
+  static SIZE_T splits[MAX_STREAM];
+  SIZE_T s;
+  unsigned nsplits;
+  unsigned failures;
+  unsigned i;
+
+  failures = 0;
+
+  Replay(stream, len, NULL, 0);
+  failures += !Matches(record, len);
+
+  if (all) {
+    for (s = 1; s < len; s++) {
+      Replay(stream, len, &s, 1);
+      failures += !Matches(record, len);
+    }
+
+    for (s = 1; s < len; s++) {
+      splits[s - 1] = s;
+    }
+
+    Replay(stream, len, splits, (len > 0) ? (unsigned) len - 1 : 0);
+    failures += !Matches(record, len);
+  }
+
+  for (i = 0; i < 10; i++) {
+    nsplits = 0;
+
+    for (s = 1 + (Random(seed) % 300); s < len; s += 1 + (Random(seed) % 300)) {
+      splits[nsplits++] = s;
+    }
+
+    Replay(stream, len, splits, nsplits);
+    failures += !Matches(record, len);
+  }
+
+  if (failures > 0) {
+    fprintf(stderr,
+            "%s (%zu bytes): %u segmentations failed\n",
+            name,
+            len,
+            failures);
+    CHECK(FALSE);
+  }
+}
+
+/* The record followed by other data of the client, whole and closed
+ * anywhere.
+ */
+static void Check(const char* name,
+                  const UINT8* record,
+                  SIZE_T size,
+                  unsigned* seed)
+{
+  SIZE_T len;
+  SIZE_T n;
+
+  memcpy(stream, record, size);
+
+  /* Application data (never reassembled). */
+  len = size;
+  stream[len++] = 0x17;
+  stream[len++] = 0x03;
+  stream[len++] = 0x03;
+  stream[len++] = 0x00;
+  stream[len++] = 0x20;
+
+  for (n = 0; n < 0x20; n++) {
+    stream[len++] = (UINT8) Random(seed);
+  }
+
+  CheckLength(name, size, len, len <= 4096, seed);
+
+  if (len <= 1024) {
+    for (n = 0; n < len; n++) {
+      CheckLength(name, size, n, n % 16 == 0, seed);
+    }
+  } else {
+    for (n = 0; n < 20; n++) {
+      CheckLength(name, size, Random(seed) % len, FALSE, seed);
+    }
+  }
+
+  CheckPool();
+}
+
+/* The ClientHello reassembled from 'data' has the server name (none if
+ * NULL) and the JA3 fingerprint (none if NULL).
+ */
+static BOOL HasHello(const UINT8* data,
+                     SIZE_T len,
+                     const char* server_name,
+                     const UINT8* fingerprint)
+{
+  tls_client_hello_t hello;
+  UINT8 digest[MD5_DIGEST_LEN];
+
+  if (!ParseTlsClientHello(data, len, &hello)) {
+    return FALSE;
+  }
+
+  if (!server_name) {
+    if (hello.server_name) {
+      return FALSE;
+    }
+  } else if ((!hello.server_name) ||
+             (hello.server_namelen != strlen(server_name)) ||
+             (memcmp(hello.server_name,
+                     server_name,
+                     hello.server_namelen) != 0)) {
+    return FALSE;
+  }
+
+  if (!fingerprint) {
+    return !GetTlsFingerprint(&hello, digest);
+  }
+
+  return ((GetTlsFingerprint(&hello, digest)) &&
+          (memcmp(digest, fingerprint, MD5_DIGEST_LEN) == 0));
+}
+
+/* The ClientHello reassembled from every segmentation into two segments
+ * and from 1-byte segments has the server name and the fingerprint of the
+ * whole ClientHello (none if it is bigger than the packets).
+ */
+static void CheckHello(const UINT8* record,
+                       SIZE_T size,
+                       const char* server_name)
+{
+  static SIZE_T splits[MAX_STREAM];
+  tls_client_hello_t hello;
+  UINT8 fingerprint[MD5_DIGEST_LEN];
+  const UINT8* expected;
+  unsigned failures;
+  SIZE_T s;
+
+  memcpy(stream, record, size);
+
+  CHECK(ParseTlsClientHello(record, size, &hello));
+  CHECK(GetTlsFingerprint(&hello, fingerprint));
+
+  expected = (size <= MAX_RECORD_SIZE) ? fingerprint : NULL;
+
+  failures = 0;
+
+  for (s = 1; s < size; s++) {
+    Replay(stream, size, &s, 1);
+
+    if ((nemitted != 1) ||
+        (!HasHello(emitted[0], emitted_len[0], server_name, expected))) {
+      failures++;
+    }
+  }
+
+  for (s = 1; s < size; s++) {
+    splits[s - 1] = s;
+  }
+
+  Replay(stream, size, splits, (unsigned) size - 1);
+
+  if ((nemitted != 1) ||
+      (!HasHello(emitted[0], emitted_len[0], server_name, expected))) {
+    failures++;
+  }
+
+  if (failures > 0) {
+    fprintf(stderr,
+            "%s: %u segmentations without the server name or the "
+            "fingerprint\n",
+            (server_name) ? server_name : "(none)",
+            failures);
+    CHECK(FALSE);
+  }
+}
+
+int main()
+{
+  static UINT8 record[TLS_RECORD_HEADER_LEN + 0xffff];
+  unsigned seed;
+  unsigned i;
+  SIZE_T len;
+  SIZE_T n;
+
+  seed = 45;
+
+  memset(&tuple, 0, sizeof(tuple));
+  tuple.remote_port = 443;
+
+  CHECK(GetTlsRecordSize(openssl_hello, 4) == 0);
+  CHECK(GetTlsRecordSize(openssl_hello, 5) == sizeof(openssl_hello));
+  CHECK(GetTlsRecordSize(grease_hello, 5) == sizeof(grease_hello));
+
+  /* Invalid sizes, connections not followed. */
+  CHECK(!InitTlsFlows(MAX_FLOWS, 0, MAX_RECORD_SIZE, FALSE));
+  CHECK(!InitTlsFlows(MAX_FLOWS,
+                      MAX_RECORDS,
+                      TLS_RECORD_HEADER_LEN - 1,
+                      FALSE));
+  CHECK(!InitTlsFlows(MAX_FLOWS, MAX_RECORDS, 0x10000, FALSE));
+
+  CHECK(InitTlsFlows(0, MAX_RECORDS, MAX_RECORD_SIZE, FALSE));
+  CHECK(NewTlsFlow(&tuple) == NULL);
+  CHECK(!IsTlsFlow(&tuple));
+  FreeTlsFlows();
+
+  if (!InitTlsFlows(MAX_FLOWS, MAX_RECORDS, MAX_RECORD_SIZE, FALSE)) {
+    CHECK(FALSE);
+    return TEST_RESULT();
+  }
+
+  /* ClientHellos which fit in the packets (and one truncated). */
+  Check("grease", grease_hello, sizeof(grease_hello), &seed);
+  Check("minimal", minimal_hello, sizeof(minimal_hello), &seed);
+  Check("openssl", openssl_hello, sizeof(openssl_hello), &seed);
+
+  /* The last one is bigger than the packets: no fingerprint. */
+  CheckHello(grease_hello, sizeof(grease_hello), "www.example.org");
+  CheckHello(minimal_hello, sizeof(minimal_hello), NULL);
+  CheckHello(openssl_hello, sizeof(openssl_hello), "www.example.com");
+
+  /* Empty record, and records of random bytes up to the biggest one. */
+  for (i = 0; i < 20; i++) {
+    switch (i) {
+      case 0:
+        len = 0;
+        break;
+      case 1:
+        len = MAX_RECORD_SIZE - TLS_RECORD_HEADER_LEN;
+        break;
+      case 2:
+        len = 0xffff;
+        break;
+      default:
+        len = Random(&seed) % (2 * MAX_RECORD_SIZE);
+    }
+
+    record[0] = 0x16;
+    record[1] = 0x03;
+    record[2] = 0x01;
+    record[3] = (UINT8) (len >> 8);
+    record[4] = (UINT8) len;
+
+    for (n = 0; n < len; n++) {
+      record[TLS_RECORD_HEADER_LEN + n] = (UINT8) Random(&seed);
+    }
+
+    Check("random", record, TLS_RECORD_HEADER_LEN + len, &seed);
+  }
+
+  FreeTlsFlows();
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,596 @@
+/* TLS ClientHello parser (sys/tls_parser.c): ParseTlsClientHello() must
+ * find the fields of generated ClientHellos (session id, GREASE values,
+ * server name after other name types, ALPN, supported groups, point
+ * formats, padding, unknown extensions, extensions in any order, no
+ * extensions, data after the record), of one captured from OpenSSL and of
+ * the smallest one. The corpus is:
+ * - truncated at every length: the fields found before the end must be the
+ *   ones of the whole ClientHello and the ClientHello must not be complete;
+ * - mutated (random bytes and length fields overwritten, random
+ *   truncations): every field must stay within the data, and a complete
+ *   ClientHello must have a fingerprint.
+ * Each buffer has the exact length of the data, so that the sanitizer
+ * catches reads past the end (in the parser and in GetTlsFingerprint(),
+ * which walks the extensions again).
+ */
+
+#include <stdio.h>
+#include "../sys/tls_parser.h"
+#include "test.h"
+#include "tls_hello.h"
+#include "test_util.h"
+
+#define NHELLOS 2000
+#define NMUTATIONS 200
+#define MAX_HELLO 2048
+#define MAX_LENGTHS 64
+
+#define MIN_HELLO_LEN 11
+
+typedef struct {
+  UINT8 data[MAX_HELLO];
+  SIZE_T len;
+
+  /* Length of the record (the data might go on after it). */
+  SIZE_T record_len;
+
+  /* Expected fields (offsets in the data). */
+  UINT16 version;
+  SIZE_T server_name;
+  SIZE_T server_namelen;
+  SIZE_T alpn;
+  SIZE_T alpnlen;
+  SIZE_T ciphers;
+  SIZE_T cipherslen;
+  SIZE_T extensions;
+  SIZE_T extensionslen;
+  SIZE_T groups;
+  SIZE_T groupslen;
+  SIZE_T point_formats;
+  SIZE_T point_formatslen;
+
+  /* Offsets and sizes of the length fields (targets of the mutations). */
+  SIZE_T lengths[MAX_LENGTHS];
+  unsigned sizes[MAX_LENGTHS];
+  unsigned nlengths;
+} hello_t;
+
+static const char* host_names[] = {
+  "www.example.com",
+  "a",
+  "a.rather.long.host.name.with.many.labels.in.the.server.name.example"
+};
+
+static const char* protocols[] = {
+  "\x02h2\x08http/1.1",
+  "\x08http/1.1",
+  "\x02h3"
+};
+
+static void Put8(hello_t* hello, unsigned n)
+{
+  hello->data[hello->len++] = (UINT8) n;
+}
+
+static void Put16(hello_t* hello, unsigned n)
+{
+  Put8(hello, n >> 8);
+  Put8(hello, n);
+}
+
+static void PutBytes(hello_t* hello, const void* data, SIZE_T len)
+{
+  memcpy(hello->data + hello->len, data, len);
+  hello->len += len;
+}
+
+/* Start a length field of 'size' bytes, to be set by EndLength(). */
+static SIZE_T StartLength(hello_t* hello, unsigned size)
+{
+  hello->lengths[hello->nlengths] = hello->len;
+  hello->sizes[hello->nlengths] = size;
+  hello->nlengths++;
+
+  hello->len += size;
+
+  return hello->len;
+}
+
+static void EndLength(hello_t* hello, SIZE_T start, unsigned size)
+{
+  SIZE_T len;
+
+  len = hello->len - start;
+
+  if (size == 3) {
+    hello->data[start - 3] = (UINT8) (len >> 16);
+  }
+
+  if (size >= 2) {
+    hello->data[start - 2] = (UINT8) (len >> 8);
+  }
+
+  hello->data[start - 1] = (UINT8) len;
+}
+
+static UINT16 Grease(unsigned* seed)
+{
+  return (UINT16) (0x0a0a | ((Random(seed) % 16) * 0x1010));
+}
+
+static void PutExtension(hello_t* hello, unsigned type, unsigned* seed)
+{
+  const char* name;
+  SIZE_T ext;
+  SIZE_T list;
+  SIZE_T start;
+  unsigned n;
+  unsigned i;
+
+  Put16(hello, type);
+  ext = StartLength(hello, 2);
+
+  switch (type) {
+    case 0:
+      /* Server name, sometimes after an entry of another type. */
+      list = StartLength(hello, 2);
+
+      if ((Random(seed) % 4) == 0) {
+        Put8(hello, 1);
+        start = StartLength(hello, 2);
+        PutBytes(hello, "other", 5);
+        EndLength(hello, start, 2);
+      }
+
+      name = host_names[Random(seed) %
+                        (sizeof(host_names) / sizeof(host_names[0]))];
+
+      Put8(hello, 0);
+      start = StartLength(hello, 2);
+      hello->server_name = hello->len;
+      hello->server_namelen = strlen(name);
+      PutBytes(hello, name, hello->server_namelen);
+      EndLength(hello, start, 2);
+
+      EndLength(hello, list, 2);
+      break;
+    case 10:
+      /* Supported groups. */
+      list = StartLength(hello, 2);
+      hello->groups = hello->len;
+
+      if ((Random(seed) % 2) == 0) {
+        Put16(hello, Grease(seed));
+      }
+
+      for (i = Random(seed) % 8; i > 0; i--) {
+        Put16(hello, 23 + (Random(seed) % 8));
+      }
+
+      hello->groupslen = hello->len - hello->groups;
+      EndLength(hello, list, 2);
+      break;
+    case 11:
+      /* EC point formats. */
+      list = StartLength(hello, 1);
+      hello->point_formats = hello->len;
+
+      for (i = 1 + (Random(seed) % 3); i > 0; i--) {
+        Put8(hello, Random(seed) % 3);
+      }
+
+      hello->point_formatslen = hello->len - hello->point_formats;
+      EndLength(hello, list, 1);
+      break;
+    case 16:
+      /* ALPN. */
+      name = protocols[Random(seed) %
+                       (sizeof(protocols) / sizeof(protocols[0]))];
+
+      list = StartLength(hello, 2);
+      hello->alpn = hello->len;
+      hello->alpnlen = strlen(name);
+      PutBytes(hello, name, hello->alpnlen);
+      EndLength(hello, list, 2);
+      break;
+    default:
+      /* Padding, GREASE and unknown extensions. */
+      n = Random(seed) % 64;
+      memset(hello->data + hello->len, 0, n);
+      hello->len += n;
+  }
+
+  EndLength(hello, ext, 2);
+}
+
+static void MakeHello(hello_t* hello, unsigned* seed)
+{
+  static const unsigned types[] = {0, 10, 11, 16, 21, 0xff01, 0x0a0a};
+  unsigned order[sizeof(types) / sizeof(types[0])];
+  SIZE_T record;
+  SIZE_T handshake;
+  SIZE_T vector;
+  unsigned ntypes;
+  unsigned tmp;
+  unsigned i;
+  unsigned j;
+
+  memset(hello, 0, sizeof(*hello));
+
+  /* Record and handshake headers. */
+  Put8(hello, 22);
+  Put16(hello, ((Random(seed) % 2) == 0) ? 0x0301 : 0x0303);
+  record = StartLength(hello, 2);
+  Put8(hello, 1);
+  handshake = StartLength(hello, 3);
+
+  hello->version = ((Random(seed) % 8) == 0) ? 0x0301 : 0x0303;
+  Put16(hello, hello->version);
+
+  /* Random. */
+  for (i = 0; i < 32; i++) {
+    Put8(hello, Random(seed));
+  }
+
+  /* Session id. */
+  vector = StartLength(hello, 1);
+
+  for (i = ((Random(seed) % 2) == 0) ? 32 : 0; i > 0; i--) {
+    Put8(hello, Random(seed));
+  }
+
+  EndLength(hello, vector, 1);
+
+  /* Cipher suites. */
+  vector = StartLength(hello, 2);
+  hello->ciphers = hello->len;
+
+  if ((Random(seed) % 2) == 0) {
+    Put16(hello, Grease(seed));
+  }
+
+  for (i = 1 + (Random(seed) % 40); i > 0; i--) {
+    Put16(hello, Random(seed));
+  }
+
+  hello->cipherslen = hello->len - hello->ciphers;
+  EndLength(hello, vector, 2);
+
+  /* Compression methods. */
+  vector = StartLength(hello, 1);
+  Put8(hello, 0);
+  EndLength(hello, vector, 1);
+
+  /* Extensions (a few in random order), sometimes none. */
+  if ((Random(seed) % 16) != 0) {
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+      order[i] = types[i];
+    }
+
+    for (i = sizeof(types) / sizeof(types[0]); i > 1; i--) {
+      j = Random(seed) % i;
+      tmp = order[i - 1];
+      order[i - 1] = order[j];
+      order[j] = tmp;
+    }
+
+    vector = StartLength(hello, 2);
+    hello->extensions = hello->len;
+
+    ntypes = Random(seed) % (sizeof(types) / sizeof(types[0]) + 1);
+
+    for (i = 0; i < ntypes; i++) {
+      PutExtension(hello, order[i], seed);
+    }
+
+    hello->extensionslen = hello->len - hello->extensions;
+    EndLength(hello, vector, 2);
+  }
+
+  EndLength(hello, handshake, 3);
+  EndLength(hello, record, 2);
+
+  hello->record_len = hello->len;
+
+  /* Next record. */
+  if ((Random(seed) % 4) == 0) {
+    PutBytes(hello, "\x16\x03\x03\x00\x01\x00", 6);
+  }
+}
+
+/* 'field' (NULL or in 'data') must be at 'off' (0: not present). */
+static BOOL SameField(const UINT8* data,
+                      const UINT8* field,
+                      SIZE_T len,
+                      SIZE_T off,
+                      SIZE_T expected_len)
+{
+  if (off == 0) {
+    return (field == NULL);
+  }
+
+  return ((field == data + off) && (len == expected_len));
+}
+
+static BOOL SameHello(const UINT8* data,
+                      const tls_client_hello_t* parsed,
+                      const hello_t* hello)
+{
+  return ((parsed->version == hello->version) &&
+          (SameField(data,
+                     parsed->server_name,
+                     parsed->server_namelen,
+                     hello->server_name,
+                     hello->server_namelen)) &&
+          (SameField(data,
+                     parsed->alpn,
+                     parsed->alpnlen,
+                     hello->alpn,
+                     hello->alpnlen)) &&
+          (SameField(data,
+                     parsed->ciphers,
+                     parsed->cipherslen,
+                     hello->ciphers,
+                     hello->cipherslen)) &&
+          (SameField(data,
+                     parsed->extensions,
+                     parsed->extensionslen,
+                     hello->extensions,
+                     hello->extensionslen)) &&
+          (SameField(data,
+                     parsed->groups,
+                     parsed->groupslen,
+                     hello->groups,
+                     hello->groupslen)) &&
+          (SameField(data,
+                     parsed->point_formats,
+                     parsed->point_formatslen,
+                     hello->point_formats,
+                     hello->point_formatslen)) &&
+          (parsed->complete));
+}
+
+/* A field found in a truncated ClientHello must be the one of the whole
+ * ClientHello (same offset and length).
+ */
+static BOOL SameOrMissing(const UINT8* data,
+                          const UINT8* field,
+                          SIZE_T len,
+                          const UINT8* whole_data,
+                          const UINT8* whole,
+                          SIZE_T whole_len)
+{
+  return ((!field) ||
+          ((whole) &&
+           (field - data == whole - whole_data) &&
+           (len == whole_len)));
+}
+
+static BOOL Prefix(const UINT8* data,
+                   const tls_client_hello_t* parsed,
+                   const UINT8* whole_data,
+                   const tls_client_hello_t* whole)
+{
+  return ((parsed->version == whole->version) &&
+          (SameOrMissing(data,
+                         parsed->server_name,
+                         parsed->server_namelen,
+                         whole_data,
+                         whole->server_name,
+                         whole->server_namelen)) &&
+          (SameOrMissing(data,
+                         parsed->alpn,
+                         parsed->alpnlen,
+                         whole_data,
+                         whole->alpn,
+                         whole->alpnlen)) &&
+          (SameOrMissing(data,
+                         parsed->ciphers,
+                         parsed->cipherslen,
+                         whole_data,
+                         whole->ciphers,
+                         whole->cipherslen)) &&
+          (SameOrMissing(data,
+                         parsed->extensions,
+                         parsed->extensionslen,
+                         whole_data,
+                         whole->extensions,
+                         whole->extensionslen)) &&
+          (SameOrMissing(data,
+                         parsed->groups,
+                         parsed->groupslen,
+                         whole_data,
+                         whole->groups,
+                         whole->groupslen)) &&
+          (SameOrMissing(data,
+                         parsed->point_formats,
+                         parsed->point_formatslen,
+                         whole_data,
+                         whole->point_formats,
+                         whole->point_formatslen)));
+}
+
+static BOOL InData(const UINT8* data,
+                   SIZE_T len,
+                   const UINT8* field,
+                   SIZE_T fieldlen)
+{
+  return ((!field) ||
+          ((field >= data) &&
+           (field <= data + len) &&
+           (fieldlen <= (SIZE_T) (data + len - field))));
+}
+
+static BOOL Valid(const UINT8* data,
+                  SIZE_T len,
+                  const tls_client_hello_t* parsed)
+{
+  UINT8 digest[MD5_DIGEST_LEN];
+
+  if ((!InData(data, len, parsed->server_name, parsed->server_namelen)) ||
+      (!InData(data, len, parsed->alpn, parsed->alpnlen)) ||
+      (!InData(data, len, parsed->ciphers, parsed->cipherslen)) ||
+      (!InData(data, len, parsed->extensions, parsed->extensionslen)) ||
+      (!InData(data, len, parsed->groups, parsed->groupslen)) ||
+      (!InData(data, len, parsed->point_formats, parsed->point_formatslen))) {
+    return FALSE;
+  }
+
+  return (GetTlsFingerprint(parsed, digest) == parsed->complete);
+}
+
+static void CheckTruncations(const UINT8* hello,
+                             SIZE_T len,
+                             SIZE_T record_len)
+{
+  tls_client_hello_t whole;
+  tls_client_hello_t parsed;
+  UINT8* data;
+  SIZE_T n;
+  BOOL ok;
+
+  if (!ParseTlsClientHello(hello, len, &whole)) {
+    CHECK(FALSE);
+    return;
+  }
+
+  for (n = 0; n <= len; n++) {
+    /* Exact size (data is not NULL for empty ClientHellos). */
+    if ((data = malloc(n + (n == 0))) == NULL) {
+      CHECK(data != NULL);
+      return;
+    }
+
+    memcpy(data, hello, n);
+
+    if (n < MIN_HELLO_LEN) {
+      ok = !ParseTlsClientHello(data, n, &parsed);
+    } else {
+      ok = (ParseTlsClientHello(data, n, &parsed)) &&
+           (parsed.complete == (n >= record_len)) &&
+           (Prefix(data, &parsed, hello, &whole)) &&
+           (Valid(data, n, &parsed));
+    }
+
+    free(data);
+
+    if (!ok) {
+      fprintf(stderr, "Truncation at %zu of %zu bytes\n", n, len);
+      CHECK(FALSE);
+    }
+  }
+}
+
+static void Mutate(UINT8* data, const hello_t* hello, unsigned* seed)
+{
+  SIZE_T off;
+  unsigned n;
+  unsigned i;
+
+  for (n = 1 + (Random(seed) % 4); n > 0; n--) {
+    if (((Random(seed) % 2) == 0) && (hello->nlengths > 0)) {
+      /* Length field: off by a few bytes or random. */
+      i = Random(seed) % hello->nlengths;
+      off = hello->lengths[i] + (Random(seed) % hello->sizes[i]);
+
+      if ((Random(seed) % 2) == 0) {
+        data[off] = (UINT8) (data[off] + (Random(seed) % 5) - 2);
+      } else {
+        data[off] = (UINT8) Random(seed);
+      }
+    } else {
+      data[Random(seed) % hello->len] = (UINT8) Random(seed);
+    }
+  }
+}
+
+static void CheckMutations(const hello_t* hello, unsigned* seed)
+{
+  tls_client_hello_t parsed;
+  UINT8* data;
+  SIZE_T len;
+  unsigned i;
+
+  for (i = 0; i < NMUTATIONS; i++) {
+    len = ((Random(seed) % 4) == 0) ? Random(seed) % (hello->len + 1) :
+                                      hello->len;
+
+    if ((data = malloc(hello->len)) == NULL) {
+      CHECK(data != NULL);
+      return;
+    }
+
+    memcpy(data, hello->data, hello->len);
+    Mutate(data, hello, seed);
+
+    /* Shorter buffer: exact size. */
+    if (len < hello->len) {
+      data = realloc(data, len + (len == 0));
+      CHECK(data != NULL);
+    }
+
+    if ((ParseTlsClientHello(data, len, &parsed)) &&
+        (!Valid(data, len, &parsed))) {
+      fprintf(stderr, "Mutation %u of %zu bytes\n", i, hello->len);
+      CHECK(FALSE);
+    }
+
+    free(data);
+  }
+}
+
+int main()
+{
+  static hello_t hello;
+  tls_client_hello_t parsed;
+  UINT8* data;
+  unsigned seed;
+  unsigned i;
+
+  /* Captured ClientHello. */
+  CHECK(ParseTlsClientHello(openssl_hello, sizeof(openssl_hello), &parsed));
+  CHECK(parsed.complete);
+  CHECK(parsed.version == 0x0303);
+  CHECK((parsed.server_namelen == 15) &&
+        (memcmp(parsed.server_name, "www.example.com", 15) == 0));
+  CHECK((parsed.alpnlen == 12) &&
+        (memcmp(parsed.alpn, "\x02h2\x08http/1.1", 12) == 0));
+
+  CheckTruncations(openssl_hello, sizeof(openssl_hello), sizeof(openssl_hello));
+
+  CHECK(ParseTlsClientHello(minimal_hello, sizeof(minimal_hello), &parsed));
+  CHECK((parsed.complete) && (!parsed.extensions) && (parsed.cipherslen == 2));
+
+  CheckTruncations(minimal_hello, sizeof(minimal_hello), sizeof(minimal_hello));
+
+  /* Generated ClientHellos. */
+  seed = 37;
+
+  for (i = 0; i < NHELLOS; i++) {
+    MakeHello(&hello, &seed);
+
+    if ((data = malloc(hello.len)) == NULL) {
+      CHECK(data != NULL);
+      break;
+    }
+
+    memcpy(data, hello.data, hello.len);
+
+    if ((!ParseTlsClientHello(data, hello.len, &parsed)) ||
+        (!SameHello(data, &parsed, &hello))) {
+      fprintf(stderr, "ClientHello %u (%zu bytes)\n", i, hello.len);
+      CHECK(FALSE);
+    }
+
+    free(data);
+
+    /* Every truncation of the first ClientHellos. */
+    if (i < 100) {
+      CheckTruncations(hello.data, hello.len, hello.record_len);
+    }
+
+    CheckMutations(&hello, &seed);
+  }
+
+  return TEST_RESULT();
+}
@@ -0,0 +1,81 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdio.h>
+#include <string.h>
+
+/* Data generators shared by the tests and the benchmarks (after the headers
+ * of the driver, which define the Windows types).
+ */
+
+/* Linear congruential generator: the low bits, which have short periods,
+ * are dropped (24 random bits).
+ */
+static inline unsigned Random(unsigned* seed)
+{
+  *seed = (*seed * 1103515245) + 12345;
+  return (*seed >> 8);
+}
+
+/* IPv4 address 10.0.0.0 + n. */
+static inline void MakeAddress(unsigned n, UINT8* ip)
+{
+  ip[0] = (UINT8) (10 + (n >> 24));
+  ip[1] = (UINT8) (n >> 16);
+  ip[2] = (UINT8) (n >> 8);
+  ip[3] = (UINT8) n;
+}
+
+/* IPv6 address 2001:: + n. */
+static inline void MakeIPv6Address(unsigned n, UINT8* ip)
+{
+  memset(ip, 0, 16);
+
+  ip[0] = 0x20;
+  ip[1] = 0x01;
+  ip[12] = (UINT8) (n >> 24);
+  ip[13] = (UINT8) (n >> 16);
+  ip[14] = (UINT8) (n >> 8);
+  ip[15] = (UINT8) n;
+}
+
+/* Hostname of 8 to 255 characters which depends on n: "h<n>." followed by
+ * a letter. Return its length.
+ */
+static inline unsigned MakeHostname(unsigned n, char* s)
+{
+  unsigned len;
+  unsigned off;
+
+  len = 8 + ((n * 37) % 248);
+
+  off = (unsigned) sprintf(s, "h%u.", n);
+
+  while (off < len) {
+    s[off++] = 'a' + (n % 26);
+  }
+
+  s[len] = 0;
+
+  return len;
+}
+
+/* Append a string to the 'len' bytes of a buffer of 'size' bytes (truncated
+ * if it doesn't fit). Return the new length.
+ */
+static inline SIZE_T Append(UINT8* buf, SIZE_T len, SIZE_T size, const char* s)
+{
+  SIZE_T n;
+
+  n = strlen(s);
+
+  if (len + n > size) {
+    n = size - len;
+  }
+
+  memcpy(buf + len, s, n);
+
+  return len + n;
+}
+
+#endif /* TEST_UTIL_H */
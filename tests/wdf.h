@@ -0,0 +1,48 @@
+#ifndef TESTS_WDF_H
+#define TESTS_WDF_H
+
+/* Registry values of the configuration (config.c): the queries are
+ * implemented by the tests, on a registry key of their own.
+ */
+
+#include <ntddk.h>
+
+typedef uint16_t USHORT;
+
+typedef struct {
+  USHORT Length;
+  USHORT MaximumLength;
+  WCHAR* Buffer;
+} UNICODE_STRING;
+
+typedef void* WDFKEY;
+
+static inline void RtlInitUnicodeString(UNICODE_STRING* str,
+                                        const WCHAR* src)
+{
+  USHORT len;
+
+  len = 0;
+
+  while (src[len] != 0) {
+    len++;
+  }
+
+  str->Length = (USHORT) (len * sizeof(WCHAR));
+  str->MaximumLength = (USHORT) (str->Length + sizeof(WCHAR));
+  str->Buffer = (WCHAR*) src;
+}
+
+NTSTATUS WdfRegistryQueryULong(WDFKEY key,
+                               const UNICODE_STRING* name,
+                               ULONG* value);
+
+/* 'value' is not terminated; STATUS_BUFFER_OVERFLOW (and the length needed
+ * in 'len') if it doesn't fit.
+ */
+NTSTATUS WdfRegistryQueryUnicodeString(WDFKEY key,
+                                       const UNICODE_STRING* name,
+                                       USHORT* len,
+                                       UNICODE_STRING* value);
+
+#endif /* TESTS_WDF_H */
@@ -0,0 +1,6 @@
+#ifndef TESTS_WDM_H
+#define TESTS_WDM_H
+
+#include "fwpsk.h"
+
+#endif /* TESTS_WDM_H */